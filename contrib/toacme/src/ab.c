@@ -189,15 +189,18 @@ static void generate_errors(int err_bits)
 {
 	if (err_bits & AB_ERRBIT_UNKNOWN_ADDRMODE) {
 		fputs(error_unknown_addressing, stderr);
-		fprintf(global_output_stream, "; ToACME: %s", error_unknown_addressing);
+		IO_put_string("; ToACME: ");
+		IO_put_string(error_unknown_addressing);
 	}
 	if (err_bits & AB_ERRBIT_UNKNOWN_NUMBER_COMPRESSION) {
 		fputs(error_unknown_compression, stderr);
-		fprintf(global_output_stream, "; ToACME: %s", error_unknown_compression);
+		IO_put_string("; ToACME: ");
+		IO_put_string(error_unknown_compression);
 	}
 	if (err_bits & AB_ERRBIT_UNKNOWN_NUMBER_FORMAT) {
 		fputs(warning_unknown_number_format, stderr);
-		fprintf(global_output_stream, "; ToACME: %s", warning_unknown_number_format);
+		IO_put_string("; ToACME: ");
+		IO_put_string(warning_unknown_number_format);
 	}
 }
 
@@ -361,7 +364,8 @@ static int parse_mnemo(int mnemonic_offset)
 		fputs("Found unused mnemo code in input file.\n", stderr);
 		mnemonic = "!error \"ToACME found unused mnemo code in input file\":";
 	}
-	fprintf(global_output_stream, "\t\t%s", mnemonic);
+	IO_put_string("\t\t");
+	IO_put_string(mnemonic);
 	// determine prefix and postfix of addressing mode
 	if (addressing_mode < conf->address_mode_count) {
 		pre = addressing_modes[addressing_mode][0];
@@ -465,7 +469,9 @@ void AB_main(struct vab *client_config)
 		if (GotByte >= conf->first_unused_byte_value
 		&& (GotByte != AB_ENDOFLINE)) {
 			handled = 1;
-			fprintf(global_output_stream, "; ToACME: AssBlaster file used unknown code ($%x). ", GotByte);
+			IO_put_string("; ToACME: AssBlaster file used unknown code ($");
+			IO_put_hex(GotByte);
+			IO_put_string("). ");
 			IO_get_byte();	// fetch next
 			err_bits |= parse_unspecified('.');	// output remainder
 		}
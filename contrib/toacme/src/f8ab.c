@@ -194,7 +194,7 @@ static int parse_number(void)	// now GotByte = first byte of packed number
 		AB_output_binary(value);
 		break;
 	case F8AB_NUMVAL__FORMAT_DEC:
-		fprintf(global_output_stream, "%lu", value);
+		IO_put_decimal(value);
 		break;
 	case F8AB_NUMVAL__FORMAT_HEX:
 hex_fallback:	IO_put_byte('$');
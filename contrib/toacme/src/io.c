@@ -3,23 +3,66 @@
 // Have a look at "main.c" for further info
 //
 // input/output
+//
+// The whole input file is read into memory at once, and output is collected
+// in a large buffer that is written in blocks, so converting a file does not
+// need a library call per byte.
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "config.h"
 #include "io.h"
 
 
+// constants
+#define INPUT_CHUNK	65536	// initial size of input buffer (doubled when full)
+#define OUTPUT_SIZE	65536	// output buffer is written when full
+
+
 // variables
 int	padding_value;
 FILE	*global_input_stream;
 FILE	*global_output_stream;
 int	GotByte		= 0;
 bool	IO_reached_eof	= FALSE;
+static unsigned char	*input_buffer	= NULL;
+static size_t		input_size	= 0;	// number of bytes read from file
+static size_t		input_index	= 0;	// index of next byte
+static char		output_buffer[OUTPUT_SIZE];
+static size_t		output_used	= 0;
+static const char	hex_digits[]	= "0123456789abcdef";
 
 
 // input functions
 
 
+// read whole input stream into memory. returns whether successful.
+bool IO_load_input(FILE *stream)
+{
+	unsigned char	*new_buffer;
+	size_t		allocated	= 0,
+			got;
+
+	input_size = 0;
+	input_index = 0;
+	IO_reached_eof = FALSE;
+	padding_value = 0;
+	do {
+		if (input_size == allocated) {
+			new_buffer = realloc(input_buffer, allocated ? 2 * allocated : INPUT_CHUNK);
+			if (new_buffer == NULL)
+				return FALSE;
+			input_buffer = new_buffer;
+			allocated = allocated ? 2 * allocated : INPUT_CHUNK;
+		}
+		got = fread(input_buffer + input_size, 1, allocated - input_size, stream);
+		input_size += got;
+	} while (got);
+	return !ferror(stream);
+}
+
+
 // set byte sent after EOF
 inline void IO_set_input_padding(int pad)
 {
@@ -30,15 +73,13 @@ inline void IO_set_input_padding(int pad)
 // fetch and buffer byte
 int IO_get_byte(void)
 {
-	int	w;
-
-	if (IO_reached_eof) {
+	if (input_index < input_size) {
+		GotByte = input_buffer[input_index++];
+	} else if (IO_reached_eof) {
 		GotByte = padding_value;
 	} else {
-		w = getc(global_input_stream);
-		if (w == EOF)
-			IO_reached_eof = TRUE;
-		GotByte = w;
+		IO_reached_eof = TRUE;
+		GotByte = EOF;
 	}
 	return GotByte;
 }
@@ -69,40 +110,89 @@ unsigned int IO_get_le24(void)
 // output functions
 
 
-// output string
-inline void IO_put_string(const char string[])
+// write output buffer to output file
+void IO_flush_output(void)
 {
-	fputs(string, global_output_stream);
+	fwrite(output_buffer, 1, output_used, global_output_stream);
+	output_used = 0;
 }
 
 
-// write byte to output file
-inline void IO_put_byte(char b)
+// make sure there is room for the given number of chars (at most OUTPUT_SIZE)
+#define ENSURE_ROOM(count)	do { if (output_used + (count) > OUTPUT_SIZE) IO_flush_output(); } while (0)
+
+
+// output string
+void IO_put_string(const char string[])
 {
-	putc(b, global_output_stream);
+	size_t	length	= strlen(string);
+
+	if (length > OUTPUT_SIZE) {
+		IO_flush_output();
+		fwrite(string, 1, length, global_output_stream);
+		return;
+	}
+	ENSURE_ROOM(length);
+	memcpy(output_buffer + output_used, string, length);
+	output_used += length;
 }
 
 
-// output low nibble of argument as hexadecimal digit
-static void put_low_nibble_hex(int v)
+// write byte to output file
+void IO_put_byte(char b)
 {
-	putc("0123456789abcdef"[v & 15], global_output_stream);
+	ENSURE_ROOM(1);
+	output_buffer[output_used++] = b;
 }
 
 
 // output low byte of argument as two hexadecimal digits
 void IO_put_low_byte_hex(int v)
 {
-	put_low_nibble_hex(v >> 4);
-	put_low_nibble_hex(v);
+	ENSURE_ROOM(2);
+	output_buffer[output_used++] = hex_digits[(v >> 4) & 15];
+	output_buffer[output_used++] = hex_digits[v & 15];
 }
 
 
 // output low 16 bits of arg as four hexadecimal digits
 void IO_put_low_16b_hex(int w)
 {
-	IO_put_low_byte_hex(w >> 8);
-	IO_put_low_byte_hex(w);
+	ENSURE_ROOM(4);
+	output_buffer[output_used++] = hex_digits[(w >> 12) & 15];
+	output_buffer[output_used++] = hex_digits[(w >> 8) & 15];
+	output_buffer[output_used++] = hex_digits[(w >> 4) & 15];
+	output_buffer[output_used++] = hex_digits[w & 15];
+}
+
+
+// output number in given base (without leading zeroes, like "%lu" or "%lx")
+static void put_number(unsigned long value, unsigned int base)
+{
+	char	digits[sizeof(value) * 8];
+	int	count	= 0;
+
+	do {
+		digits[count++] = hex_digits[value % base];
+		value /= base;
+	} while (value);
+	ENSURE_ROOM(count);
+	while (count)
+		output_buffer[output_used++] = digits[--count];
+}
+
+
+// output number as decimal digits
+void IO_put_decimal(unsigned long value)
+{
+	put_number(value, 10);
+}
+
+
+// output number as hexadecimal digits, without leading zeroes
+void IO_put_hex(unsigned long value)
+{
+	put_number(value, 16);
 }
 
 
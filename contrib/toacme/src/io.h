@@ -19,6 +19,7 @@ extern FILE	*global_output_stream;
 
 
 // prototypes
+extern bool IO_load_input(FILE *stream);	// read whole input file
 extern void IO_set_input_padding(int);
 extern int IO_get_byte(void);
 extern unsigned int IO_get_le16(void);	// get little-endian 16-bit value
@@ -27,6 +28,9 @@ extern void IO_put_string(const char string[]);
 extern void IO_put_byte(char b);
 extern void IO_put_low_byte_hex(int v);
 extern void IO_put_low_16b_hex(int w);
+extern void IO_put_decimal(unsigned long value);
+extern void IO_put_hex(unsigned long value);	// without leading zeroes
+extern void IO_flush_output(void);	// write buffered output to file
 extern void IO_process_load_address(void);
 
 
@@ -26,52 +26,226 @@
 #include "version.h"
 
 
-// guess what
-int main(int argc, char *argv[])
+// constants
+#define BATCH_LINE_SIZE	4096	// maximum length of batch file line
+
+
+// types
+struct job {
+	struct job	*next;
+	int		line_number;	// in batch file
+	char		*words[3];	// format id, input file, output file
+};
+
+
+// convert one file
+static int convert(const char *format, const char *input_name, const char *output_name)
 {
-	// handle "toacme -h" and "toacme --help" just like "toacme"
-	if (argc == 2) {
-		if ((strcmp(argv[1], "-h") == 0)
-		|| (strcmp(argv[1], "--help") == 0))
-			argc = 1;
-	}
-	// "toacme" without any switches gives info and exits successfully
-	if (argc == 1) {
-		version_show_info(argv[0]);
-		return EXIT_SUCCESS;
-	}
-	// check argument count
-	if (argc != 4) {
-		fputs("Wrong number of arguments.\n", stderr);
-		return EXIT_FAILURE;
-	}
 	// check format id
-	if (version_parse_id(argv[1])) {
+	if (version_parse_id(format)) {
 		fputs("Unknown format id.\n", stderr);
 		return EXIT_FAILURE;
 	}
 	// be nice and ensure input and output are different
-	if (strcmp(argv[2], argv[3]) == 0) {
+	if (strcmp(input_name, output_name) == 0) {
 		fputs("Input and output files must be different.\n", stderr);
 		return EXIT_FAILURE;
 	}
 	// try to open input file
-	global_input_stream = fopen(argv[2], "rb");
+	global_input_stream = fopen(input_name, "rb");
 	if (global_input_stream == NULL) {
 		fputs("Cannot open input file.\n", stderr);
 		return EXIT_FAILURE;
 	}
+	// read it completely
+	if (!IO_load_input(global_input_stream)) {
+		fputs("Cannot read input file.\n", stderr);
+		fclose(global_input_stream);
+		return EXIT_FAILURE;
+	}
+	fclose(global_input_stream);
 	// try to open output file
-	global_output_stream = fopen(argv[3], "w");
+	global_output_stream = fopen(output_name, "w");
 	if (global_output_stream == NULL) {
 		fputs("Cannot open output file.\n", stderr);
 		return EXIT_FAILURE;
 	}
 	// do the actual work
 	version_main();
-	// and then tidy up and exit
+	// and then tidy up
+	IO_flush_output();
 	fclose(global_output_stream);
-	PLATFORM_SETFILETYPE_TEXT(argv[3]);
-	fclose(global_input_stream);
+	PLATFORM_SETFILETYPE_TEXT(output_name);
 	return EXIT_SUCCESS;
 }
+
+
+// batch mode:
+// each line of the batch file holds format id, input file and output file,
+// separated by spaces or tabs. empty lines and lines starting with '#' are
+// ignored. the whole file is read before the first conversion starts, and
+// a failed conversion does not stop the others.
+// with "--jobs", several conversions run at the same time, each in a process
+// of its own (the converters keep their state in global variables).
+
+// read batch file into list of jobs. returns NULL on error.
+static struct job *read_batch(const char *filename, int *error)
+{
+	char		line[BATCH_LINE_SIZE],
+			*read;
+	struct job	*list	= NULL,
+			**link	= &list,
+			*job;
+	FILE		*fd;
+	int		line_number	= 0,
+			count;
+
+	*error = 1;
+	fd = fopen(filename, "r");
+	if (fd == NULL) {
+		fputs("Cannot open batch file.\n", stderr);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fd)) {
+		++line_number;
+		if ((strchr(line, '\n') == NULL) && !feof(fd)) {
+			fprintf(stderr, "Batch file line %d is too long.\n", line_number);
+			fclose(fd);
+			return NULL;
+		}
+		if (line[0] == '#')
+			continue;
+		job = malloc(sizeof(*job) + strlen(line) + 1);
+		if (job == NULL) {
+			fputs("Out of memory.\n", stderr);
+			fclose(fd);
+			return NULL;
+		}
+		read = strcpy((char *) (job + 1), line);
+		count = 0;
+		while ((read = strtok(count ? NULL : read, " \t\r\n"))) {
+			if (count == 3)
+				break;
+			job->words[count++] = read;
+		}
+		if (count == 0) {
+			free(job);	// empty line
+			continue;
+		}
+		if ((count != 3) || read) {
+			fprintf(stderr, "Batch file line %d does not have three arguments.\n", line_number);
+			free(job);
+			fclose(fd);
+			return NULL;
+		}
+		job->line_number = line_number;
+		job->next = NULL;
+		*link = job;
+		link = &job->next;
+	}
+	fclose(fd);
+	*error = 0;
+	return list;
+}
+
+
+// convert file of batch job, return whether successful
+static int run_job(const struct job *job)
+{
+	if (convert(job->words[0], job->words[1], job->words[2]) == EXIT_SUCCESS)
+		return 1;
+
+	fprintf(stderr, "Conversion in batch file line %d failed.\n", job->line_number);
+	return 0;
+}
+
+
+// convert all files listed in batch file, return number of failures
+static int do_batch(const char *filename, int jobs)
+{
+	struct job	*list,
+			*job;
+	int		failures	= 0,
+			running		= 0,
+			error;
+
+	list = read_batch(filename, &error);
+	if (error)
+		return -1;
+	for (job = list; job; job = job->next) {
+#ifdef PLATFORM_JOBS
+		if (jobs > 1) {
+			for (; running >= jobs; --running) {
+				if (!platform_wait_job())
+					++failures;
+			}
+			switch (platform_start_job()) {
+			case 0:	// child
+				platform_end_job(run_job(job) ? EXIT_SUCCESS : EXIT_FAILURE);
+				break;
+			case 1:	// parent
+				++running;
+				continue;
+			}
+			// could not start child, so do it here
+		}
+#endif
+		if (!run_job(job))
+			++failures;
+	}
+#ifdef PLATFORM_JOBS
+	for (; running; --running) {
+		if (!platform_wait_job())
+			++failures;
+	}
+#endif
+	while (list) {
+		job = list->next;
+		free(list);
+		list = job;
+	}
+	return failures;
+}
+
+
+// guess what
+int main(int argc, char *argv[])
+{
+	int	jobs	= 1;
+	int	failures;
+
+	// handle "toacme -h" and "toacme --help" just like "toacme"
+	if (argc == 2) {
+		if ((strcmp(argv[1], "-h") == 0)
+		|| (strcmp(argv[1], "--help") == 0))
+			argc = 1;
+	}
+	// "toacme" without any switches gives info and exits successfully
+	if (argc == 1) {
+		version_show_info(argv[0]);
+		return EXIT_SUCCESS;
+	}
+	// "toacme --jobs NUMBER --batch FILE"
+	if ((argc == 5) && (strcmp(argv[1], "--jobs") == 0)) {
+		jobs = atoi(argv[2]);
+		if (jobs < 1) {
+			fputs("Number of jobs must be positive.\n", stderr);
+			return EXIT_FAILURE;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	// "toacme --batch FILE"
+	if ((argc == 3) && (strcmp(argv[1], "--batch") == 0)) {
+		failures = do_batch(argv[2], jobs);
+		if (failures > 0)
+			fprintf(stderr, "%d conversion(s) failed.\n", failures);
+		return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+	// check argument count
+	if (argc != 4) {
+		fputs("Wrong number of arguments.\n", stderr);
+		return EXIT_FAILURE;
+	}
+	return convert(argv[1], argv[2], argv[3]);
+}
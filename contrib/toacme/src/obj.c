@@ -116,9 +116,13 @@ static int am_immediate(void)
 {
 	put_argument2(" #$", IO_get_byte(), "");
 	if (GotByte > 15) {
-		fprintf(global_output_stream, "	; (= %d", GotByte);
-		if ((GotByte > 31) && (GotByte != 127))
-			fprintf(global_output_stream, " = '%c'", GotByte);
+		IO_put_string("	; (= ");
+		IO_put_decimal(GotByte);
+		if ((GotByte > 31) && (GotByte != 127)) {
+			IO_put_string(" = '");
+			IO_put_byte(GotByte);
+			IO_put_byte('\'');
+		}
 		IO_put_byte(')');
 	}
 	return 2;
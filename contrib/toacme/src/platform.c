@@ -32,3 +32,44 @@ void platform_set_file_type_text(const char *filename)
 
 
 #endif
+
+
+#ifdef PLATFORM_JOBS
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// start child process. returns 0 in child, 1 in parent and -1 on error.
+int platform_start_job(void)
+{
+	pid_t	pid;
+
+	// otherwise, buffered output would be written by both processes
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if (pid == -1)
+		return -1;
+	return pid ? 1 : 0;
+}
+
+// end child process with given exit status
+void platform_end_job(int status)
+{
+	fflush(stdout);
+	fflush(stderr);
+	_exit(status);	// do not touch streams inherited from parent
+}
+
+// wait for a child process to end, return whether it was successful
+int platform_wait_job(void)
+{
+	int	status;
+
+	if (wait(&status) == -1)
+		return 0;
+	return WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+#endif
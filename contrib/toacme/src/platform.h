@@ -20,5 +20,17 @@ extern void	platform_set_file_type_text(const char *filename);
 #define PLATFORM_SETFILETYPE_TEXT(a)
 #endif
 
+// running conversions in child processes (for "--jobs"). if not defined,
+// batch conversions are done one after the other.
+#if defined(__unix__) || defined(__APPLE__)
+#define PLATFORM_JOBS
+// start child process. returns 0 in child, 1 in parent and -1 on error.
+extern int	platform_start_job(void);
+// end child process with given exit status
+extern void	platform_end_job(int status);
+// wait for a child process to end, return whether it was successful
+extern int	platform_wait_job(void);
+#endif
+
 
 #endif
@@ -43,6 +43,9 @@ HOME_PAGE "\n"
 "certain conditions; as outlined in the GNU General Public License.\n"
 "\n"
 "Syntax: %s  FORMAT_ID  INPUT_FILE  OUTPUT_FILE\n"
+"   or:  %s  [--jobs NUMBER] --batch BATCH_FILE\n"
+"\n"
+"Each line of the batch file holds format id, input file and output file.\n"
 "\n"
 "Format ID:  source file format             quality\n"
 "--------------------------------------------------\n"
@@ -54,7 +57,7 @@ HOME_PAGE "\n"
 "f8ab        C64: Flash8-AssBlaster              ok\n"
 "prof        C64: Professional Assembler       poor (work in progress)\n"
 "\n"
-	, program_name);
+	, program_name, program_name);
 }
 
 
@@ -70,6 +73,7 @@ extern void prof_main(void);
 // check id string. returns whether illegal.
 int version_parse_id(const char id[])
 {
+	client_main = NULL;	// in case of batch conversion
 	if (strcmp(id, "vis") == 0)
 		client_main = visass_main;
 	else if (strcmp(id, "ab3") == 0)
@@ -29,7 +29,7 @@ void DOS_entry(void)
 		DynaBuf_add_string(GlobalDynaBuf, env_var);
 		DynaBuf_append(GlobalDynaBuf, '\\');	// add dir separator
 		DynaBuf_append(GlobalDynaBuf, '\0');	// add terminator
-		DOS_lib_prefix = DynaBuf_get_copy(GlobalDynaBuf);
+		DOS_lib_prefix = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
 	}
 }
 
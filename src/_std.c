@@ -7,8 +7,17 @@
 #define platform_C
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include "dynabuf.h"
+#ifdef PLATFORM_SLEEP
+#include <time.h>
+#endif
+#if defined(PLATFORM_START_HELPER) || defined(PLATFORM_START_WORKER)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 
 // variables
@@ -29,9 +38,104 @@ void AnyOS_entry(void)
 		DynaBuf_add_string(GlobalDynaBuf, env_var);
 		DynaBuf_append(GlobalDynaBuf, '/');	// add dir separator
 		DynaBuf_append(GlobalDynaBuf, '\0');	// add terminator
-		AnyOS_lib_prefix = DynaBuf_get_copy(GlobalDynaBuf);
+		AnyOS_lib_prefix = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
 	}
 }
 
 
+#ifdef PLATFORM_SLEEP
+// used as PLATFORM_SLEEP: pauses for given number of milliseconds
+void AnyOS_sleep(int milliseconds)
+{
+	struct timespec	duration;
+
+	duration.tv_sec = milliseconds / 1000;
+	duration.tv_nsec = (milliseconds % 1000) * 1000000L;
+	nanosleep(&duration, NULL);
+}
+#endif
+
+
+#ifdef PLATFORM_START_HELPER
+// used as PLATFORM_START_HELPER: returns nonzero in new helper process
+int AnyOS_start_helper(void)
+{
+	// collect helpers of earlier builds that have finished
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	// if fork fails, there is just no helper
+	return fork() == 0;
+}
+
+// used as PLATFORM_END_HELPER: ends helper process
+void AnyOS_end_helper(void)
+{
+	// do not flush stdio buffers inherited from the main process
+	_exit(0);
+}
+#endif
+
+
+#ifdef PLATFORM_CANONICAL_PATH
+// used as PLATFORM_CANONICAL_PATH: returns nonzero on success
+int AnyOS_canonical_path(const char *path, struct dynabuf *db)
+{
+	char	*resolved;
+
+	resolved = realpath(path, NULL);
+	if (resolved == NULL)
+		return 0;
+
+	DYNABUF_CLEAR(db);
+	DynaBuf_add_string(db, resolved);
+	DynaBuf_append(db, '\0');	// add terminator
+	free(resolved);	// not from safe_malloc(), so not counted
+	return 1;
+}
+#endif
+
+
+#ifdef PLATFORM_START_WORKER
+// used as PLATFORM_START_WORKER: returns stream for worker's results
+FILE *AnyOS_start_worker(long *id)
+{
+	int	fds[2];
+	pid_t	pid;
+	FILE	*stream;
+
+	if (pipe(fds))
+		return NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	}
+	if (pid == 0) {
+		// worker writes
+		close(fds[0]);
+		stream = fdopen(fds[1], "wb");
+		if (stream == NULL)
+			_exit(0);	// calling process will do the work itself
+		*id = 0;
+		return stream;
+	}
+	// calling process reads
+	close(fds[1]);
+	stream = fdopen(fds[0], "rb");
+	if (stream == NULL)
+		close(fds[0]);	// worker will just fail to write
+	*id = pid;
+	return stream;
+}
+
+// used as PLATFORM_WAIT_WORKER: waits for worker process to end
+void AnyOS_wait_worker(long id)
+{
+	waitpid((pid_t) id, NULL, 0);
+}
+#endif
+
+
 #endif
@@ -7,6 +7,9 @@
 #define platform_H
 
 
+#include <stdio.h>	// for FILE
+
+
 // symbolic constants and macros
 
 // called once on program startup (could register exit handler, if needed)
@@ -40,6 +43,40 @@ do {				\
 	x &= 255;		\
 } while (0)
 
+// pause for given number of milliseconds (for "--watch"). if not defined,
+// a busy wait is used instead.
+#if defined(__unix__) || defined(__APPLE__)
+#define PLATFORM_SLEEP(ms)	AnyOS_sleep(ms)
+#endif
+
+// start helper process that reads files in the background (for "--prefetch").
+// PLATFORM_START_HELPER() is TRUE in the helper, which must then finish using
+// PLATFORM_END_HELPER(). if not defined, there is no background prefetch.
+#if defined(__unix__) || defined(__APPLE__)
+#define PLATFORM_START_HELPER()	AnyOS_start_helper()
+#define PLATFORM_END_HELPER()	AnyOS_end_helper()
+#endif
+
+// start worker process that evaluates part of a loop (for "--jobs").
+// PLATFORM_START_WORKER(&id) returns NULL if no worker could be started.
+// otherwise, id is zero in the worker, which writes its results to the
+// returned stream and must then finish using PLATFORM_END_WORKER(). the
+// calling process reads them from the stream it got, closes it and then
+// calls PLATFORM_WAIT_WORKER(id). if not defined, there are no workers.
+#if defined(__unix__) || defined(__APPLE__)
+#define PLATFORM_START_WORKER(id)	AnyOS_start_worker(id)
+#define PLATFORM_END_WORKER()	AnyOS_end_helper()
+#define PLATFORM_WAIT_WORKER(id)	AnyOS_wait_worker(id)
+#endif
+
+// write canonical form of given path (absolute, without symbolic links, "."
+// or "..") to given dynabuf, so a file found under different names can be
+// recognized ("!once"). returns zero on failure. if not defined, paths are
+// compared as given.
+#if defined(__unix__) || defined(__APPLE__)
+#define PLATFORM_CANONICAL_PATH(path, db)	AnyOS_canonical_path(path, db)
+#endif
+
 // output of platform-specific command line switches
 #define PLATFORM_OPTION_HELP
 
@@ -54,6 +91,27 @@ extern char	*AnyOS_lib_prefix;	// header string of library tree
 
 // used as PLATFORM_INIT: reads "ACME" environment variable
 extern void	AnyOS_entry(void);
+#ifdef PLATFORM_SLEEP
+// used as PLATFORM_SLEEP: pauses for given number of milliseconds
+extern void	AnyOS_sleep(int milliseconds);
+#endif
+#ifdef PLATFORM_START_HELPER
+// used as PLATFORM_START_HELPER: returns nonzero in new helper process
+extern int	AnyOS_start_helper(void);
+// used as PLATFORM_END_HELPER: ends helper process
+extern void	AnyOS_end_helper(void);
+#endif
+#ifdef PLATFORM_CANONICAL_PATH
+// used as PLATFORM_CANONICAL_PATH: returns nonzero on success
+struct dynabuf;
+extern int	AnyOS_canonical_path(const char *path, struct dynabuf *db);
+#endif
+#ifdef PLATFORM_START_WORKER
+// used as PLATFORM_START_WORKER: returns stream for worker's results
+extern FILE	*AnyOS_start_worker(long *id);
+// used as PLATFORM_WAIT_WORKER: waits for worker process to end
+extern void	AnyOS_wait_worker(long id);
+#endif
 
 
 #endif
@@ -15,24 +15,33 @@
 // along with this program; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include "acme.h"
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "alu.h"
+#include "buildcache.h"
 #include "cliargs.h"
 #include "config.h"
 #include "cpu.h"
 #include "dynabuf.h"
 #include "encoding.h"
+#include "fixup.h"
 #include "flow.h"
 #include "global.h"
 #include "input.h"
 #include "macro.h"
 #include "mnemo.h"
 #include "output.h"
+#include "passtrace.h"
 #include "platform.h"
+#include "profile.h"
 #include "pseudoopcodes.h"
+#include "query.h"
 #include "section.h"
+#include "snapshot.h"
+#include "strip.h"
 #include "symbol.h"
 #include "version.h"
 
@@ -44,7 +53,12 @@ static const char	FILE_WRITEBINARY[]	= "wb";
 static const char	name_outfile[]		= "output filename";
 static const char	arg_symbollist[]	= "symbol list filename";
 static const char	arg_reportfile[]	= "report filename";
+static const char	arg_depfile[]		= "dependency filename";
 static const char	arg_vicelabels[]	= "VICE labels filename";
+static const char	arg_cachedir[]		= "cache directory";
+static const char	arg_snapshotdir[]	= "snapshot directory";
+static const char	arg_batchfile[]		= "batch file name";
+static const char	arg_profile[]		= "profile filename";
 // long options
 #define OPTION_HELP		"help"
 #define OPTION_FORMAT		"format"
@@ -52,21 +66,46 @@ static const char	arg_vicelabels[]	= "VICE labels filename";
 #define OPTION_LABELDUMP	"labeldump"	// old
 #define OPTION_SYMBOLLIST	"symbollist"	// new
 #define OPTION_VICELABELS	"vicelabels"
+#define OPTION_SYMBOLORDER	"symbolorder"
+#define OPTION_SYMBOLFORMAT	"symbolformat"
 #define OPTION_REPORT		"report"
+#define OPTION_DEPFILE		"depfile"
 #define OPTION_SETPC		"setpc"
 #define OPTION_CPU		"cpu"
 #define OPTION_INITMEM		"initmem"
 #define OPTION_MAXERRORS	"maxerrors"
+#define OPTION_MAXWARNINGS	"maxwarnings"
+#define OPTION_MAXMEMORY	"maxmemory"
 #define OPTION_MAXDEPTH		"maxdepth"
 #define OPTION_USE_STDOUT	"use-stdout"
 #define OPTION_VERSION		"version"
 #define OPTION_MSVC		"msvc"
 #define OPTION_COLOR		"color"
+#define OPTION_JSON		"json-messages"
 #define OPTION_FULLSTOP		"fullstop"
 #define OPTION_IGNORE_ZEROES	"ignore-zeroes"
 #define OPTION_STRICT_SEGMENTS	"strict-segments"
+#define OPTION_SPLIT_OUTPUT	"split-output"
+#define OPTION_KEEP_UNCHANGED	"keep-unchanged"
+#define OPTION_PREFETCH		"prefetch"
+#define OPTION_FIXUPS		"fixups"
+#define OPTION_REPORT_CYCLES	"report-cycles"
+#define OPTION_RELAX_BRANCHES	"relax-branches"
+#define OPTION_PEEPHOLE		"peephole"
+#define OPTION_DEAD_STRIP	"dead-strip"
+#define OPTION_JOBS		"jobs"
 #define OPTION_DIALECT		"dialect"
 #define OPTION_TEST		"test"
+#define OPTION_CACHE_DIR	"cache-dir"
+#define OPTION_SNAPSHOT_DIR	"snapshot-dir"
+#define OPTION_BATCH		"batch"
+#define OPTION_WATCH		"watch"
+#define OPTION_QUERY		"query"
+#define OPTION_MODULES		"modules"
+#define OPTION_STATS		"stats"
+#define OPTION_TRACE_PASSES	"trace-passes"
+#define OPTION_PROFILE		"profile"
+#define OPTION_PROFILE_STACKS	"profile-stacks"
 // options for "-W"
 #define OPTIONWNO_LABEL_INDENT	"no-label-indent"
 #define OPTIONWNO_OLD_FOR	"no-old-for"
@@ -75,19 +114,32 @@ static const char	arg_vicelabels[]	= "VICE labels filename";
 
 
 // variables
+static const char	*batch_filename	= NULL;
+static boolean		watch_mode	= FALSE;
+static boolean		query_mode	= FALSE;
+static boolean		embedded	= FALSE;	// TRUE when used as library (see libacme.c)
+static boolean		catch_exit	= FALSE;	// TRUE while errors must not exit
+static jmp_buf		exit_target;	// where to go when they would
 static const char	**toplevel_sources;
 static int		toplevel_src_count	= 0;
 #define ILLEGAL_START_ADDRESS	(-1)
-static signed long	start_address		= ILLEGAL_START_ADDRESS;
-static signed long	fill_value		= MEMINIT_USE_DEFAULT;
-static const struct cpu_type	*default_cpu	= NULL;
-const char		*symbollist_filename	= NULL;
-const char		*vicelabels_filename	= NULL;
-const char		*output_filename	= NULL;
-const char		*report_filename	= NULL;
-// maximum recursion depth for macro calls and "!source"
-signed long	macro_recursions_left	= MAX_NESTING;
-signed long	source_recursions_left	= MAX_NESTING;
+static struct part	main_part;	// the only one, unless in batch mode
+
+
+// set up part struct for a new assembly
+static void part_init(struct part *new_part)
+{
+	memset(new_part, 0, sizeof(*new_part));	// filenames and tables
+	new_part->symbols->arena = &new_part->arena;
+	new_part->locals->arena = &new_part->arena;
+	new_part->macros->arena = &new_part->arena;
+	new_part->messages->arena = &new_part->arena;
+	new_part->start_address = ILLEGAL_START_ADDRESS;
+	new_part->fill_value = MEMINIT_USE_DEFAULT;
+	new_part->default_cpu = NULL;
+	new_part->macro_recursions_left = MAX_NESTING;
+	new_part->source_recursions_left = MAX_NESTING;
+}
 
 
 // show release and platform info (and exit, if wanted)
@@ -97,7 +149,7 @@ static void show_version(int exit_after)
 "This is ACME, release " RELEASE " (\"" CODENAME "\"), " CHANGE_DATE " " CHANGE_YEAR "\n"
 "  " PLATFORM_VERSION);
 	if (exit_after)
-		exit(EXIT_SUCCESS);
+		ACME_exit(EXIT_SUCCESS);
 }
 
 
@@ -126,16 +178,40 @@ static void show_help_and_exit(void)
 "  -f, --" OPTION_FORMAT " FORMAT    set output file format\n"
 "  -o, --" OPTION_OUTFILE " FILE     set output file name\n"
 "  -r, --" OPTION_REPORT " FILE      set report file name\n"
+"      --" OPTION_REPORT_CYCLES "    add cycle counts to report\n"
 "  -l, --" OPTION_SYMBOLLIST " FILE  set symbol list file name\n"
 "      --" OPTION_LABELDUMP "        (old name for --" OPTION_SYMBOLLIST ")\n"
 "      --" OPTION_VICELABELS " FILE  set file name for label dump in VICE format\n"
+"      --" OPTION_SYMBOLORDER " ORDER  sort symbol list and labels (definition, name, address)\n"
+"      --" OPTION_SYMBOLFORMAT " FORMAT  set symbol list format (acme, json, binary)\n"
+"      --" OPTION_DEPFILE " FILE     write makefile rule listing all input files\n"
 "      --" OPTION_SETPC " VALUE      set program counter\n"
 "      --" OPTION_CPU " CPU          set target processor\n"
 "      --" OPTION_INITMEM " VALUE    define 'empty' memory\n"
 "      --" OPTION_MAXERRORS " NUMBER set number of errors before exiting\n"
+"      --" OPTION_MAXWARNINGS " NUMBER set number of warnings to show\n"
+"      --" OPTION_MAXMEMORY " NUMBER set memory limit in MiB\n"
 "      --" OPTION_MAXDEPTH " NUMBER  set recursion depth for macro calls and !src\n"
 "      --" OPTION_IGNORE_ZEROES "    do not determine number size by leading zeroes\n"
 "      --" OPTION_STRICT_SEGMENTS "  turn segment overlap warnings into errors\n"
+"      --" OPTION_SPLIT_OUTPUT " SIZE  write output as one file per bank of SIZE bytes\n"
+"      --" OPTION_KEEP_UNCHANGED "   do not rewrite output files that did not change\n"
+"      --" OPTION_PREFETCH "         read included files in the background\n"
+"      --" OPTION_FIXUPS "           patch forward references instead of doing more passes\n"
+"      --" OPTION_RELAX_BRANCHES "   replace out-of-range branches with longer code\n"
+"      --" OPTION_PEEPHOLE "         remove redundant instructions\n"
+"      --" OPTION_DEAD_STRIP "       leave out unused \"!strippable\" blocks\n"
+"      --" OPTION_JOBS " NUMBER      evaluate long data loops in NUMBER processes\n"
+"      --" OPTION_CACHE_DIR " DIR    reuse output of identical earlier builds\n"
+"      --" OPTION_SNAPSHOT_DIR " DIR reuse parsed library files\n"
+"      --" OPTION_BATCH " FILE       assemble projects listed in file\n"
+"      --" OPTION_WATCH "            assemble again whenever a source file changes\n"
+"      --" OPTION_QUERY "            answer symbol and address queries from stdin\n"
+"      --" OPTION_MODULES "          assemble each source file as a separate module\n"
+"      --" OPTION_STATS "            show statistics about passes and tables\n"
+"      --" OPTION_TRACE_PASSES "     show what changed from pass to pass\n"
+"      --" OPTION_PROFILE " FILE     write cost of each source line and macro\n"
+"      --" OPTION_PROFILE_STACKS " FILE  write costs as collapsed stacks\n"
 "  -vDIGIT                set verbosity level\n"
 "  -DSYMBOL=VALUE         define global symbol\n"
 "  -I PATH/TO/DIR         add search path for input files\n"
@@ -149,22 +225,25 @@ static void show_help_and_exit(void)
 "      --" OPTION_USE_STDOUT "       fix for 'Relaunch64' IDE (see docs)\n"
 "      --" OPTION_MSVC "             output errors in MS VS format\n"
 "      --" OPTION_COLOR "            uses ANSI color codes for error output\n"
+"      --" OPTION_JSON "    output errors as JSON objects, one per line\n"
 "      --" OPTION_FULLSTOP "         use '.' as pseudo opcode prefix\n"
 "      --" OPTION_DIALECT " VERSION  behave like different version\n"
 "      --" OPTION_TEST "             enable experimental features\n"
 PLATFORM_OPTION_HELP
 "  -V, --" OPTION_VERSION "          show version and exit\n");
-	exit(EXIT_SUCCESS);
+	ACME_exit(EXIT_SUCCESS);
 }
 
 
 // initialise report struct
 static void report_init(struct report *report)
 {
+	report->active = FALSE;
 	report->fd = NULL;
-	report->asc_used = 0;
-	report->bin_used = 0;
 	report->last_input = NULL;
+	report->lines = NULL;
+	report->used = 0;
+	report->size = 0;
 }
 // open report file
 static int report_open(struct report *report, const char *filename)
@@ -176,13 +255,300 @@ static int report_open(struct report *report, const char *filename)
 	}
 	return 0;	// success
 }
-// close report file
+// close report file and forget recorded lines (in query mode, the lines are
+// kept until the next build, because queries are answered from them)
 static void report_close(struct report *report)
 {
-	if (report && report->fd) {
+	if (report == NULL)
+		return;
+
+	if (report->fd) {
 		fclose(report->fd);
 		report->fd = NULL;
 	}
+	if (query_mode)
+		return;
+
+	safe_free(report->lines, report->size * sizeof(*report->lines), MEMUSE_OUTPUT);
+	report_init(report);
+}
+
+
+// buffer for writing the report (filled by hand instead of calling
+// fprintf() for every little part of every line)
+#define REPORT_OUTBUFSIZE	65536
+static char	report_outbuf[REPORT_OUTBUFSIZE];
+static size_t	report_outused;
+static const char	hexdigits[]	= "0123456789abcdef";
+static const char	source_header[]	= "\n; ******** Source: ";
+
+// write buffered report text to file
+static void report_flush(struct report *report)
+{
+	fwrite(report_outbuf, 1, report_outused, report->fd);
+	report_outused = 0;
+}
+// add text to report buffer
+static void report_add(struct report *report, const char *text, size_t size)
+{
+	if (report_outused + size > REPORT_OUTBUFSIZE) {
+		report_flush(report);
+		// very long texts are written directly
+		if (size > REPORT_OUTBUFSIZE) {
+			fwrite(text, 1, size, report->fd);
+			return;
+		}
+	}
+	memcpy(report_outbuf + report_outused, text, size);
+	report_outused += size;
+}
+// put cycle count(s) of line into report column (at most eight chars)
+static void report_cycles(char *write, int min, int max)
+{
+	char	buffer[24];
+
+	if (min == max)
+		sprintf(buffer, "%d", min);
+	else
+		sprintf(buffer, "%d-%d", min, max);
+	memcpy(write, buffer, strlen(buffer) > 8 ? 8 : strlen(buffer));
+}
+// write one line: line number, address and bytes, then source text
+// (same layout as "%6d  %-4s %-19s%s\n" would give, plus cycles if wanted)
+static void report_write_line(struct report *report, const struct report_line *line, const char *text, size_t length)
+{
+	char		prefix[64];
+	char		*write	= prefix;
+	unsigned long	value;
+	int		digits,
+			ii;
+
+	// line number, right-aligned
+	value = line->line_number;
+	digits = 1;
+	while (value >= 10) {
+		value /= 10;
+		++digits;
+	}
+	for (ii = digits; ii < 6; ++ii)
+		*write++ = ' ';
+	value = line->line_number;
+	for (ii = digits; ii--; value /= 10)
+		write[ii] = '0' + value % 10;
+	write += digits;
+	*write++ = ' ';
+	*write++ = ' ';
+	// address, at least four digits (or nothing if there are no bytes)
+	digits = 4;
+	if (line->bin_used) {
+		value = (unsigned long) line->bin_address;
+		while ((digits < 8) && (value >> (4 * digits)))
+			++digits;
+		for (ii = digits; ii--; value >>= 4)
+			write[ii] = hexdigits[value & 15];
+	} else {
+		memset(write, ' ', digits);
+	}
+	write += digits;
+	*write++ = ' ';
+	// bytes (if buffer is full, last byte is replaced by "...")
+	memset(write, ' ', 19);
+	for (ii = 0; ii < line->bin_used; ++ii) {
+		if (ii == REPORT_BINBUFSIZE - 1) {
+			memcpy(write + 2 * ii, "...", 3);
+			break;
+		}
+		write[2 * ii] = hexdigits[(line->bin[ii] >> 4) & 15];
+		write[2 * ii + 1] = hexdigits[line->bin[ii] & 15];
+	}
+	write += 19;
+	// cycles, if wanted ("N" or "MIN-MAX", or "?" if unknown)
+	if (config.report_cycles) {
+		memset(write, ' ', 8);
+		if (line->cycles_unknown)
+			*write = '?';
+		else if (line->cycles_max)
+			report_cycles(write, line->cycles_min, line->cycles_max);
+		write += 8;
+	}
+	report_add(report, prefix, write - prefix);
+	report_add(report, text, length);
+	// rewrites done by "--peephole" are shown as comments
+	if (line->peephole) {
+		report_add(report, "\t; ", 3);
+		report_add(report, line->peephole, strlen(line->peephole));
+	}
+	report_add(report, "\n", 1);
+}
+// write all lines recorded during the last pass
+static void report_write(struct report *report)
+{
+	const struct report_line	*line,
+					*end	= report->lines + report->used;
+	const struct cached_file	*file	= NULL;
+	const char			*read	= NULL,
+					*limit	= NULL,
+					*text;
+	int				number	= 0;
+
+	report_outused = 0;
+	for (line = report->lines; line != end; ++line) {
+		if (line->new_source) {
+			report_add(report, source_header, sizeof(source_header) - 1);
+			report_add(report, line->file->name, strlen(line->file->name));
+			report_add(report, "\n", 1);
+		}
+		// find start of line (from the start of the file if going back)
+		if ((line->file != file) || (line->line_number < number)) {
+			file = line->file;
+			read = file->body;
+			limit = read + file->size;
+			number = 1;
+		}
+		while ((number < line->line_number) && (read != limit)) {
+			// CR, LF and CRLF are all line breaks
+			if (*read == '\r') {
+				++read;
+				if ((read != limit) && (*read == '\n'))
+					++read;
+				++number;
+			} else if (*read++ == '\n') {
+				++number;
+			}
+		}
+		text = read;
+		while ((text != limit) && (*text != '\r') && (*text != '\n'))
+			++text;
+		// (after a final line break, there is no line left to show)
+		if ((text != limit) || (text != read))
+			report_write_line(report, line, read, text - read);
+	}
+	report_flush(report);
+}
+
+
+// show size and name of file cache entry (for "--stats")
+static void show_file_stats(struct rwnode *node, FILE *fd)
+{
+	struct cached_file	*file	= node->body;
+
+	if (file->path)
+		fprintf(fd, "%10lu bytes read from \"%s\"\n", (unsigned long) file->size, file->path);
+}
+
+
+// show statistics gathered during assembly (for "--stats")
+static void show_stats(void)
+{
+	static const char	*const memuse_names[MEMUSE_COUNT]	= {
+		"symbols",
+		"tree nodes and tables",
+		"stored blocks and compiled statements",
+		"macros",
+		"strings, lists and copies",
+		"dynamic buffers",
+		"output",
+		"source files",
+		"other"
+	};
+	int	ii;
+
+	printf("Statistics:\n");
+	filecache_dump(show_file_stats, stdout);
+	printf("%10lu symbols created\n", stats.symbols_created);
+	printf("%10lu table lookups (%.2f slots compared on average)\n", stats.table_lookups,
+		stats.table_lookups ? (double) stats.table_probes / stats.table_lookups : 0.0);
+	printf("%10lu macro calls\n", stats.macro_calls);
+	printf("%10lu loop iterations\n", stats.loop_iterations);
+	printf("%10lu includes skipped by \"!once\"\n", stats.skipped_once);
+	printf("%10lu expressions evaluated (%lu of them compiled)\n", stats.expressions, stats.compiled_expressions);
+	printf("%10d argument stack entries used at most\n", stats.max_arg_sp);
+	printf("%10d operator stack entries used at most\n", stats.max_op_sp);
+	printf("%10lu bytes in use at most\n", memstats.peak);
+	printf("%10lu bytes in use at the end, of these:\n", memstats.in_use);
+	for (ii = 0; ii < MEMUSE_COUNT; ++ii)
+		printf("%10lu   for %s\n", memstats.use[ii], memuse_names[ii]);
+}
+
+
+// output files:
+// in watch mode, other programs may be waiting for a file to change, so it is
+// written under a temporary name and then renamed. this way, they never get to
+// see a half-written file. with "--keep-unchanged", the temporary file is
+// compared to the existing one and only renamed if they differ, so files that
+// did not change are not touched at all.
+struct outfile {
+	const char	*name;
+	char		*tmp_name;	// NULL if written directly
+};
+
+// open output file. returns NULL on error.
+static FILE *outfile_open(struct outfile *file, const char *name, const char *mode)
+{
+	FILE	*fd;
+
+	file->name = name;
+	file->tmp_name = NULL;
+	if (watch_mode || config.keep_unchanged) {
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		DynaBuf_add_string(GlobalDynaBuf, name);
+		DynaBuf_add_string(GlobalDynaBuf, ".tmp");
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		file->tmp_name = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
+	}
+	fd = fopen(file->tmp_name ? file->tmp_name : name, mode);	// FIXME - what if filename is given via !to/!sl in sub-dir? fix path!
+	if (fd == NULL) {
+		safe_free_string(file->tmp_name, MEMUSE_OTHER);
+		file->tmp_name = NULL;
+	}
+	return fd;
+}
+
+// return whether both files exist and have the same contents
+static boolean files_are_equal(const char *name, const char *other_name)
+{
+	FILE	*fd,
+		*other;
+	char	buf[4096],
+		other_buf[sizeof(buf)];
+	size_t	got;
+	boolean	equal	= FALSE;
+
+	fd = fopen(name, FILE_READBINARY);
+	if (fd == NULL)
+		return FALSE;
+
+	other = fopen(other_name, FILE_READBINARY);
+	if (other) {
+		do {
+			got = fread(buf, 1, sizeof(buf), fd);
+			equal = (fread(other_buf, 1, sizeof(other_buf), other) == got)
+				&& (memcmp(buf, other_buf, got) == 0);
+		} while (equal && got);
+		fclose(other);
+	}
+	fclose(fd);
+	return equal;
+}
+
+// close output file (and move it to where it belongs)
+static void outfile_close(struct outfile *file, FILE *fd)
+{
+	fclose(fd);
+	if (file->tmp_name == NULL)
+		return;
+
+	if (config.keep_unchanged && files_are_equal(file->tmp_name, file->name)) {
+		if (config.process_verbosity > 1)
+			printf("Output file \"%s\" did not change.\n", file->name);
+		remove(file->tmp_name);
+	} else if (rename(file->tmp_name, file->name)) {
+		// some systems cannot rename to an existing file
+		remove(file->name);
+		if (rename(file->tmp_name, file->name))
+			fprintf(stderr, "Error: Cannot rename \"%s\" to \"%s\".\n", file->tmp_name, file->name);
+	}
+	safe_free_string(file->tmp_name, MEMUSE_OTHER);
 }
 
 
@@ -191,79 +557,163 @@ static void report_close(struct report *report)
 // tidy up before exiting by saving symbol list and close other output files
 int ACME_finalize(int exit_code)
 {
-	FILE	*fd;
+	struct outfile	file;
+	FILE		*fd;
 
+	Throw_flush();
 	report_close(report);
-	if (symbollist_filename) {
-		fd = fopen(symbollist_filename, FILE_WRITETEXT);	// FIXME - what if filename is given via !sl in sub-dir? fix path!
+	if (part->symbollist_filename) {
+		fd = outfile_open(&file, part->symbollist_filename, (config.symbol_format == SYMBOLFORMAT_BINARY) ? FILE_WRITEBINARY : FILE_WRITETEXT);
 		if (fd) {
 			symbols_list(fd);
-			fclose(fd);
-			PLATFORM_SETFILETYPE_TEXT(symbollist_filename);
+			outfile_close(&file, fd);
+			if (config.symbol_format == SYMBOLFORMAT_BINARY) {
+				PLATFORM_SETFILETYPE_PLAIN(part->symbollist_filename);
+			} else {
+				PLATFORM_SETFILETYPE_TEXT(part->symbollist_filename);
+			}
 		} else {
-			fprintf(stderr, "Error: Cannot open symbol list file \"%s\".\n", symbollist_filename);
+			fprintf(stderr, "Error: Cannot open symbol list file \"%s\".\n", part->symbollist_filename);
 			exit_code = EXIT_FAILURE;
 		}
 	}
-	if (vicelabels_filename) {
-		fd = fopen(vicelabels_filename, FILE_WRITETEXT);
+	if (part->vicelabels_filename) {
+		fd = outfile_open(&file, part->vicelabels_filename, FILE_WRITETEXT);
 		if (fd) {
 			symbols_vicelabels(fd);
-			fclose(fd);
-			PLATFORM_SETFILETYPE_TEXT(vicelabels_filename);
+			outfile_close(&file, fd);
+			PLATFORM_SETFILETYPE_TEXT(part->vicelabels_filename);
 		} else {
-			fprintf(stderr, "Error: Cannot open VICE label dump file \"%s\".\n", vicelabels_filename);
+			fprintf(stderr, "Error: Cannot open VICE label dump file \"%s\".\n", part->vicelabels_filename);
 			exit_code = EXIT_FAILURE;
 		}
 	}
+	profile_write();
+	if (config.show_stats)
+		show_stats();
 	return exit_code;
 }
 
 
-// save output file
+// end assembly because of errors. in watch mode, query mode and when used as
+// library, only the current build is ended, otherwise the program exits.
+void ACME_exit(int exit_code)
+{
+	if (catch_exit)
+		longjmp(exit_target, 1);
+	exit(exit_code);
+}
+
+
+// write output file with given name (whole output, or given bank if
+// "--split-output" is used)
+static void save_file(const char *filename, intval_t bank)
+{
+	struct outfile	file;
+	FILE		*fd;
+
+	fd = outfile_open(&file, filename, FILE_WRITEBINARY);
+	if (fd == NULL) {
+		fprintf(stderr, "Error: Cannot open output file \"%s\".\n", filename);
+		return;
+	}
+	if (config.split_size)
+		Output_save_bank(fd, config.split_size, bank);
+	else
+		Output_save_file(fd);
+	outfile_close(&file, fd);
+}
+
+
+// save output file (or files, if "--split-output" is used: then each bank
+// that holds output goes to a file of its own, named "NAME.BANKNUMBER")
 static void save_output_file(void)
 {
-	FILE	*fd;
+	intval_t	bank,
+			last;
+	char		number[24];
+	char		*filename;
 
 	// if no output file chosen, tell user and do nothing
-	if (output_filename == NULL) {
+	// (the library hands the output to the caller instead)
+	if (part->output_filename == NULL) {
+		if (embedded)
+			return;
+
 		fputs("No output file specified (use the \"-o\" option or the \"!to\" pseudo opcode).\n", stderr);
 		return;
 	}
-	fd = fopen(output_filename, FILE_WRITEBINARY);	// FIXME - what if filename is given via !to in sub-dir? fix path!
-	if (fd == NULL) {
-		fprintf(stderr, "Error: Cannot open output file \"%s\".\n",
-			output_filename);
+	if (config.split_size == 0) {
+		save_file(part->output_filename, 0);
 		return;
 	}
-	Output_save_file(fd);
-	fclose(fd);
+	if (!Output_get_banks(config.split_size, &bank, &last))
+		return;	// no output, so no files
+
+	for (; bank <= last; ++bank) {
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		DynaBuf_add_string(GlobalDynaBuf, part->output_filename);
+		sprintf(number, ".%ld", (long) bank);
+		DynaBuf_add_string(GlobalDynaBuf, number);
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		filename = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
+		save_file(filename, bank);
+		safe_free_string(filename, MEMUSE_OTHER);
+	}
+}
+
+
+// set cpu, program counter and encoding to the values given on the command line
+static void set_initial_state(void)
+{
+	cputype_passinit(part->default_cpu);	// set default cpu type
+	// if start address was given on command line, use it:
+	if (part->start_address != ILLEGAL_START_ADDRESS)
+		vcpu_set_pc(part->start_address, 0);
+	encoding_passinit();	// set default encoding
 }
 
 
 // increment pass number and perform a single pass
-static void perform_pass(void)
+static void perform_pass(const char *reason)
 {
-	FILE	*fd;
-	int	ii;
+	struct cached_file	*file;
+	int			ii;
+	clock_t			start	= clock();
 
+	if (config.process_verbosity > 1)
+		printf("%s.\n", reason);
 	++pass.number;
 	// call modules' "pass init" functions
 	Output_passinit();	// disable output, PC undefined
-	cputype_passinit(default_cpu);	// set default cpu type
-	// if start address was given on command line, use it:
-	if (start_address != ILLEGAL_START_ADDRESS)
-		vcpu_set_pc(start_address, 0);
-	encoding_passinit();	// set default encoding
+	set_initial_state();
 	section_passinit();	// set initial zone (untitled)
+	mnemo_passinit();
+	strip_passinit();
+	Throw_forget_deferred();
 	// init variables
 	pass.undefined_count = 0;
-	//pass.needvalue_count = 0;	FIXME - use
+	pass.needvalue_count = 0;
+	report->used = 0;
+	report->last_input = NULL;
 	pass.error_count = 0;
+	pass.volatile_count = 0;
+	pass.relaxed_count = 0;
 	// Process toplevel files
 	for (ii = 0; ii < toplevel_src_count; ++ii) {
-		if ((fd = fopen(toplevel_sources[ii], FILE_READBINARY))) {
-			flow_parse_and_close_file(fd, toplevel_sources[ii]);
+		// with "--modules", each file starts from scratch (except for
+		// the global symbols, which are used to link the modules):
+		if (config.separate_modules && ii) {
+			output_new_module();	// end segment, PC undefined
+			set_initial_state();
+			section_new_module();	// new zone (untitled)
+		}
+		// toplevel files are cached as well, but without using include paths
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		DynaBuf_add_string(GlobalDynaBuf, toplevel_sources[ii]);
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		if ((file = filecache_get(FALSE))) {
+			flow_parse_file(file);
 		} else {
 			fprintf(stderr, "Error: Cannot open toplevel file \"%s\".\n", toplevel_sources[ii]);
 			if (toplevel_sources[ii][0] == '-')
@@ -272,58 +722,91 @@ static void perform_pass(void)
 		}
 	}
 	Output_end_segment();
+	if (config.show_stats)
+		printf("Pass %d (%s): %.3f seconds, %d undefined results (%d needed), %d errors.\n",
+			pass.number + 1, reason, (double) (clock() - start) / CLOCKS_PER_SEC,
+			pass.undefined_count, pass.needvalue_count, pass.error_count);
+	if (config.trace_passes)
+		passtrace_end_pass();
 /*	TODO:
 	if --save-start is given, parse arg string
 	if --save-limit is given, parse arg string
 */
 	if (pass.error_count)
-		exit(ACME_finalize(EXIT_FAILURE));
+		ACME_exit(ACME_finalize(EXIT_FAILURE));
+}
+
+
+// return number of undefined results that keep the output from being final
+static int undefined_needed(void)
+{
+	// symbol dumps contain every symbol, so then all values are needed
+	// (the library hands all symbols to the caller as well, and queries
+	// may ask for any of them)
+	if (part->symbollist_filename || part->vicelabels_filename || query_mode || embedded)
+		return pass.undefined_count + pass.needvalue_count;
+
+	return pass.needvalue_count;
 }
 
 
-static struct report	global_report;
 // do passes until done (or errors occurred). Return whether output is ready.
+#define RELAX_MAX_PASSES	100	// "--relax-branches" gives up after this many passes
 static boolean do_actual_work(void)
 {
 	int	undefs_before;	// number of undefined results in previous pass
 
-	report = &global_report;	// let global pointer point to something
+	report = &part->report;	// let global pointer point to something
 	report_init(report);	// we must init struct before doing passes
-	if (config.process_verbosity > 1)
-		puts("First pass.");
-	pass.complain_about_undefined = FALSE;	// disable until error pass needed
+	report->active = (part->report_filename != NULL) || query_mode;
+	pass.complain_about_undefined = FALSE;	// defer errors (see is_not_defined() in alu.c)
 	pass.number = -1;	// pre-init, will be incremented by perform_pass()
-	perform_pass();	// first pass
-	// pretend there has been a previous pass, with one more undefined result
-	undefs_before = pass.undefined_count + 1;
-	// keep doing passes as long as the number of undefined results keeps decreasing.
-	// stop on zero (FIXME - zero-check pass.needvalue_count instead!)
-	while (pass.undefined_count && (pass.undefined_count < undefs_before)) {
-		undefs_before = pass.undefined_count;
-		if (config.process_verbosity > 1)
-			puts("Further pass.");
-		perform_pass();
+	pass.relaxed_count = 0;
+	fixup_begin();
+	perform_pass("First pass");	// first pass
+	if (fixup_end()) {
+		// forward references have been patched into the output, so
+		// there is no need for further passes
+		if (pass.error_count)
+			ACME_exit(ACME_finalize(EXIT_FAILURE));
+	} else {
+		// pretend there has been a previous pass, with one more undefined result
+		undefs_before = pass.undefined_count + pass.needvalue_count + 1;
+		// keep doing passes as long as the number of undefined results keeps decreasing.
+		// values that do not end up in the output or the program counter
+		// are not needed for the output, but they still have to be
+		// resolved: if they cannot be, that is an error.
+		// if branches got longer, the layout has changed, so always go on.
+		// when done, unused "!strippable" blocks are removed, and then
+		// it starts all over.
+		while ((pass.undefined_count + pass.needvalue_count && (pass.undefined_count + pass.needvalue_count < undefs_before))
+		|| pass.relaxed_count
+		|| (config.dead_strip && (undefined_needed() == 0) && strip_unused())) {
+			// branches can only grow, but moving labels could still
+			// change sizes of other things back and forth
+			if (pass.relaxed_count && (pass.number >= RELAX_MAX_PASSES))
+				Throw_serious_error("Branch relaxation does not converge.");
+			undefs_before = pass.undefined_count + pass.needvalue_count;
+			perform_pass("Further pass");
+		}
 	}
 	// any errors left?
-	if (pass.undefined_count == 0) {	// FIXME - use pass.needvalue_count instead!
+	if ((pass.undefined_count == 0) && (pass.needvalue_count == 0)) {
 		// if listing report is wanted and there were no errors,
-		// do another pass to generate listing report
-		if (report_filename) {
-			if (config.process_verbosity > 1)
-				puts("Extra pass to generate listing report.");
-			if (report_open(report, report_filename) == 0) {
-				perform_pass();
-				report_close(report);
-			}
+		// write the lines recorded during the last pass
+		if (part->report_filename) {
+			if (report_open(report, part->report_filename) == 0)
+				report_write(report);
+			report_close(report);
 		}
 		return TRUE;
 	}
-	// There are still errors (unsolvable by doing further passes),
-	// so perform additional pass to find and show them.
-	if (config.process_verbosity > 1)
-		puts("Extra pass needed to find error.");
-	pass.complain_about_undefined = TRUE;	// activate error output
-	perform_pass();	// perform pass, but now show "value undefined"
+	// There are still errors (unsolvable by doing further passes). The
+	// last pass has remembered where undefined values were used, so
+	// show those errors now.
+	Throw_deferred_now();
+	if (pass.error_count)
+		ACME_exit(ACME_finalize(EXIT_FAILURE));
 	return FALSE;
 }
 
@@ -352,7 +835,7 @@ static void set_output_format(const char format_name[])
 		fputs("Error: No output format specified.\n", stderr);
 	}
 	fprintf(stderr, "Supported formats are:\n\n\t%s\n\n", outputfile_formats);
-	exit(EXIT_FAILURE);
+	ACME_exit(EXIT_FAILURE);
 }
 
 
@@ -366,7 +849,7 @@ static void set_starting_cpu(const char cpu_name[])
 		keyword_to_dynabuf(cpu_name);
 		new_cpu_type = cputype_find();
 		if (new_cpu_type) {
-			default_cpu = new_cpu_type;
+			part->default_cpu = new_cpu_type;
 			return;	// ok
 		}
 		fputs("Error: Unknown CPU type.\n", stderr);
@@ -374,14 +857,14 @@ static void set_starting_cpu(const char cpu_name[])
 		fputs("Error: No CPU type specified.\n", stderr);
 	}
 	fprintf(stderr, "Supported types are:\n\n\t%s\n\n", cputype_names);
-	exit(EXIT_FAILURE);
+	ACME_exit(EXIT_FAILURE);
 }
 
 
 static void could_not_parse(const char strange[])
 {
 	fprintf(stderr, "%sCould not parse '%s'.\n", cliargs_error, strange);
-	exit(EXIT_FAILURE);
+	ACME_exit(EXIT_FAILURE);
 }
 
 
@@ -416,27 +899,39 @@ static signed long string_to_number(const char *string)
 }
 
 
+// set bank size for "--split-output"
+static void set_split_size(const char *expression)
+{
+	config.split_size = string_to_number(expression);
+	if (config.split_size > 0)
+		return;
+
+	fprintf(stderr, "%sBank size must be positive.\n", cliargs_error);
+	ACME_exit(EXIT_FAILURE);
+}
+
+
 // set program counter
 static void set_starting_pc(const char expression[])
 {
-	start_address = string_to_number(expression);
-	if ((start_address > -1) && (start_address < 65536))
+	part->start_address = string_to_number(expression);
+	if ((part->start_address > -1) && (part->start_address < 65536))
 		return;
 
 	fprintf(stderr, "%sProgram counter out of range (0-0xffff).\n", cliargs_error);
-	exit(EXIT_FAILURE);
+	ACME_exit(EXIT_FAILURE);
 }
 
 
 // set initial memory contents
 static void set_mem_contents(const char expression[])
 {
-	fill_value = string_to_number(expression);
-	if ((fill_value >= -128) && (fill_value <= 255))
+	part->fill_value = string_to_number(expression);
+	if ((part->fill_value >= -128) && (part->fill_value <= 255))
 		return;
 
 	fprintf(stderr, "%sInitmem value out of range (0-0xff).\n", cliargs_error);
-	exit(EXIT_FAILURE);
+	ACME_exit(EXIT_FAILURE);
 }
 
 
@@ -458,6 +953,58 @@ static void define_symbol(const char definition[])
 }
 
 
+// set order of symbol list and VICE labels
+static void set_symbol_order(const char order[])
+{
+	// caution, order may be NULL!
+	if (order) {
+		if (strcmp(order, "definition") == 0) {
+			config.symbol_order = SYMBOLORDER_DEFINITION;
+			return;
+		}
+		if (strcmp(order, "name") == 0) {
+			config.symbol_order = SYMBOLORDER_NAME;
+			return;
+		}
+		if (strcmp(order, "address") == 0) {
+			config.symbol_order = SYMBOLORDER_ADDRESS;
+			return;
+		}
+		fputs("Error: Unknown symbol order.\n", stderr);
+	} else {
+		fputs("Error: No symbol order specified.\n", stderr);
+	}
+	fputs("Supported orders are:\n\n\t'definition', 'name', 'address'\n\n", stderr);
+	ACME_exit(EXIT_FAILURE);
+}
+
+
+// set format of symbol list
+static void set_symbol_format(const char format[])
+{
+	// caution, format may be NULL!
+	if (format) {
+		if (strcmp(format, "acme") == 0) {
+			config.symbol_format = SYMBOLFORMAT_ACME;
+			return;
+		}
+		if (strcmp(format, "json") == 0) {
+			config.symbol_format = SYMBOLFORMAT_JSON;
+			return;
+		}
+		if (strcmp(format, "binary") == 0) {
+			config.symbol_format = SYMBOLFORMAT_BINARY;
+			return;
+		}
+		fputs("Error: Unknown symbol list format.\n", stderr);
+	} else {
+		fputs("Error: No symbol list format specified.\n", stderr);
+	}
+	fputs("Supported formats are:\n\n\t'acme', 'json', 'binary'\n\n", stderr);
+	ACME_exit(EXIT_FAILURE);
+}
+
+
 struct dialect {
 	enum version	dialect;
 	const char	*version;
@@ -505,7 +1052,7 @@ static void set_dialect(const char version[])
 	for (dia = dialects; dia->version; ++dia)
 		fprintf(stderr, "\t%s\t\t%s\n", dia->version, dia->description);
 	fputc('\n', stderr);
-	exit(EXIT_FAILURE);
+	ACME_exit(EXIT_FAILURE);
 }
 
 
@@ -517,15 +1064,21 @@ static const char *long_option(const char *string)
 	else if (strcmp(string, OPTION_FORMAT) == 0)
 		set_output_format(cliargs_get_next());	// NULL is ok (handled like unknown)
 	else if (strcmp(string, OPTION_OUTFILE) == 0)
-		output_filename = cliargs_safe_get_next(name_outfile);
+		part->output_filename = cliargs_safe_get_next(name_outfile);
 	else if (strcmp(string, OPTION_LABELDUMP) == 0)	// old
-		symbollist_filename = cliargs_safe_get_next(arg_symbollist);
+		part->symbollist_filename = cliargs_safe_get_next(arg_symbollist);
 	else if (strcmp(string, OPTION_SYMBOLLIST) == 0)	// new
-		symbollist_filename = cliargs_safe_get_next(arg_symbollist);
+		part->symbollist_filename = cliargs_safe_get_next(arg_symbollist);
 	else if (strcmp(string, OPTION_VICELABELS) == 0)
-		vicelabels_filename = cliargs_safe_get_next(arg_vicelabels);
+		part->vicelabels_filename = cliargs_safe_get_next(arg_vicelabels);
+	else if (strcmp(string, OPTION_SYMBOLORDER) == 0)
+		set_symbol_order(cliargs_get_next());	// NULL is ok (handled like unknown)
+	else if (strcmp(string, OPTION_SYMBOLFORMAT) == 0)
+		set_symbol_format(cliargs_get_next());	// NULL is ok (handled like unknown)
 	else if (strcmp(string, OPTION_REPORT) == 0)
-		report_filename = cliargs_safe_get_next(arg_reportfile);
+		part->report_filename = cliargs_safe_get_next(arg_reportfile);
+	else if (strcmp(string, OPTION_DEPFILE) == 0)
+		part->depfile_filename = cliargs_safe_get_next(arg_depfile);
 	else if (strcmp(string, OPTION_SETPC) == 0)
 		set_starting_pc(cliargs_safe_get_next("program counter"));
 	else if (strcmp(string, OPTION_CPU) == 0)
@@ -534,8 +1087,12 @@ static const char *long_option(const char *string)
 		set_mem_contents(cliargs_safe_get_next("initmem value"));
 	else if (strcmp(string, OPTION_MAXERRORS) == 0)
 		config.max_errors = string_to_number(cliargs_safe_get_next("maximum error count"));
+	else if (strcmp(string, OPTION_MAXWARNINGS) == 0)
+		config.max_warnings = string_to_number(cliargs_safe_get_next("maximum warning count"));
+	else if (strcmp(string, OPTION_MAXMEMORY) == 0)
+		config.max_memory = string_to_number(cliargs_safe_get_next("memory limit")) * 1024UL * 1024UL;
 	else if (strcmp(string, OPTION_MAXDEPTH) == 0)
-		macro_recursions_left = (source_recursions_left = string_to_number(cliargs_safe_get_next("recursion depth")));
+		part->macro_recursions_left = (part->source_recursions_left = string_to_number(cliargs_safe_get_next("recursion depth")));
 //	else if (strcmp(string, "strictsyntax") == 0)
 //		strict_syntax = TRUE;
 	else if (strcmp(string, OPTION_USE_STDOUT) == 0)
@@ -548,7 +1105,47 @@ static const char *long_option(const char *string)
 		config.honor_leading_zeroes = FALSE;
 	else if (strcmp(string, OPTION_STRICT_SEGMENTS) == 0)
 		config.segment_warning_is_error = TRUE;
-	else if (strcmp(string, OPTION_DIALECT) == 0)
+	else if (strcmp(string, OPTION_SPLIT_OUTPUT) == 0)
+		set_split_size(cliargs_safe_get_next("bank size"));
+	else if (strcmp(string, OPTION_KEEP_UNCHANGED) == 0)
+		config.keep_unchanged = TRUE;
+	else if (strcmp(string, OPTION_PREFETCH) == 0)
+		config.prefetch = TRUE;
+	else if (strcmp(string, OPTION_FIXUPS) == 0)
+		config.fixups = TRUE;
+	else if (strcmp(string, OPTION_REPORT_CYCLES) == 0)
+		config.report_cycles = TRUE;
+	else if (strcmp(string, OPTION_RELAX_BRANCHES) == 0)
+		config.relax_branches = TRUE;
+	else if (strcmp(string, OPTION_PEEPHOLE) == 0)
+		config.peephole = TRUE;
+	else if (strcmp(string, OPTION_DEAD_STRIP) == 0)
+		config.dead_strip = TRUE;
+	else if (strcmp(string, OPTION_JOBS) == 0)
+		config.jobs = string_to_number(cliargs_safe_get_next("number of jobs"));
+	else if (strcmp(string, OPTION_CACHE_DIR) == 0)
+		buildcache_dir = cliargs_safe_get_next(arg_cachedir);
+	else if (strcmp(string, OPTION_SNAPSHOT_DIR) == 0)
+		snapshot_dir = cliargs_safe_get_next(arg_snapshotdir);
+	else if (strcmp(string, OPTION_BATCH) == 0)
+		batch_filename = cliargs_safe_get_next(arg_batchfile);
+	else if (strcmp(string, OPTION_WATCH) == 0)
+		watch_mode = TRUE;
+	else if (strcmp(string, OPTION_QUERY) == 0)
+		query_mode = TRUE;
+	else if (strcmp(string, OPTION_MODULES) == 0)
+		config.separate_modules = TRUE;
+	else if (strcmp(string, OPTION_STATS) == 0)
+		config.show_stats = TRUE;
+	else if (strcmp(string, OPTION_TRACE_PASSES) == 0)
+		config.trace_passes = TRUE;
+	else if (strcmp(string, OPTION_PROFILE) == 0) {
+		profile_filename = cliargs_safe_get_next(arg_profile);
+		profile_active = TRUE;
+	} else if (strcmp(string, OPTION_PROFILE_STACKS) == 0) {
+		profile_stacks_filename = cliargs_safe_get_next(arg_profile);
+		profile_active = TRUE;
+	} else if (strcmp(string, OPTION_DIALECT) == 0)
 		set_dialect(cliargs_get_next());	// NULL is ok (handled like unknown)
 	else if (strcmp(string, OPTION_TEST) == 0) {
 		config.wanted_version = VER_FUTURE;
@@ -556,6 +1153,8 @@ static const char *long_option(const char *string)
 	} PLATFORM_LONGOPTION_CODE
 	else if (strcmp(string, OPTION_COLOR) == 0)
 		config.format_color = TRUE;
+	else if (strcmp(string, OPTION_JSON) == 0)
+		config.format_json = TRUE;
 	else if (strcmp(string, OPTION_VERSION) == 0)
 		show_version(TRUE);
 	else
@@ -585,13 +1184,13 @@ static char short_option(const char *argument)
 				includepaths_add(cliargs_safe_get_next("include path"));
 			goto done;
 		case 'l':	// "-l" selects symbol list filename
-			symbollist_filename = cliargs_safe_get_next(arg_symbollist);
+			part->symbollist_filename = cliargs_safe_get_next(arg_symbollist);
 			break;
 		case 'o':	// "-o" selects output filename
-			output_filename = cliargs_safe_get_next(name_outfile);
+			part->output_filename = cliargs_safe_get_next(name_outfile);
 			break;
 		case 'r':	// "-r" selects report filename
-			report_filename = cliargs_safe_get_next(arg_reportfile);
+			part->report_filename = cliargs_safe_get_next(arg_reportfile);
 			break;
 		case 'v':	// "-v" changes verbosity
 			++config.process_verbosity;
@@ -618,7 +1217,7 @@ static char short_option(const char *argument)
 				goto done;
 			} else {
 				fprintf(stderr, "%sUnknown warning level.\n", cliargs_error);
-				exit(EXIT_FAILURE);
+				ACME_exit(EXIT_FAILURE);
 			}
 			break;
 		default:	// unknown ones: program termination
@@ -631,10 +1230,387 @@ done:
 }
 
 
+// dependency file ("--depfile"):
+// a makefile rule saying that the output file depends on all files that were
+// read by the build (sources, binaries, conversion tables, library files),
+// so make and ninja know when the build must be done again.
+static	STRUCT_DYNABUF_REF(depfile_paths, 256);	// paths written so far, each zero-terminated
+
+// write file name for makefile rule (spaces, '#' and '$' are escaped)
+static void write_make_name(FILE *fd, const char *name)
+{
+	for (; *name; ++name) {
+		if ((*name == ' ') || (*name == '#'))
+			putc('\\', fd);
+		else if (*name == '$')
+			putc('$', fd);
+		putc(*name, fd);
+	}
+}
+
+// write file cache entry as dependency (if used by this build and not
+// written before - the same file may have been looked up in different ways)
+static void write_dependency(struct rwnode *node, FILE *fd)
+{
+	const struct cached_file	*file	= node->body;
+	const char			*read,
+					*end;
+
+	// (files that are not on disk, like stdin, cannot be dependencies)
+	if ((!file->used) || (file->path == NULL) || file->in_memory)
+		return;
+
+	read = depfile_paths->buffer;
+	end = read + depfile_paths->size;
+	for (; read != end; read += strlen(read) + 1) {
+		if (strcmp(read, file->path) == 0)
+			return;
+	}
+	DynaBuf_add_string(depfile_paths, file->path);
+	DynaBuf_append(depfile_paths, '\0');
+	fputs(" \\\n  ", fd);
+	write_make_name(fd, file->path);
+}
+
+// write dependency file, if wanted
+static void save_depfile(void)
+{
+	FILE	*fd;
+
+	if ((part->depfile_filename == NULL) || (part->output_filename == NULL))
+		return;
+
+	fd = fopen(part->depfile_filename, FILE_WRITETEXT);
+	if (fd == NULL) {
+		fprintf(stderr, "Error: Cannot open dependency file \"%s\".\n", part->depfile_filename);
+		return;
+	}
+	write_make_name(fd, part->output_filename);
+	putc(':', fd);
+	DYNABUF_CLEAR(depfile_paths);
+	filecache_dump(write_dependency, fd);
+	putc('\n', fd);
+	fclose(fd);
+}
+
+
+// assemble project (options have already been handled)
+static int assemble(int argc, const char *argv[])
+{
+	int	throws_before	= Throw_get_counter(),
+		exit_code;
+
+	// generate list of files to process
+	cliargs_get_rest(&toplevel_src_count, &toplevel_sources, "No top level sources given");
+	// if nothing has changed since an earlier build, we're done
+	// (unless a profile is wanted, queries are to be answered or the library
+	// wants the output in memory, because neither the profile nor the
+	// symbol table nor the output buffer are cached)
+	filecache_forget_uses();
+	buildcache_init(argc, argv);
+	// (the dependency file is one of the cached output files)
+	if ((!profile_active) && (!query_mode) && (!embedded) && buildcache_fetch())
+		return EXIT_SUCCESS;
+
+	// a stale cache entry may have marked files this build does not read
+	filecache_forget_uses();
+	memset(&stats, 0, sizeof(stats));
+	memstats.peak = memstats.in_use;
+	if (config.prefetch)
+		filecache_prefetch(toplevel_src_count, toplevel_sources);
+	// init output buffer
+	Output_init(part->fill_value, config.test_new_features);
+	if (do_actual_work())
+		save_output_file();
+	exit_code = ACME_finalize(EXIT_SUCCESS);	// dump labels, if wanted
+	if (exit_code == EXIT_SUCCESS)
+		save_depfile();
+	// only cache clean builds, because messages are not stored
+	if ((exit_code == EXIT_SUCCESS) && (Throw_get_counter() == throws_before))
+		buildcache_store();
+	return exit_code;
+}
+
+
+// batch mode:
+// each line of the batch file holds the arguments for one project (words are
+// separated by spaces, double quotes can be used to include spaces). options
+// given on the command line before "--batch" are used for all projects.
+// empty lines and lines starting with '#' are ignored. the file cache and the
+// keyword trees are shared by all projects, everything else is reset. errors
+// end the whole batch, just as they end a normal run.
+#define BATCH_MAX_ARGS	256
+
+// reset everything that command line arguments or the previous project
+// might have changed
+static void reset_project(void)
+{
+	config_default(&config);
+	symbols_clear();
+	passtrace_clear();
+	Macro_clear();
+	arena_free(&part->arena);
+	part_init(part);
+	buildcache_dir = NULL;
+	snapshot_clear();	// in case the previous build was aborted
+	snapshot_dir = NULL;
+	profile_filename = NULL;
+	profile_stacks_filename = NULL;
+	profile_active = FALSE;
+	outputfile_clear_format();
+	includepaths_clear();
+	flow_clear_replays();
+	Input_reset();	// in case the previous build was aborted
+	Parse_reset();	// (same here)
+}
+
+#ifndef ACME_LIBRARY
+// split batch file line into words, return number of words.
+// CAUTION: the line is changed (terminators are written into it)!
+static int split_line(char *line, int common_count, const char *words[])
+{
+	int	count	= common_count;
+	char	*write;
+
+	for (;;) {
+		while ((*line == ' ') || (*line == '\t') || (*line == '\r') || (*line == '\n'))
+			++line;
+		if (*line == '\0')
+			return count;
+
+		if (count == BATCH_MAX_ARGS) {
+			fputs("Error: Too many arguments in batch file line.\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		words[count++] = write = line;
+		while (*line && (*line != ' ') && (*line != '\t') && (*line != '\r') && (*line != '\n')) {
+			if (*line == '"') {
+				++line;
+				while (*line && (*line != '"'))
+					*write++ = *line++;
+				if (*line)
+					++line;	// skip closing quote
+			} else {
+				*write++ = *line++;
+			}
+		}
+		if (*line)
+			++line;
+		*write = '\0';
+	}
+}
+
+// assemble all projects listed in batch file
+static int do_batch(int argc, const char *argv[])
+{
+	const char	*words[BATCH_MAX_ARGS];
+	int		common_count	= 0,
+			word_count,
+			ii,
+			line_number	= 0;
+	FILE		*fd;
+	char		*line;
+	size_t		line_size;
+
+	// remaining arguments would be sources
+	if (cliargs_get_next()) {
+		fprintf(stderr, "%s\"--" OPTION_BATCH "\" cannot be used with source files.\n", cliargs_error);
+		return EXIT_FAILURE;
+	}
+	// collect common options (all but "--batch FILE")
+	words[common_count++] = argv[0];
+	for (ii = 1; ii < argc; ++ii) {
+		if (strcmp(argv[ii], "--" OPTION_BATCH) == 0)
+			++ii;
+		else if (common_count < BATCH_MAX_ARGS)
+			words[common_count++] = argv[ii];
+	}
+	fd = fopen(batch_filename, "r");
+	if (fd == NULL) {
+		fprintf(stderr, "Error: Cannot open batch file \"%s\".\n", batch_filename);
+		return EXIT_FAILURE;
+	}
+	for (;;) {
+		// read line
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		for (;;) {
+			ii = getc(fd);
+			if ((ii == EOF) || (ii == '\n'))
+				break;
+			DynaBuf_append(GlobalDynaBuf, (char) ii);
+		}
+		if ((ii == EOF) && (GlobalDynaBuf->size == 0))
+			break;
+		++line_number;
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		if (GlobalDynaBuf->buffer[0] == '#')
+			continue;
+
+		line_size = GlobalDynaBuf->size;
+		line = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
+		word_count = split_line(line, common_count, words);
+		if (word_count > common_count) {
+			if (config.process_verbosity > 1)
+				printf("Batch file line %d.\n", line_number);
+			reset_project();
+			cliargs_init(word_count, words);
+			batch_filename = NULL;
+			cliargs_handle_options(short_option, long_option);
+			if (batch_filename) {
+				fprintf(stderr, "%s\"--" OPTION_BATCH "\" cannot be nested.\n", cliargs_error);
+				exit(EXIT_FAILURE);
+			}
+			if (assemble(word_count, words) != EXIT_SUCCESS)
+				exit(EXIT_FAILURE);
+		}
+		safe_free(line, line_size, MEMUSE_OTHER);	// (split_line() has put terminators in it)
+	}
+	fclose(fd);
+	return EXIT_SUCCESS;
+}
+
+
+// watch mode:
+// the project is assembled, then all files read while doing so are checked
+// for changes every now and then. when one of them has changed, the project
+// is assembled again (the keyword trees, the unchanged files in the file
+// cache and their high-level format copies are kept). errors only end the
+// current build, not the whole program. there is no way to end watch mode
+// other than killing the process.
+#define WATCH_INTERVAL	250	// milliseconds between checks
+
+// wait for some time
+static void watch_wait(void)
+{
+#ifdef PLATFORM_SLEEP
+	PLATFORM_SLEEP(WATCH_INTERVAL);
+#else
+	clock_t	end	= clock() + (clock_t) WATCH_INTERVAL * CLOCKS_PER_SEC / 1000;
+
+	while (clock() < end)
+		;
+#endif
+}
+
+// assemble project again and again (does not return)
+static void do_watch(int argc, const char *argv[])
+{
+	for (;;) {
+		catch_exit = TRUE;
+		if (setjmp(exit_target) == 0)
+			assemble(argc, argv);
+		catch_exit = FALSE;
+		if (config.process_verbosity)
+			printf("Waiting for changes.\n");
+		fflush(stdout);
+		while (filecache_refresh() == 0)
+			watch_wait();
+		if (config.process_verbosity)
+			printf("Files have changed, assembling again.\n");
+		fflush(stdout);
+		reset_project();
+		cliargs_init(argc, argv);
+		cliargs_handle_options(short_option, long_option);
+	}
+}
+
+
+// query mode:
+// the project is assembled, then queries are read from stdin and answered on
+// stdout (see query.c), so other programs can look up symbols and addresses
+// without parsing symbol lists and reports. the "update" query checks all
+// files read during the build and assembles again if any of them changed.
+// as in watch mode, errors only end the current build.
+static int do_query(int argc, const char *argv[])
+{
+	enum query_result	result;
+	int			changed	= -1;	// no "update" query yet
+
+	for (;;) {
+		catch_exit = TRUE;
+		if (setjmp(exit_target) == 0)
+			assemble(argc, argv);
+		catch_exit = FALSE;
+		if (changed >= 0)
+			query_updated(stdout, changed);
+		fflush(stdout);
+		for (;;) {
+			result = query_handle(stdin, stdout);
+			if (result == QUERY_QUIT)
+				return EXIT_SUCCESS;
+
+			if (result == QUERY_UPDATE) {
+				changed = filecache_refresh();
+				if (changed)
+					break;
+
+				query_updated(stdout, 0);
+			}
+		}
+		safe_free(part->report.lines, part->report.size * sizeof(*part->report.lines), MEMUSE_OUTPUT);
+		reset_project();
+		cliargs_init(argc, argv);
+		cliargs_handle_options(short_option, long_option);
+	}
+}
+
+#endif
+
+
+#ifdef ACME_LIBRARY
+// library use (see libacme.c):
+// the project given as command line arguments (including a program name
+// in argv[0]) is assembled and all results are left in memory. this never
+// exits, errors (even in the arguments) only end the build. as in batch
+// mode, the file cache and the keyword trees are kept for the next build.
+int ACME_assemble_embedded(int argc, const char *argv[])
+{
+	static boolean	initialized	= FALSE;
+	int		exit_code;
+
+	if (initialized) {
+		reset_project();
+	} else {
+		initialized = TRUE;
+		config_default(&config);
+		part = &main_part;
+		part_init(part);
+		PLATFORM_INIT;
+	}
+	embedded = TRUE;
+	batch_filename = NULL;
+	watch_mode = FALSE;
+	query_mode = FALSE;
+	catch_exit = TRUE;
+	if (setjmp(exit_target) == 0) {
+		cliargs_init(argc, argv);
+		cliargs_handle_options(short_option, long_option);
+		if (batch_filename || watch_mode || query_mode) {
+			fprintf(stderr, "%s\"--" OPTION_BATCH "\", \"--" OPTION_WATCH "\" and \"--" OPTION_QUERY "\" cannot be used by the library.\n", cliargs_error);
+			exit_code = EXIT_FAILURE;
+		} else {
+			// (assemble() would exit if there were no sources)
+			cliargs_get_rest(&toplevel_src_count, &toplevel_sources, NULL);
+			if (toplevel_src_count) {
+				exit_code = assemble(argc, argv);
+			} else {
+				fprintf(stderr, "%sNo top level sources given.\n", cliargs_error);
+				exit_code = EXIT_FAILURE;
+			}
+		}
+	} else {
+		exit_code = EXIT_FAILURE;
+	}
+	catch_exit = FALSE;
+	return exit_code;
+}
+#else
 // guess what
 int main(int argc, const char *argv[])
 {
 	config_default(&config);
+	part = &main_part;
+	part_init(part);
 	// if called without any arguments, show usage info (not full help)
 	if (argc == 1)
 		show_help_and_exit();
@@ -644,11 +1620,17 @@ int main(int argc, const char *argv[])
 	PLATFORM_INIT;
 	// handle command line arguments
 	cliargs_handle_options(short_option, long_option);
-	// generate list of files to process
-	cliargs_get_rest(&toplevel_src_count, &toplevel_sources, "No top level sources given");
-	// init output buffer
-	Output_init(fill_value, config.test_new_features);
-	if (do_actual_work())
-		save_output_file();
-	return ACME_finalize(EXIT_SUCCESS);	// dump labels, if wanted
+	if ((batch_filename != NULL) + watch_mode + query_mode > 1) {
+		fprintf(stderr, "%sOnly one of \"--" OPTION_BATCH "\", \"--" OPTION_WATCH "\" and \"--" OPTION_QUERY "\" can be used.\n", cliargs_error);
+		return EXIT_FAILURE;
+	}
+	if (batch_filename)
+		return do_batch(argc, argv);
+	if (watch_mode)
+		do_watch(argc, argv);
+	if (query_mode)
+		return do_query(argc, argv);
+
+	return assemble(argc, argv);
 }
+#endif
@@ -10,19 +10,17 @@
 #include "config.h"
 
 
-// Variables
-extern const char	*symbollist_filename;
-extern const char	*output_filename;	// TODO - put in "part" struct
-extern const char	*report_filename;	// TODO - put in "part" struct
-// maximum recursion depth for macro calls and "!source"
-extern signed long	macro_recursions_left;
-extern signed long	source_recursions_left;
-
-
 // Prototypes
 
 // tidy up before exiting by saving symbol dump
 extern int ACME_finalize(int exit_code);
+// end assembly because of errors. in watch mode, query mode and when used as
+// library, only the current build is ended, otherwise the program exits.
+extern void ACME_exit(int exit_code);
+// assemble project given as command line arguments, leaving the results in
+// memory (only in the library, see libacme.c). never exits. returns
+// EXIT_SUCCESS or EXIT_FAILURE.
+extern int ACME_assemble_embedded(int argc, const char *argv[]);
 
 
 #endif
@@ -24,10 +24,12 @@
 #include "platform.h"
 #include "dynabuf.h"
 #include "encoding.h"
+#include "fixup.h"
 #include "global.h"
 #include "input.h"
 #include "output.h"
 #include "section.h"
+#include "strip.h"
 #include "symbol.h"
 #include "tree.h"
 
@@ -35,7 +37,6 @@
 // constants
 
 #define ERRORMSG_INITIALSIZE	256	// ad hoc
-#define FUNCTION_INITIALSIZE	8	// enough for "arctan"
 #define HALF_INITIAL_STACK_SIZE	8
 static const char	exception_div_by_zero[]	= "Division by zero.";
 static const char	exception_no_value[]	= "No value given.";
@@ -75,6 +76,7 @@ enum op_id {
 	OPID_ISNUMBER,		//	is_number(v)
 	OPID_ISLIST,		//	is_list(v)
 	OPID_ISSTRING,		//	is_string(v)
+	OPID_RANGE,		//	range(v)
 // add CHR function to create 1-byte string? or rather add \xAB escape sequence?
 	// dyadic operators:
 	OPID_POWEROF,		//	v^w
@@ -163,11 +165,11 @@ static struct op ops_len		= {42, OPGROUP_MONADIC, OPID_LEN,	"len()"	};
 static struct op ops_isnumber		= {42, OPGROUP_MONADIC, OPID_ISNUMBER,	"is_number()"	};
 static struct op ops_islist		= {42, OPGROUP_MONADIC, OPID_ISLIST,	"is_list()"	};
 static struct op ops_isstring		= {42, OPGROUP_MONADIC, OPID_ISSTRING,	"is_string()"	};
+static struct op ops_range		= {42, OPGROUP_MONADIC, OPID_RANGE,	"range()"	};
 
 
 // variables
 static	STRUCT_DYNABUF_REF(errormsg_dyna_buf, ERRORMSG_INITIALSIZE);	// to build variable-length error messages
-static	STRUCT_DYNABUF_REF(function_dyna_buf, FUNCTION_INITIALSIZE);	// for fn names
 // operator stack, current size and stack pointer:
 static struct op	**op_stack	= NULL;
 static int		opstack_size	= HALF_INITIAL_STACK_SIZE;
@@ -184,6 +186,56 @@ enum alu_state {
 	STATE_END		// standard end
 };
 static enum alu_state	alu_state;	// deterministic finite automaton
+// expressions in macro and loop bodies are compiled to reverse polish
+// notation when parsed the first time. symbol-free
+// sub-expressions are folded to constants, so later the text does not have to
+// be read again. with "--fixups", expressions outside of blocks are compiled
+// as well, so they can be evaluated again after the first pass:
+enum rpn_kind {
+	RPN_CONSTANT,	// push number
+	RPN_SYMBOL,	// push symbol value
+	RPN_PC,		// push program counter
+	RPN_ANON,	// push value of anonymous label (only for fixups)
+	RPN_MONADIC,	// perform monadic operation on newest arg
+	RPN_DYADIC	// perform dyadic operation on the two newest args
+};
+struct rpn_item {
+	enum rpn_kind	kind;
+	union {
+		struct object	constant;
+		struct op	*op;
+		struct symbol	*anon;
+		struct {
+			char		prefix;	// '\0', LOCAL_PREFIX or CHEAP_PREFIX
+			unsigned int	unpseudo_count;
+			int		name_offset,	// in names area after items
+					name_length;	// for error messages
+			size_t		name_size;	// including terminator
+			hash_t		name_hash;	// so it is only computed once
+		} symbol;	// also used for program counter
+	} u;
+};
+struct rpn {
+	size_t		size;	// of whole struct, for copying
+	char		first_byte;	// GotByte at start (for sanity check)
+	boolean		is_empty;	// these three only depend on text, so
+	int		open_parentheses;	// they are just copied
+	boolean		is_parenthesized;
+	int		max_depth;	// arg stack size needed
+	int		items;
+	struct rpn_item	item[1];	// actually, there are more (followed by symbol names)
+};
+static boolean		recording	= FALSE;	// TRUE while compiling an expression
+static boolean		reusable;	// FALSE if compiled form must not be remembered in block
+static struct rpn_item	*rpn_items	= NULL;
+static int		rpnitems_size	= 0;
+static int		rpn_used;	// number of items
+static int		rpn_args;	// number of args already recorded
+static int		rpn_depth;	// max arg stack depth
+static int		*rpn_first	= NULL;	// for each arg on stack: index of first item
+static	STRUCT_DYNABUF_REF(rpn_names, 64);	// symbol names used in expression
+static const struct rpn	*last_rpn	= NULL;	// compiled form of most recent expression
+static struct rpn	*loose_rpn	= NULL;	// same, if not remembered in a block (only for fixups)
 // predefined stuff
 static struct ronode	op_tree[]	= {
 	PREDEF_START,
@@ -209,6 +261,7 @@ static struct ronode	function_tree[]	= {
 	PREDEFNODE("is_number",	&ops_isnumber),
 	PREDEFNODE("is_list",	&ops_islist),
 	PREDEFNODE("is_string",	&ops_isstring),
+	PREDEFNODE("range",	&ops_range),
 	PREDEFNODE("arcsin",	&ops_arcsin),
 	PREDEFNODE("arccos",	&ops_arccos),
 	PREDEFNODE("arctan",	&ops_arctan),
@@ -246,22 +299,104 @@ do {							\
 // double the size of the operator stack
 static void enlarge_operator_stack(void)
 {
+	op_stack = safe_realloc(op_stack, op_stack ? opstack_size * sizeof(*op_stack) : 0, 2 * opstack_size * sizeof(*op_stack), MEMUSE_OTHER);
 	opstack_size *= 2;
 	//printf("Doubling op stack size to %d.\n", opstack_size);
-	op_stack = realloc(op_stack, opstack_size * sizeof(*op_stack));
-	if (op_stack == NULL)
-		Throw_serious_error(exception_no_memory_left);
 }
 
 
 // double the size of the argument stack
 static void enlarge_argument_stack(void)
 {
+	arg_stack = safe_realloc(arg_stack, arg_stack ? argstack_size * sizeof(*arg_stack) : 0, 2 * argstack_size * sizeof(*arg_stack), MEMUSE_OTHER);
+	rpn_first = safe_realloc(rpn_first, rpn_first ? argstack_size * sizeof(*rpn_first) : 0, 2 * argstack_size * sizeof(*rpn_first), MEMUSE_OTHER);
 	argstack_size *= 2;
 	//printf("Doubling arg stack size to %d.\n", argstack_size);
-	arg_stack = realloc(arg_stack, argstack_size * sizeof(*arg_stack));
-	if (arg_stack == NULL)
-		Throw_serious_error(exception_no_memory_left);
+}
+
+
+// add item to expression being compiled
+static struct rpn_item *rpn_new_item(enum rpn_kind kind)
+{
+	if (rpn_used >= rpnitems_size) {
+		rpn_items = safe_realloc(rpn_items, rpnitems_size * sizeof(*rpn_items), (rpnitems_size ? (rpnitems_size * 2) : 16) * sizeof(*rpn_items), MEMUSE_BLOCKS);
+		rpnitems_size = rpnitems_size ? (rpnitems_size * 2) : 16;
+	}
+	rpn_items[rpn_used].kind = kind;
+	return &rpn_items[rpn_used++];
+}
+
+// add item for arg that has just been pushed
+static struct rpn_item *rpn_record_arg(enum rpn_kind kind)
+{
+	rpn_first[arg_sp - 1] = rpn_used;
+	++rpn_args;
+	if (arg_sp > rpn_depth)
+		rpn_depth = arg_sp;
+	return rpn_new_item(kind);
+}
+
+// if newest arg is a literal (and has not been recorded yet), record it
+static void rpn_record_constant(void)
+{
+	if (recording && (rpn_args < arg_sp))
+		rpn_record_arg(RPN_CONSTANT)->u.constant = arg_stack[arg_sp - 1];
+}
+
+// record operation that has just been performed (call before arg stack
+// shrinks). if all args were constants, the result is stored instead.
+static void rpn_record_operation(struct op *op, int args)
+{
+	int		first	= rpn_first[arg_sp - args];
+	struct object	*result	= &arg_stack[arg_sp - args];
+
+	if ((rpn_used - first == args)	// one item for each arg?
+	&& (rpn_items[first].kind == RPN_CONSTANT)
+	&& (rpn_items[rpn_used - 1].kind == RPN_CONSTANT)
+	&& (result->type == &type_number)) {
+		rpn_used = first + 1;
+		rpn_items[first].u.constant = *result;
+	} else {
+		rpn_new_item((args == 1) ? RPN_MONADIC : RPN_DYADIC)->u.op = op;
+	}
+	rpn_args -= args - 1;
+}
+
+// the expression being compiled depends on the current position or state, so
+// it must not be used again. fixups only evaluate it once more, so they still
+// get the compiled form.
+static void rpn_not_reusable(void)
+{
+	if (fixup_recording)
+		reusable = FALSE;
+	else
+		recording = FALSE;
+}
+
+// forget expression that was only compiled for fixups
+static void forget_loose_rpn(void)
+{
+	ALU_free_compiled(loose_rpn);
+	loose_rpn = NULL;
+}
+
+// make a malloc'd copy of the expression that has just been compiled
+static struct rpn *rpn_get_copy(const struct expression *expression, char first_byte)
+{
+	struct rpn	*rpn;
+	size_t		size	= sizeof(*rpn) + (rpn_used - 1) * sizeof(*rpn_items) + rpn_names->size;
+
+	rpn = safe_malloc(size, MEMUSE_BLOCKS);
+	rpn->size = size;
+	rpn->first_byte = first_byte;
+	rpn->is_empty = expression->is_empty;
+	rpn->open_parentheses = expression->open_parentheses;
+	rpn->is_parenthesized = expression->is_parenthesized;
+	rpn->max_depth = rpn_depth;
+	rpn->items = rpn_used;
+	memcpy(rpn->item, rpn_items, rpn_used * sizeof(*rpn_items));
+	memcpy(rpn->item + rpn_used, rpn_names->buffer, rpn_names->size);
+	return rpn;
 }
 
 
@@ -304,20 +439,128 @@ static intval_t my_asr(intval_t left, intval_t right)
 }
 
 
-// if wanted, throw "Value not defined" error
+// integer fast path:
+// most expressions are additions, shifts, comparisons and byte selectors on
+// plain integers. these are handled here without going through the type's
+// function pointers and the int/float/undefined checks. the results (value,
+// flags and address refs) are the same as what int_handle_dyadic_operator()
+// and int_handle_monadic_operator() would produce. anything else (including
+// operators that may throw warnings or errors) returns FALSE, and then the
+// caller must use the general path.
+static boolean int_fast_dyadic(struct object *self, const struct op *op, const struct object *other)
+{
+	intval_t	left,
+			right,
+			result;
+	int		refs	= 0;
+
+	if ((self->type != &type_number) || (other->type != &type_number)
+	|| (self->u.number.ntype != NUMTYPE_INT) || (other->u.number.ntype != NUMTYPE_INT))
+		return FALSE;
+
+	left = self->u.number.val.intval;
+	right = other->u.number.val.intval;
+	switch (op->id) {
+	case OPID_ADD:
+		result = left + right;
+		refs = self->u.number.addr_refs + other->u.number.addr_refs;
+		break;
+	case OPID_SUBTRACT:
+		result = left - right;
+		refs = self->u.number.addr_refs - other->u.number.addr_refs;
+		break;
+	case OPID_AND:
+		result = left & right;
+		refs = self->u.number.addr_refs + other->u.number.addr_refs;
+		break;
+	case OPID_OR:
+		result = left | right;
+		refs = self->u.number.addr_refs + other->u.number.addr_refs;
+		break;
+	case OPID_XOR:
+		result = left ^ right;
+		refs = self->u.number.addr_refs + other->u.number.addr_refs;
+		break;
+	case OPID_SHIFTLEFT:
+		result = left << right;
+		break;
+	case OPID_ASR:
+		result = my_asr(left, right);
+		break;
+	case OPID_LSR:
+		result = ((uintval_t) left) >> right;
+		break;
+	case OPID_EQUALS:
+		result = left == right;
+		goto comparison;
+	case OPID_NOTEQUAL:
+		result = left != right;
+		goto comparison;
+	case OPID_LESSTHAN:
+		result = left < right;
+		goto comparison;
+	case OPID_LESSOREQUAL:
+		result = left <= right;
+		goto comparison;
+	case OPID_GREATERTHAN:
+		result = left > right;
+		goto comparison;
+	case OPID_GREATEROREQUAL:
+		result = left >= right;
+		goto comparison;
+	default:
+		return FALSE;
+	}
+	self->u.number.val.intval = result;
+	self->u.number.addr_refs = refs;
+	self->u.number.flags |= other->u.number.flags & (NUMBER_EVER_UNDEFINED | NUMBER_FORCEBITS);
+	self->u.number.flags &= ~NUMBER_FITS_BYTE;
+	return TRUE;
+
+comparison:
+	// comparison results are either 0 or 1, so fit in byte (FORCEBITS are cleared)
+	self->u.number.val.intval = result;
+	self->u.number.addr_refs = 0;
+	self->u.number.flags = ((self->u.number.flags | other->u.number.flags) & NUMBER_EVER_UNDEFINED) | NUMBER_FITS_BYTE;
+	return TRUE;
+}
+static boolean int_fast_monadic(struct object *self, const struct op *op)
+{
+	if ((self->type != &type_number) || (self->u.number.ntype != NUMTYPE_INT))
+		return FALSE;
+
+	switch (op->id) {
+	case OPID_LOWBYTEOF:
+		self->u.number.val.intval &= 255;
+		break;
+	case OPID_HIGHBYTEOF:
+		self->u.number.val.intval = (self->u.number.val.intval >> 8) & 255;
+		break;
+	case OPID_BANKBYTEOF:
+		self->u.number.val.intval = (self->u.number.val.intval >> 16) & 255;
+		break;
+	default:
+		return FALSE;
+	}
+	self->u.number.flags |= NUMBER_FITS_BYTE;
+	self->u.number.flags &= ~NUMBER_FORCEBITS;
+	self->u.number.addr_refs = 0;
+	return TRUE;
+}
+
+
+// throw "Value not defined" error. unless an error is wanted at once, it is
+// deferred: it is only shown if this pass turns out to be the last one.
 // This function is not allowed to change DynaBuf because the symbol's name
 // might be stored there!
-static void is_not_defined(struct symbol *optional_symbol, char optional_prefix_char, char *name, size_t length)
+static void is_not_defined(struct symbol *optional_symbol, char optional_prefix_char, const char *name, size_t length)
 {
-	if (!pass.complain_about_undefined)
-		return;
-
-	// only complain once per symbol
+	// only complain once per symbol and pass
 	if (optional_symbol) {
-		if (optional_symbol->has_been_reported)
+		if (optional_symbol->reported_pass == pass.number)
 			return;
 
-		optional_symbol->has_been_reported = TRUE;
+		optional_symbol->reported_pass = pass.number;
 	}
 
 	DYNABUF_CLEAR(errormsg_dyna_buf);
@@ -336,23 +579,22 @@ static void is_not_defined(struct symbol *optional_symbol, char optional_prefix_
 	}
 	DynaBuf_add_string(errormsg_dyna_buf, ").");
 	DynaBuf_append(errormsg_dyna_buf, '\0');
-	Throw_error(errormsg_dyna_buf->buffer);
+	if (pass.complain_about_undefined)
+		Throw_error(errormsg_dyna_buf->buffer);
+	else
+		Throw_deferred_error(errormsg_dyna_buf->buffer);
 }
 
 
-// Lookup (and create, if necessary) symbol tree item and return its value.
-// DynaBuf holds the symbol's name and "scope" its scope.
-// The name length must be given explicitly because of anonymous forward labels;
-// their internal name is different (longer) than their displayed name.
-// This function is not allowed to change DynaBuf because that's where the
-// symbol name is stored!
-static void get_symbol_value(scope_t scope, char optional_prefix_char, size_t name_length, unsigned int unpseudo_count)
+// push value of given symbol on arg stack (and complain if undefined).
+// "name" and "length" are only used for error messages.
+static void push_symbol_value(struct symbol *symbol, char optional_prefix_char, const char *name, size_t name_length, unsigned int unpseudo_count)
 {
-	struct symbol	*symbol;
 	struct object	*arg;
 
-	symbol = symbol_find(scope);
 	symbol->has_been_read = TRUE;
+	if (symbol->strip_block)
+		strip_note_read(symbol->strip_block);
 	if (symbol->object.type == NULL) {
 		// finish symbol item by making it an undefined number
 		symbol->object.type = &type_number;
@@ -379,17 +621,59 @@ static void get_symbol_value(scope_t scope, char optional_prefix_char, size_t na
 // FIXME - now that lists with undefined items are "undefined", this fails in
 // case of "!if len(some_list) {", so check for undefined _numbers_ explicitly:
 	if ((arg->type == &type_number) && (arg->u.number.ntype == NUMTYPE_UNDEFINED))
-		is_not_defined(symbol, optional_prefix_char, GLOBALDYNABUF_CURRENT, name_length);
+		is_not_defined(symbol, optional_prefix_char, name, name_length);
 	// FIXME - if arg is list, increment ref count!
 }
+// Lookup (and create, if necessary) symbol tree item and push its value.
+// "name" is the symbol's name and "scope" its scope.
+static void get_named_symbol_value(const struct rwname *name, scope_t scope, char optional_prefix_char, size_t name_length, unsigned int unpseudo_count)
+{
+	struct rpn_item	*item;
+
+	push_symbol_value(symbol_find_name(name, scope), optional_prefix_char, name->string, name_length, unpseudo_count);
+	if (recording) {
+		item = rpn_record_arg(RPN_SYMBOL);
+		item->u.symbol.prefix = optional_prefix_char;
+		item->u.symbol.unpseudo_count = unpseudo_count;
+		item->u.symbol.name_offset = rpn_names->size;
+		item->u.symbol.name_length = name_length;
+		item->u.symbol.name_size = name->size;
+		item->u.symbol.name_hash = name->hash;
+		DynaBuf_add_string(rpn_names, name->string);
+		DynaBuf_append(rpn_names, '\0');
+	}
+}
+// push value of anonymous label (DynaBuf holds its '+' or '-' characters,
+// it is only used for error messages)
+static void get_anon_value(boolean forward)
+{
+	struct symbol	*symbol;
 
+	DynaBuf_append(GlobalDynaBuf, '\0');
+	symbol = symbol_find_anon(forward, GlobalDynaBuf->size - 1, FALSE);
+	push_symbol_value(symbol, '\0', GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size - 1, 0);	// no prefix, -1 to not count terminator, no unpseudo
+	// anonymous labels are found by position, not by name
+	rpn_not_reusable();
+	if (recording)
+		rpn_record_arg(RPN_ANON)->u.anon = symbol;
+}
+// same, but DynaBuf holds the symbol's name.
+// This function is not allowed to change DynaBuf because that's where the
+// symbol name is stored!
+static void get_symbol_value(scope_t scope, char optional_prefix_char, size_t name_length, unsigned int unpseudo_count)
+{
+	struct rwname	name;
 
-// Parse program counter ('*')
-static void parse_program_counter(unsigned int unpseudo_count)	// Now GotByte = "*"
+	Tree_make_name(&name, GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size);
+	get_named_symbol_value(&name, scope, optional_prefix_char, name_length, unpseudo_count);
+}
+
+
+// push program counter
+static void push_program_counter(unsigned int unpseudo_count)
 {
 	struct number	pc;
 
-	GetByte();
 	vcpu_read_pc(&pc);
 	// if needed, output "value not defined" error
 	if (pc.ntype == NUMTYPE_UNDEFINED)
@@ -397,17 +681,64 @@ static void parse_program_counter(unsigned int unpseudo_count)	// Now GotByte =
 	if (unpseudo_count)
 		pseudopc_unpseudo(&pc, pseudopc_get_context(), unpseudo_count);
 	PUSH_INT_ARG(pc.val.intval, pc.flags, pc.addr_refs);	// FIXME - when undefined pc is allowed, this must be changed for numtype!
+	if (recording)
+		rpn_record_arg(RPN_PC)->u.symbol.unpseudo_count = unpseudo_count;
+}
+
+// Parse program counter ('*')
+static void parse_program_counter(unsigned int unpseudo_count)	// Now GotByte = "*"
+{
+	GetByte();
+	push_program_counter(unpseudo_count);
 }
 
 
 // make new string object
-static void string_prepare_string(struct object *self, int len)
+static void string_prepare_sized(struct object *self, int len, int size)
 {
+	struct string_buffer	*buffer;
+
 	self->type = &type_string;
-	self->u.string = safe_malloc(sizeof(*(self->u.string)) + len);
-	self->u.string->payload[len] = 0;	// terminate, to facilitate string_print()
+	// string and buffer are allocated as one block
+	self->u.string = safe_malloc(sizeof(*(self->u.string)) + sizeof(*buffer) + size, MEMUSE_OBJECTS);
+	buffer = (struct string_buffer *) (self->u.string + 1);
+	buffer->size = size;
+	buffer->used = len;
+	buffer->data[len] = 0;	// terminate, to facilitate debugging
 	self->u.string->length = len;	// length does not include the added terminator
 	self->u.string->refs = 1;
+	self->u.string->payload = buffer->data;
+	self->u.string->buffer = buffer;
+}
+static void string_prepare_string(struct object *self, int len)
+{
+	string_prepare_sized(self, len, len);
+}
+
+// concatenate strings. if the first one ends where the used part of its buffer
+// ends and there is enough room left, the second one is appended in place.
+// otherwise, both are copied to a new buffer with room for more.
+static void string_concatenate(struct object *self, const struct string *arthur, const struct string *ford)
+{
+	struct string_buffer	*buffer	= arthur->buffer;
+	int			length	= arthur->length + ford->length;
+
+	if ((arthur->payload + arthur->length == buffer->data + buffer->used)
+	&& (buffer->size - buffer->used >= ford->length)) {
+		memcpy(buffer->data + buffer->used, ford->payload, ford->length);
+		buffer->used += ford->length;
+		buffer->data[buffer->used] = 0;
+		self->type = &type_string;
+		self->u.string = safe_malloc(sizeof(*(self->u.string)), MEMUSE_OBJECTS);
+		self->u.string->length = length;
+		self->u.string->refs = 1;
+		self->u.string->payload = arthur->payload;
+		self->u.string->buffer = buffer;
+	} else {
+		string_prepare_sized(self, length, 2 * length);
+		memcpy(self->u.string->payload, arthur->payload, arthur->length);
+		memcpy(self->u.string->payload + arthur->length, ford->payload, ford->length);
+	}
 }
 // parse string or character
 // characters will be converted using the current encoding, strings are kept as-is.
@@ -416,20 +747,17 @@ static void parse_quoted(char closing_quote)
 	intval_t	value;
 
 	DYNABUF_CLEAR(GlobalDynaBuf);
-	if (Input_quoted_to_dynabuf(closing_quote))
+	if (Input_unescaped_to_dynabuf(closing_quote))
 		goto fail;	// unterminated or escaping error
 
 	// eat closing quote
 	GetByte();
-	// now convert to unescaped version
-	if (Input_unescape_dynabuf(0))
-		goto fail;	// escaping error
-
 	// without backslash escaping, both ' and " are used for single
 	// characters.
 	// with backslash escaping, ' is for characters and " is for strings:
 	if ((closing_quote == '"') && (config.wanted_version >= VER_BACKSLASHESCAPING)) {
 		// string //////////////////////////////////
+		recording = FALSE;	// strings are not supported
 		string_prepare_string(&arg_stack[arg_sp], GlobalDynaBuf->size);	// create string object and put on arg stack
 		memcpy(arg_stack[arg_sp].u.string->payload, GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size);	// copy payload
 		++arg_sp;
@@ -445,6 +773,7 @@ static void parse_quoted(char closing_quote)
 		if (GlobalDynaBuf->size != 1)
 			Throw_error("There's more than one character.");
 		// parse character
+		rpn_not_reusable();	// result depends on encoding
 		value = encoding_encode_char(GLOBALDYNABUF_CURRENT[0]);
 		PUSH_INT_ARG(value, 0, 0);	// no flags, no addr refs
 	}
@@ -506,28 +835,17 @@ static void parse_binary_literal(void)	// Now GotByte = "%" or "b"
 // those given above.
 static void parse_hex_literal(void)	// Now GotByte = "$" or "x"
 {
-	char		byte;
+	int		nibble;
 	int		digits	= -1;	// digit counter
 	bits		flags	= 0;
 	intval_t	value	= 0;
 
 	for (;;) {
 		++digits;
-		byte = GetByte();
-		// if digit or legal character, add value
-		if ((byte >= '0') && (byte <= '9')) {
-			value = (value << 4) + (byte - '0');
-			continue;
-		}
-		if ((byte >= 'a') && (byte <= 'f')) {
-			value = (value << 4) + (byte - 'a') + 10;
-			continue;
-		}
-		if ((byte >= 'A') && (byte <= 'F')) {
-			value = (value << 4) + (byte - 'A') + 10;
-			continue;
-		}
-		break;	// found illegal character
+		nibble = DIGIT_VALUE(GetByte());
+		if (nibble == DIGIT_NONE)
+			break;	// found illegal character
+		value = (value << 4) + nibble;
 	}
 	if (!digits)
 		Throw_error("Hex literal without any digits.");
@@ -555,8 +873,8 @@ static void parse_frac_part(int integer_part)	// Now GotByte = first digit after
 		fpval		= integer_part;
 
 	// parse digits until no more
-	while ((GotByte >= '0') && (GotByte <= '9')) {
-		fpval = 10 * fpval + (GotByte & 15);	// this works. it's ASCII.
+	while (DIGIT_VALUE(GotByte) < 10) {
+		fpval = 10 * fpval + DIGIT_VALUE(GotByte);
 		denominator *= 10;
 		GetByte();
 	}
@@ -596,8 +914,8 @@ static void parse_number_literal(void)	// Now GotByte = first digit
 		}
 	}
 	// parse digits until no more
-	while ((GotByte >= '0') && (GotByte <= '9')) {
-		intval = 10 * intval + (GotByte & 15);	// ASCII, see above
+	while (DIGIT_VALUE(GotByte) < 10) {
+		intval = 10 * intval + DIGIT_VALUE(GotByte);
 		GetByte();
 	}
 	// check whether it's a float
@@ -620,8 +938,8 @@ static void parse_octal_literal(void)	// Now GotByte = first octal digit
 	bits		flags	= 0;
 	int		digits	= 0;	// digit counter
 
-	while ((GotByte >= '0') && (GotByte <= '7')) {
-		value = (value << 3) + (GotByte & 7);	// this works. it's ASCII.
+	while (DIGIT_VALUE(GotByte) < 8) {
+		value = (value << 3) + DIGIT_VALUE(GotByte);
 		++digits;
 		GetByte();
 	}
@@ -647,10 +965,8 @@ static void parse_function_call(void)
 {
 	void	*node_body;
 
-	// make lower case version of name in local dynamic buffer
-	DynaBuf_to_lower(function_dyna_buf, GlobalDynaBuf);
-	// search for tree item
-	if (Tree_easy_scan(function_tree, &node_body, function_dyna_buf)) {
+	// search for tree item (using lower case version made by input module)
+	if (Tree_easy_scan_hashed(function_tree, &node_body, Input_keyword.lower->buffer, Input_keyword.hash)) {
 		PUSH_OP((struct op *) node_body);
 	} else {
 		Throw_error("Unknown function.");
@@ -659,43 +975,128 @@ static void parse_function_call(void)
 }
 
 
+// lists are arrays, so indexing is fast and each list is a single block.
+// items are only ever appended while building a list literal. if a list is
+// shared (refs > 1), appending makes a private copy first.
+#define LIST_INITIAL_SIZE	8
+#define LIST_BLOCK_SIZE(size)	(sizeof(struct list) + ((size) - 1) * sizeof(struct object))
+#define RANGE_MAXLENGTH		0x10000	// output buffer cannot hold more bytes anyway
+
+// make empty list with room for given number of items
+static void list_init_sized(struct object *self, int size)
+{
+	if (size < 1)
+		size = 1;
+	self->type = &type_list;
+	self->u.list = safe_malloc(LIST_BLOCK_SIZE(size), MEMUSE_OBJECTS);
+	self->u.list->length = 0;
+	self->u.list->refs = 1;
+	self->u.list->size = size;
+}
 // make empty list
 static void list_init_list(struct object *self)
 {
-	self->type = &type_list;
-	self->u.listhead = safe_malloc(sizeof(*(self->u.listhead)));
-	self->u.listhead->next = self->u.listhead;
-	self->u.listhead->prev = self->u.listhead;
-	self->u.listhead->u.listinfo.length = 0;
-	self->u.listhead->u.listinfo.refs = 1;
+	list_init_sized(self, LIST_INITIAL_SIZE);
 }
 // extend list by appending a single object
-static void list_append_object(struct listitem *head, const struct object *obj)
+static void list_append_object(struct object *self, const struct object *obj)
+{
+	struct list	*list	= self->u.list;
+
+	if (list->refs > 1) {
+		// shared, so copy before changing
+		list_init_sized(self, list->length + LIST_INITIAL_SIZE);
+		memcpy(self->u.list->item, list->item, list->length * sizeof(*(list->item)));
+		self->u.list->length = list->length;
+		list->refs--;	// FIXME - call a function for this...
+		list = self->u.list;
+	} else if (list->length == list->size) {
+		list = safe_realloc(list, LIST_BLOCK_SIZE(list->size), LIST_BLOCK_SIZE(2 * list->size), MEMUSE_OBJECTS);
+		list->size *= 2;
+		self->u.list = list;
+	}
+	list->item[list->length++] = *obj;
+}
+
+// replace list with a copy, so its items can be changed in place
+// (the original may belong to a symbol - ref counts of lists on the arg stack
+// cannot be trusted yet, see push_symbol_value())
+static void list_copy(struct object *self)
 {
-	struct listitem	*item;
+	struct list	*list	= self->u.list;
 
-	item = safe_malloc(sizeof(*item));
-	item->u.payload = *obj;
-	item->next = head;
-	item->prev = head->prev;
-	item->next->prev = item;
-	item->prev->next = item;
-	head->u.listinfo.length++;
+	list_init_sized(self, list->length);
+	memcpy(self->u.list->item, list->item, list->length * sizeof(*(list->item)));
+	self->u.list->length = list->length;
 }
-// extend list by appending all items of a list
-static void list_append_list(struct listitem *selfhead, struct listitem *otherhead)
+
+// element-wise operations: apply monadic operator to each item of list
+static void list_map_monadic(struct object *self, const struct op *op)
 {
-	struct listitem	*item;
+	struct object	*item;
+	int		length;
 
-	if (selfhead == otherhead)
-		Bug_found("ExtendingListWithItself", 0);
-	item = otherhead->next;
-	while (item != otherhead) {
-		list_append_object(selfhead, &item->u.payload);
-		item = item->next;
+	list_copy(self);
+	item = self->u.list->item;
+	for (length = self->u.list->length; length; --length) {
+		item->type->monadic_op(item, op);
+		++item;
 	}
 }
 
+// element-wise operations: "LIST op NUMBER" or "NUMBER op LIST" gives list of
+// results of applying operator to each item and the number.
+// returns FALSE if operator is not suitable for this.
+static boolean list_map_dyadic(struct object *self, const struct op *op, struct object *other)
+{
+	struct object	number,
+			arg,
+			*item;
+	int		length;
+	boolean		list_is_left	= (self->type == &type_list);
+
+	switch (op->id) {
+	case OPID_POWEROF:
+	case OPID_MULTIPLY:
+	case OPID_DIVIDE:
+	case OPID_INTDIV:
+	case OPID_MODULO:
+	case OPID_SHIFTLEFT:
+	case OPID_ASR:
+	case OPID_LSR:
+	case OPID_ADD:
+	case OPID_SUBTRACT:
+	case OPID_AND:
+	case OPID_OR:
+	case OPID_EOR:
+	case OPID_XOR:
+		break;
+	default:
+		return FALSE;
+	}
+	if (list_is_left) {
+		number = *other;
+	} else {
+		number = *self;
+		*self = *other;	// take over reference to list
+	}
+	list_copy(self);
+	item = self->u.list->item;
+	for (length = self->u.list->length; length; --length) {
+		// operators may convert their args, so use fresh copies
+		if (list_is_left) {
+			arg = number;
+			item->type->dyadic_op(item, op, &arg);
+		} else {
+			arg = *item;
+			*item = number;
+			number.type->dyadic_op(item, op, &arg);
+		}
+		++item;
+	}
+	return TRUE;
+}
+
 
 // helper function for "monadic &" (either octal value or "unpseudo" operator)
 // returns nonzero on error
@@ -837,7 +1238,10 @@ static void push_dyadic_and_check(struct expression *expression, struct op *op)
 			// stacks:	...	...	previous op(monadic)	newest arg	newest op(dyadic)
 			if (arg_sp < 1)
 				Bug_found("ArgStackEmpty", arg_sp);
-			NEWEST_ARGUMENT.type->monadic_op(&NEWEST_ARGUMENT, PREVIOUS_OPERATOR);
+			if (!int_fast_monadic(&NEWEST_ARGUMENT, PREVIOUS_OPERATOR))
+				NEWEST_ARGUMENT.type->monadic_op(&NEWEST_ARGUMENT, PREVIOUS_OPERATOR);
+			if (recording)
+				rpn_record_operation(PREVIOUS_OPERATOR, 1);
 			expression->is_parenthesized = FALSE;	// operation was something other than parentheses
 			// now remove previous operator by overwriting with newest one...
 			PREVIOUS_OPERATOR = NEWEST_OPERATOR;
@@ -847,7 +1251,10 @@ static void push_dyadic_and_check(struct expression *expression, struct op *op)
 			// stacks:	previous arg	previous op(dyadic)	newest arg	newest op(dyadic)
 			if (arg_sp < 2)
 				Bug_found("NotEnoughArgs", arg_sp);
-			PREVIOUS_ARGUMENT.type->dyadic_op(&PREVIOUS_ARGUMENT, PREVIOUS_OPERATOR, &NEWEST_ARGUMENT);
+			if (!int_fast_dyadic(&PREVIOUS_ARGUMENT, PREVIOUS_OPERATOR, &NEWEST_ARGUMENT))
+				PREVIOUS_ARGUMENT.type->dyadic_op(&PREVIOUS_ARGUMENT, PREVIOUS_OPERATOR, &NEWEST_ARGUMENT);
+			if (recording)
+				rpn_record_operation(PREVIOUS_OPERATOR, 2);
 			expression->is_parenthesized = FALSE;	// operation was something other than parentheses
 			// now remove previous operator by overwriting with newest one...
 			PREVIOUS_OPERATOR = NEWEST_OPERATOR;
@@ -874,7 +1281,6 @@ static void push_dyadic_and_check(struct expression *expression, struct op *op)
 static boolean expect_argument_or_monadic_operator(struct expression *expression)
 {
 	struct op	*op;
-	int		ugly_length_kluge;
 	boolean		perform_negation;
 
 	SKIPSPACE();
@@ -885,9 +1291,7 @@ static boolean expect_argument_or_monadic_operator(struct expression *expression
 		do
 			DYNABUF_APPEND(GlobalDynaBuf, '+');
 		while (GetByte() == '+');
-		ugly_length_kluge = GlobalDynaBuf->size;	// FIXME - get rid of this!
-		symbol_fix_forward_anon_name(FALSE);	// FALSE: do not increment counter
-		get_symbol_value(section_now->local_scope, '\0', ugly_length_kluge, 0);	// no prefix, no unpseudo
+		get_anon_value(TRUE);
 		goto now_expect_dyadic_op;
 
 	case '-':	// NEGATION operator or anonymous backward label
@@ -900,8 +1304,7 @@ static boolean expect_argument_or_monadic_operator(struct expression *expression
 		} while (GetByte() == '-');
 		SKIPSPACE();
 		if (BYTE_FOLLOWS_ANON(GotByte)) {
-			DynaBuf_append(GlobalDynaBuf, '\0');
-			get_symbol_value(section_now->local_scope, '\0', GlobalDynaBuf->size - 1, 0);	// no prefix, -1 to not count terminator, no unpseudo
+			get_anon_value(FALSE);
 			goto now_expect_dyadic_op;
 		}
 
@@ -928,6 +1331,7 @@ static boolean expect_argument_or_monadic_operator(struct expression *expression
 
 // special operators
 	case '[':	// start of list literal
+		recording = FALSE;	// lists are not supported
 		list_init_list(&arg_stack[arg_sp++]);	// put empty list on arg stack
 		NEXTANDSKIPSPACE();
 		if (GotByte == ']') {
@@ -1046,6 +1450,7 @@ static boolean expect_argument_or_monadic_operator(struct expression *expression
 			// we found end-of-expression instead of an argument,
 			// that's either an empty expression or an erroneous one!
 			PUSH_INT_ARG(0, 0, 0);	// push dummy argument so stack checking code won't bark	FIXME - use undefined?
+			rpn_record_constant();
 			if (op_stack[op_sp - 1] == &ops_start_expression) {
 				push_dyadic_and_check(expression, &ops_terminating_char);
 			} else {
@@ -1065,6 +1470,7 @@ get_byte_and_push_monadic:
 		break;
 
 now_expect_dyadic_op:
+		rpn_record_constant();	// literals do not record themselves
 		// bugfix: if in error state, do not change state back to valid one
 		if (alu_state < STATE_MAX_GO_ON)
 			alu_state = STATE_EXPECT_DYADIC_OP;
@@ -1133,6 +1539,7 @@ static void expect_dyadic_operator(struct expression *expression)
 		goto push_dyadic_op;
 
 	case '[':	// indexing operator
+		recording = FALSE;	// only useful for lists and strings, so not supported
 		GetByte();	// eat char
 		// first put high-priority dyadic on stack,
 		// then low-priority special ops_subexpr_bracket
@@ -1202,7 +1609,7 @@ static void expect_dyadic_operator(struct expression *expression)
 			Input_read_and_lower_keyword();
 			// Now GotByte = illegal char
 			// search for tree item
-			if (Tree_easy_scan(op_tree, &node_body, GlobalDynaBuf)) {
+			if (Tree_easy_scan_hashed(op_tree, &node_body, GLOBALDYNABUF_CURRENT, Input_keyword.hash)) {
 				op = node_body;
 				goto push_dyadic_op;
 			}
@@ -1285,15 +1692,10 @@ inline static void float_to_int(struct object *self)
 // replace with item at index
 static void list_to_item(struct object *self, int index)
 {
-	struct listitem	*item;
+	struct list	*list	= self->u.list;
 
-	item = self->u.listhead->next;
-	while (index) {
-		item = item->next;
-		--index;
-	}
-	self->u.listhead->u.listinfo.refs--;	// FIXME - call some fn for this (and do _after_ next line)
-	*self = item->u.payload;	// FIXME - if item is a list, it would gain a ref by this...
+	*self = list->item[index];	// FIXME - if item is a list, it would gain a ref by this...
+	list->refs--;	// FIXME - call some fn for this
 }
 
 // string:
@@ -1318,15 +1720,15 @@ static boolean number_is_defined(const struct object *self)
 // return TRUE only if completely defined
 static boolean list_is_defined(const struct object *self)
 {
-	struct listitem	*item;
+	const struct object	*item	= self->u.list->item;
+	int			ii;
 
 	// iterate over items: if an undefined one is found, return FALSE
-	item = self->u.listhead->next;
-	while (item != self->u.listhead) {
-		if (!(item->u.payload.type->is_defined(&item->u.payload)))
+	for (ii = self->u.list->length; ii; --ii) {
+		if (!(item->type->is_defined(item)))
 			return FALSE;	// we found something undefined
 
-		item = item->next;
+		++item;
 	}
 	// otherwise, list is defined
 	return TRUE;
@@ -1366,29 +1768,24 @@ static boolean number_differs(const struct object *self, const struct object *ot
 // check if new value differs from old
 static boolean list_differs(const struct object *self, const struct object *other)
 {
-	struct listitem	*arthur,
-			*ford;
+	const struct object	*arthur	= self->u.list->item,
+				*ford	= other->u.list->item;
+	int			ii;
 
-	if (self->u.listhead->u.listinfo.length != other->u.listhead->u.listinfo.length)
+	if (self->u.list->length != other->u.list->length)
 		return TRUE;	// lengths differ
 
 	// same length, so iterate over lists and check items
-	arthur = self->u.listhead->next;
-	ford = other->u.listhead->next;
-	while (arthur != self->u.listhead) {
-		if (ford == other->u.listhead)
-			Bug_found("ListLengthError", 0);
-		if (arthur->u.payload.type != ford->u.payload.type)
+	for (ii = self->u.list->length; ii; --ii) {
+		if (arthur->type != ford->type)
 			return TRUE;	// item types differ
 
-		if (arthur->u.payload.type->differs(&arthur->u.payload, &ford->u.payload))
+		if (arthur->type->differs(arthur, ford))
 			return TRUE;	// item values differ
 
-		arthur = arthur->next;
-		ford = ford->next;
+		++arthur;
+		++ford;
 	}
-	if (ford != other->u.listhead)
-		Bug_found("ListLengthError", 1);
 	return FALSE;	// no difference found
 }
 // string:
@@ -1502,6 +1899,11 @@ static void undef_handle_monadic_operator(struct object *self, const struct op *
 		self->u.number.flags &= ~NUMBER_FORCEBITS;
 		self->u.number.addr_refs = 0;
 		break;
+	case OPID_RANGE:
+		// result stays undefined as well
+		self->u.number.flags &= ~(NUMBER_FITS_BYTE | NUMBER_FORCEBITS);
+		self->u.number.addr_refs = 0;
+		break;
 // add new monadic operators here
 //	case OPID_:
 //		break;
@@ -1510,6 +1912,33 @@ static void undef_handle_monadic_operator(struct object *self, const struct op *
 	}
 }
 
+// replace int n with list of ints 0 to n-1 ("range()")
+static void int_create_range(struct object *self)
+{
+	intval_t	length	= self->u.number.val.intval,
+			ii;
+	struct object	*item;
+
+	if (length < 0) {
+		Throw_error("Range length is negative.");
+		length = 0;
+	} else if (length > RANGE_MAXLENGTH) {
+		Throw_error("Range too large.");
+		length = 0;
+	}
+	list_init_sized(self, length);
+	item = self->u.list->item;
+	for (ii = 0; ii < length; ++ii) {
+		item->type = &type_number;
+		item->u.number.ntype = NUMTYPE_INT;
+		item->u.number.flags = 0;
+		item->u.number.val.intval = ii;
+		item->u.number.addr_refs = 0;
+		++item;
+	}
+	self->u.list->length = length;
+}
+
 // prototype for int/float passing
 static void float_handle_monadic_operator(struct object *self, const struct op *op);
 // int:
@@ -1560,6 +1989,10 @@ static void int_handle_monadic_operator(struct object *self, const struct op *op
 		self->u.number.flags |= NUMBER_FITS_BYTE;
 		self->u.number.flags &= ~NUMBER_FORCEBITS;
 		break;
+	case OPID_RANGE:
+		int_create_range(self);
+		return;	// self has become a list
+
 // add new monadic operators here
 //	case OPID_:
 //		break;
@@ -1627,6 +2060,7 @@ static void float_handle_monadic_operator(struct object *self, const struct op *
 	case OPID_LOWBYTEOF:
 	case OPID_HIGHBYTEOF:
 	case OPID_BANKBYTEOF:
+	case OPID_RANGE:
 		// convert fp to int and ask int handler to do the work
 		float_to_int(self);
 		int_handle_monadic_operator(self, op);	// TODO - put recursion check around this?
@@ -1687,8 +2121,8 @@ static void list_handle_monadic_operator(struct object *self, const struct op *o
 
 	switch (op->id) {
 	case OPID_LEN:
-		length = self->u.listhead->u.listinfo.length;
-		self->u.listhead->u.listinfo.refs--;	// FIXME - call some list_decrement_refs() instead...
+		length = self->u.list->length;
+		self->u.list->refs--;	// FIXME - call some list_decrement_refs() instead...
 		self->type = &type_number;
 		self->u.number.ntype = NUMTYPE_INT;
 		self->u.number.flags = 0;
@@ -1703,7 +2137,8 @@ static void list_handle_monadic_operator(struct object *self, const struct op *o
 		int_create_byte(self, FALSE);
 		break;
 	default:
-		unsupported_operation(NULL, op, self);
+		// all other monadic operators and functions work on each item
+		list_map_monadic(self, op);
 	}
 }
 
@@ -2128,7 +2563,8 @@ static void number_handle_dyadic_operator(struct object *self, const struct op *
 {
 	// first check type of second arg:
 	if (other->type != &type_number) {
-		unsupported_operation(self, op, other);
+		if ((other->type != &type_list) || !list_map_dyadic(self, op, other))
+			unsupported_operation(self, op, other);
 		return;
 	}
 
@@ -2179,14 +2615,14 @@ static int get_valid_index(int *target, int length, const struct object *self, c
 // handle dyadic operator
 static void list_handle_dyadic_operator(struct object *self, const struct op *op, struct object *other)
 {
-	struct listitem	*item;
+	struct list	*first;
 	int		length;
 	int		index;
 
-	length = self->u.listhead->u.listinfo.length;
+	length = self->u.list->length;
 	switch (op->id) {
 	case OPID_LIST_APPEND:
-		list_append_object(self->u.listhead, other);
+		list_append_object(self, other);
 		// no need to check/update ref count of "other": it loses the ref on the stack and gains one in the list
 		return;
 
@@ -2200,13 +2636,14 @@ static void list_handle_dyadic_operator(struct object *self, const struct op *op
 	case OPID_ADD:
 		if (other->type != &type_list)
 			break;	// complain
-		item = self->u.listhead;	// get ref to first list
-		list_init_list(self);	// replace first list on arg stack with new one
-		list_append_list(self->u.listhead, item);
-		item->u.listinfo.refs--;	// FIXME - call a function for this...
-		item = other->u.listhead;
-		list_append_list(self->u.listhead, item);
-		item->u.listinfo.refs--;	// FIXME - call a function for this...
+		first = self->u.list;	// get ref to first list
+		// replace first list on arg stack with new one
+		list_init_sized(self, length + other->u.list->length);
+		memcpy(self->u.list->item, first->item, length * sizeof(*(first->item)));
+		memcpy(self->u.list->item + length, other->u.list->item, other->u.list->length * sizeof(*(first->item)));
+		self->u.list->length = length + other->u.list->length;
+		first->refs--;	// FIXME - call a function for this...
+		other->u.list->refs--;	// FIXME - call a function for this...
 		return;
 
 	case OPID_EQUALS:
@@ -2227,6 +2664,9 @@ static void list_handle_dyadic_operator(struct object *self, const struct op *op
 	default:
 		break;	// complain
 	}
+	if ((other->type == &type_number) && list_map_dyadic(self, op, other))
+		return;	// element-wise operation
+
 	unsupported_operation(self, op, other);
 }
 
@@ -2253,9 +2693,7 @@ static void string_handle_dyadic_operator(struct object *self, const struct op *
 			break;	// complain
 		arthur = self->u.string;
 		ford = other->u.string;
-		string_prepare_string(self, arthur->length + ford->length);	// create string object and put on arg stack
-		memcpy(self->u.string->payload, arthur->payload, arthur->length);
-		memcpy(self->u.string->payload + arthur->length, ford->payload, ford->length);
+		string_concatenate(self, arthur, ford);	// create string object and put on arg stack
 		arthur->refs--;	// FIXME - call a function for this...
 		ford->refs--;	// FIXME - call a function for this...
 		return;
@@ -2335,19 +2773,17 @@ static void number_print(const struct object *self, struct dynabuf *db)
 // print value for user message
 static void list_print(const struct object *self, struct dynabuf *db)
 {
-	struct listitem	*item;
-	int		length;
-	struct object	*obj;
-	const char	*prefix	= "";	// first item does not get a prefix
+	int			length;
+	const struct object	*obj;
+	const char		*prefix	= "";	// first item does not get a prefix
 
 	DynaBuf_append(db, '[');
-	length = self->u.listhead->u.listinfo.length;
-	item = self->u.listhead->next;
+	length = self->u.list->length;
+	obj = self->u.list->item;
 	while (length--) {
-		obj = &item->u.payload;
 		DynaBuf_add_string(db, prefix);
 		obj->type->print(obj, db);
-		item = item->next;
+		++obj;
 		prefix = ", ";	// following items are prefixed
 	}
 	DynaBuf_append(db, ']');
@@ -2357,7 +2793,7 @@ static void list_print(const struct object *self, struct dynabuf *db)
 // print value for user message
 static void string_print(const struct object *self, struct dynabuf *db)
 {
-	DynaBuf_add_string(db, self->u.string->payload);	// there is a terminator after the actual payload, so this works
+	DynaBuf_add_span(db, self->u.string->payload, self->u.string->length);
 }
 
 // number:
@@ -2371,7 +2807,7 @@ static int has_no_length(const struct object *self)
 // return length
 static int list_get_length(const struct object *self)
 {
-	return self->u.listhead->u.listinfo.length;
+	return self->u.list->length;
 }
 
 // string:
@@ -2443,49 +2879,73 @@ struct type	type_string	= {
 };
 
 
-// this is what the exported functions call
-// returns nonzero on parse error
-static int parse_expression(struct expression *expression)
+// evaluate compiled expression
+static void run_rpn(struct expression *expression, const struct rpn *rpn)
 {
-	struct object	*result	= &expression->result;
+	const struct rpn_item	*item	= rpn->item;
+	const char		*names	= (const char *) (rpn->item + rpn->items);
+	int			ii;
+	scope_t			scope;
+	struct rwname		name;
 
-	// make sure stacks are ready (if not yet initialised, do it now)
-	if (arg_stack == NULL)
+	while (argstack_size <= rpn->max_depth)
 		enlarge_argument_stack();
-	if (op_stack == NULL)
-		enlarge_operator_stack();
-
-	// init
-	expression->is_empty = TRUE;	// becomes FALSE when first valid char gets parsed
-	expression->open_parentheses = 0;
-	expression->is_parenthesized = FALSE;	// '(' operator sets this to TRUE, all others to FALSE. outermost operator wins!
-	//expression->number will be overwritten later, so no need to init
-
-	op_sp = 0;	// operator stack pointer
-	arg_sp = 0;	// argument stack pointer
-	// begin by reading an argument (or a monadic operator)
-	PUSH_OP(&ops_start_expression);
-	alu_state = STATE_EXPECT_ARG_OR_MONADIC_OP;
-	do {
-		// check arg stack size. enlarge if needed
-		if (arg_sp >= argstack_size)
-			enlarge_argument_stack();
-		// (op stack size is checked whenever pushing an operator)
-		switch (alu_state) {
-		case STATE_EXPECT_ARG_OR_MONADIC_OP:
-			if (expect_argument_or_monadic_operator(expression))
-				expression->is_empty = FALSE;
+	if (rpn->max_depth > stats.max_arg_sp)
+		stats.max_arg_sp = rpn->max_depth;
+	++stats.compiled_expressions;
+	arg_sp = 0;
+	for (ii = rpn->items; ii; --ii) {
+		switch (item->kind) {
+		case RPN_CONSTANT:
+			arg_stack[arg_sp++] = item->u.constant;
 			break;
-		case STATE_EXPECT_DYADIC_OP:
-			expect_dyadic_operator(expression);
+		case RPN_SYMBOL:
+			if (item->u.symbol.prefix == LOCAL_PREFIX)
+				scope = section_now->local_scope;
+			else if (item->u.symbol.prefix == CHEAP_PREFIX)
+				scope = section_now->cheap_scope;
+			else
+				scope = SCOPE_GLOBAL;
+			name.string = names + item->u.symbol.name_offset;
+			name.size = item->u.symbol.name_size;
+			name.hash = item->u.symbol.name_hash;
+			get_named_symbol_value(&name, scope, item->u.symbol.prefix, item->u.symbol.name_length, item->u.symbol.unpseudo_count);
 			break;
-		case STATE_MAX_GO_ON:	// suppress
-		case STATE_ERROR:	// compiler
-		case STATE_END:		// warnings
+		case RPN_PC:
+			push_program_counter(item->u.symbol.unpseudo_count);
+			break;
+		case RPN_ANON:
+			push_symbol_value(item->u.anon, '\0', "anonymous label", 15, 0);
+			break;
+		case RPN_MONADIC:
+			if (!int_fast_monadic(&arg_stack[arg_sp - 1], item->u.op))
+				arg_stack[arg_sp - 1].type->monadic_op(&arg_stack[arg_sp - 1], item->u.op);
 			break;
+		case RPN_DYADIC:
+			if (!int_fast_dyadic(&arg_stack[arg_sp - 2], item->u.op, &arg_stack[arg_sp - 1]))
+				arg_stack[arg_sp - 2].type->dyadic_op(&arg_stack[arg_sp - 2], item->u.op, &arg_stack[arg_sp - 1]);
+			--arg_sp;
+			break;
+		default:
+			Bug_found("IllegalRpnItem", item->kind);
 		}
-	} while (alu_state < STATE_MAX_GO_ON);
-	// done. check state.
+		++item;
+	}
+	expression->is_empty = rpn->is_empty;
+	expression->open_parentheses = rpn->open_parentheses;
+	expression->is_parenthesized = rpn->is_parenthesized;
+	op_sp = 1;	// for sanity check
+	alu_state = STATE_END;
+}
+
+
+// check state after parsing or running expression and copy result
+// returns nonzero on parse error
+static int finish_expression(struct expression *expression)
+{
+	struct object	*result	= &expression->result;
+
+	// check state.
 	if (alu_state == STATE_END) {
 		// check for bugs
 		if (arg_sp != 1)
@@ -2530,11 +2990,105 @@ static int parse_expression(struct expression *expression)
 }
 
 
+// this is what the exported functions call
+// returns nonzero on parse error
+static int parse_expression(struct expression *expression)
+{
+	struct parsed_stmt	site,
+				*known;
+	char			first_byte	= GotByte;
+	int			outer_throw_count;
+
+	// make sure stacks are ready (if not yet initialised, do it now)
+	if (arg_stack == NULL)
+		enlarge_argument_stack();
+	if (op_stack == NULL)
+		enlarge_operator_stack();
+
+	++stats.expressions;
+	// if expression has been compiled before, just evaluate that
+	known = Input_find_stmt(&site);
+	if (known
+	&& (known->kind == STMT_EXPRESSION)
+	&& (((struct rpn *) known->action)->first_byte == first_byte)) {
+		last_rpn = known->action;
+		forget_loose_rpn();
+		run_rpn(expression, last_rpn);
+		Input_resume_stmt(known);
+		return finish_expression(expression);
+	}
+
+	// otherwise compile while parsing (if possible)
+	last_rpn = NULL;
+	forget_loose_rpn();
+	recording = (site.start != NULL) || fixup_recording;
+	reusable = TRUE;
+	rpn_used = 0;
+	rpn_args = 0;
+	rpn_depth = 0;
+	DYNABUF_CLEAR(rpn_names);
+	outer_throw_count = Throw_get_counter();
+
+	// init
+	expression->is_empty = TRUE;	// becomes FALSE when first valid char gets parsed
+	expression->open_parentheses = 0;
+	expression->is_parenthesized = FALSE;	// '(' operator sets this to TRUE, all others to FALSE. outermost operator wins!
+	//expression->number will be overwritten later, so no need to init
+
+	op_sp = 0;	// operator stack pointer
+	arg_sp = 0;	// argument stack pointer
+	// begin by reading an argument (or a monadic operator)
+	PUSH_OP(&ops_start_expression);
+	alu_state = STATE_EXPECT_ARG_OR_MONADIC_OP;
+	do {
+		// check arg stack size. enlarge if needed
+		if (arg_sp >= argstack_size)
+			enlarge_argument_stack();
+		if (arg_sp > stats.max_arg_sp)
+			stats.max_arg_sp = arg_sp;
+		if (op_sp > stats.max_op_sp)
+			stats.max_op_sp = op_sp;
+		// (op stack size is checked whenever pushing an operator)
+		switch (alu_state) {
+		case STATE_EXPECT_ARG_OR_MONADIC_OP:
+			if (expect_argument_or_monadic_operator(expression))
+				expression->is_empty = FALSE;
+			break;
+		case STATE_EXPECT_DYADIC_OP:
+			expect_dyadic_operator(expression);
+			break;
+		case STATE_MAX_GO_ON:	// suppress
+		case STATE_ERROR:	// compiler
+		case STATE_END:		// warnings
+			break;
+		}
+	} while (alu_state < STATE_MAX_GO_ON);
+	// do not compile if there were errors or warnings, because they would
+	// not be shown again
+	if (recording
+	&& (alu_state == STATE_END)
+	&& (Throw_get_counter() == outer_throw_count)) {
+		if (site.start && reusable) {
+			Input_set_resume(&site);
+			site.kind = STMT_EXPRESSION;
+			site.cpu = NULL;
+			site.action = rpn_get_copy(expression, first_byte);
+			Input_remember_stmt(&site);
+			last_rpn = site.action;
+		} else {
+			loose_rpn = rpn_get_copy(expression, first_byte);
+		}
+	}
+	recording = FALSE;
+	return finish_expression(expression);
+}
+
+
 // store int value (if undefined, store zero)
 // For empty expressions, an error is thrown.
 // OPEN_PARENTHESIS: complain
 // EMPTY: complain
-// UNDEFINED: allow
+// UNDEFINED: allow (but count as needed for output)
 // FLOAT: convert to int
 void ALU_any_int(intval_t *target)	// ACCEPT_UNDEFINED
 {
@@ -2546,9 +3100,10 @@ void ALU_any_int(intval_t *target)	// ACCEPT_UNDEFINED
 	if (expression.is_empty)
 		Throw_error(exception_no_value);
 	if (expression.result.type == &type_number) {
-		if (expression.result.u.number.ntype == NUMTYPE_UNDEFINED)
+		if (expression.result.u.number.ntype == NUMTYPE_UNDEFINED) {
+			++pass.needvalue_count;
 			*target = 0;
-		else if (expression.result.u.number.ntype == NUMTYPE_INT)
+		} else if (expression.result.u.number.ntype == NUMTYPE_INT)
 			*target = expression.result.u.number.val.intval;
 		else if (expression.result.u.number.ntype == NUMTYPE_FLOAT)
 			*target = expression.result.u.number.val.fpval;
@@ -2631,7 +3186,7 @@ throws errors even though the result is defined!
 // addressing modes where internal indices have to be possible.
 // For empty expressions, an error is thrown.
 // OPEN_PARENTHESIS: depends on arg
-// UNDEFINED: allow
+// UNDEFINED: allow (but count as needed for output)
 // EMPTY: complain
 // FLOAT: convert to int
 void ALU_addrmode_int(struct expression *expression, int paren)	// ACCEPT_UNDEFINED | ACCEPT_OPENPARENTHESIS
@@ -2639,10 +3194,12 @@ void ALU_addrmode_int(struct expression *expression, int paren)	// ACCEPT_UNDEFI
 	parse_expression(expression);	// FIXME - check return value and pass to caller!
 	if (expression->result.type == &type_number) {
 		// convert float to int
-		if (expression->result.u.number.ntype == NUMTYPE_FLOAT)
+		if (expression->result.u.number.ntype == NUMTYPE_FLOAT) {
 			float_to_int(&(expression->result));
-		else if (expression->result.u.number.ntype == NUMTYPE_UNDEFINED)
+		} else if (expression->result.u.number.ntype == NUMTYPE_UNDEFINED) {
+			++pass.needvalue_count;
 			expression->result.u.number.val.intval = 0;
+		}
 	} else if (expression->result.type == &type_string) {
 		// accept single-char strings, to be more
 		// compatible with versions before 0.97:
@@ -2683,6 +3240,120 @@ void ALU_any_result(struct object *result)	// ACCEPT_UNDEFINED | ACCEPT_FLOAT
 }
 
 
+// return compiled form of the expression that has just been parsed (NULL if
+// it could not be compiled). this stays valid as long as the block it was
+// read from.
+const struct rpn *ALU_last_compiled(void)
+{
+	return last_rpn;
+}
+
+
+// free compiled expression (NULL is ignored)
+void ALU_free_compiled(struct rpn *rpn)
+{
+	if (rpn)
+		safe_free(rpn, rpn->size, MEMUSE_BLOCKS);
+}
+
+
+// return malloc'd copy of the compiled form of the expression that has just
+// been parsed or run, so it can be evaluated later (for fixups). the program
+// counter and all symbols that are defined now are replaced by their current
+// values. returns NULL if the expression was not compiled.
+struct rpn *ALU_keep_last_compiled(void)
+{
+	struct rpn	*copy;
+	struct rpn_item	*item;
+	struct symbol	*symbol;
+	struct rwname	name;
+	const char	*names;
+	scope_t		scope;
+	int		ii;
+
+	if (loose_rpn) {
+		copy = loose_rpn;	// caller now owns it
+		loose_rpn = NULL;
+	} else if (last_rpn) {
+		copy = safe_malloc(last_rpn->size, MEMUSE_BLOCKS);
+		memcpy(copy, last_rpn, last_rpn->size);
+	} else {
+		return NULL;
+	}
+
+	// values that may change until the expression is evaluated again are
+	// pushed on the arg stack as usual and then turned into constants
+	names = (const char *) (copy->item + copy->items);
+	for (ii = 0; ii < copy->items; ++ii) {
+		item = &copy->item[ii];
+		switch (item->kind) {
+		case RPN_SYMBOL:
+			if (item->u.symbol.prefix == LOCAL_PREFIX)
+				scope = section_now->local_scope;
+			else if (item->u.symbol.prefix == CHEAP_PREFIX)
+				scope = section_now->cheap_scope;
+			else
+				scope = SCOPE_GLOBAL;
+			name.string = names + item->u.symbol.name_offset;
+			name.size = item->u.symbol.name_size;
+			name.hash = item->u.symbol.name_hash;
+			symbol = symbol_find_name(&name, scope);
+			if ((symbol->object.type == NULL)
+			|| !symbol->object.type->is_defined(&symbol->object))
+				continue;
+			push_symbol_value(symbol, item->u.symbol.prefix, name.string, item->u.symbol.name_length, item->u.symbol.unpseudo_count);
+			break;
+		case RPN_ANON:
+			symbol = item->u.anon;
+			if ((symbol->object.type == NULL)
+			|| !symbol->object.type->is_defined(&symbol->object))
+				continue;
+			push_symbol_value(symbol, '\0', "anonymous label", 15, 0);
+			break;
+		case RPN_PC:
+			push_program_counter(item->u.symbol.unpseudo_count);
+			break;
+		default:
+			continue;
+		}
+		item->kind = RPN_CONSTANT;
+		item->u.constant = arg_stack[--arg_sp];
+	}
+	return copy;
+}
+
+
+// like ALU_any_result(), but run expression compiled before instead of
+// reading it from input.
+void ALU_compiled_any_result(const struct rpn *rpn, struct object *result)
+{
+	struct expression	expression;
+
+	last_rpn = rpn;
+	forget_loose_rpn();
+	run_rpn(&expression, rpn);
+	finish_expression(&expression);
+	*result = expression.result;
+	if (expression.open_parentheses)
+		Throw_error(exception_paren_open);
+	if (expression.is_empty)
+		Throw_error(exception_no_value);
+}
+
+
+// return whether compiled expression reads the program counter
+boolean ALU_compiled_reads_pc(const struct rpn *rpn)
+{
+	int	ii;
+
+	for (ii = 0; ii < rpn->items; ++ii) {
+		if (rpn->item[ii].kind == RPN_PC)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
 /* TODO
 
 maybe move
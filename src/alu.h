@@ -11,6 +11,7 @@
 
 
 struct op;
+struct rpn;
 struct dynabuf;
 struct type {
 	const char	*name;
@@ -74,6 +75,23 @@ extern void ALU_defined_int(struct number *intresult);
 extern void ALU_addrmode_int(struct expression *expression, int paren);
 // stores resulting object
 extern void ALU_any_result(struct object *result);
+// return compiled form of the expression that has just been parsed (NULL if
+// it could not be compiled). this stays valid as long as the block it was
+// read from.
+extern const struct rpn *ALU_last_compiled(void);
+// free compiled expression (NULL is ignored)
+extern void ALU_free_compiled(struct rpn *rpn);
+// return malloc'd copy of the compiled form of the expression that has just
+// been parsed or run, so it can be evaluated later (for fixups). the program
+// counter and all symbols that are defined now are replaced by their current
+// values. returns NULL if the expression was not compiled.
+extern struct rpn *ALU_keep_last_compiled(void);
+// like ALU_any_result(), but run expression compiled before instead of
+// reading it from input.
+extern void ALU_compiled_any_result(const struct rpn *rpn, struct object *result);
+// return whether compiled expression reads the program counter (so its value
+// depends on where it is used)
+extern boolean ALU_compiled_reads_pc(const struct rpn *rpn);
 
 
 #endif
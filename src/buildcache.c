@@ -0,0 +1,343 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// build cache ("--cache-dir")
+//
+// After a successful build without warnings, a cache entry is written. It is
+// named after a checksum of the command line arguments and holds the
+// arguments themselves, the name, path and checksum of each file that was
+// read (and the names of those that could not be found), and the contents of
+// all output files. When the same command line is used again, each file is
+// looked up again. If all of them still resolve to the same path and have the
+// same contents, the output files are written from the cache and nothing needs
+// to be assembled.
+#include "buildcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acme.h"
+#include "dynabuf.h"
+#include "global.h"
+#include "input.h"
+#include "platform.h"
+#include "tree.h"
+#include "version.h"
+
+
+// constants
+static const char	cache_magic[]	= "ACME build cache, release " RELEASE "\n";
+static const char	cache_suffix[]	= ".acmecache";
+static const char	temp_suffix[]	= ".tmp";
+#define OUTPUT_FILES	5	// output, symbol list, vice labels, report, dependencies
+
+
+// variables
+const char		*buildcache_dir	= NULL;
+static STRUCT_DYNABUF_REF(key_buf, 256);	// command line arguments
+static STRUCT_DYNABUF_REF(name_buf, 256);	// name of cache entry
+static STRUCT_DYNABUF_REF(data_buf, 1024);	// strings and file contents
+
+
+// compute checksum of a block of data
+void buildcache_checksum(struct checksum *sum, const char *data, size_t size)
+{
+	unsigned long	a	= 2166136261UL,	// FNV-1a
+			b	= 0;	// sdbm
+	unsigned char	byte;
+
+	while (size--) {
+		byte = (unsigned char) *data++;
+		a = ((a ^ byte) * 16777619UL) & 0xffffffffUL;
+		b = (byte + (b << 6) + (b << 16) - b) & 0xffffffffUL;
+	}
+	sum->a = a;
+	sum->b = b;
+}
+
+
+// remember command line arguments (they are part of the cache key)
+void buildcache_init(int argc, const char *argv[])
+{
+	int	ii;
+
+	DYNABUF_CLEAR(key_buf);
+	for (ii = 1; ii < argc; ++ii) {
+		DynaBuf_add_string(key_buf, argv[ii]);
+		DynaBuf_append(key_buf, '\0');
+	}
+}
+
+
+// put name of cache entry (plus given suffix) into name_buf
+static void make_entry_name(const char *suffix)
+{
+	struct checksum	sum;
+	char		hex[20];
+
+	buildcache_checksum(&sum, key_buf->buffer, key_buf->size);
+	sprintf(hex, "%08lx%08lx", sum.a, sum.b);
+	DYNABUF_CLEAR(name_buf);
+	DynaBuf_add_string(name_buf, buildcache_dir);
+	// if wanted and possible, ensure last char is directory separator
+	if (DIRECTORY_SEPARATOR
+	&& name_buf->size
+	&& (name_buf->buffer[name_buf->size - 1] != DIRECTORY_SEPARATOR))
+		DynaBuf_append(name_buf, DIRECTORY_SEPARATOR);
+	DynaBuf_add_string(name_buf, hex);
+	DynaBuf_add_string(name_buf, cache_suffix);
+	DynaBuf_add_string(name_buf, suffix);
+	DynaBuf_append(name_buf, '\0');
+}
+
+
+// read zero-terminated string from cache entry into given buffer.
+// returns nonzero on error.
+static int read_string(struct dynabuf *db, FILE *fd)
+{
+	int	byte;
+
+	DYNABUF_CLEAR(db);
+	for (;;) {
+		byte = getc(fd);
+		if (byte == EOF)
+			return 1;	// error
+
+		DYNABUF_APPEND(db, (char) byte);
+		if (byte == '\0')
+			return 0;	// ok
+	}
+}
+
+
+// read given number of bytes from stream into data_buf.
+// returns nonzero on error.
+static int read_block(size_t size, FILE *fd)
+{
+	DYNABUF_CLEAR(data_buf);
+	while (data_buf->reserved < size)
+		dynabuf_enlarge(data_buf);
+	data_buf->size = fread(data_buf->buffer, 1, size, fd);
+	return data_buf->size != size;
+}
+
+
+// check that the file mentioned in the next record still resolves to the same
+// path and contents. returns nonzero if not.
+static int check_file(FILE *fd)
+{
+	int			use_include_paths,
+				found;
+	unsigned long		size;
+	struct checksum		sum,
+				stored;
+	struct cached_file	*file;
+
+	if (fscanf(fd, "%d %d %lu %lx %lx\n", &use_include_paths, &found, &size, &stored.a, &stored.b) != 5)
+		return 1;	// broken entry
+
+	// name
+	if (read_string(GlobalDynaBuf, fd))
+		return 1;
+
+	file = filecache_get(use_include_paths);
+	// path
+	if (read_string(data_buf, fd))
+		return 1;
+
+	if (!found)
+		return file != NULL;	// file must still be missing
+
+	if ((file == NULL)
+	|| (strcmp(file->path, data_buf->buffer))
+	|| (file->size != size))
+		return 1;
+
+	buildcache_checksum(&sum, file->body, file->size);
+	return (sum.a != stored.a) || (sum.b != stored.b);
+}
+
+
+// return whether file exists and holds what data_buf holds
+static boolean file_is_unchanged(const char *name)
+{
+	FILE	*in;
+	size_t	ii;
+	boolean	equal;
+
+	in = fopen(name, "rb");
+	if (in == NULL)
+		return FALSE;
+
+	for (ii = 0; ii < data_buf->size; ++ii) {
+		if (getc(in) != (unsigned char) data_buf->buffer[ii])
+			break;
+	}
+	equal = (ii == data_buf->size) && (getc(in) == EOF);
+	fclose(in);
+	return equal;
+}
+
+
+// write output file mentioned in next record. returns nonzero on error.
+static int write_output(FILE *fd)
+{
+	unsigned long	size;
+	char		*name;
+	FILE		*out;
+
+	if ((fscanf(fd, "%lu\n", &size) != 1)
+	|| read_string(data_buf, fd))
+		return 1;
+
+	name = DynaBuf_get_copy(data_buf, MEMUSE_OTHER);
+	if (read_block(size, fd)) {
+		safe_free_string(name, MEMUSE_OTHER);
+		return 1;
+	}
+	// with "--keep-unchanged", files that would not change are not touched
+	if (config.keep_unchanged && file_is_unchanged(name)) {
+		safe_free_string(name, MEMUSE_OTHER);
+		return 0;
+	}
+	out = fopen(name, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Error: Cannot open output file \"%s\".\n", name);
+		safe_free_string(name, MEMUSE_OTHER);
+		return 1;
+	}
+	fwrite(data_buf->buffer, 1, data_buf->size, out);
+	fclose(out);
+	safe_free_string(name, MEMUSE_OTHER);
+	return 0;
+}
+
+
+// if an earlier build with the same arguments read the same files, write its
+// output files again and return TRUE. returns FALSE if assembling is needed.
+boolean buildcache_fetch(void)
+{
+	FILE	*fd;
+	int	type;
+	boolean	done	= FALSE;
+
+	if (buildcache_dir == NULL)
+		return FALSE;
+
+	make_entry_name("");
+	fd = fopen(name_buf->buffer, "rb");
+	if (fd == NULL)
+		return FALSE;	// no entry yet
+
+	// check header and arguments (checksums might collide)
+	if (read_block(strlen(cache_magic), fd)
+	|| memcmp(data_buf->buffer, cache_magic, data_buf->size)
+	|| read_block(key_buf->size, fd)
+	|| memcmp(data_buf->buffer, key_buf->buffer, data_buf->size))
+		goto out;
+
+	// first check input files, then write output files
+	for (;;) {
+		type = getc(fd);
+		if (type == 'F') {
+			if (check_file(fd))
+				goto out;
+		} else if (type == 'O') {
+			if (write_output(fd))
+				goto out;
+		} else {
+			done = (type == 'E');
+			goto out;
+		}
+	}
+out:
+	fclose(fd);
+	if (done && (config.process_verbosity > 1))
+		puts("Output files taken from build cache.");
+	return done;
+}
+
+
+// write record for file cache entry
+static void dump_file(struct rwnode *node, FILE *fd)
+{
+	struct cached_file	*file	= node->body;
+	struct checksum		sum;
+
+	// (in batch mode, the file cache also holds other projects' files)
+	if (!file->used)
+		return;
+
+	buildcache_checksum(&sum, file->body, file->size);
+	fprintf(fd, "F%d %d %lu %08lx %08lx\n", node->id_number != 0, file->path != NULL, (unsigned long) file->size, sum.a, sum.b);
+	fwrite(file->name, 1, strlen(file->name) + 1, fd);
+	if (file->path)
+		fwrite(file->path, 1, strlen(file->path), fd);
+	putc('\0', fd);
+}
+
+
+// write record for output file. returns nonzero if file cannot be read.
+static int dump_output(const char *name, FILE *fd)
+{
+	FILE	*in;
+	int	byte;
+
+	in = fopen(name, "rb");
+	if (in == NULL)
+		return 1;
+
+	DYNABUF_CLEAR(data_buf);
+	while ((byte = getc(in)) != EOF)
+		DYNABUF_APPEND(data_buf, (char) byte);
+	fclose(in);
+	fprintf(fd, "O%lu\n", (unsigned long) data_buf->size);
+	fwrite(name, 1, strlen(name) + 1, fd);
+	fwrite(data_buf->buffer, 1, data_buf->size, fd);
+	return 0;
+}
+
+
+// store files read and written by this build in cache
+void buildcache_store(void)
+{
+	const char	*outputs[OUTPUT_FILES];
+	char		*temp_name;
+	FILE		*fd;
+	int		ii,
+			failed	= 0;
+
+	// split output ("--split-output") is not stored
+	if ((buildcache_dir == NULL) || (part->output_filename == NULL) || config.split_size)
+		return;
+
+	outputs[0] = part->output_filename;
+	outputs[1] = part->symbollist_filename;
+	outputs[2] = part->vicelabels_filename;
+	outputs[3] = part->report_filename;
+	outputs[4] = part->depfile_filename;
+	// write to temporary file first, so other builds never see half an entry
+	make_entry_name(temp_suffix);
+	temp_name = DynaBuf_get_copy(name_buf, MEMUSE_OTHER);
+	fd = fopen(temp_name, "wb");
+	if (fd == NULL) {
+		fprintf(stderr, "Warning: Cannot write build cache entry \"%s\".\n", temp_name);
+		safe_free_string(temp_name, MEMUSE_OTHER);
+		return;
+	}
+	fputs(cache_magic, fd);
+	fwrite(key_buf->buffer, 1, key_buf->size, fd);
+	filecache_dump(dump_file, fd);
+	for (ii = 0; ii < OUTPUT_FILES; ++ii) {
+		if (outputs[ii])
+			failed |= dump_output(outputs[ii], fd);
+	}
+	putc('E', fd);
+	failed |= ferror(fd);
+	failed |= fclose(fd);
+	make_entry_name("");
+	remove(name_buf->buffer);	// rename() may fail if target exists
+	if (failed || rename(temp_name, name_buf->buffer))
+		remove(temp_name);
+	safe_free_string(temp_name, MEMUSE_OTHER);
+}
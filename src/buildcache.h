@@ -0,0 +1,38 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// build cache ("--cache-dir")
+#ifndef buildcache_H
+#define buildcache_H
+
+
+#include <stdlib.h>	// for size_t
+#include "config.h"
+
+
+// checksum of a block of data (two independent 32-bit hashes)
+struct checksum {
+	unsigned long	a,
+			b;
+};
+
+
+// variables
+extern const char	*buildcache_dir;	// NULL means "do not use cache"
+
+
+// prototypes
+
+// remember command line arguments (they are part of the cache key)
+extern void buildcache_init(int argc, const char *argv[]);
+// if an earlier build with the same arguments read the same files, write its
+// output files again and return TRUE. returns FALSE if assembling is needed.
+extern boolean buildcache_fetch(void);
+// store files read and written by this build in cache
+extern void buildcache_store(void);
+// compute checksum of a block of data
+extern void buildcache_checksum(struct checksum *sum, const char *data, size_t size);
+
+
+#endif
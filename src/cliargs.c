@@ -6,6 +6,7 @@
 #include "cliargs.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include "acme.h"
 #include "config.h"
 
 
@@ -42,7 +43,8 @@ void cliargs_handle_options(char (*fn_short)(const char *), const char *(*fn_lon
 			return;
 
 		// if next argument is not an option, return immediately
-		if ((**next_argument) != '-')
+		// (a single '-' is not an option either, it means stdin)
+		if (((**next_argument) != '-') || ((*next_argument)[1] == '\0'))
 			return;
 
 		// officially fetch argument. We already know the
@@ -57,13 +59,13 @@ void cliargs_handle_options(char (*fn_short)(const char *), const char *(*fn_lon
 			problem_string = fn_long(argument + 1);
 			if (problem_string) {
 				fprintf(stderr, "%sUnknown option (--%s).\n", cliargs_error, problem_string);
-				exit(EXIT_FAILURE);
+				ACME_exit(EXIT_FAILURE);
 			}
 		} else {
 			problem_char = fn_short(argument);
 			if (problem_char) {
 				fprintf(stderr, "%sUnknown switch (-%c).\n", cliargs_error, problem_char);
-				exit(EXIT_FAILURE);
+				ACME_exit(EXIT_FAILURE);
 			}
 		}
 	}
@@ -80,7 +82,8 @@ const char *cliargs_safe_get_next(const char name[])
 		return string;
 
 	fprintf(stderr, "%sMissing %s.\n", cliargs_error, name);
-	exit(EXIT_FAILURE);
+	ACME_exit(EXIT_FAILURE);
+	return NULL;	// not reached
 }
 
 
@@ -25,6 +25,19 @@ enum numtype {
 	NUMTYPE_INT,
 	NUMTYPE_FLOAT,
 };
+// what memory is used for (see "--stats" and "--maxmemory")
+enum memuse {
+	MEMUSE_SYMBOLS,	// symbol structs
+	MEMUSE_TREES,	// tree nodes and hash tables
+	MEMUSE_BLOCKS,	// stored blocks, compiled statements and expressions
+	MEMUSE_MACROS,	// macro definitions and bodies
+	MEMUSE_OBJECTS,	// strings, lists and other copies
+	MEMUSE_DYNABUFS,	// dynamic buffers
+	MEMUSE_OUTPUT,	// output buffer, segments, pseudopc contexts
+	MEMUSE_FILES,	// cached source files
+	MEMUSE_OTHER,	// stacks, messages, ...
+	MEMUSE_COUNT	// number of entries above
+};
 
 // structure for ints/floats
 struct number {
@@ -39,31 +52,36 @@ struct number {
 
 struct type;
 struct string;
-struct listitem;
+struct list;
 // structure for ints/floats/lists/strings (anything that can be assigned to symbol)
 struct object {
 	struct type	*type;
 	union {
 		struct number	number;
 		struct string	*string;
-		struct listitem	*listhead;
+		struct list	*list;
 	} u;
 };
+// string contents are kept in buffers that may be shared: appending to the
+// string that ends where the used part of its buffer ends just claims more of
+// the buffer, so repeated concatenation does not copy the string each time.
+// bytes that have been claimed are never changed.
+struct string_buffer {
+	int	size;	// number of bytes there is room for
+	int	used;	// number of bytes claimed by strings
+	char	data[1];	// real structs are malloc'd to correct size
+};
 struct string {
-	int 	length;
-	int 	refs;
-	char	payload[1];	// real structs are malloc'd to correct size
+	int 			length;
+	int 			refs;
+	char			*payload;	// points into buffer
+	struct string_buffer	*buffer;
 };
-struct listitem {
-	struct listitem	*next;
-	struct listitem	*prev;
-	union {
-		struct {
-			int	length;	// this does not include the head element
-			int	refs;
-		} listinfo;			// if item is list head
-		struct object	payload;	// if item is not list head
-	} u;
+struct list {
+	int		length;	// number of items
+	int		refs;
+	int		size;	// number of items there is room for
+	struct object	item[1];	// real structs are malloc'd to correct size
 };
 
 // debugging flag, should be undefined in release version
@@ -72,6 +90,10 @@ struct listitem {
 // maximum nesting depth of "!src" and macro calls
 // is not actually a limitation, but a means of finding recursions
 #define MAX_NESTING	64
+// maximum nesting depth of blocks parsed recursively (loops, "!source",
+// "!zone", ... but not macro calls and "!if"), so the C stack does not overflow
+// even if "--maxdepth" is very large
+#define MAX_RECURSION	1000
 // default value for output buffer
 #define FILLVALUE_INITIAL	0
 // default value for "!fill"
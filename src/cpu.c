@@ -16,55 +16,85 @@
 
 // constants
 static struct cpu_type	cpu_type_6502	= {
-	keyword_is_6502_mnemo,
+	mnemo_6502_tables,
+	NULL,	// merged table is built by prepare_cpu_type()
 	CPUFLAG_WARN_ABOUT_FF_PTR | CPUFLAG_INDIRECTJMPBUGGY,	// warn about "XYZ ($ff),y" and "jmp ($XYff)"
-	234	// !align fills with "NOP"
+	234,	// !align fills with "NOP"
+	mnemo_6502_cycles,	// for listing and "!cycles"
+	mnemo_6502_peephole	// for "--peephole"
 };
 static struct cpu_type	cpu_type_nmos6502	= {
-	keyword_is_nmos6502_mnemo,
+	mnemo_nmos6502_tables,
+	NULL,
 	CPUFLAG_WARN_ABOUT_FF_PTR | CPUFLAG_INDIRECTJMPBUGGY | CPUFLAG_8B_AND_AB_NEED_0_ARG,	// ANE/LXA #$xx are unstable unless arg is $00
-	234	// !align fills with "NOP"
+	234,	// !align fills with "NOP"
+	mnemo_6502_cycles,
+	mnemo_6502_peephole
 };
 static struct cpu_type	cpu_type_c64dtv2	= {
-	keyword_is_c64dtv2_mnemo,
+	mnemo_c64dtv2_tables,
+	NULL,
 	CPUFLAG_WARN_ABOUT_FF_PTR | CPUFLAG_INDIRECTJMPBUGGY | CPUFLAG_8B_AND_AB_NEED_0_ARG,
-	234	// !align fills with "NOP"
+	234,	// !align fills with "NOP"
+	mnemo_6502_cycles,
+	mnemo_6502_peephole
 };
 static struct cpu_type	cpu_type_65c02	= {
-	keyword_is_65c02_mnemo,
+	mnemo_65c02_tables,
+	NULL,
 	CPUFLAG_WARN_ABOUT_FF_PTR,	// from WDC docs
-	234	// !align fills with "NOP"
+	234,	// !align fills with "NOP"
+	mnemo_65c02_cycles,
+	mnemo_6502_peephole
 };
 static struct cpu_type	cpu_type_r65c02	= {
-	keyword_is_r65c02_mnemo,
+	mnemo_r65c02_tables,
+	NULL,
 	CPUFLAG_WARN_ABOUT_FF_PTR,	// from WDC docs
-	234	// !align fills with "NOP"
+	234,	// !align fills with "NOP"
+	mnemo_65c02_cycles,
+	mnemo_6502_peephole
 };
 static struct cpu_type	cpu_type_w65c02	= {
-	keyword_is_w65c02_mnemo,
+	mnemo_w65c02_tables,
+	NULL,
 	CPUFLAG_WARN_ABOUT_FF_PTR,	// from WDC docs
-	234	// !align fills with "NOP"
+	234,	// !align fills with "NOP"
+	mnemo_65c02_cycles,
+	mnemo_6502_peephole
 };
 static struct cpu_type	cpu_type_65816	= {
-	keyword_is_65816_mnemo,
+	mnemo_65816_tables,
+	NULL,
 	// TODO - what about CPUFLAG_WARN_ABOUT_FF_PTR? only needed for old opcodes in emulation mode!
 	CPUFLAG_SUPPORTSLONGREGS,	// allows A and XY to be 16bits wide
-	234	// !align fills with "NOP"
+	234,	// !align fills with "NOP"
+	NULL,	// cycle counts are not known
+	mnemo_65816_peephole
 };
 static struct cpu_type	cpu_type_65ce02	= {
-	keyword_is_65ce02_mnemo,
-	CPUFLAG_DECIMALSUBTRACTBUGGY,	// SBC does not work reliably in decimal mode
-	234	// !align fills with "NOP"
+	mnemo_65ce02_tables,
+	NULL,
+	CPUFLAG_DECIMALSUBTRACTBUGGY | CPUFLAG_LONGBRANCHES,	// SBC does not work reliably in decimal mode
+	234,	// !align fills with "NOP"
+	NULL,	// cycle counts are not known
+	mnemo_65ce02_peephole
 };
 static struct cpu_type	cpu_type_4502	= {
-	keyword_is_4502_mnemo,
-	CPUFLAG_DECIMALSUBTRACTBUGGY,	// SBC does not work reliably in decimal mode
-	234	// !align fills with "NOP"
+	mnemo_4502_tables,
+	NULL,
+	CPUFLAG_DECIMALSUBTRACTBUGGY | CPUFLAG_LONGBRANCHES,	// SBC does not work reliably in decimal mode
+	234,	// !align fills with "NOP"
+	NULL,	// cycle counts are not known
+	mnemo_65ce02_peephole
 };
 static struct cpu_type	cpu_type_m65	= {
-	keyword_is_m65_mnemo,
-	CPUFLAG_WARN_ABOUT_FF_PTR,	// TODO - remove this? check datasheets/realhw!
-	234	// !align fills with "NOP"
+	mnemo_m65_tables,
+	NULL,
+	CPUFLAG_WARN_ABOUT_FF_PTR | CPUFLAG_LONGBRANCHES,	// TODO - remove this? check datasheets/realhw!
+	234,	// !align fills with "NOP"
+	NULL,	// cycle counts are not known
+	mnemo_65ce02_peephole
 };
 
 
@@ -90,6 +120,14 @@ static struct ronode	cputype_tree[]	= {
 };
 const char	cputype_names[]	= KNOWN_TYPES;	// string to show if cputype_find() returns NULL
 
+// build merged mnemonic table for cpu type, unless already done
+static struct cpu_type *prepare_cpu_type(struct cpu_type *cpu_type)
+{
+	if (cpu_type->mnemonics == NULL)
+		cpu_type->mnemonics = mnemo_merge_tables(cpu_type->mnemo_tables);
+	return cpu_type;
+}
+
 // lookup cpu type held in DynaBuf and return its struct pointer (or NULL on failure)
 const struct cpu_type *cputype_find(void)
 {
@@ -99,7 +137,7 @@ const struct cpu_type *cputype_find(void)
 	if (!Tree_easy_scan(cputype_tree, &node_body, GlobalDynaBuf))
 		return NULL;
 
-	return node_body;
+	return prepare_cpu_type(node_body);
 }
 
 
@@ -120,7 +158,7 @@ void vcpu_check_and_set_reg_length(boolean *var, boolean make_long)
 void cputype_passinit(const struct cpu_type *cpu_type)
 {
 	// handle cpu type (default is 6502)
-	CPU_state.type = cpu_type ? cpu_type : &cpu_type_6502;
+	CPU_state.type = cpu_type ? cpu_type : prepare_cpu_type(&cpu_type_6502);
 	CPU_state.a_is_long = FALSE;	// short accu
 	CPU_state.xy_are_long = FALSE;	// short index regs
 }
@@ -11,12 +11,15 @@
 
 
 // CPU type structure definition
+struct ronode;
+struct peephole_rule;
 struct cpu_type {
-	// This function is not allowed to change GlobalDynaBuf
-	// because that's where the mnemonic is stored!
-	boolean		(*keyword_is_mnemonic)(int);
+	struct ronode	*const *mnemo_tables;	// NULL-terminated list
+	struct ronode	*mnemonics;	// all of the above, merged into one table
 	bits		flags;	// see below for bit meanings
 	unsigned char	default_align_value;
+	const unsigned char	*cycles;	// cycle counts per opcode (NULL if unknown)
+	const struct peephole_rule	*peephole;	// rules for "--peephole" (NULL if none)
 };
 #define	CPUFLAG_INDIRECTJMPBUGGY	(1u << 0)	// warn if "jmp ($xxff)" is assembled
 #define CPUFLAG_SUPPORTSLONGREGS	(1u << 1)	// allow "!al" and "!rl" pseudo opcodes
@@ -24,6 +27,7 @@ struct cpu_type {
 #define CPUFLAG_ISBIGENDIAN		(1u << 3)	// for 16/24/32-bit values, output msb first
 #define CPUFLAG_DECIMALSUBTRACTBUGGY	(1u << 4)	// warn if "sed" is assembled
 #define CPUFLAG_WARN_ABOUT_FF_PTR	(1u << 5)	// warn if MNEMO($ff) is assembled
+#define CPUFLAG_LONGBRANCHES		(1u << 6)	// all branches have 16-bit versions (opcode | 3)
 
 // if cpu type and value match, set register length variable to value.
 // if cpu type and value don't match, complain instead.
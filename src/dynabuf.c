@@ -34,14 +34,9 @@ STRUCT_DYNABUF_REF(GlobalDynaBuf, GLOBALDYNABUF_INITIALSIZE);	// global dynamic
 // get new buffer of given size
 static void resize(struct dynabuf *db, size_t new_size)
 {
-	char	*new_buf;
-
 	//printf("Growing dynabuf to size %d.\n", new_size);
-	new_buf = realloc(db->buffer, new_size);
-	if (new_buf == NULL)
-		Throw_serious_error(exception_no_memory_left);
+	db->buffer = safe_realloc(db->buffer, db->reserved, new_size, MEMUSE_DYNABUFS);
 	db->reserved = new_size;
-	db->buffer = new_buf;
 }
 // get buffer mem and fill in struct
 static void initstruct(struct dynabuf *db, size_t initial_size)
@@ -51,6 +46,7 @@ static void initstruct(struct dynabuf *db, size_t initial_size)
 		initial_size = DYNABUF_MINIMUM_INITIALSIZE;
 	db->size = 0;
 	db->reserved = initial_size;
+	memuse_add(MEMUSE_DYNABUFS, initial_size);
 	db->buffer = malloc(initial_size);
 	if (db->buffer == NULL) {
 		// scream and die because there is not enough memory 
@@ -76,14 +72,38 @@ void dynabuf_enlarge(struct dynabuf *db)
 	resize(db, MAKE_LARGER_THAN(db->reserved));
 }
 
+// make sure buffer can take "size" more bytes, return pointer to end of
+// current contents
+// (buffer size is doubled as often as needed, but reallocated only once)
+char *DynaBuf_reserve(struct dynabuf *db, size_t size)
+{
+	size_t	new_size;
+
+	if (db->reserved - db->size < size) {
+		new_size = db->reserved;
+		do
+			new_size = MAKE_LARGER_THAN(new_size);
+		while (new_size - db->size < size);
+		resize(db, new_size);
+	}
+	return db->buffer + db->size;
+}
+
+// copy block of given size to buffer
+void DynaBuf_add_span(struct dynabuf *db, const char *data, size_t size)
+{
+	memcpy(DynaBuf_reserve(db, size), data, size);
+	db->size += size;
+}
+
 // Claim enough memory to hold a copy of the current buffer contents,
 // make that copy and return it.
-// The copy must be released by calling free().
-char *DynaBuf_get_copy(struct dynabuf *db)
+// The copy must be released by calling safe_free() (size is db->size).
+char *DynaBuf_get_copy(struct dynabuf *db, enum memuse use)
 {
 	char	*copy;
 
-	copy = safe_malloc(db->size);
+	copy = safe_malloc(db->size, use);
 	memcpy(copy, db->buffer, db->size);
 	return copy;
 }
@@ -97,20 +117,8 @@ void DynaBuf_append(struct dynabuf *db, char byte)
 // Append string to buffer (without terminator)
 void DynaBuf_add_string(struct dynabuf *db, const char *string)
 {
-	char	byte;
-
-	while ((byte = *string++))
-		DYNABUF_APPEND(db, byte);
+	DynaBuf_add_span(db, string, strlen(string));
 }
-/*
-// make sure DynaBuf is large enough to take "size" more bytes
-// return pointer to end of current contents
-static char *ensure_free_space(struct dynabuf *db, int size)
-{
-	while ((db->reserved - db->size) < size)
-		resize(db, MAKE_LARGER_THAN(db->reserved));
-	return db->buffer + db->size;
-}*/
 
 // Convert buffer contents to lower case (target and source may be identical)
 void DynaBuf_to_lower(struct dynabuf *target, struct dynabuf *source)
@@ -130,16 +138,7 @@ void DynaBuf_to_lower(struct dynabuf *target, struct dynabuf *source)
 	// convert to lower case
 	read = source->buffer;	// CAUTION - ptr may change when buf grows!
 	write = target->buffer;	// CAUTION - ptr may change when buf grows!
-	while ((byte = *read++)) {
-		// we want to keep underscore, so this check restricts:
-		if (byte <= 'Z')
-			byte |= 32;
-		*write++ = byte;
-	}
-	// Okay, so this method of converting to lowercase is lousy.
-	// But actually it doesn't matter, because only pre-defined
-	// keywords are converted, and all of those are plain
-	// old-fashioned 7-bit ASCII anyway. So I guess it'll do.
-	// FIXME - use BYTE_ macro from global.h
+	while ((byte = *read++))
+		*write++ = BYTE_TO_LOWER_CASE(byte);
 	*write = '\0';	// terminate
 }
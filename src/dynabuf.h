@@ -18,6 +18,8 @@ do {					\
 		dynabuf_enlarge(db);	\
 	db->buffer[(db->size)++] = byte;\
 } while (0)
+// use this one only after making sure there is enough space (DynaBuf_reserve)
+#define DYNABUF_APPEND_RESERVED(db, byte)	((db)->buffer[((db)->size)++] = (byte))
 // the next one is dangerous - the buffer location can change when a character
 // is appended. So after calling this, don't change the buffer as long as you
 // use the address.
@@ -50,7 +52,12 @@ extern void dynabuf_clear(struct dynabuf *db);
 // call whenever buffer is too small
 extern void dynabuf_enlarge(struct dynabuf *db);
 // return malloc'd copy of buffer contents
-extern char *DynaBuf_get_copy(struct dynabuf *db);
+extern char *DynaBuf_get_copy(struct dynabuf *db, enum memuse use);
+// make sure buffer can take "size" more bytes, return pointer to end of
+// current contents
+extern char *DynaBuf_reserve(struct dynabuf *db, size_t size);
+// copy block of given size to buffer
+extern void DynaBuf_add_span(struct dynabuf *db, const char *data, size_t size);
 // copy string to buffer (without terminator)
 extern void DynaBuf_add_string(struct dynabuf *db, const char *);
 // converts buffer contents to lower case
@@ -15,27 +15,36 @@
 #include "tree.h"
 
 
-// struct definition
+// struct definitions
+// each encoder is a 256-byte lookup table, so converting a character does not
+// need a function call.
 struct encoder {
-	unsigned char	(*fn)(unsigned char);
-	// maybe add table pointer?
+	const unsigned char	*table;
+};
+// tables loaded from files are kept for the whole run, so "!convtab" only has
+// to switch pointers. they are found by path, and tables with the same
+// contents share a single encoder.
+struct loaded_encoder {
+	struct encoder		encoder;	// must be first
+	unsigned char		table[256];
+	hash_t			hash;
+	struct loaded_encoder	*next;		// other loaded tables
 };
 
 
 // variables
-static unsigned char	outermost_table[256];	// space for encoding table...
 const struct encoder	*encoder_current;	// gets set before each pass
-unsigned char		*encoding_loaded_table	= outermost_table;	// ...loaded from file
+static unsigned char	raw_table[256];	// these get filled on first pass init
+static unsigned char	pet_table[256];
+static unsigned char	scr_table[256];
+static struct arena	loaded_arena;
+static STRUCT_RWTABLE_REF(path_table, &loaded_arena);	// node bodies point to struct loaded_encoder
+static struct loaded_encoder	*loaded_list	= NULL;
 
 
-// encoder functions:
+// conversion rules used to fill the tables:
 
 
-// convert raw to raw (do not convert at all)
-static unsigned char encoderfn_raw(unsigned char byte)
-{
-	return byte;
-}
 // convert raw to petscii
 static unsigned char encoderfn_pet(unsigned char byte)
 {
@@ -58,34 +67,25 @@ static unsigned char encoderfn_scr(unsigned char byte)
 		return 0;	// shift @ down
 	return byte;
 }
-// convert raw to whatever is defined in table
-static unsigned char encoderfn_file(unsigned char byte)
-{
-	return encoding_loaded_table[byte];
-}
 
 
 // predefined encoder structs:
 
 
 const struct encoder	encoder_raw	= {
-	encoderfn_raw
+	raw_table
 };
 const struct encoder	encoder_pet	= {
-	encoderfn_pet
+	pet_table
 };
 const struct encoder	encoder_scr	= {
-	encoderfn_scr
-};
-const struct encoder	encoder_file	= {
-	encoderfn_file
+	scr_table
 };
 
 
 // keywords for "!convtab" pseudo opcode
 static struct ronode	encoder_tree[]	= {
 	PREDEF_START,
-//no!	PREDEFNODE("file",	&encoder_file),	"!ct file" is not needed; just use {} after initial loading of table!
 	PREDEFNODE("pet",	&encoder_pet),
 	PREDEFNODE("raw",	&encoder_raw),
 	PREDEF_END("scr",	&encoder_scr),
@@ -99,20 +99,85 @@ static struct ronode	encoder_tree[]	= {
 // convert character using current encoding (exported for use by alu.c and pseudoopcodes.c)
 unsigned char encoding_encode_char(unsigned char byte)
 {
-	return encoder_current->fn(byte);
+	return encoder_current->table[byte];
+}
+
+// convert string using current encoding and XOR each result byte with given
+// value (target may be the same as source)
+void encoding_encode_string(char *target, const char *source, size_t length, unsigned char xor)
+{
+	const unsigned char	*table	= encoder_current->table;
+	unsigned char		folded[256];
+	int			ii;
+
+	// for long strings, fold XOR value into a copy of the table
+	if (xor && (length > sizeof(folded))) {
+		for (ii = 0; ii < 256; ++ii)
+			folded[ii] = table[ii] ^ xor;
+		table = folded;
+		xor = 0;
+	}
+	while (length--)
+		*target++ = table[(unsigned char) *source++] ^ xor;
 }
 
 // set "raw" as default encoding
 void encoding_passinit(void)
 {
+	static boolean	tables_filled	= FALSE;
+	int		ii;
+
+	if (!tables_filled) {
+		for (ii = 0; ii < 256; ++ii) {
+			raw_table[ii] = ii;
+			pet_table[ii] = encoderfn_pet(ii);
+			scr_table[ii] = encoderfn_scr(ii);
+		}
+		tables_filled = TRUE;
+	}
 	encoder_current = &encoder_raw;
 }
 
-// try to load encoding table from given file
-void encoding_load_from_file(unsigned char target[256], FILE *stream)
+// return encoder for table in given file (or NULL on failure, error has been
+// reported)
+const struct encoder *encoding_from_file(const struct cached_file *file)
 {
-	if (fread(target, sizeof(char), 256, stream) != 256)
+	struct rwname		name;
+	struct rwnode		*node;
+	struct loaded_encoder	*loaded;
+	hash_t			hash	= TREE_HASH_START;
+	int			ii;
+
+	Tree_make_name(&name, file->path, strlen(file->path) + 1);
+	Tree_hard_scan_name(&node, path_table, &name, 0, TRUE);
+	// (with "--watch", the file may have changed since it was looked up)
+	if (node->body
+	&& (file->size >= 256)
+	&& (memcmp(((const struct encoder *) node->body)->table, file->body, 256) == 0))
+		return node->body;
+
+	if (file->size < 256) {
 		Throw_error("Conversion table incomplete.");
+		return NULL;	// not cached, so error is shown every time
+	}
+	for (ii = 0; ii < 256; ++ii)
+		TREE_HASH_ADD(hash, file->body[ii]);
+	// re-use table with same contents if there is one
+	for (loaded = loaded_list; loaded; loaded = loaded->next) {
+		if ((loaded->hash == hash)
+		&& (memcmp(loaded->table, file->body, 256) == 0))
+			break;
+	}
+	if (loaded == NULL) {
+		loaded = arena_alloc(&loaded_arena, sizeof(*loaded), MEMUSE_OTHER);
+		memcpy(loaded->table, file->body, 256);
+		loaded->encoder.table = loaded->table;
+		loaded->hash = hash;
+		loaded->next = loaded_list;
+		loaded_list = loaded;
+	}
+	node->body = &loaded->encoder;
+	return node->body;
 }
 
 // lookup encoder held in DynaBuf and return its struct pointer (or NULL on failure)
@@ -7,7 +7,7 @@
 #define encoding_H
 
 
-#include <stdio.h>	// for FILE*
+#include <stdio.h>	// for size_t
 
 
 //struct encoder;
@@ -15,18 +15,21 @@ extern const struct encoder	*encoder_current;	// gets set before each pass	TODO
 extern const struct encoder	encoder_raw;
 extern const struct encoder	encoder_pet;
 extern const struct encoder	encoder_scr;
-extern const struct encoder	encoder_file;
-extern unsigned char		*encoding_loaded_table;	// ...loaded from file
 
 
 // prototypes
 
 // convert character using current encoding
 extern unsigned char encoding_encode_char(unsigned char byte);
+// convert string using current encoding and XOR each result byte with given
+// value (target may be the same as source)
+extern void encoding_encode_string(char *target, const char *source, size_t length, unsigned char xor);
 // set "raw" as default encoding
 extern void encoding_passinit(void);
-// try to load encoding table from given file
-extern void encoding_load_from_file(unsigned char target[256], FILE *stream);
+// return encoder for table in given file (or NULL on failure, error has been
+// reported)
+struct cached_file;
+extern const struct encoder *encoding_from_file(const struct cached_file *file);
 // lookup encoder held in DynaBuf and return its struct pointer (or NULL on failure)
 extern const struct encoder *encoding_find(void);
 
@@ -0,0 +1,245 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// fixups ("--fixups")
+//
+// Usually, forward references are resolved by doing further passes. Because
+// sizes are chosen using NUMBER_EVER_UNDEFINED, these passes produce the same
+// layout as the first one, and only the undefined values change. So in this
+// mode, the first pass records the expression, zone and output position of
+// each undefined value that is sent to the output buffer. If nothing else was
+// undefined, the expressions are then evaluated again and the results are
+// written over the placeholder bytes, instead of doing another pass.
+#include "fixup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alu.h"
+#include "dynabuf.h"
+#include "global.h"
+#include "input.h"
+#include "output.h"
+#include "section.h"
+
+
+// fixup data
+struct fixup {
+	struct rpn	*rpn;	// expression, in compiled form
+	void		(*fn)(intval_t);	// output function...
+	void		(*relative_fn)(intval_t, intval_t);	// ...or one for branches
+	intval_t	base;	// for branches
+	boolean		relocatable;
+	intval_t	idx;	// position in output buffer
+	char		xor;
+	scope_t		local_scope,	// for symbols in expression
+			cheap_scope;
+	const char	*filename;	// for error messages
+	int		line_number;
+	const char	*section_type;
+	int		section_title;	// offset in section_titles
+};
+
+
+// variables
+boolean			fixup_recording	= FALSE;
+static boolean		fixups_invalid;	// TRUE if something could not be recorded
+static struct fixup	*fixups		= NULL;
+static int		fixups_used	= 0;
+static int		fixups_size	= 0;
+// section titles may be freed when the section ends, so copies are kept here:
+static	STRUCT_DYNABUF_REF(section_titles, 256);
+static int		last_title;	// offset of latest one
+
+
+// forget all fixups
+static void forget_fixups(void)
+{
+	int	ii;
+
+	for (ii = 0; ii < fixups_used; ++ii)
+		ALU_free_compiled(fixups[ii].rpn);
+	fixups_used = 0;
+	DYNABUF_CLEAR(section_titles);
+	last_title = -1;
+}
+
+
+// start recording fixups, if wanted (call before first pass)
+void fixup_begin(void)
+{
+	forget_fixups();	// in case the last build was aborted
+	fixups_invalid = FALSE;
+	// the listing report shows the bytes as they are written, and the
+	// type checks are only done while parsing, so those need a real pass.
+	// dead-stripping needs further passes anyway.
+	fixup_recording = config.fixups && !report->active && !config.warn_on_type_mismatch && !config.dead_strip;
+}
+
+
+// add fixup for current output position and return it (NULL if impossible)
+static struct fixup *new_fixup(void)
+{
+	struct fixup	*fixup;
+	struct rpn	*rpn;
+
+	rpn = ALU_keep_last_compiled();
+	if (rpn == NULL) {
+		fixups_invalid = TRUE;
+		return NULL;
+	}
+
+	if (fixups_used == fixups_size) {
+		fixups = safe_realloc(fixups, fixups_size * sizeof(*fixups), (fixups_size ? 2 * fixups_size : 256) * sizeof(*fixups), MEMUSE_BLOCKS);
+		fixups_size = fixups_size ? 2 * fixups_size : 256;
+	}
+	fixup = &fixups[fixups_used++];
+	fixup->rpn = rpn;
+	fixup->fn = NULL;
+	fixup->relative_fn = NULL;
+	fixup->base = 0;
+	fixup->relocatable = FALSE;
+	fixup->idx = output_get_index();
+	fixup->xor = output_get_xor();
+	fixup->local_scope = section_now->local_scope;
+	fixup->cheap_scope = section_now->cheap_scope;
+	fixup->filename = Input_now->original_filename;
+	fixup->line_number = Input_now->line_number;
+	fixup->section_type = section_now->type;
+	// consecutive fixups usually are in the same section
+	if ((last_title < 0)
+	|| strcmp(section_titles->buffer + last_title, section_now->title)) {
+		last_title = section_titles->size;
+		DynaBuf_add_string(section_titles, section_now->title);
+		DynaBuf_append(section_titles, '\0');
+	}
+	fixup->section_title = last_title;
+	return fixup;
+}
+
+
+// the value of the expression that has just been parsed is undefined and
+// placeholder bytes are about to be sent to the output buffer using the given
+// function. "relocatable" is TRUE if this is an address for "o65" output.
+void fixup_add(void (*fn)(intval_t), boolean relocatable)
+{
+	struct fixup	*fixup;
+
+	if (!fixup_recording)
+		return;
+
+	fixup = new_fixup();
+	if (fixup) {
+		fixup->fn = fn;
+		fixup->relocatable = relocatable;
+	}
+}
+
+
+// same for branch offset, the function gets target and base address
+void fixup_add_relative(void (*fn)(intval_t target, intval_t base), intval_t base)
+{
+	struct fixup	*fixup;
+
+	if (!fixup_recording)
+		return;
+
+	fixup = new_fixup();
+	if (fixup) {
+		fixup->relative_fn = fn;
+		fixup->base = base;
+	}
+}
+
+
+// something happened in the first pass that fixups cannot repair
+void fixup_invalidate(void)
+{
+	fixups_invalid = TRUE;
+}
+
+
+// make error messages and symbol lookups work as if parsing the fixup's line
+static struct input	patch_input;
+static struct section	patch_section;
+static void enter_context(const struct fixup *fixup)
+{
+	patch_input.original_filename = fixup->filename;
+	patch_input.line_number = fixup->line_number;
+	patch_section.local_scope = fixup->local_scope;
+	patch_section.cheap_scope = fixup->cheap_scope;
+	patch_section.type = fixup->section_type;
+	patch_section.title = section_titles->buffer + fixup->section_title;
+}
+
+
+// stop recording (call after first pass). if all undefined results of the
+// first pass were fixups and all of them can be resolved now, patch output
+// buffer and return TRUE. otherwise, further passes are needed.
+boolean fixup_end(void)
+{
+	struct input	*outer_input	= Input_now;
+	struct section	*outer_section	= section_now;
+	struct object	*values;
+	struct fixup	*fixup;
+	intval_t	value;
+	int		ii;
+	boolean		resolved	= TRUE;
+
+	if (!fixup_recording)
+		return FALSE;
+
+	fixup_recording = FALSE;
+	// any other undefined result might have changed the layout
+	if (fixups_invalid
+	|| pass.relaxed_count
+	|| (fixups_used == 0)
+	|| (pass.undefined_count != fixups_used)
+	|| (pass.needvalue_count != fixups_used)) {
+		forget_fixups();
+		return FALSE;
+	}
+
+	// evaluate all expressions before changing anything, so in case one of
+	// them is still undefined, everything can be left to further passes.
+	values = safe_malloc(fixups_used * sizeof(*values), MEMUSE_OTHER);
+	patch_input = *Input_now;
+	patch_section = *section_now;
+	Input_now = &patch_input;
+	section_now = &patch_section;
+	for (ii = 0; resolved && (ii < fixups_used); ++ii) {
+		fixup = &fixups[ii];
+		enter_context(fixup);
+		ALU_compiled_any_result(fixup->rpn, &values[ii]);
+		resolved = (values[ii].type == &type_number)
+			&& ((values[ii].u.number.ntype == NUMTYPE_INT) || (values[ii].u.number.ntype == NUMTYPE_FLOAT));
+	}
+	if (resolved) {
+		for (ii = 0; ii < fixups_used; ++ii) {
+			fixup = &fixups[ii];
+			enter_context(fixup);
+			if (values[ii].u.number.ntype == NUMTYPE_INT)
+				value = values[ii].u.number.val.intval;
+			else
+				value = values[ii].u.number.val.fpval;
+			output_begin_patch(fixup->idx, fixup->xor);
+			if (fixup->relocatable && (values[ii].u.number.addr_refs == 1))
+				output_relocation();
+			if (fixup->relative_fn)
+				fixup->relative_fn(value, fixup->base);
+			else
+				fixup->fn(value);
+			output_end_patch();
+		}
+		if (config.show_stats)
+			printf("Fixups: %d values patched.\n", fixups_used);
+		// now none of them is undefined anymore
+		pass.undefined_count = 0;
+		pass.needvalue_count = 0;
+	}
+	Input_now = outer_input;
+	section_now = outer_section;
+	safe_free(values, fixups_used * sizeof(*values), MEMUSE_OTHER);
+	forget_fixups();
+	return resolved;
+}
@@ -0,0 +1,35 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// fixups ("--fixups")
+#ifndef fixup_H
+#define fixup_H
+
+
+#include "config.h"
+
+
+// variables
+extern boolean	fixup_recording;	// TRUE during first pass if fixups are wanted
+
+
+// prototypes
+
+// start recording fixups, if wanted (call before first pass)
+extern void fixup_begin(void);
+// the value of the expression that has just been parsed is undefined and
+// placeholder bytes are about to be sent to the output buffer using the given
+// function. "relocatable" is TRUE if this is an address for "o65" output.
+extern void fixup_add(void (*fn)(intval_t), boolean relocatable);
+// same for branch offset, the function gets target and base address
+extern void fixup_add_relative(void (*fn)(intval_t target, intval_t base), intval_t base);
+// something happened in the first pass that fixups cannot repair
+extern void fixup_invalidate(void);
+// stop recording (call after first pass). if all undefined results of the
+// first pass were fixups and all of them can be resolved now, patch output
+// buffer and return TRUE. otherwise, further passes are needed.
+extern boolean fixup_end(void);
+
+
+#endif
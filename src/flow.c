@@ -12,16 +12,35 @@
 //
 // 24 Nov 2007	Added "!ifndef"
 #include "flow.h"
+#include <stdlib.h>
 #include <string.h>
 #include "acme.h"
 #include "alu.h"
 #include "config.h"
 #include "dynabuf.h"
+#include "encoding.h"
+#include "fixup.h"
 #include "global.h"
 #include "input.h"
 #include "mnemo.h"
+#include "output.h"
+#include "passtrace.h"
+#include "platform.h"
+#include "profile.h"
+#include "section.h"
+#include "snapshot.h"
+#include "strip.h"
 #include "symbol.h"
 #include "tree.h"
+#include "typesystem.h"
+
+
+// number of most recent pass in which "!ifdef" and "!ifndef" saw an
+// undefined symbol (in the next pass, that symbol might be defined, so
+// control flow might change)
+static int	ifdef_undefined_pass	= -1;
+struct data_trace	*flow_trace	= NULL;
+boolean			flow_in_worker	= FALSE;
 
 
 // helper functions for if/ifdef/ifndef/else/for/do/while
@@ -31,7 +50,6 @@
 boolean check_ifdef_condition(void)
 {
 	scope_t		scope;
-	struct rwnode	*node;
 	struct symbol	*symbol;
 
 	// read symbol name
@@ -39,15 +57,32 @@ boolean check_ifdef_condition(void)
 		return FALSE;	// there was an error, it has been reported, so return value is more or less meaningless anway
 
 	// look for it
-	Tree_hard_scan(&node, symbols_forest, scope, FALSE);
-	if (!node)
-		return FALSE;	// not found -> no, not defined
-
-	symbol = (struct symbol *) node->body;
-	symbol->has_been_read = TRUE;	// we did not really read the symbol's value, but checking for its existence still counts as "used it"
-	if (symbol->object.type == NULL)
-		Bug_found("ObjectHasNullType", 0);
-	return symbol->object.type->is_defined(&symbol->object);
+	symbol = symbol_lookup(scope);
+	if (snapshot_recording)
+		snapshot_note_symbol(GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size, scope, symbol);
+	if (symbol) {
+		symbol->has_been_read = TRUE;	// we did not really read the symbol's value, but checking for its existence still counts as "used it"
+		if (symbol->object.type == NULL)
+			Bug_found("ObjectHasNullType", 0);
+		// (symbols of blocks removed by "--dead-strip" do not count)
+		if (symbol->object.type->is_defined(&symbol->object)
+		&& !strip_is_removed(symbol->strip_block))
+			return TRUE;
+	}
+	// not found or not defined
+	if (snapshot_recording)
+		snapshot_note_undefined_ifdef();
+	ifdef_undefined_pass = pass.number;
+	++pass.volatile_count;
+	return FALSE;
+}
+
+
+// a library snapshot has been applied, and parsing the library had "!ifdef"
+// see an undefined symbol
+void flow_undefined_ifdef(void)
+{
+	ifdef_undefined_pass = pass.number;
 }
 
 
@@ -63,10 +98,229 @@ static void parse_ram_block(struct block *block)
 }
 
 
+// add value of data directive to loop body trace (only call if tracing)
+#define TRACE_INITIALSIZE	16
+void flow_trace_item(void (*fn)(intval_t), const struct rpn *rpn)
+{
+	struct data_item	*item;
+
+	if (rpn == NULL) {
+		flow_trace->broken = TRUE;
+		return;
+	}
+	if (flow_trace->used >= flow_trace->size) {
+		flow_trace->items = safe_realloc(flow_trace->items, flow_trace->size * sizeof(*(flow_trace->items)),
+			(flow_trace->size ? (flow_trace->size * 2) : TRACE_INITIALSIZE) * sizeof(*(flow_trace->items)), MEMUSE_BLOCKS);
+		flow_trace->size = flow_trace->size ? (flow_trace->size * 2) : TRACE_INITIALSIZE;
+	}
+	item = &flow_trace->items[flow_trace->used++];
+	item->fn = fn;
+	item->rpn = rpn;
+	item->line_number = Input_now->line_number;
+	item->ends_statement = FALSE;
+}
+
+
+// mark end of data directive in loop body trace (only call if tracing)
+void flow_trace_end_statement(void)
+{
+	++(flow_trace->data_statements);
+	if (flow_trace->used)
+		flow_trace->items[flow_trace->used - 1].ends_statement = TRUE;
+}
+
+
+// run loop body from trace instead of parsing it. if values are given (one
+// per item, see run_in_workers()), they are used instead of evaluating the
+// expressions.
+static void run_trace(const struct data_trace *trace, const struct number *values)
+{
+	const struct data_item	*item	= trace->items;
+	struct iter_context	iter;
+	struct object		object;
+	boolean			starts_statement	= TRUE;
+	int			ii;
+
+	iter.accept_long_strings = FALSE;
+	iter.stringxor = 0;
+	for (ii = trace->used; ii; --ii) {
+		Input_now->line_number = item->line_number;	// for error messages
+		if (starts_statement) {
+			typesystem_force_address_statement(FALSE);
+			if (profile_active)
+				profile_begin_statement();
+		}
+		iter.fn = item->fn;
+		if (values) {
+			object.type = &type_number;
+			object.u.number = *(values++);
+		} else {
+			ALU_compiled_any_result(item->rpn, &object);
+		}
+		if ((object.type == &type_number) && (object.u.number.ntype == NUMTYPE_UNDEFINED))
+			fixup_add(item->fn, item->fn == output_le16);
+		output_object(&object, &iter);
+		starts_statement = item->ends_statement;
+		if (starts_statement) {
+			if (profile_active)
+				profile_end_statement(CPU_state.add_to_pc);
+			if (config.trace_passes)
+				passtrace_statement(CPU_state.add_to_pc);
+			vcpu_end_statement();	// adjust program counter
+		}
+		++item;
+	}
+}
+
+
+// parse first iteration of loop body while tracing it. returns TRUE if all
+// statements were data directives and the trace can be used instead of
+// parsing the body again.
+static boolean parse_and_trace(struct block *block, struct data_trace *trace)
+{
+	struct data_trace	*outer_trace	= flow_trace;
+	int			outer_throw_count	= Throw_get_counter();
+
+	trace->used = 0;
+	trace->statements = 0;
+	trace->data_statements = 0;
+	trace->broken = FALSE;
+	flow_trace = trace;
+	parse_ram_block(block);
+	flow_trace = outer_trace;
+	// do not use trace if there were errors or warnings, because they
+	// would not be shown again
+	return (!trace->broken)
+		&& trace->data_statements
+		&& (trace->statements == trace->data_statements)
+		&& (Throw_get_counter() == outer_throw_count);
+}
+
+
+// evaluating data loops in worker processes ("--jobs"):
+// once a loop body has been traced, the remaining iterations only evaluate the
+// traced expressions and output the results. if none of them reads the
+// program counter, the results only depend on the loop counter (the body
+// cannot define symbols, or it would not have been traced), so the remaining
+// iterations are split among worker processes. each one gets its own copy of
+// everything, evaluates its share of the iterations into a private buffer and
+// sends the resulting numbers back. the calling process then outputs them in
+// order, just like run_trace() would have done. a worker stops when it gets a
+// result that is not a plain number, or when a message would be thrown, so
+// the calling process does the rest of its iterations the normal way.
+#define WORKER_MIN_ITERATIONS	256	// fewer are not worth a process
+#define MAX_JOBS		64	// more are silently reduced to this
+#ifdef PLATFORM_START_WORKER
+static FILE		*worker_stream;	// for sending results
+static struct number	*worker_values;	// results of one worker
+static int		worker_done;	// number of complete iterations
+static int		worker_items;	// results per iteration
+#endif
+
+// send results and end worker process (see above)
+void flow_abandon_worker(void)
+{
+#ifdef PLATFORM_START_WORKER
+	fwrite(worker_values, worker_items * sizeof(*worker_values), worker_done, worker_stream);
+	fclose(worker_stream);
+	PLATFORM_END_WORKER();
+#endif
+}
+
+#ifdef PLATFORM_START_WORKER
+// worker process: evaluate traced expressions for given number of iterations
+static void run_worker(struct for_loop *loop, const struct data_trace *trace, struct object loop_var, int iterations)
+{
+	struct object	object;
+	int		ii;
+
+	flow_in_worker = TRUE;
+	worker_values = safe_malloc(iterations * trace->used * sizeof(*worker_values), MEMUSE_OTHER);
+	worker_items = trace->used;
+	for (worker_done = 0; worker_done < iterations; ++worker_done) {
+		loop->symbol->object = loop_var;
+		for (ii = 0; ii < trace->used; ++ii) {
+			ALU_compiled_any_result(trace->items[ii].rpn, &object);
+			if ((object.type != &type_number)
+			|| ((object.u.number.ntype != NUMTYPE_INT) && (object.u.number.ntype != NUMTYPE_FLOAT)))
+				flow_abandon_worker();
+			worker_values[worker_done * trace->used + ii] = object.u.number;
+		}
+		loop_var.u.number.val.intval += loop->u.counter.increment;
+	}
+	flow_abandon_worker();	// (not really abandoned, all done)
+}
+
+// if useful, do remaining iterations of counting loop using worker processes
+static void run_in_workers(struct for_loop *loop, const struct data_trace *trace, struct object *loop_var)
+{
+	FILE		*streams[MAX_JOBS];
+	long		ids[MAX_JOBS];
+	int		shares[MAX_JOBS];
+	struct number	*values;
+	struct object	worker_var;
+	long		workers	= config.jobs;
+	int		ii,
+			left;
+
+	if (workers > MAX_JOBS)
+		workers = MAX_JOBS;
+	if (workers > loop->iterations_left / WORKER_MIN_ITERATIONS)
+		workers = loop->iterations_left / WORKER_MIN_ITERATIONS;
+	if ((workers < 2) || snapshot_recording)
+		return;
+
+	for (ii = 0; ii < trace->used; ++ii) {
+		if (ALU_compiled_reads_pc(trace->items[ii].rpn))
+			return;
+	}
+	// start workers, each with its share of the iterations
+	worker_var = *loop_var;
+	left = loop->iterations_left;
+	for (ii = 0; ii < workers; ++ii) {
+		shares[ii] = left / (workers - ii);
+		left -= shares[ii];
+		streams[ii] = PLATFORM_START_WORKER(&ids[ii]);
+		if (streams[ii] && (ids[ii] == 0)) {
+			worker_stream = streams[ii];
+			run_worker(loop, trace, worker_var, shares[ii]);
+		}
+		worker_var.u.number.val.intval += shares[ii] * loop->u.counter.increment;
+	}
+	// output their results in order. whatever a worker did not do is done
+	// here.
+	values = safe_malloc(trace->used * sizeof(*values), MEMUSE_OTHER);
+	for (ii = 0; ii < workers; ++ii) {
+		for (; shares[ii]; --shares[ii]) {
+			loop->symbol->object = *loop_var;	// overwrite whole struct, in case some joker has re-assigned loop counter var
+			if (streams[ii]
+			&& (fread(values, sizeof(*values), trace->used, streams[ii]) == trace->used)) {
+				run_trace(trace, values);
+			} else {
+				run_trace(trace, NULL);
+			}
+			loop_var->u.number.val.intval += loop->u.counter.increment;
+			loop->iterations_left--;
+			++stats.loop_iterations;
+		}
+		if (streams[ii]) {
+			fclose(streams[ii]);
+			PLATFORM_WAIT_WORKER(ids[ii]);
+		}
+	}
+	safe_free(values, trace->used * sizeof(*values), MEMUSE_OTHER);
+}
+#endif
+
+
 // function for "!for" with counter variable
 static void counting_for(struct for_loop *loop)
 {
-	struct object	loop_var;
+	struct object		loop_var;
+	struct data_trace	trace;
+	boolean			traced		= FALSE,
+				use_trace	= FALSE,
+				workers_tried	= FALSE;
 
 	// init counter
 	loop_var.type = &type_number;
@@ -90,12 +344,29 @@ static void counting_for(struct for_loop *loop)
 	loop_var = loop->symbol->object;	// update local copy with force bit
 	loop->symbol->has_been_read = TRUE;	// lock force bit
 	loop_var.u.number.val.intval = loop->u.counter.first;	// SEE ABOVE - this may be nonzero, but has not yet been copied to user symbol!
+	trace.items = NULL;
+	trace.size = 0;
 	while (loop->iterations_left) {
 		loop->symbol->object = loop_var;	// overwrite whole struct, in case some joker has re-assigned loop counter var
-		parse_ram_block(&loop->block);
+		if (use_trace)
+			run_trace(&trace, NULL);
+		else if ((!traced) && (loop->iterations_left > 1)) {
+			traced = TRUE;
+			use_trace = parse_and_trace(&loop->block, &trace);
+		} else
+			parse_ram_block(&loop->block);
 		loop_var.u.number.val.intval += loop->u.counter.increment;
 		loop->iterations_left--;
+		++stats.loop_iterations;
+#ifdef PLATFORM_START_WORKER
+		// right after tracing, maybe let workers do the rest
+		if (use_trace && !workers_tried) {
+			workers_tried = TRUE;
+			run_in_workers(loop, &trace, &loop_var);
+		}
+#endif
 	}
+	safe_free(trace.items, trace.size * sizeof(*(trace.items)), MEMUSE_BLOCKS);
 	// new algo wants illegal value in loop counter after block:
 	if (loop->algorithm == FORALGO_NEWCOUNT)
 		loop->symbol->object = loop_var;	// overwrite whole struct, in case some joker has re-assigned loop counter var
@@ -112,6 +383,7 @@ static void iterating_for(struct for_loop *loop)
 		symbol_set_object(loop->symbol, &obj, POWER_CHANGE_VALUE | POWER_CHANGE_OBJTYPE);
 		parse_ram_block(&loop->block);
 		loop->iterations_left--;
+		++stats.loop_iterations;
 	}
 }
 
@@ -119,13 +391,16 @@ static void iterating_for(struct for_loop *loop)
 // back end function for "!for" pseudo opcode
 void flow_forloop(struct for_loop *loop)
 {
-	struct input	loop_input,
-			*outer_input;
+	struct input		loop_input,
+				*outer_input;
+	struct parsed_block	parsed;
 
 	// switching input makes us lose GotByte. But we know it's '}' anyway!
 	// set up new input
 	loop_input = *Input_now;	// copy current input structure into new
 	loop_input.source = INPUTSRC_RAM;	// set new byte source
+	PARSED_BLOCK_INIT(&parsed);
+	loop_input.parsed = &parsed;	// body only lives as long as the loop
 	// remember old input
 	outer_input = Input_now;
 	// activate new input
@@ -144,6 +419,7 @@ void flow_forloop(struct for_loop *loop)
 	default:
 		Bug_found("IllegalLoopAlgo", loop->algorithm);
 	}
+	Input_free_parsed_block(&parsed);
 	// restore previous input:
 	Input_now = outer_input;
 }
@@ -169,7 +445,8 @@ static void copy_condition(struct condition *condition, char terminator)
 		GetByte();
 	}
 	DynaBuf_append(GlobalDynaBuf, CHAR_EOS);	// ensure terminator
-	condition->body = DynaBuf_get_copy(GlobalDynaBuf);
+	condition->body = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_BLOCKS);
+	condition->size = GlobalDynaBuf->size;
 }
 
 // try to read a condition into DynaBuf and store pointer to copy in
@@ -183,6 +460,7 @@ void flow_store_doloop_condition(struct condition *condition, char terminator)
 	// set defaults
 	condition->invert = FALSE;
 	condition->body = NULL;
+	condition->size = 0;
 	// check for empty condition
 	if (GotByte == terminator)
 		return;
@@ -237,12 +515,15 @@ static boolean check_condition(struct condition *condition)
 // back end function for "!do" and "!while" pseudo opcodes
 void flow_do_while(struct do_while *loop)
 {
-	struct input	loop_input;
-	struct input	*outer_input;
+	struct input		loop_input;
+	struct input		*outer_input;
+	struct parsed_block	parsed;
 
 	// set up new input
 	loop_input = *Input_now;	// copy current input structure into new
 	loop_input.source = INPUTSRC_RAM;	// set new byte source
+	PARSED_BLOCK_INIT(&parsed);
+	loop_input.parsed = &parsed;	// body only lives as long as the loop
 	// remember old input
 	outer_input = Input_now;
 	// activate new input (not useable yet, as pointer and
@@ -253,10 +534,12 @@ void flow_do_while(struct do_while *loop)
 		if (!check_condition(&loop->head_cond))
 			break;
 		parse_ram_block(&loop->block);
+		++stats.loop_iterations;
 		// check tail condition
 		if (!check_condition(&loop->tail_cond))
 			break;
 	}
+	Input_free_parsed_block(&parsed);
 	// restore previous input:
 	Input_now = outer_input;
 	GotByte = CHAR_EOS;	// CAUTION! Very ugly kluge.
@@ -267,18 +550,213 @@ void flow_do_while(struct do_while *loop)
 }
 
 
+// replaying files:
+// once a pass has parsed a file without any undefined results, messages or
+// order-dependent side effects (see pass.volatile_count), the next pass would
+// just do the same thing again. so the state at the end of the file and the
+// bytes it generated are remembered, and the next pass puts them back instead
+// of parsing the file again. files are identified by the order in which they
+// are parsed during the pass.
+struct replay {
+	struct cached_file	*file;
+	int			pass;	// pass in which entry was last valid
+	int			nested;	// number of files parsed from this one
+	boolean			clean;	// TRUE if file can be replayed
+	struct output_state	out_entry,
+				out_exit;
+	struct section_state	section_entry,
+				section_exit;
+	const struct encoder	*encoder;
+	char			*bytes;	// generated output
+	size_t			bytes_size;	// allocated size of bytes
+};
+static struct replay	*replays	= NULL;
+static int		replays_size	= 0;	// number of allocated entries
+static int		replays_used	= 0;	// number of valid entries
+static int		replay_index;	// index of next file in this pass
+static int		replay_pass	= -1;	// pass replay_index belongs to
+
+
+// return index of next file in this pass
+static int next_replay_index(void)
+{
+	if (replay_pass != pass.number) {
+		replay_pass = pass.number;
+		replay_index = 0;
+	}
+	return replay_index++;
+}
+
+
+// make sure entry exists and return it
+static struct replay *get_replay(int index)
+{
+	if (index >= replays_size) {
+		replays = safe_realloc(replays, replays_size * sizeof(*replays), (replays_size ? 2 * replays_size : 16) * sizeof(*replays), MEMUSE_BLOCKS);
+		replays_size = replays_size ? 2 * replays_size : 16;
+	}
+	if (index >= replays_used) {
+		replays[index].bytes = NULL;
+		replays[index].bytes_size = 0;
+		replays_used = index + 1;
+	}
+	return &replays[index];
+}
+
+
+// check whether file can be replayed, and if so, do it
+static boolean replay_file(int index, struct cached_file *file)
+{
+	struct replay		*replay;
+	struct output_state	out_now;
+	struct section_state	section_now_state;
+	int			ii;
+
+	// listing output needs the real thing, and if the previous pass saw
+	// undefined symbols in "!ifdef", control flow may now differ.
+	// when relaxing branches or removing instructions, symbols may change
+	// their values, so the output of a file may differ even though nothing
+	// was undefined (and the peephole optimizer must see all instructions).
+	if (report->active
+	|| LAYOUT_MAY_CHANGE
+	|| (ifdef_undefined_pass == pass.number - 1)
+	|| (index >= replays_used))
+		return FALSE;
+
+	replay = &replays[index];
+	if ((replay->file != file)
+	|| (replay->pass != pass.number - 1)
+	|| (!replay->clean)
+	|| (replay->encoder != encoder_current))
+		return FALSE;
+
+	// entry state must be the same as in previous pass
+	output_get_state(&out_now);
+	if (!output_state_equal(&out_now, &replay->out_entry))
+		return FALSE;
+
+	section_get_state(&section_now_state);
+	if ((section_now_state.section.local_scope != replay->section_entry.section.local_scope)
+	|| (section_now_state.section.cheap_scope != replay->section_entry.section.cheap_scope)
+	|| (section_now_state.section.type != replay->section_entry.section.type)
+	|| (section_now_state.section.title != replay->section_entry.section.title)
+	|| (section_now_state.local_scope_max != replay->section_entry.local_scope_max)
+	|| (section_now_state.cheap_scope_max != replay->section_entry.cheap_scope_max))
+		return FALSE;
+
+	// be verbose
+	if (config.process_verbosity > 2)
+		printf("Replaying source file '%s'\n", file->name);
+	output_restore(replay->bytes, &replay->out_entry, &replay->out_exit);
+	output_set_state(&replay->out_exit);
+	section_set_state(&replay->section_exit);
+	// files parsed from this one have been replayed as well
+	for (ii = 0; ii <= replay->nested; ++ii)
+		replays[index + ii].pass = pass.number;
+	replay_index += replay->nested;
+	return TRUE;
+}
+
+
+// return number of files parsed (or skipped) in this pass so far
+int flow_file_count(void)
+{
+	return (replay_pass == pass.number) ? replay_index : 0;
+}
+
+
+// a library snapshot was applied instead of parsing the given number of
+// files, so skip their entries (they cannot be replayed in the next pass)
+void flow_skip_files(int count)
+{
+	struct replay	*replay;
+
+	while (count-- > 0) {
+		replay = get_replay(next_replay_index());
+		replay->file = NULL;
+		replay->pass = pass.number;
+		replay->nested = 0;
+		replay->clean = FALSE;
+	}
+}
+
+
+// forget which files can be replayed (for "--batch")
+void flow_clear_replays(void)
+{
+	int	ii;
+
+	for (ii = 0; ii < replays_used; ++ii)
+		safe_free(replays[ii].bytes, replays[ii].bytes_size, MEMUSE_BLOCKS);
+	replays_used = 0;
+	replay_pass = -1;
+	ifdef_undefined_pass = -1;
+}
+
+
 // parse a whole source code file
-void flow_parse_and_close_file(FILE *fd, const char *filename)
+void flow_parse_file(struct cached_file *file)
 {
+	struct replay	*replay;
+	int		index,
+			outer_throws,
+			outer_undefined,
+			outer_needvalue,
+			outer_volatile;
+	intval_t	size;
+
+	// find out which entry of replay table to use
+	index = next_replay_index();
+	if (replay_file(index, file))
+		return;
+
+	// remember entry state
+	replay = get_replay(index);
+	replay->file = file;
+	replay->pass = pass.number;
+	replay->clean = FALSE;
+	replay->encoder = encoder_current;
+	output_get_state(&replay->out_entry);
+	section_get_state(&replay->section_entry);
+	outer_throws = Throw_get_counter();
+	outer_undefined = pass.undefined_count;
+	outer_needvalue = pass.needvalue_count;
+	outer_volatile = pass.volatile_count;
+
 	// be verbose
 	if (config.process_verbosity > 2)
-		printf("Parsing source file '%s'\n", filename);
+		printf("Parsing source file '%s'\n", file->name);
 	// set up new input
-	Input_new_file(filename, fd);
+	if (Input_open_file(file))
+		return;	// error has been reported
 	// Parse block and check end reason
 	Parse_until_eob_or_eof();
 	if (GotByte != CHAR_EOF)
 		Throw_error("Found '}' instead of end-of-file.");
 	// close sublevel src
-	fclose(Input_now->src.fd);
+	Input_close_file();
+
+	// nested files may have moved the table, and they have used entries
+	replay = &replays[index];
+	replay->nested = replay_index - index - 1;
+	output_get_state(&replay->out_exit);
+	section_get_state(&replay->section_exit);
+	size = replay->out_exit.write_idx - replay->out_entry.write_idx;
+	if ((outer_throws != Throw_get_counter())
+	|| (outer_undefined != pass.undefined_count)
+	|| (outer_needvalue != pass.needvalue_count)
+	|| (outer_volatile != pass.volatile_count)
+	|| (size < 0)
+	|| (!replay->out_entry.enabled)
+	|| (replay->out_entry.segment_start != replay->out_exit.segment_start)
+	|| (replay->out_entry.pseudopc != replay->out_exit.pseudopc)
+	|| (replay->section_entry.section.type != replay->section_exit.section.type)
+	|| (replay->section_entry.section.title != replay->section_exit.section.title)
+	|| (replay->encoder != encoder_current))
+		return;	// file must be parsed again in next pass
+
+	// remember generated output
+	safe_free(replay->bytes, replay->bytes_size, MEMUSE_BLOCKS);
+	replay->bytes = output_backup(&replay->out_entry, &replay->out_exit, &replay->bytes_size);
+	replay->clean = TRUE;
 }
@@ -13,7 +13,9 @@
 
 struct block {
 	int	start;	// line number of start of block
-	char	*body;
+	char	*body,
+		*copy;	// malloc'd copy of body to free afterwards (or NULL)
+	size_t	copy_size;	// allocated size of copy
 };
 
 // struct to pass "!for" loop stuff from pseudoopcodes.c to flow.c
@@ -40,11 +42,31 @@ struct for_loop {
 	struct block	block;
 };
 
+// "!for" loops with bodies that only hold data directives (like "!byte") are
+// traced during their first iteration. the remaining iterations then just run
+// the recorded compiled expressions instead of parsing the body again.
+struct rpn;
+struct data_item {
+	void			(*fn)(intval_t);	// output function
+	const struct rpn	*rpn;	// compiled expression
+	int			line_number;
+	boolean			ends_statement;
+};
+struct data_trace {
+	struct data_item	*items;
+	int			used,
+				size,
+				statements,	// number of statements parsed...
+				data_statements;	// ...and how many of them were traced
+	boolean			broken;	// TRUE if an expression was not compiled
+};
+
 // structs to pass "!do"/"!while" stuff from pseudoopcodes.c to flow.c
 struct condition {
 	int	line;	// original line number
 	boolean	invert;	// only set for UNTIL conditions
 	char	*body;	// pointer to actual expression
+	size_t	size;	// allocated size of body
 };
 struct do_while {
 	struct condition	head_cond;
@@ -53,8 +75,21 @@ struct do_while {
 };
 
 
+// variables
+extern struct data_trace	*flow_trace;	// NULL when not tracing a loop body
+extern boolean			flow_in_worker;	// TRUE in worker process (see "--jobs")
+
+
 // parse symbol name and return if symbol has defined value (called by ifdef/ifndef)
 extern boolean check_ifdef_condition(void);
+// add value of data directive to loop body trace (only call if tracing)
+extern void flow_trace_item(void (*fn)(intval_t), const struct rpn *rpn);
+// mark end of data directive in loop body trace (only call if tracing)
+extern void flow_trace_end_statement(void);
+// called in worker process instead of throwing a message: send results of the
+// iterations done so far and end the process, so the calling process does the
+// rest (and throws the message)
+extern void flow_abandon_worker(void);
 // back end function for "!for" pseudo opcode
 extern void flow_forloop(struct for_loop *loop);
 // try to read a condition into DynaBuf and store pointer to copy in
@@ -69,7 +104,18 @@ extern void flow_store_while_condition(struct condition *condition);
 // back end function for "!do" pseudo opcode
 extern void flow_do_while(struct do_while *loop);
 // parse a whole source code file
-extern void flow_parse_and_close_file(FILE *fd, const char *filename);
+struct cached_file;
+extern void flow_parse_file(struct cached_file *file);
+// return number of files parsed (or skipped) in this pass so far
+extern int flow_file_count(void);
+// a library snapshot was applied instead of parsing the given number of
+// files, so skip their entries (they cannot be replayed in the next pass)
+extern void flow_skip_files(int count);
+// a library snapshot has been applied, and parsing the library had "!ifdef"
+// see an undefined symbol
+extern void flow_undefined_ifdef(void);
+// forget which files can be replayed (for "--batch")
+extern void flow_clear_replays(void);
 
 
 #endif
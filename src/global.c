@@ -18,9 +18,13 @@
 #include "cpu.h"
 #include "dynabuf.h"
 #include "encoding.h"
+#include "flow.h"
 #include "input.h"
 #include "macro.h"
+#include "mnemo.h"
 #include "output.h"
+#include "passtrace.h"
+#include "profile.h"
 #include "pseudoopcodes.h"
 #include "section.h"
 #include "symbol.h"
@@ -98,11 +102,52 @@ const char	global_byte_flags[256]	= {
 };
 
 
+// value of each byte when used as a hexadecimal digit (so literal parsers do
+// not need cascaded comparisons), 16 means "not a hex digit"
+const char	global_digit_value[256]	= {
+/*$00*/	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+/*$20*/	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	 0,  1,  2,  3,  4,  5,  6,  7,// "01234567"
+	 8,  9, 16, 16, 16, 16, 16, 16,// "89:;<=>?"
+/*$40*/	16, 10, 11, 12, 13, 14, 15, 16,// "@ABCDEFG"
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+/*$60*/	16, 10, 11, 12, 13, 14, 15, 16,// "`abcdefg"
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+/*$80*/	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+/*$a0*/	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+/*$c0*/	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+/*$e0*/	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+	16, 16, 16, 16, 16, 16, 16, 16,
+};
+
+
 // variables
 char		GotByte;			// Last byte read (processed)
 struct report 	*report			= NULL;
+struct part	*part			= NULL;
 struct config	config;
 struct pass	pass;
+struct stats	stats;
+struct memstats	memstats;
 
 // set configuration to default values
 void config_default(struct config *conf)
@@ -113,19 +158,56 @@ void config_default(struct config *conf)
 	conf->warn_on_type_mismatch	= FALSE;	// use type-checking system
 	conf->warn_bin_mask		= 3;  // %11 -> warn if not divisible by four
 	conf->max_errors		= MAXERRORS;	// errors before giving up
+	conf->max_warnings		= 0;	// changed by --maxwarnings
 	conf->format_msvc		= FALSE;	// enabled by --msvc
 	conf->format_color		= FALSE;	// enabled by --color
+	conf->format_json		= FALSE;	// enabled by --json-messages
 	conf->msg_stream		= stderr;	// set to stdout by --use-stdout
 	conf->honor_leading_zeroes	= TRUE;		// disabled by --ignore-zeroes
 	conf->segment_warning_is_error	= FALSE;	// enabled by --strict-segments		TODO - toggle default?
+	conf->split_size		= 0;	// changed by --split-output
+	conf->keep_unchanged		= FALSE;	// enabled by --keep-unchanged
+	conf->prefetch			= FALSE;	// enabled by --prefetch
+	conf->fixups			= FALSE;	// enabled by --fixups
+	conf->report_cycles		= FALSE;	// enabled by --report-cycles
+	conf->relax_branches		= FALSE;	// enabled by --relax-branches
+	conf->peephole			= FALSE;	// enabled by --peephole
+	conf->dead_strip		= FALSE;	// enabled by --dead-strip
+	conf->jobs			= 1;	// changed by --jobs
+	conf->separate_modules		= FALSE;	// enabled by --modules
 	conf->test_new_features		= FALSE;	// enabled by --test
+	conf->show_stats		= FALSE;	// enabled by --stats
+	conf->max_memory		= 0;	// changed by --maxmemory
+	conf->trace_passes		= FALSE;	// enabled by --trace-passes
+	conf->symbol_order		= SYMBOLORDER_DEFINITION;	// changed by --symbolorder
+	conf->symbol_format		= SYMBOLFORMAT_ACME;	// changed by --symbolformat
 	conf->wanted_version		= VER_CURRENT;	// changed by --dialect
 }
 
 // memory allocation stuff
 
-// allocate memory and die if not available
-void *safe_malloc(size_t size)
+// count memory used for given purpose, die if limit is exceeded
+void memuse_add(enum memuse use, size_t amount)
+{
+	memstats.use[use] += amount;
+	memstats.in_use += amount;
+	if (memstats.in_use > memstats.peak)
+		memstats.peak = memstats.in_use;
+	if (config.max_memory && (memstats.in_use > config.max_memory)) {
+		config.max_memory = 0;	// finalizing may need some more
+		Throw_serious_error("Memory limit exceeded.");
+	}
+}
+
+// count memory freed
+void memuse_sub(enum memuse use, size_t amount)
+{
+	memstats.use[use] -= amount;
+	memstats.in_use -= amount;
+}
+
+// allocate memory and die if not available (does not count memory)
+static void *get_memory(size_t size)
 {
 	void	*block;
 
@@ -134,6 +216,116 @@ void *safe_malloc(size_t size)
 	return block;
 }
 
+// allocate memory and die if not available
+void *safe_malloc(size_t size, enum memuse use)
+{
+	memuse_add(use, size);
+	return get_memory(size);
+}
+
+// resize block and die if not possible (block may be NULL)
+void *safe_realloc(void *block, size_t old_size, size_t new_size, enum memuse use)
+{
+	if (new_size > old_size)
+		memuse_add(use, new_size - old_size);
+	else
+		memuse_sub(use, old_size - new_size);
+	if ((block = realloc(block, new_size)) == NULL)
+		Throw_serious_error(exception_no_memory_left);
+	return block;
+}
+
+// free block and count it (block may be NULL)
+void safe_free(void *block, size_t size, enum memuse use)
+{
+	if (block == NULL)
+		return;
+	memuse_sub(use, size);
+	free(block);
+}
+
+// free string and count it
+void safe_free_string(char *string, enum memuse use)
+{
+	if (string)
+		safe_free(string, strlen(string) + 1, use);
+}
+
+
+// arena allocator:
+// blocks are cut from large chunks, so there is no per-block overhead, blocks
+// allocated one after the other are adjacent in memory, and freeing everything
+// only needs one free() per chunk.
+#define ARENA_CHUNK_SIZE	65536	// blocks larger than a quarter of this get their own chunk
+union arena_chunk {
+	union arena_chunk	*next;
+	// these make sure the data after the header is suitably aligned:
+	double			align_double;
+	long			align_long;
+	void			*align_ptr;
+};
+#define ARENA_ALIGN	(sizeof(union arena_chunk))
+
+// allocate memory from arena (there is no way to free a single block)
+// (blocks are counted, chunks are not)
+void *arena_alloc(struct arena *arena, size_t size, enum memuse use)
+{
+	union arena_chunk	*chunk;
+	char			*block;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	memuse_add(use, size);
+	arena->counted[use] += size;
+	if (size > ARENA_CHUNK_SIZE / 4) {
+		// large block: put in chunk of its own, behind the current one
+		chunk = get_memory(ARENA_ALIGN + size);
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		}
+		return chunk + 1;
+	}
+
+	if (size > arena->left) {
+		chunk = get_memory(ARENA_ALIGN + ARENA_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->next = (char *) (chunk + 1);
+		arena->left = ARENA_CHUNK_SIZE;
+	}
+	block = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return block;
+}
+
+// return arena copy of given data
+void *arena_copy(struct arena *arena, const void *src, size_t size, enum memuse use)
+{
+	return memcpy(arena_alloc(arena, size, use), src, size);
+}
+
+// free all blocks of arena at once
+void arena_free(struct arena *arena)
+{
+	union arena_chunk	*chunk;
+	int			use;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	arena->next = NULL;
+	arena->left = 0;
+	for (use = 0; use < MEMUSE_COUNT; ++use) {
+		memuse_sub(use, arena->counted[use]);
+		arena->counted[use] = 0;
+	}
+}
+
 
 // Parser stuff
 
@@ -152,18 +344,15 @@ static int first_label_of_statement(bits *statement_flags)
 
 
 // parse label definition (can be either global or local).
-// name must be held in GlobalDynaBuf.
 // called by parse_symbol_definition, parse_backward_anon_def, parse_forward_anon_def
 // "powers" is used by backward anons to allow changes
-static void set_label(scope_t scope, bits stat_flags, bits force_bit, bits powers)
+static void set_label(struct symbol *symbol, scope_t scope, bits stat_flags, bits force_bit, bits powers)
 {
-	struct symbol	*symbol;
 	struct number	pc;
 	struct object	result;
 
 	if ((stat_flags & SF_FOUND_BLANK) && config.warn_on_indented_labels)
 		Throw_first_pass_warning("Label name not in leftmost column.");
-	symbol = symbol_find(scope);
 	vcpu_read_pc(&pc);	// FIXME - if undefined, check pass.complain_about_undefined and maybe throw "value not defined"!
 	result.type = &type_number;
 	result.u.number.ntype = NUMTYPE_INT;	// FIXME - if undefined, use NUMTYPE_UNDEFINED!
@@ -215,7 +404,7 @@ static void parse_symbol_definition(scope_t scope, bits stat_flags)
 		Input_ensure_EOS();
 	} else {
 		// implicit symbol definition (label)
-		set_label(scope, stat_flags, force_bit, POWER_NONE);
+		set_label(symbol_find(scope), scope, stat_flags, force_bit, POWER_NONE);
 	}
 }
 
@@ -223,9 +412,26 @@ static void parse_symbol_definition(scope_t scope, bits stat_flags)
 // Parse global symbol definition or assembler mnemonic
 static void parse_mnemo_or_global_symbol_def(bits *statement_flags)
 {
-	boolean	is_mnemonic;
-
-	is_mnemonic = CPU_state.type->keyword_is_mnemonic(Input_read_keyword());
+	struct parsed_stmt	stmt,
+				*known;
+	boolean			is_mnemonic;
+
+	// if mnemonic has been found here before, skip reading and looking up
+	known = Input_find_stmt(&stmt);
+	if (known && (known->kind == STMT_MNEMONIC) && (known->cpu == CPU_state.type)) {
+		Input_resume_stmt(known);
+		mnemo_assemble(known->action);
+		return;
+	}
+	Input_read_keyword();
+	Input_set_resume(&stmt);
+	is_mnemonic = keyword_is_mnemonic();
+	if (is_mnemonic) {
+		stmt.kind = STMT_MNEMONIC;
+		stmt.cpu = CPU_state.type;
+		stmt.action = mnemo_found;
+		Input_remember_stmt(&stmt);
+	}
 	// It is only a label if it isn't a mnemonic
 	if ((!is_mnemonic)
 	&& first_label_of_statement(statement_flags)) {
@@ -255,58 +461,124 @@ static void parse_local_symbol_def(bits *statement_flags, scope_t scope)
 // parse anonymous backward label definition. Called with GotByte == '-'
 static void parse_backward_anon_def(bits *statement_flags)
 {
+	int	depth	= 0;
+
 	if (!first_label_of_statement(statement_flags))
 		return;
 
-	DYNABUF_CLEAR(GlobalDynaBuf);
 	do
-		DYNABUF_APPEND(GlobalDynaBuf, '-');
+		++depth;
 	while (GetByte() == '-');
-	DynaBuf_append(GlobalDynaBuf, '\0');
 	// backward anons change their value!
-	set_label(section_now->local_scope, *statement_flags, NO_FORCE_BIT, POWER_CHANGE_VALUE);
+	set_label(symbol_find_anon(FALSE, depth, TRUE), section_now->local_scope, *statement_flags, NO_FORCE_BIT, POWER_CHANGE_VALUE);
 }
 
 
 // parse anonymous forward label definition. called with GotByte == ?
 static void parse_forward_anon_def(bits *statement_flags)
 {
+	int	depth	= 1;
+
 	if (!first_label_of_statement(statement_flags))
 		return;
 
-	DYNABUF_CLEAR(GlobalDynaBuf);
-	DynaBuf_append(GlobalDynaBuf, '+');
 	while (GotByte == '+') {
-		DYNABUF_APPEND(GlobalDynaBuf, '+');
+		++depth;
 		GetByte();
 	}
-	symbol_fix_forward_anon_name(TRUE);	// TRUE: increment counter
-	DynaBuf_append(GlobalDynaBuf, '\0');
-	//printf("[%d, %s]\n", section_now->local_scope, GlobalDynaBuf->buffer);
-	set_label(section_now->local_scope, *statement_flags, NO_FORCE_BIT, POWER_NONE);
+	set_label(symbol_find_anon(TRUE, depth, TRUE), section_now->local_scope, *statement_flags, NO_FORCE_BIT, POWER_NONE);
 }
 
 
+// kinds of blocks entered by Parse_enter_block(), innermost last. each loop
+// only ends the blocks entered after it was started.
+static	STRUCT_DYNABUF_REF(entered_blocks, 64);
+static	int	recursion_left	= MAX_RECURSION;	// for nested main loops
+
+// let main loop parse block (see header file)
+void Parse_enter_block(enum block_kind kind)
+{
+	if (entered_blocks->buffer == NULL)
+		DYNABUF_CLEAR(entered_blocks);	// allocate buffer on first call
+	DynaBuf_append(entered_blocks, kind);
+}
+
+// forget about main loops (see header file)
+void Parse_reset(void)
+{
+	entered_blocks->size = 0;
+	recursion_left = MAX_RECURSION;
+}
+
+// end statement (after the last byte of a statement has been parsed)
+static void end_statement(boolean counted)
+{
+	if (counted) {
+		if (profile_active)
+			profile_end_statement(CPU_state.add_to_pc);
+		if (config.trace_passes)
+			passtrace_statement(CPU_state.add_to_pc);
+	}
+	vcpu_end_statement();	// adjust program counter
+}
+
 // Parse block, beginning with next byte.
 // End reason (either CHAR_EOB or CHAR_EOF) can be found in GotByte afterwards
 // Has to be re-entrant.
+// Macro calls and "!if" do not recurse: their blocks are parsed by this loop
+// (see Parse_enter_block()), so deeply nested macro calls do not need a deep C
+// stack. All other blocks do, so their nesting is limited to MAX_RECURSION.
 void Parse_until_eob_or_eof(void)
 {
 	bits	statement_flags;
+	boolean	counted;	// for profiling and pass tracing
+	size_t	outer_blocks	= entered_blocks->size;	// blocks not entered by this loop
+	size_t	statement_blocks;	// blocks entered before current statement
 
+	if (--recursion_left < 0)
+		Throw_serious_error("Too deeply nested. Recursive loops or \"!source\"?");
 //	// start with next byte, don't care about spaces
 //	NEXTANDSKIPSPACE();
 	// start with next byte
 	GetByte();
 	// loop until end of block or end of file
-	while ((GotByte != CHAR_EOB) && (GotByte != CHAR_EOF)) {
+	for (;;) {
+		if ((GotByte == CHAR_EOB) || (GotByte == CHAR_EOF)) {
+			// end of the block this loop was called for?
+			if (entered_blocks->size == outer_blocks)
+				break;
+			// no, end of a block entered by a statement: finish that
+			// statement (its first byte was not a separator, so it
+			// was counted if statements are counted at all)
+			--entered_blocks->size;
+			if (entered_blocks->buffer[entered_blocks->size] == BLOCKKIND_MACRO)
+				Macro_end_call();
+			else
+				pseudoopcode_end_block(entered_blocks->buffer[entered_blocks->size]);
+			end_statement(profile_active || config.trace_passes);
+			GetByte();
+			continue;
+		}
 		// process one statement
 		statement_flags = 0;	// no "label = pc" definition yet
+		counted = FALSE;
+		statement_blocks = entered_blocks->size;
 		typesystem_force_address_statement(FALSE);
 		// Parse until end of statement. Only loops if statement
 		// contains implicit label definition (=pc) and something else; or
 		// if "!ifdef/ifndef" is true/false, or if "!addr" is used without block.
 		do {
+			// when tracing a loop body, count everything but separators
+			if (flow_trace
+			&& (GotByte != CHAR_EOS) && (GotByte != ' ') && (GotByte != CHAR_SOL))
+				++(flow_trace->statements);
+			// when profiling or tracing, count statement at its first real byte
+			if ((profile_active || config.trace_passes) && (!counted)
+			&& (GotByte != CHAR_EOS) && (GotByte != ' ') && (GotByte != CHAR_SOL)) {
+				if (profile_active)
+					profile_begin_statement();
+				counted = TRUE;
+			}
 			// check for pseudo opcodes was moved out of switch,
 			// because prefix character is now configurable.
 			if (GotByte == config.pseudoop_prefix) {
@@ -352,11 +624,14 @@ void Parse_until_eob_or_eof(void)
 					}
 				}
 			}
-		} while (GotByte != CHAR_EOS);	// until end-of-statement
-		vcpu_end_statement();	// adjust program counter
+		} while ((GotByte != CHAR_EOS) && (entered_blocks->size == statement_blocks));	// until end-of-statement
+		// if a block was entered, the statement is finished at its end
+		if (entered_blocks->size == statement_blocks)
+			end_statement(counted);
 		// go on with next byte
 		GetByte();	//NEXTANDSKIPSPACE();
 	}
+	++recursion_left;
 }
 
 
@@ -378,28 +653,177 @@ int Parse_optional_block(void)
 
 // Error handling
 
-// error/warning counter so macro calls can find out whether to show a call stack
+// error/warning counter to find out whether anything was thrown
 static int	throw_counter	= 0;
 int Throw_get_counter(void)
 {
 	return throw_counter;
 }
 
+// counter for messages that were not known before, so macro calls can find out
+// whether to show a call stack (duplicates are not shown, so their call stack
+// would just pile up under the first one)
+static int	new_message_counter	= 0;
+int Throw_get_new_counter(void)
+{
+	return new_message_counter;
+}
+
+// Warnings and errors are not shown at once, but collected in the active
+// part's "messages" table and shown by Throw_flush(), so generated sources
+// with lots of messages do not have to wait for the terminal. The table is
+// keyed by file name, line number and message text, so a message thrown in
+// several passes (or in every iteration of a loop) is only shown once.
+enum msgkind {
+	MSGKIND_WARNING,
+	MSGKIND_ERROR,
+	MSGKIND_SERIOUS
+};
+struct message {
+	enum msgkind	kind;
+	const char	*filename;
+	int		line_number;
+	const char	*section_type;
+	const char	*section_title;
+	const char	*text;
+};
+static const char	*const msgkind_names[]	= {"Warning", "Error", "Serious error"};
+static const char	*const msgkind_colored[]	= {"\033[33mWarning\033[0m", "\033[31mError\033[0m", "\033[1m\033[31mSerious error\033[0m"};
+static	STRUCT_DYNABUF_REF(msgkey_buf, 256);	// to build table key
+// messages deferred in current pass, see Throw_deferred_error(). they have
+// their own arena, so they can be forgotten at the start of each pass.
+static struct arena	deferred_arena;
+static struct rwtable	deferred[1]	= {{NULL, 0, 0, NULL, NULL, &deferred_arena}};
+static int		deferred_counter	= 0;
+
+// write string in JSON format
+static void json_string(const char *string)
+{
+	unsigned char	byte;
+
+	putc('"', config.msg_stream);
+	while ((byte = *string++)) {
+		if ((byte == '"') || (byte == '\\'))
+			fprintf(config.msg_stream, "\\%c", byte);
+		else if (byte < 32)
+			fprintf(config.msg_stream, "\\u%04x", byte);
+		else
+			putc(byte, config.msg_stream);
+	}
+	putc('"', config.msg_stream);
+}
+
 // This function will do the actual output for warnings, errors and serious
-// errors. It shows the given message string, as well as the current
-// context: file name, line number, source type and source title.
-// TODO: make un-static so !info and !debug can use this.
-static void throw_message(const char *message, const char *type)
+// errors. It shows the given message string, as well as its context: file
+// name, line number, source type and source title.
+static void show_message(const struct message *msg)
 {
-	++throw_counter;
+	const char	*type;
+
+	if (config.format_json) {
+		fputs("{\"kind\": ", config.msg_stream);
+		json_string(msgkind_names[msg->kind]);
+		fputs(", \"file\": ", config.msg_stream);
+		json_string(msg->filename);
+		fprintf(config.msg_stream, ", \"line\": %d, \"section\": ", msg->line_number);
+		json_string(msg->section_type);
+		fputs(", \"title\": ", config.msg_stream);
+		json_string(msg->section_title);
+		fputs(", \"message\": ", config.msg_stream);
+		json_string(msg->text);
+		fputs("}\n", config.msg_stream);
+		return;
+	}
+	type = config.format_color ? msgkind_colored[msg->kind] : msgkind_names[msg->kind];
 	if (config.format_msvc)
 		fprintf(config.msg_stream, "%s(%d) : %s (%s %s): %s\n",
-			Input_now->original_filename, Input_now->line_number,
-			type, section_now->type, section_now->title, message);
+			msg->filename, msg->line_number,
+			type, msg->section_type, msg->section_title, msg->text);
 	else
 		fprintf(config.msg_stream, "%s - File %s, line %d (%s %s): %s\n",
-			type, Input_now->original_filename, Input_now->line_number,
-			section_now->type, section_now->title, message);
+			type, msg->filename, msg->line_number,
+			msg->section_type, msg->section_title, msg->text);
+}
+
+// fill in context of message
+static void set_context(struct message *msg, enum msgkind kind, const char *text)
+{
+	msg->kind = kind;
+	msg->filename = Input_now->original_filename;
+	msg->line_number = Input_now->line_number;
+	msg->section_type = section_now->type;
+	msg->section_title = section_now->title;
+	msg->text = text;
+}
+
+// add message to given table, unless it is already known. returns whether it
+// is new.
+static boolean store_message(struct rwtable *table, struct arena *arena, const struct message *msg)
+{
+	struct message	*stored;
+	struct rwname	name;
+	struct rwnode	*node;
+	char		line[24];
+
+	DYNABUF_CLEAR(msgkey_buf);
+	DynaBuf_add_string(msgkey_buf, msg->filename);
+	sprintf(line, "\n%d\n", msg->line_number);
+	DynaBuf_add_string(msgkey_buf, line);
+	DynaBuf_add_string(msgkey_buf, msg->text);
+	DynaBuf_append(msgkey_buf, '\0');
+	Tree_make_name(&name, msgkey_buf->buffer, msgkey_buf->size);
+	if (!Tree_hard_scan_name(&node, table, &name, 0, TRUE))
+		return FALSE;	// already known
+
+	// strings may change or be freed before the message is shown
+	stored = arena_alloc(arena, sizeof(*stored), MEMUSE_OTHER);
+	*stored = *msg;
+	stored->filename = arena_copy(arena, msg->filename, strlen(msg->filename) + 1, MEMUSE_OTHER);
+	stored->section_type = arena_copy(arena, msg->section_type, strlen(msg->section_type) + 1, MEMUSE_OTHER);
+	stored->section_title = arena_copy(arena, msg->section_title, strlen(msg->section_title) + 1, MEMUSE_OTHER);
+	stored->text = arena_copy(arena, msg->text, strlen(msg->text) + 1, MEMUSE_OTHER);
+	node->body = stored;
+	return TRUE;
+}
+
+// remember message, unless it is already known. returns whether it is new.
+static boolean collect_message(enum msgkind kind, const char *text)
+{
+	struct message	msg;
+
+	set_context(&msg, kind, text);
+	if (!store_message(part->messages, &part->arena, &msg))
+		return FALSE;
+
+	++new_message_counter;
+	return TRUE;
+}
+
+// show warnings and errors collected so far (each one only once, even if it
+// was thrown in several passes)
+void Throw_flush(void)
+{
+	struct rwnode	*node;
+	struct message	*msg;
+	long		warnings	= 0;
+
+	for (node = part->messages->first; node; node = node->next) {
+		msg = node->body;
+		if ((msg->kind == MSGKIND_WARNING)
+		&& (++warnings > config.max_warnings)
+		&& config.max_warnings)
+			continue;	// over the limit
+
+		show_message(msg);
+	}
+	if (config.max_warnings && (warnings > config.max_warnings)) {
+		if (config.format_json)
+			fprintf(config.msg_stream, "{\"kind\": \"Warning\", \"suppressed\": %ld}\n", warnings - config.max_warnings);
+		else
+			fprintf(config.msg_stream, "(%ld more warnings not shown)\n", warnings - config.max_warnings);
+	}
+	fflush(config.msg_stream);
+	Tree_clear(part->messages, NULL);	// nodes stay in arena
 }
 
 
@@ -409,11 +833,11 @@ static void throw_message(const char *message, const char *type)
 // assembled a 16-bit parameter with an 8-bit value.
 void Throw_warning(const char *message)
 {
-	PLATFORM_WARNING(message);
-	if (config.format_color)
-		throw_message(message, "\033[33mWarning\033[0m");
-	else
-		throw_message(message, "Warning");
+	if (flow_in_worker)
+		flow_abandon_worker();	// let calling process throw it
+	++throw_counter;
+	if (collect_message(MSGKIND_WARNING, message))
+		PLATFORM_WARNING(message);
 }
 // Output a warning if in first pass. See above.
 void Throw_first_pass_warning(const char *message)
@@ -430,14 +854,14 @@ void Throw_first_pass_warning(const char *message)
 // the user gets to know about more than one of his typos at a time.
 void Throw_error(const char *message)
 {
-	PLATFORM_ERROR(message);
-	if (config.format_color)
-		throw_message(message, "\033[31mError\033[0m");
-	else
-		throw_message(message, "Error");
+	if (flow_in_worker)
+		flow_abandon_worker();	// let calling process throw it
+	++throw_counter;
+	if (collect_message(MSGKIND_ERROR, message))
+		PLATFORM_ERROR(message);
 	++pass.error_count;
 	if (pass.error_count >= config.max_errors)
-		exit(ACME_finalize(EXIT_FAILURE));
+		ACME_exit(ACME_finalize(EXIT_FAILURE));
 }
 
 
@@ -447,13 +871,19 @@ void Throw_error(const char *message)
 // be set correctly in this case, so proceeding would be of no use at all.
 void Throw_serious_error(const char *message)
 {
+	struct message	msg;
+
+	if (flow_in_worker)
+		flow_abandon_worker();	// let calling process throw it
+	++throw_counter;
 	PLATFORM_SERIOUS(message);
-	if (config.format_color)
-		throw_message(message, "\033[1m\033[31mSerious error\033[0m");
-	else
-		throw_message(message, "Serious error");
+	// this is the last message, so show it directly (this does not need
+	// memory, which may have run out)
+	Throw_flush();
+	set_context(&msg, MSGKIND_SERIOUS, message);
+	show_message(&msg);
 	// FIXME - exiting immediately inhibits output of macro call stack!
-	exit(ACME_finalize(EXIT_FAILURE));
+	ACME_exit(ACME_finalize(EXIT_FAILURE));
 }
 
 
@@ -461,34 +891,179 @@ void Throw_serious_error(const char *message)
 void Bug_found(const char *message, int code)
 {
 	Throw_warning("Bug in ACME, code follows");
+	Throw_flush();
 	fprintf(stderr, "(0x%x:)", code);
 	Throw_serious_error(message);
 }
 
 
+// remember error or warning for end of pass (see header file)
+static void defer_message(enum msgkind kind, const char *text)
+{
+	struct message	msg;
+
+	if (flow_in_worker)
+		flow_abandon_worker();	// let calling process defer it
+	set_context(&msg, kind, text);
+	if (store_message(deferred, &deferred_arena, &msg))
+		++deferred_counter;
+}
+void Throw_deferred_error(const char *message)
+{
+	defer_message(MSGKIND_ERROR, message);
+}
+void Throw_deferred_warning(const char *message)
+{
+	defer_message(MSGKIND_WARNING, message);
+}
+
+// counter for deferred messages
+int Throw_get_deferred_counter(void)
+{
+	return deferred_counter;
+}
+
+// forget messages deferred in previous pass
+void Throw_forget_deferred(void)
+{
+	Tree_clear(deferred, NULL);
+	arena_free(&deferred_arena);
+}
+
+// throw messages deferred in current pass, as if they had been thrown at
+// their original positions
+void Throw_deferred_now(void)
+{
+	struct rwnode	*node;
+	struct message	*msg;
+
+	for (node = deferred->first; node; node = node->next) {
+		msg = node->body;
+		++throw_counter;
+		if (store_message(part->messages, &part->arena, msg)) {
+			if (msg->kind == MSGKIND_WARNING)
+				PLATFORM_WARNING(msg->text);
+			else
+				PLATFORM_ERROR(msg->text);
+		}
+		if (msg->kind == MSGKIND_ERROR) {
+			++pass.error_count;
+			if (pass.error_count >= config.max_errors)
+				break;	// caller will exit
+		}
+	}
+	Throw_forget_deferred();
+}
+
+
+// the plain output functions below, so list items can be converted to bytes
+// without calling them for each item
+struct writer {
+	void		(*fn)(intval_t);
+	int		size;	// number of bytes per value
+	boolean		big_endian;
+	boolean		check;	// FALSE for 32 bits (see FIXME at output_be32())
+	intval_t	min,
+			max;
+	const char	*error;
+};
+static const struct writer	writers[]	= {
+	{output_8,	1, FALSE, TRUE,	-0x80,		0xff,		exception_number_out_of_8b_range},
+	{output_le16,	2, FALSE, TRUE,	-0x8000,	0xffff,		exception_number_out_of_16b_range},
+	{output_be16,	2, TRUE,  TRUE,	-0x8000,	0xffff,		exception_number_out_of_16b_range},
+	{output_le24,	3, FALSE, TRUE,	-0x800000,	0xffffff,	exception_number_out_of_24b_range},
+	{output_be24,	3, TRUE,  TRUE,	-0x800000,	0xffffff,	exception_number_out_of_24b_range},
+	{output_le32,	4, FALSE, FALSE, 0,		0,		NULL},
+	{output_be32,	4, TRUE,  FALSE, 0,		0,		NULL},
+	{NULL}
+};
+#define BULK_SIZE	1024	// buffer size for converted list items
+
+
+// convert numbers in list to bytes and send them to output buffer in blocks.
+// this does the same as calling the writer's output function for each item
+// (other items, like strings and sublists, are passed to output_object()).
+static void output_list_bulk(struct object *item, int length, const struct writer *writer, struct iter_context *iter)
+{
+	char		buf[BULK_SIZE];
+	size_t		used	= 0;
+	intval_t	value;
+	int		shift;
+
+	for (; length; --length, ++item) {
+		if (item->type != &type_number) {
+			output_block(buf, used);
+			used = 0;
+			output_object(item, iter);
+			continue;
+		}
+		if (item->u.number.ntype == NUMTYPE_UNDEFINED) {
+			++pass.needvalue_count;
+			value = 0;
+		} else if (item->u.number.ntype == NUMTYPE_INT) {
+			value = item->u.number.val.intval;
+			if ((item->u.number.addr_refs == 1) && (writer->fn == output_le16)) {
+				// relocation entry must refer to current position
+				output_block(buf, used);
+				used = 0;
+				output_relocation();
+			}
+		} else if (item->u.number.ntype == NUMTYPE_FLOAT) {
+			value = item->u.number.val.fpval;
+		} else {
+			Bug_found("IllegalNumberType0", item->u.number.ntype);
+			value = 0;
+		}
+		if (writer->check && ((value < writer->min) || (value > writer->max)))
+			Throw_error(writer->error);
+		if (used + writer->size > sizeof(buf)) {
+			output_block(buf, used);
+			used = 0;
+		}
+		if (writer->big_endian) {
+			for (shift = 8 * (writer->size - 1); shift >= 0; shift -= 8)
+				buf[used++] = value >> shift;
+		} else {
+			for (shift = 0; shift < 8 * writer->size; shift += 8)
+				buf[used++] = value >> shift;
+		}
+	}
+	output_block(buf, used);
+}
+
+
 // insert object (in case of list, will iterate/recurse until done)
 void output_object(struct object *object, struct iter_context *iter)
 {
-	struct listitem	*item;
-	int		length;
-	char		*read;
+	const struct writer	*writer;
+	struct object		*item;
+	int			length;
+	char			*read;
 
 	if (object->type == &type_number) {
-		if (object->u.number.ntype == NUMTYPE_UNDEFINED)
+		if (object->u.number.ntype == NUMTYPE_UNDEFINED) {
+			++pass.needvalue_count;
 			iter->fn(0);
-		else if (object->u.number.ntype == NUMTYPE_INT)
+		} else if (object->u.number.ntype == NUMTYPE_INT) {
+			if ((object->u.number.addr_refs == 1) && (iter->fn == output_le16))
+				output_relocation();
 			iter->fn(object->u.number.val.intval);
-		else if (object->u.number.ntype == NUMTYPE_FLOAT)
+		} else if (object->u.number.ntype == NUMTYPE_FLOAT)
 			iter->fn(object->u.number.val.fpval);
 		else
 			Bug_found("IllegalNumberType0", object->u.number.ntype);
 	} else if (object->type == &type_list) {
-		// iterate over list
-		item = object->u.listhead->next;
-		while (item != object->u.listhead) {
-			output_object(&item->u.payload, iter);
-			item = item->next;
+		// plain output functions are handled in bulk
+		for (writer = writers; writer->fn; ++writer) {
+			if (writer->fn == iter->fn) {
+				output_list_bulk(object->u.list->item, object->u.list->length, writer, iter);
+				return;
+			}
 		}
+		// iterate over list
+		item = object->u.list->item;
+		for (length = object->u.list->length; length; --length)
+			output_object(item++, iter);
 	} else if (object->type == &type_string) {
 		// iterate over string
 		read = object->u.string->payload;
@@ -496,8 +1071,12 @@ void output_object(struct object *object, struct iter_context *iter)
 		// single-char strings are accepted, to be more compatible with
 		// versions before 0.97 (and empty strings are not really a problem...)
 		if (iter->accept_long_strings || (length < 2)) {
-			while (length--)
-				iter->fn(iter->stringxor ^ encoding_encode_char(*(read++)));
+			if (iter->fn == output_8) {
+				output_encoded_string(read, length, iter->stringxor);
+			} else {
+				while (length--)
+					iter->fn(iter->stringxor ^ encoding_encode_char(*(read++)));
+			}
 		} else {
 			Throw_error("There's more than one character.");	// see alu.c for the original of this error
 		}
@@ -507,6 +1086,24 @@ void output_object(struct object *object, struct iter_context *iter)
 }
 
 
+// convert string using current encoding, XOR with given value and send the
+// result to output buffer as a block (this does the same as calling output_8()
+// for each character, because converted characters are always in range)
+void output_encoded_string(const char *src, size_t length, unsigned char xor)
+{
+	char	buf[256];
+	size_t	chunk;
+
+	while (length) {
+		chunk = (length > sizeof(buf)) ? sizeof(buf) : length;
+		encoding_encode_string(buf, src, chunk, xor);
+		output_block(buf, chunk);
+		src += chunk;
+		length -= chunk;
+	}
+}
+
+
 // output 8-bit value with range check
 void output_8(intval_t value)
 {
@@ -516,45 +1113,60 @@ void output_8(intval_t value)
 }
 
 
+// bytes of larger values are put together first, so the output checks are
+// only done once per value:
+
 // output 16-bit value with range check big-endian
 void output_be16(intval_t value)
 {
+	char	bytes[2];
+
 	if ((value < -0x8000) || (value > 0xffff))
 		Throw_error(exception_number_out_of_16b_range);
-	Output_byte(value >> 8);
-	Output_byte(value);
+	bytes[0] = value >> 8;
+	bytes[1] = value;
+	output_block(bytes, 2);
 }
 
 
 // output 16-bit value with range check little-endian
 void output_le16(intval_t value)
 {
+	char	bytes[2];
+
 	if ((value < -0x8000) || (value > 0xffff))
 		Throw_error(exception_number_out_of_16b_range);
-	Output_byte(value);
-	Output_byte(value >> 8);
+	bytes[0] = value;
+	bytes[1] = value >> 8;
+	output_block(bytes, 2);
 }
 
 
 // output 24-bit value with range check big-endian
 void output_be24(intval_t value)
 {
+	char	bytes[3];
+
 	if ((value < -0x800000) || (value > 0xffffff))
 		Throw_error(exception_number_out_of_24b_range);
-	Output_byte(value >> 16);
-	Output_byte(value >> 8);
-	Output_byte(value);
+	bytes[0] = value >> 16;
+	bytes[1] = value >> 8;
+	bytes[2] = value;
+	output_block(bytes, 3);
 }
 
 
 // output 24-bit value with range check little-endian
 void output_le24(intval_t value)
 {
+	char	bytes[3];
+
 	if ((value < -0x800000) || (value > 0xffffff))
 		Throw_error(exception_number_out_of_24b_range);
-	Output_byte(value);
-	Output_byte(value >> 8);
-	Output_byte(value >> 16);
+	bytes[0] = value;
+	bytes[1] = value >> 8;
+	bytes[2] = value >> 16;
+	output_block(bytes, 3);
 }
 
 
@@ -567,22 +1179,28 @@ void output_le24(intval_t value)
 // output 32-bit value (without range check) big-endian
 void output_be32(intval_t value)
 {
+	char	bytes[4];
+
 //	if ((value < -0x80000000) || (value > 0xffffffff))
 //		Throw_error(exception_number_out_of_32b_range);
-	Output_byte(value >> 24);
-	Output_byte(value >> 16);
-	Output_byte(value >> 8);
-	Output_byte(value);
+	bytes[0] = value >> 24;
+	bytes[1] = value >> 16;
+	bytes[2] = value >> 8;
+	bytes[3] = value;
+	output_block(bytes, 4);
 }
 
 
 // output 32-bit value (without range check) little-endian
 void output_le32(intval_t value)
 {
+	char	bytes[4];
+
 //	if ((value < -0x80000000) || (value > 0xffffffff))
 //		Throw_error(exception_number_out_of_32b_range);
-	Output_byte(value);
-	Output_byte(value >> 8);
-	Output_byte(value >> 16);
-	Output_byte(value >> 24);
+	bytes[0] = value;
+	bytes[1] = value >> 8;
+	bytes[2] = value >> 16;
+	bytes[3] = value >> 24;
+	output_block(bytes, 4);
 }
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "config.h"
+#include "tree.h"
 
 #define LOCAL_PREFIX		'.'	// FIXME - this is not yet used consistently!
 #define CHEAP_PREFIX		'@'	// prefix character for cheap locals
@@ -38,10 +39,14 @@ extern const char	exception_syntax[];
 extern const char	global_byte_flags[];
 #define BYTE_STARTS_KEYWORD(b)		(global_byte_flags[(unsigned char) b] & (1u << 7))	// byte is allowed at start of keyword (a-z, A-Z, _, everything>127)
 #define BYTE_CONTINUES_KEYWORD(b)	(global_byte_flags[(unsigned char) b] & (1u << 6))	// byte is allowed in a keyword (as above, plus digits)
-//#define BYTE_TO_LOWER_CASE(b)	bit 5 means: "byte is upper case, and can be converted to lower case by ORing this bit" - but this is not used at the moment!
+#define BYTE_TO_LOWER_CASE(b)		((b) | (global_byte_flags[(unsigned char) b] & (1u << 5)))	// bit 5 means: "byte is upper case, and can be converted to lower case by ORing this bit"
 #define BYTE_IS_SYNTAX_CHAR(b)		(global_byte_flags[(unsigned char) b] & (1u << 4))	// special character for input syntax
 #define BYTE_FOLLOWS_ANON(b)		(global_byte_flags[(unsigned char) b] & (1u << 3))	// preceding '-' are backward label
 // bits 2, 1 and 0 are currently unused
+// digit value table
+extern const char	global_digit_value[];
+#define DIGIT_VALUE(b)			(global_digit_value[(unsigned char) b])	// 0..15 for hex digits (also upper case), 16 for other bytes
+#define DIGIT_NONE			16
 
 // TODO - put in runtime struct:
 extern char	GotByte;	// Last byte read (processed)
@@ -62,6 +67,17 @@ enum version {
 					//	ignore leading zeroes?
 	VER_FUTURE			// far future
 };
+// order and format of symbol list ("--symbolorder" and "--symbolformat")
+enum symbol_order {
+	SYMBOLORDER_DEFINITION,	// order of creation (default)
+	SYMBOLORDER_NAME,
+	SYMBOLORDER_ADDRESS	// by value, then by name
+};
+enum symbol_format {
+	SYMBOLFORMAT_ACME,	// can be included as source code (default)
+	SYMBOLFORMAT_JSON,
+	SYMBOLFORMAT_BINARY
+};
 // configuration
 struct config {
 	char		pseudoop_prefix;	// '!' or '.'
@@ -70,12 +86,29 @@ struct config {
 	boolean		warn_on_type_mismatch;	// use type-checking system
 	int		warn_bin_mask;	// bitmask for digit counter of binary literals
 	signed long	max_errors;	// errors before giving up
+	signed long	max_warnings;	// warnings to show (0 means no limit)
 	boolean		format_msvc;		// enabled by --msvc
 	boolean		format_color;		// enabled by --color
+	boolean		format_json;		// enabled by --json-messages
 	FILE		*msg_stream;		// defaults to stderr, changed to stdout by --use-stdout
 	boolean		honor_leading_zeroes;	// TRUE, disabled by --ignore-zeroes
 	boolean		segment_warning_is_error;	// FALSE, enabled by --strict-segments
+	signed long	split_size;	// 0 means one output file, set by --split-output
+	boolean		keep_unchanged;	// FALSE, enabled by --keep-unchanged
+	boolean		prefetch;	// FALSE, enabled by --prefetch
+	boolean		fixups;	// FALSE, enabled by --fixups
+	boolean		report_cycles;	// FALSE, enabled by --report-cycles
+	boolean		relax_branches;	// FALSE, enabled by --relax-branches
+	boolean		peephole;	// FALSE, enabled by --peephole
+	boolean		dead_strip;	// FALSE, enabled by --dead-strip
+	signed long	jobs;	// 1, number of processes for data loops, set by --jobs
+	boolean		separate_modules;	// FALSE, enabled by --modules
 	boolean		test_new_features;	// FALSE, enabled by --test
+	boolean		show_stats;	// FALSE, enabled by --stats
+	unsigned long	max_memory;	// 0 means no limit, set by --maxmemory
+	boolean		trace_passes;	// FALSE, enabled by --trace-passes
+	enum symbol_order	symbol_order;	// set by --symbolorder
+	enum symbol_format	symbol_format;	// set by --symbolformat
 	enum version	wanted_version;	// set by --dialect (and --test --test)
 };
 extern struct config	config;
@@ -83,26 +116,102 @@ extern struct config	config;
 struct pass {
 	int	number;	// counts up from zero
 	int	undefined_count;	// counts undefined expression results (if this stops decreasing, next pass must list them as errors)
-	//int	needvalue_count;	// counts undefined expression results actually needed for output (when this hits zero, we're done)	FIXME - use
+	int	needvalue_count;	// counts undefined expression results actually needed for output (when this hits zero, we're done)
 	int	error_count;
-	boolean	complain_about_undefined;	// will be FALSE until error pass is needed
+	int	volatile_count;	// counts things that keep a file from being replayed in the next pass ("!set", anon labels, "*=", ...)
+	int	relaxed_count;	// counts instructions and blocks that changed size and labels that moved (see "--relax-branches", "--peephole" and "--dead-strip"), so another pass is needed
+	boolean	complain_about_undefined;	// TRUE while undefined values must be reported at once
 };
 extern struct pass	pass;
 #define FIRST_PASS	(pass.number == 0)
+// TRUE if instructions may change size (or blocks may be removed) from one
+// pass to the next, so labels may move
+#define LAYOUT_MAY_CHANGE	(config.relax_branches || config.peephole || config.dead_strip)
+
+// statistics (shown if "--stats" is given)
+struct stats {
+	unsigned long	symbols_created;
+	unsigned long	table_lookups;	// calls of Tree_hard_scan_name()
+	unsigned long	table_probes;	// slots compared by those calls
+	unsigned long	macro_calls;
+	unsigned long	loop_iterations;
+	unsigned long	skipped_once;	// "!source" of files already included (see "!once")
+	unsigned long	expressions;	// parsed or compiled ones evaluated
+	unsigned long	compiled_expressions;	// compiled ones evaluated
+	int		max_arg_sp;	// peak size of ALU's argument stack
+	int		max_op_sp;	// peak size of ALU's operator stack
+};
+extern struct stats	stats;
+// memory use (kept from one build to the next, because so is some memory)
+struct memstats {
+	unsigned long	in_use;	// bytes allocated and not freed yet
+	unsigned long	peak;	// highest value of in_use in current build
+	unsigned long	use[MEMUSE_COUNT];	// in_use, split up by purpose
+};
+extern struct memstats	memstats;
 
 // report stuff
-#define REPORT_ASCBUFSIZE	1024
+// during each pass, every source line read from a file is recorded (with the
+// first few bytes it generated). after the last pass, the listing is written
+// from these records, so no extra pass is needed.
 #define REPORT_BINBUFSIZE	9	// eight are shown, then "..."
+struct cached_file;
+struct report_line {
+	const struct cached_file	*file;	// source text is taken from here
+	int		line_number;
+	boolean		new_source;	// TRUE => input changed before this line
+	int		bin_used;	// number of bytes (only the first ones are in bin[])
+	int		bin_address;	// address at start of bin[]
+	scope_t		local_scope;	// zone of line (for "--query")
+	scope_t		cheap_scope;
+	int		cycles_min;	// cycles of instructions (for "--report-cycles")
+	int		cycles_max;
+	boolean		cycles_unknown;	// TRUE => some instruction had no cycle count
+	const char	*peephole;	// rewrite done in this line (for "--peephole"), or NULL
+	char		bin[REPORT_BINBUFSIZE];	// output bytes
+};
 struct report {
-	FILE		*fd;		// report file descriptor (NULL => no report)
-	struct input	*last_input;
-	size_t		asc_used;
-	size_t		bin_used;
-	int		bin_address;	// address at start of bin_buf[]
-	char		asc_buf[REPORT_ASCBUFSIZE];	// source bytes
-	char		bin_buf[REPORT_BINBUFSIZE];	// output bytes
+	boolean			active;		// TRUE => record lines (listing report wanted)
+	FILE			*fd;		// report file descriptor
+	struct input		*last_input;	// input of last recorded line
+	struct report_line	*lines;		// lines of current pass
+	size_t			used;
+	size_t			size;
 };
-extern struct report	*report;	// TODO - put in "part" struct
+extern struct report	*report;	// points to active part's report struct
+
+// arena for lots of small blocks that are never freed one by one, but all at
+// once (tree nodes, symbols, macros)
+union arena_chunk;
+struct arena {
+	union arena_chunk	*chunks;	// list of chunks, newest first
+	char			*next;		// free space in newest chunk
+	size_t			left;
+	size_t			counted[MEMUSE_COUNT];	// bytes of blocks, by purpose
+};
+
+// everything that belongs to one assembly ("part"), so several of them can be
+// handled by the same process. only one part is active at any time.
+struct cpu_type;
+struct part {
+	const char		*output_filename;	// "-o" or "!to"
+	const char		*symbollist_filename;	// "-l" or "!sl"
+	const char		*vicelabels_filename;	// "--vicelabels"
+	const char		*report_filename;	// "-r"
+	const char		*depfile_filename;	// "--depfile"
+	signed long		start_address;	// "--setpc"
+	signed long		fill_value;	// "--initmem"
+	const struct cpu_type	*default_cpu;	// "--cpu"
+	signed long		macro_recursions_left;	// maximum nesting depth for macro calls
+	signed long		source_recursions_left;	// ...and for "!source"
+	struct rwtable		symbols[1];	// global symbols
+	struct rwtable		locals[1];	// local and cheap symbols (all scopes)
+	struct rwtable		macros[1];	// macro table
+	struct rwtable		messages[1];	// warnings and errors not shown yet
+	struct report		report;
+	struct arena		arena;	// for everything the tables point to
+};
+extern struct part	*part;	// currently active part
 
 // Macros for skipping a single space character
 #define SKIPSPACE()		\
@@ -121,8 +230,24 @@ do {				\
 
 // set configuration to default values
 extern void config_default(struct config *conf);
+// count memory used for given purpose, die if limit is exceeded
+extern void memuse_add(enum memuse use, size_t amount);
+// count memory freed (call with the amount memuse_add() got for it)
+extern void memuse_sub(enum memuse use, size_t amount);
 // allocate memory and die if not available
-extern void *safe_malloc(size_t amount);
+extern void *safe_malloc(size_t amount, enum memuse use);
+// resize block and die if not possible (block may be NULL)
+extern void *safe_realloc(void *block, size_t old_size, size_t new_size, enum memuse use);
+// free block allocated by safe_malloc() or safe_realloc() (block may be NULL)
+extern void safe_free(void *block, size_t size, enum memuse use);
+// free zero-terminated string allocated by safe_malloc() (may be NULL)
+extern void safe_free_string(char *string, enum memuse use);
+// allocate memory from arena (there is no way to free a single block)
+extern void *arena_alloc(struct arena *arena, size_t size, enum memuse use);
+// return arena copy of given data
+extern void *arena_copy(struct arena *arena, const void *src, size_t size, enum memuse use);
+// free all blocks of arena at once
+extern void arena_free(struct arena *arena);
 // call with symbol name in GlobalDynaBuf and GotByte == '='
 // "powers" is for "!set" pseudo opcode so changes are allowed (see symbol.h for powers)
 extern void parse_assignment(scope_t scope, bits force_bit, bits powers);
@@ -130,12 +255,31 @@ extern void parse_assignment(scope_t scope, bits force_bit, bits powers);
 // End reason (either CHAR_EOB or CHAR_EOF) can be found in GotByte afterwards
 // Has to be re-entrant.
 extern void Parse_until_eob_or_eof(void);
+// Forget about main loops that were running when a build was aborted.
+extern void Parse_reset(void);
+// kinds of blocks that the main loop parses without recursion
+enum block_kind {
+	BLOCKKIND_MACRO,	// macro body, finished by Macro_end_call()
+	BLOCKKIND_IF,	// "!if"/"!ifdef"/"!ifndef" block, finished by pseudoopcode_end_block()
+	BLOCKKIND_ELSE	// "else" block, finished by pseudoopcode_end_block()
+};
+// Let the main loop parse the block beginning with the next byte, instead of
+// calling Parse_until_eob_or_eof() recursively. Return at once afterwards;
+// when the block has ended, the kind's function is called to finish the
+// current statement. Call at most once per statement.
+extern void Parse_enter_block(enum block_kind kind);
 // Skip space. If GotByte is CHAR_SOB ('{'), parse block and return TRUE.
 // Otherwise (if there is no block), return FALSE.
 // Don't forget to call EnsureEOL() afterwards.
 extern int Parse_optional_block(void);
-// error/warning counter so macro calls can find out whether to show a call stack
+// error/warning counter to find out whether anything was thrown
 extern int Throw_get_counter(void);
+// counter for warnings and errors that were not known before (duplicates are
+// not shown), so macro calls can find out whether to show a call stack
+extern int Throw_get_new_counter(void);
+// show warnings and errors collected so far (each one only once, even if it
+// was thrown in several passes)
+extern void Throw_flush(void);
 // Output a warning.
 // This means the produced code looks as expected. But there has been a
 // situation that should be reported to the user, for example ACME may have
@@ -156,6 +300,19 @@ extern void Throw_error(const char *msg);
 extern void Throw_serious_error(const char *msg);
 // handle bugs
 extern void Bug_found(const char *msg, int code);
+// Remember an error (or a warning) that only matters if the current pass turns
+// out to be the last one ("Value not defined" and its call stack), so no extra
+// pass is needed to find it. It is not counted as an error until
+// Throw_deferred_now() is called.
+extern void Throw_deferred_error(const char *msg);
+extern void Throw_deferred_warning(const char *msg);
+// counter for deferred messages that were not known before, see
+// Throw_get_new_counter()
+extern int Throw_get_deferred_counter(void);
+// forget messages deferred in previous pass (call at start of pass)
+extern void Throw_forget_deferred(void);
+// throw messages deferred in current pass
+extern void Throw_deferred_now(void);
 // insert object (in case of list, will iterate/recurse until done)
 struct iter_context {
 	void		(*fn)(intval_t);	// output function
@@ -163,6 +320,9 @@ struct iter_context {
 	unsigned char	stringxor;		// for !scrxor, 0 otherwise
 };
 extern void output_object(struct object *object, struct iter_context *iter);
+// convert string using current encoding, XOR with given value and send the
+// result to output buffer as a block
+extern void output_encoded_string(const char *src, size_t length, unsigned char xor);
 // output 8-bit value with range check
 extern void output_8(intval_t value);
 // output 16-bit value with range check big-endian
@@ -6,14 +6,17 @@
 // 19 Nov 2014	Merged Johann Klasek's report listing generator patch
 //  9 Jan 2018	Allowed "//" comments
 #include "input.h"
+#include <string.h>	// for memchr()
 #include "config.h"
 #include "alu.h"
 #include "dynabuf.h"
 #include "global.h"
 #include "platform.h"
 #include "section.h"
+#include "snapshot.h"
 #include "symbol.h"
 #include "tree.h"
+#include "unpack.h"
 
 
 // Constants
@@ -24,6 +27,9 @@ const char	FILE_READBINARY[]	= "rb";
 		//	(13)	// end of file		(in high-level format)
 // if the characters above are changed, don't forget to adjust byte_flags[]!
 
+// what the RAM read pointer of file reads points to, so GetByte() always
+// calls Input_get_byte() for them
+static char		file_read_ptr[]	= {CHAR_SOL};
 // fake input structure (for error msgs before any real input is established)
 static struct input	outermost	= {
 	"<none>",	// file name
@@ -31,83 +37,535 @@ static struct input	outermost	= {
 	INPUTSRC_FILE,	// fake file access, so no RAM read
 	INPUTSTATE_EOF,	// state of input
 	{
-		NULL	// RAM read pointer or file handle
-	}
+		NULL,		// file handle
+		file_read_ptr	// RAM read pointer
+	},
+	NULL,		// no looked-up statements
+	NULL		// no file
 };
 
 
+// constants
+static const char	exception_quotes_open[]	= "Quotes still open at end of line.";
+
+
 // variables
 struct input	*Input_now	= &outermost;	// current input structure
+// source files are converted to high-level format only once, all later reads
+// (in further passes or by repeated "!source") use the copy in the file cache.
+static	STRUCT_DYNABUF_REF(cachebuf, 65536);	// to convert file to high-level format
+static	STRUCT_DYNABUF_REF(lower_keyword, 64);	// lower case version of keyword
+struct keyword	Input_keyword	= {lower_keyword, 0};
+// while converting, the matching block end of each block start is found, so
+// skipping blocks in converted files does not have to read them again. the
+// results are kept in a hash table using the read pointer after '{' as key.
+struct brace_match {
+	const char	*start;	// read pointer after '{' (NULL for unused slot)
+	const char	*end;	// read pointer after matching '}'
+	int		lines;	// number of line starts in between
+};
+static struct brace_match	*brace_table	= NULL;
+static int			brace_table_size	= 0,	// a power of two
+				brace_table_used	= 0;
+// blocks found during conversion (using offsets, because cachebuf may move)
+struct brace_found {
+	size_t		start,
+			end;	// zero while block is still open
+	int		lines;	// line count at start, later difference
+	boolean		unsure;	// TRUE if skipping would complain about quotes
+};
+static struct brace_found	*braces_found	= NULL;
+static int			braces_found_used	= 0,
+				braces_found_size	= 0;
+static int			*open_braces	= NULL;	// stack of indices into braces_found
+static int			open_braces_used	= 0,
+				open_braces_size	= 0;
+
+
+// prototype for error reporting (defined in include path stuff below)
+static void throw_cannot_open(const char *filename);
 
 
 // functions
 
+// return pointer to first CR or LF in given area (or to its end if none found)
+static const unsigned char *find_line_end(const unsigned char *read, const unsigned char *end)
+{
+	const unsigned char	*lf,
+				*cr;
+
+	lf = memchr(read, CHAR_LF, end - read);
+	if (lf == NULL)
+		lf = end;
+	cr = memchr(read, CHAR_CR, lf - read);
+	return cr ? cr : lf;
+}
+
+// remember block start found while converting
+static void brace_opened(int lines)
+{
+	struct brace_found	*found;
+
+	if (braces_found_used == braces_found_size) {
+		braces_found = safe_realloc(braces_found, braces_found_size * sizeof(*braces_found), (braces_found_size ? (braces_found_size * 2) : 64) * sizeof(*braces_found), MEMUSE_BLOCKS);
+		braces_found_size = braces_found_size ? (braces_found_size * 2) : 64;
+	}
+	if (open_braces_used == open_braces_size) {
+		open_braces = safe_realloc(open_braces, open_braces_size * sizeof(*open_braces), (open_braces_size ? (open_braces_size * 2) : 16) * sizeof(*open_braces), MEMUSE_BLOCKS);
+		open_braces_size = open_braces_size ? (open_braces_size * 2) : 16;
+	}
+	found = &braces_found[braces_found_used];
+	found->start = cachebuf->size;
+	found->end = 0;
+	found->lines = lines;
+	found->unsure = FALSE;
+	open_braces[open_braces_used++] = braces_found_used++;
+}
+
+// remember block end found while converting
+static void brace_closed(int lines)
+{
+	struct brace_found	*found;
+
+	if (open_braces_used == 0)
+		return;	// parser will complain
+
+	found = &braces_found[open_braces[--open_braces_used]];
+	found->end = cachebuf->size;
+	found->lines = lines - found->lines;
+	// if inner block cannot be skipped quietly, neither can outer one
+	if (found->unsure && open_braces_used)
+		braces_found[open_braces[open_braces_used - 1]].unsure = TRUE;
+}
+
+// skipping innermost open block would throw an error about quotes, so it
+// must really be read
+static void mark_quote_problem(void)
+{
+	if (open_braces_used)
+		braces_found[open_braces[open_braces_used - 1]].unsure = TRUE;
+}
+
+// return hash table slot for given read pointer
+static struct brace_match *find_brace_slot(const char *start)
+{
+	size_t			hash;
+	struct brace_match	*slot;
+
+	hash = ((size_t) start) * 2654435761u;
+	hash ^= hash >> 15;
+	for (;;) {
+		slot = brace_table + (hash & (brace_table_size - 1));
+		if ((slot->start == start) || (slot->start == NULL))
+			return slot;
+		++hash;
+	}
+}
+
+// add blocks found while converting to hash table (table is doubled when
+// half full)
+static void remember_braces(const char *converted)
+{
+	struct brace_match	*old_table;
+	struct brace_found	*found;
+	struct brace_match	*slot;
+	int			old_size,
+				ii;
+
+	for (found = braces_found; found < braces_found + braces_found_used; ++found) {
+		if ((found->end == 0) || found->unsure)
+			continue;
+
+		if (brace_table_used * 2 >= brace_table_size) {
+			old_table = brace_table;
+			old_size = brace_table_size;
+			brace_table_size = old_size ? (old_size * 2) : 256;
+			brace_table = safe_malloc(brace_table_size * sizeof(*brace_table), MEMUSE_BLOCKS);
+			for (ii = 0; ii < brace_table_size; ++ii)
+				brace_table[ii].start = NULL;
+			for (ii = 0; ii < old_size; ++ii) {
+				if (old_table[ii].start)
+					*find_brace_slot(old_table[ii].start) = old_table[ii];
+			}
+			safe_free(old_table, old_size * sizeof(*old_table), MEMUSE_BLOCKS);
+		}
+		slot = find_brace_slot(converted + found->start);
+		slot->start = converted + found->start;
+		slot->end = converted + found->end;
+		slot->lines = found->lines;
+		++brace_table_used;
+	}
+}
+
+// remove blocks of given converted file from hash table (before the file is
+// freed, so a new buffer at the same address cannot find stale entries)
+static void forget_braces(const char *converted, size_t size)
+{
+	struct brace_match	*old_table	= brace_table;
+	int			ii;
+
+	if (brace_table_used == 0)
+		return;
+
+	brace_table = safe_malloc(brace_table_size * sizeof(*brace_table), MEMUSE_BLOCKS);
+	for (ii = 0; ii < brace_table_size; ++ii)
+		brace_table[ii].start = NULL;
+	brace_table_used = 0;
+	for (ii = 0; ii < brace_table_size; ++ii) {
+		if (old_table[ii].start
+		&& ((old_table[ii].start < converted) || (old_table[ii].start >= converted + size))) {
+			*find_brace_slot(old_table[ii].start) = old_table[ii];
+			++brace_table_used;
+		}
+	}
+	safe_free(old_table, brace_table_size * sizeof(*old_table), MEMUSE_BLOCKS);
+}
+
+// convert file contents to high-level format (into cachebuf), doing the
+// same conversions get_processed_from_file() does, so parsing the RAM copy
+// has the same results as parsing the file.
+// returns nonzero if file contains illegal characters (these must be
+// complained about in every pass, so such a file does not get converted).
+#define NEXT_BYTE()	(byte = (read < end) ? *read++ : EOF)
+static int convert_file(const struct cached_file *file)
+{
+	const unsigned char	*read,
+				*end;
+	int			byte;
+	int			quote	= 0;	// closing quote character while inside quotes
+	boolean			escaped	= FALSE;
+	int			lines	= 0;
+
+	read = (const unsigned char *) file->body;
+	end = read + file->size;
+	DYNABUF_CLEAR(cachebuf);
+	// each input byte becomes at most two bytes, plus terminators (see below)
+	DynaBuf_reserve(cachebuf, 2 * file->size + 5);
+	braces_found_used = 0;
+	open_braces_used = 0;
+	NEXT_BYTE();
+	// check for hashbang line and ignore
+	if (byte == '#') {
+		DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+		byte = ';';	// skip line just like a comment
+	}
+	for (;;) {
+		// EOF must be checked first because it cannot be used
+		// as an index into global_byte_flags[]
+		if (byte == EOF)
+			break;
+
+		// inside quotes, bytes are stored unconverted (except for line
+		// breaks - strings are never continued on next line)
+		if (quote && (byte != CHAR_LF) && (byte != CHAR_CR)) {
+			DYNABUF_APPEND_RESERVED(cachebuf, byte);
+			if (byte == CHAR_EOS)
+				mark_quote_problem();	// skipping would end string here
+			if (escaped)
+				escaped = FALSE;
+			else if (byte == quote)
+				quote = 0;
+			else if ((byte == '\\') && (config.wanted_version >= VER_BACKSLASHESCAPING))
+				escaped = TRUE;
+			NEXT_BYTE();
+			continue;
+		}
+		if (quote)
+			mark_quote_problem();	// string not terminated
+		quote = 0;
+		escaped = FALSE;
+		if (BYTE_IS_SYNTAX_CHAR(byte) == 0) {
+			DYNABUF_APPEND_RESERVED(cachebuf, byte);
+			if ((byte == '"') || (byte == '\''))
+				quote = byte;
+			else if (byte == CHAR_SOB)
+				brace_opened(lines);
+			NEXT_BYTE();
+			continue;
+		}
+		// special characters ("0x00 TAB LF CR SPC / : ; }")
+		switch (byte) {
+		case '\t':
+		case ' ':
+			// shrink multiple blanks
+			DYNABUF_APPEND_RESERVED(cachebuf, ' ');
+			while ((read < end) && ((*read == '\t') || (*read == ' ')))
+				++read;
+			NEXT_BYTE();
+			break;
+		case CHAR_LF:
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_SOL);
+			++lines;
+			NEXT_BYTE();
+			break;
+		case CHAR_CR:
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_SOL);
+			++lines;
+			NEXT_BYTE();
+			if (byte == CHAR_LF)
+				NEXT_BYTE();	// skip LF of CRLF
+			break;
+		case CHAR_EOB:
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOB);
+			brace_closed(lines);
+			NEXT_BYTE();
+			break;
+		case '/':
+			// to check for "//", get another byte:
+			NEXT_BYTE();
+			if (byte != '/') {
+				DYNABUF_APPEND_RESERVED(cachebuf, '/');
+				break;	// second byte must be processed normally
+			}
+			// it's really "//", so act as if ';'
+			/*FALLTHROUGH*/
+		case ';':
+			// skip remainder of line
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+			read = find_line_end(read, end);
+			NEXT_BYTE();
+			break;
+		case ':':	// statement delimiter
+			DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+			NEXT_BYTE();
+			break;
+		default:
+			return 1;	// illegal character, so do not cache
+		}
+	}
+	DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+	DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOF);
+	// add another EOF, just to make sure file is never read too far
+	DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOS);
+	DYNABUF_APPEND_RESERVED(cachebuf, CHAR_EOF);
+	return 0;	// ok
+}
+#undef NEXT_BYTE
+
+// remember that the listing report has reached the current line of a file
+// (lines skipped since the previous one, for example in blocks, are added too)
+static void report_reached_line(void)
+{
+	struct report_line	*line;
+	int			number;
+
+	if ((Input_now->source != INPUTSRC_FILE) && (Input_now->source != INPUTSRC_CACHE))
+		return;
+
+	if (Input_now == report->last_input)
+		number = report->lines[report->used - 1].line_number + 1;
+	else
+		number = Input_now->line_number;
+	for (; number <= Input_now->line_number; ++number) {
+		if (report->used == report->size) {
+			report->lines = safe_realloc(report->lines, report->size * sizeof(*report->lines), (report->size ? 2 * report->size : 1024) * sizeof(*report->lines), MEMUSE_OUTPUT);
+			report->size = report->size ? 2 * report->size : 1024;
+		}
+		line = &report->lines[report->used++];
+		line->file = Input_now->file;
+		line->line_number = number;
+		line->new_source = (Input_now != report->last_input);
+		line->bin_used = 0;
+		line->cycles_min = 0;
+		line->cycles_max = 0;
+		line->cycles_unknown = FALSE;
+		line->peephole = NULL;
+		line->local_scope = section_now->local_scope;
+		line->cheap_scope = section_now->cheap_scope;
+		report->last_input = Input_now;
+	}
+}
+
 // let current input point to start of file
-void Input_new_file(const char *filename, FILE *fd)
+static void new_file(const struct cached_file *file, FILE *fd)
 {
-	Input_now->original_filename	= filename;
+	Input_now->original_filename	= file->name;
+	Input_now->file			= file;
 	Input_now->line_number		= 1;
 	Input_now->source		= INPUTSRC_FILE;
 	Input_now->state		= INPUTSTATE_SOF;
 	Input_now->src.fd		= fd;
+	Input_now->src.ram_ptr		= file_read_ptr;
+	Input_now->parsed		= NULL;
 }
 
+// let current input point to start of given file. if possible, the copy in
+// high-level format is used, otherwise the file is opened (again).
+// returns nonzero on error (file could not be opened).
+int Input_open_file(struct cached_file *file)
+{
+	FILE	*fd;
+
+	// convert on first use
+	if (!file->conversion_tried) {
+		file->conversion_tried = TRUE;
+		if (convert_file(file) == 0) {
+			file->converted = DynaBuf_get_copy(cachebuf, MEMUSE_FILES);
+			file->converted_size = cachebuf->size;
+			remember_braces(file->converted);
+		}
+	}
+	// files with illegal characters must be read normally so errors get
+	// reported
+	if (file->converted) {
+		new_file(file, NULL);
+		Input_now->source = INPUTSRC_CACHE;
+		Input_now->state = INPUTSTATE_NORMAL;
+		Input_now->src.ram_ptr = file->converted;
+	} else {
+		// files that only exist in memory are read from a temporary copy
+		if (file->in_memory) {
+			fd = tmpfile();
+			if (fd) {
+				fwrite(file->body, 1, file->size, fd);
+				rewind(fd);
+			}
+		} else {
+			fd = fopen(file->path, FILE_READBINARY);
+		}
+		if (fd == NULL) {
+			throw_cannot_open(file->name);
+			return 1;	// error
+		}
+		new_file(file, fd);
+	}
+	if (report->active) {
+		report->last_input = NULL;	// always show file name
+		report_reached_line();
+	}
+	return 0;	// ok
+}
 
-// remember source code character for report generator
-#define HEXBUFSIZE	9	// actually, 4+1 is enough, but for systems without snprintf(), let's be extra-safe.
-#define IF_WANTED_REPORT_SRCCHAR(c)	do { if (report->fd) report_srcchar(c); } while(0)
-static void report_srcchar(char new_char)
+// close file opened by Input_open_file() (if it was really opened)
+void Input_close_file(void)
 {
-	static char	prev_char	= '\0';
-	int		ii;
-	char		hex_address[HEXBUFSIZE];
-	char		hexdump[2 * REPORT_BINBUFSIZE + 2];	// +2 for '.' and terminator
+	if (Input_now->source == INPUTSRC_FILE)
+		fclose(Input_now->src.fd);
+}
 
-	// if input has changed, insert explanation
-	if (Input_now != report->last_input) {
-		fprintf(report->fd, "\n; ******** Source: %s\n", Input_now->original_filename);
-		report->last_input = Input_now;
-		report->asc_used = 0;	// clear buffer
-		prev_char = '\0';
-	}
-	if (prev_char == '\n') {
-		// line start after line break detected and EOS processed,
-		// build report line:
-		// show line number...
-		fprintf(report->fd, "%6d  ", Input_now->line_number - 1);
-		// prepare outbytes' start address
-		if (report->bin_used) {
-#if _BSD_SOURCE || _XOPEN_SOURCE >= 500 || _ISOC99_SOURCE || _POSIX_C_SOURCE >= 200112L
-			snprintf(hex_address, HEXBUFSIZE, "%04x", report->bin_address);
-#else
-			sprintf(hex_address, "%04x", report->bin_address);
-#endif
-		} else {
-			hex_address[0] = '\0';
-		}
-		// prepare outbytes
-		hexdump[0] = '\0';
-		for (ii = 0; ii < report->bin_used; ++ii)
-			sprintf(hexdump + 2 * ii, "%02x", (unsigned int) (unsigned char) (report->bin_buf[ii]));
-		// if binary buffer is full, overwrite last byte with "..."
-		if (report->bin_used == REPORT_BINBUFSIZE)
-			sprintf(hexdump + 2 * (REPORT_BINBUFSIZE - 1), "...");
-		// show address and bytes
-		fprintf(report->fd, "%-4s %-19s", hex_address, hexdump);
-		// at this point the output should be a multiple of 8 characters
-		// so far to preserve tabs of the source...
-		if (report->asc_used == REPORT_ASCBUFSIZE)
-			--report->asc_used;
-		report->asc_buf[report->asc_used] = '\0';
-		fprintf(report->fd, "%s\n", report->asc_buf);	// show source line
-		report->asc_used = 0;	// reset buffers
-		report->bin_used = 0;
-	}
-	if (new_char != '\n' && new_char != '\r') {	// detect line break
-		if (report->asc_used < REPORT_ASCBUFSIZE)
-			report->asc_buf[report->asc_used++] = new_char;
-	}
-	prev_char = new_char;
+// make current input deliver end-of-file after current statement ("!eof")
+void Input_end_file(void)
+{
+	if (Input_now->source == INPUTSRC_CACHE) {
+		// converted files only contain a single CHAR_EOF (well, two,
+		// but the first one will do), so move read pointer there
+		while (*(Input_now->src.ram_ptr) != CHAR_EOF)
+			++(Input_now->src.ram_ptr);
+	} else {
+		Input_now->state = INPUTSTATE_EOF;
+	}
+}
+
+// mark current file as to be included only once per pass ("!once")
+boolean Input_mark_once(void)
+{
+	if (Input_now->source == INPUTSRC_RAM)
+		return FALSE;
+
+	Input_now->file->original->has_once = TRUE;
+	return TRUE;
+}
+
+
+// looked-up statements are stored in a hash table using the read pointer as
+// key (linear probing, table is doubled when half full)
+#define PARSED_INITIALSIZE	64
+static struct parsed_stmt *find_slot(struct parsed_block *block, const char *start)
+{
+	size_t			hash;
+	struct parsed_stmt	*slot;
+
+	hash = ((size_t) start) * 2654435761u;
+	hash ^= hash >> 15;
+	for (;;) {
+		slot = block->slots + (hash & (block->size - 1));
+		if ((slot->start == start) || (slot->start == NULL))
+			return slot;
+		++hash;
+	}
+}
+
+// check for already looked-up statement at current read position. returns
+// NULL if there is none. "stmt" is prepared so Input_remember_stmt() can be
+// called after the keyword has been looked up.
+struct parsed_stmt *Input_find_stmt(struct parsed_stmt *stmt)
+{
+	struct parsed_stmt	*slot;
+
+	if (Input_now->parsed == NULL) {
+		stmt->start = NULL;
+		return NULL;
+	}
+	stmt->start = Input_now->src.ram_ptr;
+	if (Input_now->parsed->used == 0)
+		return NULL;
+	slot = find_slot(Input_now->parsed, stmt->start);
+	return slot->start ? slot : NULL;
+}
+
+// remember current read position as the one to continue at (call after
+// reading the keyword or the expression)
+void Input_set_resume(struct parsed_stmt *stmt)
+{
+	if (stmt->start == NULL)
+		return;
+	stmt->resume = Input_now->src.ram_ptr;
+	stmt->gotbyte = GotByte;
+}
+
+// remember looked-up statement (does nothing if current input cannot do it)
+void Input_remember_stmt(const struct parsed_stmt *stmt)
+{
+	struct parsed_block	*block	= Input_now->parsed;
+	struct parsed_stmt	*old_slots,
+				*slot;
+	int			old_size,
+				ii;
+
+	if (stmt->start == NULL)
+		return;
+	if (block->used * 2 >= block->size) {
+		old_slots = block->slots;
+		old_size = block->size;
+		block->size = old_size ? (old_size * 2) : PARSED_INITIALSIZE;
+		block->slots = safe_malloc(block->size * sizeof(*(block->slots)), MEMUSE_BLOCKS);
+		for (ii = 0; ii < block->size; ++ii)
+			block->slots[ii].start = NULL;
+		for (ii = 0; ii < old_size; ++ii) {
+			if (old_slots[ii].start)
+				*find_slot(block, old_slots[ii].start) = old_slots[ii];
+		}
+		safe_free(old_slots, old_size * sizeof(*old_slots), MEMUSE_BLOCKS);
+	}
+	slot = find_slot(block, stmt->start);
+	if (slot->start == NULL)
+		++(block->used);
+	else if ((slot->kind == STMT_EXPRESSION) && (slot->action != stmt->action))
+		ALU_free_compiled(slot->action);
+	*slot = *stmt;
+}
+
+// continue reading after keyword of already looked-up statement
+void Input_resume_stmt(const struct parsed_stmt *stmt)
+{
+	Input_now->src.ram_ptr = (char *) stmt->resume;
+	GotByte = stmt->gotbyte;
+}
+
+// free memory used for looked-up statements
+void Input_free_parsed_block(struct parsed_block *block)
+{
+	int	ii;
+
+	for (ii = 0; ii < block->size; ++ii) {
+		if (block->slots[ii].start && (block->slots[ii].kind == STMT_EXPRESSION))
+			ALU_free_compiled(block->slots[ii].action);
+	}
+	safe_free(block->slots, block->size * sizeof(*(block->slots)), MEMUSE_BLOCKS);
+	PARSED_BLOCK_INIT(block);
 }
 
 
@@ -121,7 +579,6 @@ static char get_processed_from_file(void)
 		case INPUTSTATE_SOF:
 			// fetch first byte from the current source file
 			from_file = getc(Input_now->src.fd);
-			IF_WANTED_REPORT_SRCCHAR(from_file);
 			//TODO - check for bogus/malformed BOM and ignore?
 			// check for hashbang line and ignore
 			if (from_file == '#') {
@@ -134,7 +591,6 @@ static char get_processed_from_file(void)
 		case INPUTSTATE_NORMAL:
 			// fetch a fresh byte from the current source file
 			from_file = getc(Input_now->src.fd);
-			IF_WANTED_REPORT_SRCCHAR(from_file);
 			// now process it
 			/*FALLTHROUGH*/
 		case INPUTSTATE_AGAIN:
@@ -184,7 +640,6 @@ static char get_processed_from_file(void)
 			case '/':
 				// to check for "//", get another byte:
 				from_file = getc(Input_now->src.fd);
-				IF_WANTED_REPORT_SRCCHAR(from_file);
 				if (from_file != '/') {
 					// not "//", so:
 					Input_now->state = INPUTSTATE_AGAIN;	// second byte must be parsed normally later on
@@ -210,7 +665,6 @@ static char get_processed_from_file(void)
 			// read until non-blank, then deliver that
 			do {
 				from_file = getc(Input_now->src.fd);
-				IF_WANTED_REPORT_SRCCHAR(from_file);
 			} while ((from_file == '\t') || (from_file == ' '));
 			// re-process last byte
 			Input_now->state = INPUTSTATE_AGAIN;
@@ -227,7 +681,6 @@ static char get_processed_from_file(void)
 
 		case INPUTSTATE_SKIPLF:
 			from_file = getc(Input_now->src.fd);
-			IF_WANTED_REPORT_SRCCHAR(from_file);
 			// if LF, ignore it and fetch another byte
 			// otherwise, process current byte
 			if (from_file == CHAR_LF)
@@ -239,7 +692,6 @@ static char get_processed_from_file(void)
 			// read until end-of-line or end-of-file
 			do {
 				from_file = getc(Input_now->src.fd);
-				IF_WANTED_REPORT_SRCCHAR(from_file);
 			} while ((from_file != EOF) && (from_file != CHAR_CR) && (from_file != CHAR_LF));
 			// re-process last byte
 			Input_now->state = INPUTSTATE_AGAIN;
@@ -261,9 +713,10 @@ static char get_processed_from_file(void)
 }
 
 // This function delivers the next byte from the currently active byte source
-// in shortened high-level format. FIXME - use fn ptr?
+// in shortened high-level format. It is called by the GetByte() macro for
+// start-of-line bytes and file reads, ordinary RAM bytes are fetched there.
 // When inside quotes, use Input_quoted_to_dynabuf() instead!
-char GetByte(void)
+char Input_get_byte(void)
 {
 //	for (;;) {
 		// If byte source is RAM, then no conversions are
@@ -273,6 +726,7 @@ char GetByte(void)
 		// get_processed_from_file() which will do a shit load of conversions.
 		switch (Input_now->source) {
 		case INPUTSRC_RAM:
+		case INPUTSRC_CACHE:
 			GotByte = *(Input_now->src.ram_ptr++);
 			break;
 		case INPUTSRC_FILE:
@@ -286,8 +740,11 @@ char GetByte(void)
 //			return GotByte;
 //		Input_now->line_number++;
 //	}
-		if (GotByte == CHAR_SOL)
+		if (GotByte == CHAR_SOL) {
 			Input_now->line_number++;
+			if (report->active)
+				report_reached_line();
+		}
 		return GotByte;
 }
 
@@ -301,6 +758,7 @@ static char GetQuotedByte(void)
 
 	switch (Input_now->source) {
 	case INPUTSRC_RAM:
+	case INPUTSRC_CACHE:
 		// if byte source is RAM, then no conversion is necessary,
 		// because in RAM the source already has high-level format
 		GotByte = *(Input_now->src.ram_ptr++);
@@ -308,7 +766,6 @@ static char GetQuotedByte(void)
 	case INPUTSRC_FILE:
 		// fetch a fresh byte from the current source file
 		from_file = getc(Input_now->src.fd);
-		IF_WANTED_REPORT_SRCCHAR(from_file);
 		switch (from_file) {
 		case EOF:
 			// remember to send an end-of-file
@@ -334,7 +791,7 @@ static char GetQuotedByte(void)
 	}
 	// now check for end of statement
 	if (GotByte == CHAR_EOS)
-		Throw_error("Quotes still open at end of line.");
+		Throw_error(exception_quotes_open);
 	return GotByte;
 }
 
@@ -362,13 +819,50 @@ void Input_ensure_EOS(void)	// Now GotByte = first char to test
 	}
 }
 
+// return set of bytes a quoted string in memory has to be checked for
+// (the terminating zero of the set is CHAR_EOS, so strcspn() stops there, too)
+static const char *quote_stoppers(char closing_quote)
+{
+	static char	stoppers[3];
+
+	stoppers[0] = closing_quote;
+	stoppers[1] = (config.wanted_version >= VER_BACKSLASHESCAPING) ? '\\' : '\0';
+	stoppers[2] = '\0';
+	return stoppers;
+}
+
 // read string to dynabuf until closing quote is found
 // returns 1 on errors (unterminated, escaping error)
 int Input_quoted_to_dynabuf(char closing_quote)
 {
-	boolean	escaped	= FALSE;
+	boolean		escaped	= FALSE;
+	const char	*stoppers,
+			*read;
 
 	//DYNABUF_CLEAR(GlobalDynaBuf);	// do not clear, caller might want to append to existing contents (TODO - check!)
+	// if source is in RAM, find end of string and copy it in one go
+	if ((Input_now->source == INPUTSRC_RAM)
+	|| (Input_now->source == INPUTSRC_CACHE)) {
+		stoppers = quote_stoppers(closing_quote);
+		read = Input_now->src.ram_ptr;
+		for (;;) {
+			read += strcspn(read, stoppers);
+			if ((*read == CHAR_EOS) || (*read == closing_quote))
+				break;
+
+			// backslash, so skip escaped byte (unless end of statement)
+			if (*++read != CHAR_EOS)
+				++read;
+		}
+		DynaBuf_add_span(GlobalDynaBuf, Input_now->src.ram_ptr, read - Input_now->src.ram_ptr);
+		if (*read == CHAR_EOS) {
+			Input_now->src.ram_ptr = (char *) read;	// let code below complain
+		} else {
+			Input_now->src.ram_ptr = (char *) read + 1;
+			GotByte = closing_quote;
+			return 0;	// ok
+		}
+	}
 	for (;;) {
 		GetQuotedByte();
 		if (GotByte == CHAR_EOS)
@@ -377,7 +871,7 @@ int Input_quoted_to_dynabuf(char closing_quote)
 		if (escaped) {
 			// previous byte was backslash, so do not check for terminator nor backslash
 			escaped = FALSE;
-			// do not actually _convert_ escape sequences to their target byte, that is done by Input_unescape_dynabuf() below!
+			// do not actually _convert_ escape sequences to their target byte, that is done by unescape_dynabuf()!
 			// TODO - but maybe check for illegal escape sequences?
 			// at the moment checking is only done when the string
 			// gets used for something...
@@ -393,10 +887,32 @@ int Input_quoted_to_dynabuf(char closing_quote)
 	}
 }
 
+// return byte meant by backslash sequence (complain if unsupported)
+static char unescape_byte(char byte)
+{
+	switch (byte) {
+	case '\\':
+	case '\'':
+	case '"':
+		return byte;
+	case '0':	// NUL
+		return 0;
+	case 't':	// TAB
+		return 9;
+	case 'n':	// LF
+		return 10;
+	case 'r':	// CR
+		return 13;
+	// TODO - 'a' to BEL? others?
+	default:
+		Throw_error("Unsupported backslash sequence.");	// TODO - add unexpected character to error message?
+		return byte;
+	}
+}
+
 // process backslash escapes in GlobalDynaBuf (so size might shrink)
 // returns 1 on errors (escaping errors)
-// TODO - check: if this is only ever called directly after Input_quoted_to_dynabuf, integrate that call here?
-int Input_unescape_dynabuf(int read_index)
+static int unescape_dynabuf(int read_index)
 {
 	int	write_index;
 	char	byte;
@@ -411,28 +927,7 @@ int Input_unescape_dynabuf(int read_index)
 	while (read_index < GlobalDynaBuf->size) {
 		byte = GLOBALDYNABUF_CURRENT[read_index++];
 		if (escaped) {
-			switch (byte) {
-			case '\\':
-			case '\'':
-			case '"':
-				break;
-			case '0':	// NUL
-				byte = 0;
-				break;
-			case 't':	// TAB
-				byte = 9;
-				break;
-			case 'n':	// LF
-				byte = 10;
-				break;
-			case 'r':	// CR
-				byte = 13;
-				break;
-			// TODO - 'a' to BEL? others?
-			default:
-				Throw_error("Unsupported backslash sequence.");	// TODO - add unexpected character to error message?
-			}
-			GLOBALDYNABUF_CURRENT[write_index++] = byte;
+			GLOBALDYNABUF_CURRENT[write_index++] = unescape_byte(byte);
 			escaped = FALSE;
 		} else {
 			if (byte == '\\') {
@@ -448,15 +943,120 @@ int Input_unescape_dynabuf(int read_index)
 	return 0;	// ok
 }
 
-// Skip or store block (starting with next byte, so call directly after
-// reading opening brace).
-// the block is read into GlobalDynaBuf.
-// If "Store" is TRUE, then a copy is made and a pointer to that is returned.
-// If "Store" is FALSE, NULL is returned.
-// After calling this function, GotByte holds '}'. Unless EOF was found first,
-// but then a serious error would have been thrown.
-// FIXME - use a struct block *ptr argument!
-char *Input_skip_or_store_block(boolean store)
+// read string to dynabuf until closing quote is found and process backslash
+// escapes. if the source is in RAM, this is done in a single pass: runs of
+// plain bytes are found using strcspn() and copied in one go.
+// returns 1 on errors (unterminated, escaping error)
+int Input_unescaped_to_dynabuf(char closing_quote)
+{
+	const char	*stoppers,
+			*read,
+			*plain;
+	int		start	= GlobalDynaBuf->size;
+
+	if ((Input_now->source == INPUTSRC_RAM)
+	|| (Input_now->source == INPUTSRC_CACHE)) {
+		stoppers = quote_stoppers(closing_quote);
+		read = Input_now->src.ram_ptr;
+		for (;;) {
+			plain = read;
+			read += strcspn(read, stoppers);
+			DynaBuf_add_span(GlobalDynaBuf, plain, read - plain);
+			if (*read == closing_quote) {
+				Input_now->src.ram_ptr = (char *) read + 1;
+				GotByte = closing_quote;
+				return 0;	// ok
+			}
+			if ((*read == CHAR_EOS) || (read[1] == CHAR_EOS))
+				break;
+
+			// backslash
+			DYNABUF_APPEND(GlobalDynaBuf, unescape_byte(read[1]));
+			read += 2;
+		}
+		// end of statement before closing quote: let the code below
+		// complain
+		Input_now->src.ram_ptr = (char *) read;
+	}
+	if (Input_quoted_to_dynabuf(closing_quote))
+		return 1;	// unterminated or escaping error
+
+	return unescape_dynabuf(start);
+}
+
+// Skip block in memory, doing exactly what reading it via GetByte() and
+// Input_quoted_to_dynabuf() would do, only faster.
+static void skip_ram_block(void)
+{
+	const char		*read	= Input_now->src.ram_ptr;
+	int			depth	= 1,	// to find matching block end
+				lines	= 0;
+	char			byte,
+				quote;
+	boolean			escaped;
+	struct brace_match	*match;
+
+	// if this block is part of a converted file, its end is known
+	if (brace_table_used) {
+		match = find_brace_slot(read);
+		if (match->start) {
+			Input_now->line_number += match->lines;
+			Input_now->src.ram_ptr = (char *) match->end;
+			GotByte = CHAR_EOB;
+			if (report->active)
+				report_reached_line();
+			return;
+		}
+	}
+	do {
+		byte = *read++;
+		switch (byte) {
+		case CHAR_SOL:
+			++lines;
+			break;
+		case CHAR_EOF:	// End-of-file in block? Sorry, no way.
+			Input_now->line_number += lines;
+			Input_now->src.ram_ptr = (char *) read;
+			GotByte = byte;
+			Throw_serious_error(exception_no_right_brace);
+
+		case '"':	// Quotes? Okay, skip quoted stuff.
+		case '\'':
+			quote = byte;
+			escaped = FALSE;
+			for (;;) {
+				byte = *read++;
+				if (byte == CHAR_EOS) {
+					Input_now->line_number += lines;
+					lines = 0;
+					Throw_error(exception_quotes_open);
+					break;
+				}
+				if (escaped)
+					escaped = FALSE;
+				else if (byte == quote)
+					break;
+				else if ((byte == '\\') && (config.wanted_version >= VER_BACKSLASHESCAPING))
+					escaped = TRUE;
+			}
+			break;
+		case CHAR_SOB:
+			++depth;
+			break;
+		case CHAR_EOB:
+			--depth;
+			break;
+		}
+	} while (depth);
+	Input_now->line_number += lines;
+	Input_now->src.ram_ptr = (char *) read;
+	GotByte = CHAR_EOB;
+	if (report->active)
+		report_reached_line();
+}
+
+// read block into GlobalDynaBuf (from file, byte by byte)
+static void read_block_from_file(void)
 {
 	char	byte;
 	int	depth	= 1;	// to find matching block end
@@ -485,31 +1085,106 @@ char *Input_skip_or_store_block(boolean store)
 			break;
 		}
 	} while (depth);
-	// in case of skip, return now
-	if (!store)
-		return NULL;
+}
 
-	// otherwise, prepare to return copy of block
-	// add EOF, just to make sure block is never read too far
-	DynaBuf_append(GlobalDynaBuf, CHAR_EOS);
-	DynaBuf_append(GlobalDynaBuf, CHAR_EOF);
-	// return pointer to copy
-	return DynaBuf_get_copy(GlobalDynaBuf);
+// Skip block (starting with next byte, so call directly after reading
+// opening brace).
+// After calling this function, GotByte holds '}'. Unless EOF was found first,
+// but then a serious error would have been thrown.
+void Input_skip_block(void)
+{
+	if (Input_now->source == INPUTSRC_FILE)
+		read_block_from_file();
+	else
+		skip_ram_block();
+}
+
+// Store block (see Input_skip_block()) and return pointer to it.
+// If the current input is already in memory, the pointer just points into it.
+// Otherwise a copy is made, and that pointer is also written to "*copy" so
+// the caller can free it afterwards (*copy is NULL if there is no copy).
+// The size of the copy is written to "*copy_size".
+// If the block must stay available after the current input has ended (macro
+// bodies), set "permanent" to TRUE.
+char *Input_store_block(boolean permanent, char **copy, size_t *copy_size)
+{
+	char	*body;
+	size_t	size;
+
+	// cached files are never freed, and blocks read from other blocks
+	// (loops inside loops or macros) live as long as the outer block
+	if ((Input_now->source == INPUTSRC_CACHE)
+	|| ((Input_now->source == INPUTSRC_RAM) && !permanent)) {
+		body = Input_now->src.ram_ptr;
+		skip_ram_block();
+		*copy = NULL;
+		*copy_size = 0;
+		return body;
+	}
+
+	// otherwise, make a copy
+	if (Input_now->source == INPUTSRC_FILE) {
+		read_block_from_file();
+		// add EOF, just to make sure block is never read too far
+		DynaBuf_append(GlobalDynaBuf, CHAR_EOS);
+		DynaBuf_append(GlobalDynaBuf, CHAR_EOF);
+		*copy = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_BLOCKS);
+		*copy_size = GlobalDynaBuf->size;
+	} else {
+		body = Input_now->src.ram_ptr;
+		skip_ram_block();
+		size = Input_now->src.ram_ptr - body;
+		*copy_size = size + 2;
+		*copy = safe_malloc(*copy_size, MEMUSE_BLOCKS);
+		memcpy(*copy, body, size);
+		(*copy)[size] = CHAR_EOS;	// add EOF, see above
+		(*copy)[size + 1] = CHAR_EOF;
+	}
+	return *copy;
 }
 
 // Append to GlobalDynaBuf while characters are legal for keywords.
 // Throws "missing string" error if none.
 // Returns number of characters added.
+// Also puts lower case version and its hash value into Input_keyword.
 int Input_append_keyword_to_global_dynabuf(void)
 {
-	int	length	= 0;
-
-	// add characters to buffer until an illegal one comes along
-	while (BYTE_CONTINUES_KEYWORD(GotByte)) {
+	int		length;
+	const char	*read;
+	char		lower;
+	hash_t		hash	= TREE_HASH_START;
+
+	DYNABUF_CLEAR(lower_keyword);
+	// if source is in RAM, find end of keyword and copy it in one go
+	if (BYTE_CONTINUES_KEYWORD(GotByte)
+	&& ((Input_now->source == INPUTSRC_RAM) || (Input_now->source == INPUTSRC_CACHE))) {
 		DYNABUF_APPEND(GlobalDynaBuf, GotByte);
-		++length;
-		GetByte();
+		lower = BYTE_TO_LOWER_CASE(GotByte);
+		DYNABUF_APPEND(lower_keyword, lower);
+		TREE_HASH_ADD(hash, lower);
+		read = Input_now->src.ram_ptr;
+		while (BYTE_CONTINUES_KEYWORD(*read)) {
+			lower = BYTE_TO_LOWER_CASE(*read);
+			DYNABUF_APPEND(lower_keyword, lower);
+			TREE_HASH_ADD(hash, lower);
+			++read;
+		}
+		DynaBuf_add_span(GlobalDynaBuf, Input_now->src.ram_ptr, read - Input_now->src.ram_ptr);
+		Input_now->src.ram_ptr = (char *) read;
+		GetByte();	// fetch byte after keyword
+	} else {
+		// add characters to buffer until an illegal one comes along
+		while (BYTE_CONTINUES_KEYWORD(GotByte)) {
+			DYNABUF_APPEND(GlobalDynaBuf, GotByte);
+			lower = BYTE_TO_LOWER_CASE(GotByte);
+			DYNABUF_APPEND(lower_keyword, lower);
+			TREE_HASH_ADD(hash, lower);
+			GetByte();
+		}
 	}
+	length = lower_keyword->size;
+	DYNABUF_APPEND(lower_keyword, '\0');
+	Input_keyword.hash = hash;
 	if (length == 0)
 		Throw_error(exception_missing_string);
 	return length;
@@ -560,9 +1235,10 @@ int Input_read_and_lower_keyword(void)
 
 	DYNABUF_CLEAR(GlobalDynaBuf);
 	length = Input_append_keyword_to_global_dynabuf();
+	// lower case version is already there, so just copy it over
+	memcpy(GLOBALDYNABUF_CURRENT, lower_keyword->buffer, length);
 	// add terminator to buffer (increments buffer's length counter)
 	DynaBuf_append(GlobalDynaBuf, '\0');
-	DynaBuf_to_lower(GlobalDynaBuf, GlobalDynaBuf);	// convert to lower case
 	return length;
 }
 
@@ -617,8 +1293,8 @@ int Input_read_filename(boolean allow_library, boolean *uses_lib)
 	}
 	// remember border between optional library prefix and string from assembler source file
 	start_of_string = GlobalDynaBuf->size;
-	// read file name string
-	if (Input_quoted_to_dynabuf(terminator))
+	// read file name string and resolve backslash escapes
+	if (Input_unescaped_to_dynabuf(terminator))
 		return 1;	// unterminated or escaping error
 
 	GetByte();	// eat terminator
@@ -628,10 +1304,6 @@ int Input_read_filename(boolean allow_library, boolean *uses_lib)
 		return 1;	// error
 	}
 
-	// resolve backslash escapes
-	if (Input_unescape_dynabuf(start_of_string))
-		return 1;	// escaping error
-
 	// terminate string
 	DynaBuf_append(GlobalDynaBuf, '\0');
 #ifdef PLATFORM_CONVERTPATH
@@ -688,31 +1360,207 @@ struct ipi {
 };
 static struct ipi	ipi_head	= {&ipi_head, &ipi_head, NULL};	// head element
 static	STRUCT_DYNABUF_REF(pathbuf, 256);	// to combine search path and file spec
+// file cache: files are only searched for and read once, all later accesses
+// (in further passes or by repeated "!source"/"!binary") use the cache.
+// id number 0 means "name as given", other values mean "include paths were
+// tried, too". in batch mode, each different list of include paths gets its
+// own id number, so the cache can be shared by all projects.
+static struct arena	file_arena;	// file cache is kept until program exits
+static	STRUCT_RWTABLE_REF(file_forest, &file_arena);	// node bodies point to struct cached_file
+// files found under different names or include paths are recognized by their
+// canonical path, so "!once" works for all of them:
+static	STRUCT_RWTABLE_REF(canonical_table, &file_arena);	// node bodies point to first entry for that file
+static	STRUCT_DYNABUF_REF(canonicalbuf, 256);	// to build canonical path
+static	STRUCT_DYNABUF_REF(filebuf, 65536);	// to hold raw file contents
+static	STRUCT_DYNABUF_REF(unpackbuf, 65536);	// to unpack compressed file contents
+static	STRUCT_DYNABUF_REF(ipi_names, 256);	// all include paths, each one terminated
+static	STRUCT_DYNABUF_REF(ipi_used_names, 256);	// list that ipi_id belongs to
+static int		ipi_id		= 1;	// file cache id for include path lookups
+static boolean		ipi_changed	= FALSE;
+// files in memory (for libacme), looked up before the file system
+struct memfile {
+	struct memfile	*next;
+	char		*name;
+	char		*body;
+	size_t		size;
+};
+static struct memfile	*memfiles	= NULL;
+static boolean		stdin_spooled	= FALSE;	// TRUE when stdin has been read into a memfile
+#define STDIN_NAME	"-"	// file name meaning "standard input stream"
 
 // add entry
 void includepaths_add(const char *path)
 {
 	struct ipi	*ipi;
 
-	ipi = safe_malloc(sizeof(*ipi));
+	if (ipi_names->buffer == NULL)
+		DYNABUF_CLEAR(ipi_names);
+	DynaBuf_add_string(ipi_names, path);
+	DynaBuf_append(ipi_names, '\0');
+	ipi_changed = TRUE;
+	ipi = safe_malloc(sizeof(*ipi), MEMUSE_OTHER);
 	ipi->path = path;
 	ipi->next = &ipi_head;
 	ipi->prev = ipi_head.prev;
 	ipi->next->prev = ipi;
 	ipi->prev->next = ipi;
 }
-// open file for reading (trying list entries as prefixes)
-// "uses_lib" tells whether to access library or to make use of include paths
-// file name is expected in GlobalDynaBuf
-FILE *includepaths_open_ro(boolean uses_lib)
+
+// remove all entries (for "--batch")
+void includepaths_clear(void)
+{
+	struct ipi	*ipi,
+			*next;
+
+	for (ipi = ipi_head.next; ipi != &ipi_head; ipi = next) {
+		next = ipi->next;
+		safe_free(ipi, sizeof(*ipi), MEMUSE_OTHER);
+	}
+	ipi_head.next = &ipi_head;
+	ipi_head.prev = &ipi_head;
+	DYNABUF_CLEAR(ipi_names);
+	ipi_changed = TRUE;
+}
+
+// add file in memory (an earlier one with the same name is replaced).
+// name and contents are copied.
+void filecache_add_memfile(const char *name, const char *body, size_t size)
+{
+	struct memfile	*memfile;
+
+	for (memfile = memfiles; memfile; memfile = memfile->next) {
+		if (strcmp(memfile->name, name) == 0)
+			break;
+	}
+	if (memfile) {
+		safe_free(memfile->body, memfile->size ? memfile->size : 1, MEMUSE_FILES);
+	} else {
+		memfile = safe_malloc(sizeof(*memfile), MEMUSE_FILES);
+		memfile->name = safe_malloc(strlen(name) + 1, MEMUSE_FILES);
+		strcpy(memfile->name, name);
+		memfile->next = memfiles;
+		memfiles = memfile;
+	}
+	memfile->body = safe_malloc(size ? size : 1, MEMUSE_FILES);
+	memcpy(memfile->body, body, size);
+	memfile->size = size;
+}
+
+// remove all files in memory
+void filecache_clear_memfiles(void)
+{
+	struct memfile	*next;
+
+	for (; memfiles; memfiles = next) {
+		next = memfiles->next;
+		safe_free_string(memfiles->name, MEMUSE_FILES);
+		safe_free(memfiles->body, memfiles->size ? memfiles->size : 1, MEMUSE_FILES);
+		safe_free(memfiles, sizeof(*memfiles), MEMUSE_FILES);
+	}
+}
+
+// return file cache id number for lookups using include paths
+static int get_ipi_id(void)
+{
+	if (ipi_changed) {
+		ipi_changed = FALSE;
+		if (ipi_used_names->buffer == NULL)
+			DYNABUF_CLEAR(ipi_used_names);
+		if ((ipi_names->size != ipi_used_names->size)
+		|| memcmp(ipi_names->buffer, ipi_used_names->buffer, ipi_names->size)) {
+			++ipi_id;
+			DYNABUF_CLEAR(ipi_used_names);
+			if (ipi_names->size) {
+				while (ipi_used_names->reserved < ipi_names->size)
+					dynabuf_enlarge(ipi_used_names);
+				memcpy(ipi_used_names->buffer, ipi_names->buffer, ipi_names->size);
+				ipi_used_names->size = ipi_names->size;
+			}
+		}
+	}
+	return ipi_id;
+}
+
+// complain about file that cannot be opened
+static void throw_cannot_open(const char *filename)
+{
+	// CAUTION, I'm re-using the path dynabuf to assemble the error message:
+	DYNABUF_CLEAR(pathbuf);
+	DynaBuf_add_string(pathbuf, "Cannot open input file \"");
+	DynaBuf_add_string(pathbuf, filename);
+	DynaBuf_add_string(pathbuf, "\".");
+	DynaBuf_append(pathbuf, '\0');
+	Throw_error(pathbuf->buffer);
+}
+
+// read whole file into filebuf (in one go, instead of calling getc() for
+// each byte)
+#define FILE_CHUNKSIZE	65536
+static void read_whole_file(FILE *fd)
+{
+	size_t	got;
+
+	DYNABUF_CLEAR(filebuf);
+	do {
+		while (filebuf->reserved - filebuf->size < FILE_CHUNKSIZE)
+			dynabuf_enlarge(filebuf);
+		got = fread(filebuf->buffer + filebuf->size, 1, FILE_CHUNKSIZE, fd);
+		filebuf->size += got;
+	} while (got == FILE_CHUNKSIZE);
+}
+
+// read file whose path is in pathbuf into filebuf (files in memory are
+// checked first). the standard input stream can only be read once, so it
+// is spooled to a file in memory. returns FALSE if there is no such file,
+// otherwise "*in_memory" tells whether the file is on disk.
+static boolean try_path(boolean *in_memory)
 {
+	struct memfile	*memfile;
 	FILE		*stream;
+
+	if ((!stdin_spooled) && (strcmp(pathbuf->buffer, STDIN_NAME) == 0)) {
+		stdin_spooled = TRUE;
+		read_whole_file(stdin);
+		filecache_add_memfile(STDIN_NAME, filebuf->buffer, filebuf->size);
+	}
+	*in_memory = TRUE;
+	for (memfile = memfiles; memfile; memfile = memfile->next) {
+		if (strcmp(memfile->name, pathbuf->buffer) == 0) {
+			DYNABUF_CLEAR(filebuf);
+			while (filebuf->reserved < memfile->size)
+				dynabuf_enlarge(filebuf);
+			memcpy(filebuf->buffer, memfile->body, memfile->size);
+			filebuf->size = memfile->size;
+			return TRUE;
+		}
+	}
+	*in_memory = FALSE;
+	stream = fopen(pathbuf->buffer, FILE_READBINARY);
+	if (stream == NULL)
+		return FALSE;
+
+	read_whole_file(stream);
+	fclose(stream);
+	return TRUE;
+}
+
+// read file into filebuf (trying list entries as prefixes, if wanted)
+// file name is expected in GlobalDynaBuf, path is left in pathbuf
+// returns FALSE if file could not be found, otherwise "*in_memory" tells
+// whether the file is on disk.
+static boolean read_file(boolean use_include_paths, boolean *in_memory)
+{
 	struct ipi	*ipi;
 
-	// first try directly, regardless of whether lib or not:
-	stream = fopen(GLOBALDYNABUF_CURRENT, FILE_READBINARY);
-	// if failed and not lib, try include paths:
-	if ((stream == NULL) && !uses_lib) {
+	DYNABUF_CLEAR(pathbuf);
+	DynaBuf_add_string(pathbuf, GLOBALDYNABUF_CURRENT);
+	DynaBuf_append(pathbuf, '\0');
+	// first try directly:
+	if (try_path(in_memory))
+		return TRUE;
+
+	// if failed and wanted, try include paths:
+	if (use_include_paths) {
 		for (ipi = ipi_head.next; ipi != &ipi_head; ipi = ipi->next) {
 			DYNABUF_CLEAR(pathbuf);
 			// add first part
@@ -727,25 +1575,309 @@ FILE *includepaths_open_ro(boolean uses_lib)
 			// terminate
 			DynaBuf_append(pathbuf, '\0');
 			// try
-			stream = fopen(pathbuf->buffer, FILE_READBINARY);
-			//printf("trying <<%s>> - ", pathbuf->buffer);
-			if (stream) {
-				//printf("ok\n");
+			if (try_path(in_memory))
+				return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// return first cache entry for the file that was found for the given entry
+// (files in memory and files whose canonical path cannot be found are only
+// recognized by their path)
+static struct cached_file *find_original(struct cached_file *file)
+{
+	struct rwnode	*node;
+	struct rwname	name;
+
+#ifdef PLATFORM_CANONICAL_PATH
+	if (file->in_memory || !PLATFORM_CANONICAL_PATH(file->path, canonicalbuf)) {
+#endif
+		DYNABUF_CLEAR(canonicalbuf);
+		DynaBuf_add_string(canonicalbuf, file->path);
+		DynaBuf_append(canonicalbuf, '\0');
+#ifdef PLATFORM_CANONICAL_PATH
+	}
+#endif
+	Tree_make_name(&name, canonicalbuf->buffer, canonicalbuf->size);
+	if (Tree_hard_scan_name(&node, canonical_table, &name, file->in_memory, TRUE))
+		node->body = file;
+	return node->body;
+}
+
+// get file from cache (searching for it and reading it if not done yet)
+// if "use_include_paths" is TRUE, include path list entries are tried as
+// prefixes.
+// file name is expected in GlobalDynaBuf
+// returns NULL if file could not be opened (failures are cached as well, but
+// no error is thrown - the caller must complain).
+struct cached_file *filecache_get(boolean use_include_paths)
+{
+	struct rwnode		*node;
+	struct cached_file	*file;
+
+	if (Tree_hard_scan(&node, file_forest, use_include_paths ? get_ipi_id() : 0, TRUE)) {
+		// new entry, so fill it
+		file = safe_malloc(sizeof(*file), MEMUSE_FILES);
+		file->name = node->id_string;
+		file->path = NULL;	// means "file not found"
+		file->body = NULL;
+		file->size = 0;
+		file->converted = NULL;
+		file->converted_size = 0;
+		file->conversion_tried = FALSE;
+		file->unpacked = NULL;
+		file->unpacked_size = 0;
+		file->unpacking_tried = FALSE;
+		file->used = FALSE;
+		file->in_memory = FALSE;
+		file->original = file;
+		file->has_once = FALSE;
+		file->sourced_pass = -1;
+		if (read_file(use_include_paths, &file->in_memory)) {
+			file->path = DynaBuf_get_copy(pathbuf, MEMUSE_FILES);
+			file->size = filebuf->size;
+			file->body = DynaBuf_get_copy(filebuf, MEMUSE_FILES);
+			file->original = find_original(file);
+		}
+		node->body = file;
+	}
+	file = node->body;
+	file->used = TRUE;
+	if (snapshot_recording)
+		snapshot_note_file(file->name, use_include_paths, file->path ? file : NULL);
+	return file->path ? file : NULL;
+}
+
+// get contents of file for "!binary", unpacking them on first use
+boolean filecache_get_binary(struct cached_file *file, const char **body, size_t *size)
+{
+	if (!file->unpacking_tried) {
+		file->unpacking_tried = TRUE;
+		if (unpack_is_gzip(file->name, file->body, file->size)
+		&& unpack_gzip(file->body, file->size, unpackbuf)) {
+			file->unpacked = DynaBuf_get_copy(unpackbuf, MEMUSE_FILES);
+			file->unpacked_size = unpackbuf->size;
+		}
+	}
+	if (file->unpacked) {
+		*body = file->unpacked;
+		*size = file->unpacked_size;
+		return TRUE;
+	}
+	*body = file->body;
+	*size = file->size;
+	return !unpack_is_gzip(file->name, file->body, file->size);
+}
+
+// clear "used" flags and pass numbers of all file cache entries (done before
+// each build)
+void filecache_forget_uses(void)
+{
+	struct rwnode		*node;
+	struct cached_file	*file;
+
+	for (node = file_forest->first; node; node = node->next) {
+		file = node->body;
+		file->used = FALSE;
+		file->sourced_pass = -1;
+	}
+}
+
+// check all file cache entries against the files on disk (for "--watch"):
+// files that have changed, vanished or appeared are read again and their
+// high-level format copies are dropped. returns number of changed entries.
+int filecache_refresh(void)
+{
+	struct rwnode		*node;
+	struct cached_file	*file;
+	boolean			found,
+				in_memory,
+				changed;
+	int			count	= 0;
+
+	for (node = file_forest->first; node; node = node->next) {
+		// entries for outdated lists of include paths cannot be used anyway
+		if (node->id_number && (node->id_number != get_ipi_id()))
+			continue;
+
+		file = node->body;
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		DynaBuf_add_string(GlobalDynaBuf, file->name);
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		found = read_file(node->id_number != 0, &in_memory);
+		if (found) {
+			changed = (file->path == NULL)
+				|| strcmp(file->path, pathbuf->buffer)
+				|| (file->size != filebuf->size)
+				|| memcmp(file->body, filebuf->buffer, filebuf->size);
+		} else {
+			changed = (file->path != NULL);
+		}
+		if (!changed)
+			continue;
+
+		++count;
+		if (file->converted) {
+			forget_braces(file->converted, file->converted_size);
+			safe_free(file->converted, file->converted_size, MEMUSE_FILES);
+			file->converted = NULL;
+			file->converted_size = 0;
+		}
+		file->conversion_tried = FALSE;
+		safe_free(file->unpacked, file->unpacked_size, MEMUSE_FILES);
+		file->unpacked = NULL;
+		file->unpacked_size = 0;
+		file->unpacking_tried = FALSE;
+		file->has_once = FALSE;	// will be found again if still there
+		safe_free_string((char *) file->path, MEMUSE_FILES);
+		safe_free(file->body, file->size, MEMUSE_FILES);
+		file->path = NULL;
+		file->body = NULL;
+		file->size = 0;
+		file->original = file;
+		if (found) {
+			file->path = DynaBuf_get_copy(pathbuf, MEMUSE_FILES);
+			file->in_memory = in_memory;
+			file->size = filebuf->size;
+			file->body = DynaBuf_get_copy(filebuf, MEMUSE_FILES);
+			file->original = find_original(file);
+		}
+	}
+	return count;
+}
+
+// forget about all nested inputs (after assembly was aborted by an error)
+void Input_reset(void)
+{
+	Input_now = &outermost;
+}
+
+// call given function for each file cache entry of current project
+void filecache_dump(void (*fn)(struct rwnode *, FILE *), FILE *fd)
+{
+	Tree_dump_forest(file_forest, 0, fn, fd);
+	Tree_dump_forest(file_forest, get_ipi_id(), fn, fd);
+}
+
+#ifdef PLATFORM_START_HELPER
+// background prefetch ("--prefetch"):
+// a helper process scans the raw contents of the top level sources for
+// "!src", "!source", "!bin", "!binary" and "!convtab" with literal file names
+// and reads those files (and the files included by them) via its own copy of
+// the file cache. this way, they are in the operating system's cache when the
+// main process gets to them. the helper's file cache is thrown away.
+static const char	*prefetch_keywords[]	= {"src", "source", "bin", "binary", "convtab", NULL};
+static	STRUCT_DYNABUF_REF(prefetch_visited, 64);	// pointers to scanned files
+
+// read file (name in GlobalDynaBuf) and, if it is a source file that has not
+// been scanned yet, scan it as well
+static void prefetch_scan(const struct cached_file *file, int depth);
+static void prefetch_file(boolean use_include_paths, boolean is_source, int depth)
+{
+	const struct cached_file	*file,
+					**visited;
+	size_t				ii;
+
+	// the standard input stream is left to the main process
+	if (strcmp(GLOBALDYNABUF_CURRENT, STDIN_NAME) == 0)
+		return;
+
+	file = filecache_get(use_include_paths);
+	if ((file == NULL) || (!is_source) || (depth >= MAX_NESTING))
+		return;
+
+	visited = (const struct cached_file **) prefetch_visited->buffer;
+	for (ii = 0; ii < prefetch_visited->size / sizeof(file); ++ii) {
+		if (visited[ii] == file)
+			return;
+	}
+	DynaBuf_add_span(prefetch_visited, (const char *) &file, sizeof(file));
+	prefetch_scan(file, depth + 1);
+}
+
+// scan file contents for pseudo opcodes reading other files
+static void prefetch_scan(const struct cached_file *file, int depth)
+{
+	const char	*read	= file->body,
+			*end	= file->body + file->size,
+			**keyword;
+	char		word[8],
+			terminator;
+	size_t		length;
+
+	while ((read = memchr(read, '!', end - read))) {
+		// read keyword (in lower case)
+		++read;
+		for (length = 0; (read != end) && (length < sizeof(word) - 1) && BYTE_STARTS_KEYWORD(*read); ++length, ++read)
+			word[length] = BYTE_TO_LOWER_CASE(*read);
+		word[length] = '\0';
+		for (keyword = prefetch_keywords; *keyword; ++keyword) {
+			if (strcmp(word, *keyword) == 0)
 				break;
-			} else {
-				//printf("failed\n");
-			}
 		}
+		if (*keyword == NULL)
+			continue;
+
+		// read file name (names using escapes are left to the main process)
+		while ((read != end) && ((*read == ' ') || (*read == '\t')))
+			++read;
+		if ((read == end) || ((*read != '"') && (*read != '<')))
+			continue;
+
+		terminator = (*read++ == '"') ? '"' : '>';
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		if (terminator == '>') {
+			if (PLATFORM_LIBPREFIX == NULL)
+				continue;
+			DynaBuf_add_string(GlobalDynaBuf, PLATFORM_LIBPREFIX);
+		}
+		length = GlobalDynaBuf->size;
+		while ((read != end) && (*read != terminator) && (*read != '\\') && (*read != '\n') && (*read != '\r'))
+			DynaBuf_append(GlobalDynaBuf, *read++);
+		if ((read == end) || (*read != terminator) || (GlobalDynaBuf->size == length))
+			continue;
+
+		DynaBuf_append(GlobalDynaBuf, '\0');
+#ifdef PLATFORM_CONVERTPATH
+		PLATFORM_CONVERTPATH(GlobalDynaBuf->buffer + length);
+#endif
+		prefetch_file(terminator == '"', keyword - prefetch_keywords < 2, depth);
 	}
-	if (stream == NULL) {
-		// CAUTION, I'm re-using the path dynabuf to assemble the error message:
-		DYNABUF_CLEAR(pathbuf);
-		DynaBuf_add_string(pathbuf, "Cannot open input file \"");
-		DynaBuf_add_string(pathbuf, GLOBALDYNABUF_CURRENT);
-		DynaBuf_add_string(pathbuf, "\".");
-		DynaBuf_append(pathbuf, '\0');
-		Throw_error(pathbuf->buffer);
+}
+#endif
+
+// start reading the files the given top level sources will need in the
+// background, if the platform allows this ("--prefetch")
+void filecache_prefetch(int count, const char *names[])
+{
+#ifdef PLATFORM_START_HELPER
+	int	ii;
+
+	if (!PLATFORM_START_HELPER())
+		return;	// main process goes on
+
+	DYNABUF_CLEAR(prefetch_visited);
+	for (ii = 0; ii < count; ++ii) {
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		DynaBuf_add_string(GlobalDynaBuf, names[ii]);
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		prefetch_file(FALSE, TRUE, 0);
 	}
-	//fprintf(stderr, "File is [%s]\n", GLOBALDYNABUF_CURRENT);
-	return stream;
+	PLATFORM_END_HELPER();
+#endif
 }
+
+// get file, using include paths unless library access is wanted
+// file name is expected in GlobalDynaBuf
+// returns NULL on error (error has been reported)
+struct cached_file *includepaths_get(boolean uses_lib)
+{
+	struct cached_file	*file;
+
+	file = filecache_get(!uses_lib);
+	if (file == NULL)
+		throw_cannot_open(GLOBALDYNABUF_CURRENT);
+	return file;
+}
+
@@ -8,7 +8,9 @@
 
 
 #include <stdio.h>	// for FILE
+#include <stdlib.h>	// for size_t
 #include "config.h"	// for bits and scope_t
+#include "tree.h"	// for hash_t
 
 
 // type definitions
@@ -28,17 +30,50 @@ enum inputstate {
 };
 enum inputsrc {
 	INPUTSRC_FILE,
-	INPUTSRC_RAM
+	INPUTSRC_RAM,
+	INPUTSRC_CACHE	// file already converted to high-level format, now in RAM
 };
+// statements in macro and loop bodies are looked up only once, later on their
+// keyword does not have to be read again. this is not done for files, because
+// there are just a few passes, so building the tables would not pay off.
+enum stmtkind {
+	STMT_PSEUDOOPCODE,	// action is handler function
+	STMT_MNEMONIC,		// action is mnemonic's tree node body
+	STMT_EXPRESSION		// action is malloc'd compiled expression (see alu.c)
+};
+struct parsed_stmt {
+	const char	*start;		// read pointer at keyword (used as key)
+	const char	*resume;	// read pointer after keyword (or expression)
+	char		gotbyte;	// GotByte at that position
+	enum stmtkind	kind;
+	const void	*cpu;		// cpu type (mnemonics depend on it)
+	void		*action;
+};
+struct parsed_block {
+	struct parsed_stmt	*slots;	// hash table, NULL if empty
+	int			size,	// number of slots (a power of two)
+				used;	// number of slots in use
+};
+#define PARSED_BLOCK_INIT(block)	do { (block)->slots = NULL; (block)->size = 0; (block)->used = 0; } while (0)
 struct input {
 	const char	*original_filename;	// during RAM reads, too
 	int		line_number;	// in file (on RAM reads, too)
 	enum inputsrc	source;
 	enum inputstate	state;	// state of input
-	union {
+	struct {
 		FILE	*fd;		// file descriptor
-		char	*ram_ptr;	// RAM read ptr (loop or macro block)
+		char	*ram_ptr;	// RAM read ptr (loop or macro block, or cached file)
+					// (on file reads, points to a CHAR_SOL, see GetByte())
 	} src;
+	struct parsed_block	*parsed;	// statements already looked up (NULL on file reads)
+	const struct cached_file	*file;	// file being read (only valid on file and cache reads)
+};
+// lower case version of keyword read last, with its hash value, so keyword
+// tables can be searched without converting and hashing it again
+struct dynabuf;
+struct keyword {
+	struct dynabuf	*lower;	// zero-terminated
+	hash_t		hash;	// for Tree_easy_scan_hashed()
 };
 
 
@@ -56,15 +91,42 @@ extern const char	FILE_READBINARY[];
 
 // Variables
 extern struct input	*Input_now;	// current input structure
+extern struct keyword	Input_keyword;	// set by Input_append_keyword_to_global_dynabuf()
 
 
 // Prototypes
 
-// let current input point to start of file
-extern void Input_new_file(const char *filename, FILE *fd);
+// let current input point to start of given file. if possible, the copy in
+// high-level format is used, otherwise the file is opened (again).
+// returns nonzero on error (file could not be opened).
+struct cached_file;
+extern int Input_open_file(struct cached_file *file);
+// close file opened by Input_open_file() (if it was really opened)
+extern void Input_close_file(void);
+// make current input deliver end-of-file after current statement ("!eof")
+extern void Input_end_file(void);
+// mark current file as to be included only once per pass ("!once"). returns
+// FALSE if not reading from a file (but from a loop or macro body).
+extern boolean Input_mark_once(void);
 // get next byte from currently active byte source in shortened high-level
 // format. When inside quotes, use Input_quoted_to_dynabuf() instead!
-extern char GetByte(void);
+// RAM bytes other than start-of-line are just fetched, everything else (line
+// counting, and all file reads) is done by Input_get_byte().
+#define GetByte()	((*Input_now->src.ram_ptr == CHAR_SOL) ? Input_get_byte() : (GotByte = *(Input_now->src.ram_ptr++)))
+extern char Input_get_byte(void);
+// check for already looked-up statement at current read position. returns
+// NULL if there is none. "stmt" is prepared so Input_remember_stmt() can be
+// called after the keyword has been looked up.
+extern struct parsed_stmt *Input_find_stmt(struct parsed_stmt *stmt);
+// remember current read position as the one to continue at (call after
+// reading the keyword or the expression)
+extern void Input_set_resume(struct parsed_stmt *stmt);
+// remember looked-up statement (does nothing if current input cannot do it)
+extern void Input_remember_stmt(const struct parsed_stmt *stmt);
+// continue reading after keyword of already looked-up statement
+extern void Input_resume_stmt(const struct parsed_stmt *stmt);
+// free memory used for looked-up statements
+extern void Input_free_parsed_block(struct parsed_block *block);
 // Skip remainder of statement, for example on error
 extern void Input_skip_remainder(void);
 // Ensure that the remainder of the current statement is empty, for example
@@ -75,21 +137,27 @@ extern void Input_ensure_EOS(void);
 // returns 1 on errors (unterminated, escaping error)
 extern int Input_quoted_to_dynabuf(char closing_quote);
 
-// process backslash escapes in GlobalDynaBuf (so size might shrink)
-// returns 1 on errors (escaping errors)
-extern int Input_unescape_dynabuf(int start_index);
+// read string to dynabuf until closing quote is found and process backslash
+// escapes (in a single pass if the source is in RAM)
+// returns 1 on errors (unterminated, escaping error)
+extern int Input_unescaped_to_dynabuf(char closing_quote);
 
-// Skip or store block (starting with next byte, so call directly after
-// reading opening brace).
-// the block is read into GlobalDynaBuf.
-// If "Store" is TRUE, then a copy is made and a pointer to that is returned.
-// If "Store" is FALSE, NULL is returned.
+// Skip block (starting with next byte, so call directly after reading
+// opening brace).
 // After calling this function, GotByte holds '}'. Unless EOF was found first,
 // but then a serious error would have been thrown.
-extern char *Input_skip_or_store_block(boolean store);
+extern void Input_skip_block(void);
+// Store block (see Input_skip_block()) and return pointer to it.
+// If the current input is already in memory, the pointer just points into it.
+// Otherwise a copy is made, and that pointer is also written to "*copy" so
+// the caller can free it afterwards (*copy is NULL if there is no copy).
+// If the block must stay available after the current input has ended (macro
+// bodies), set "permanent" to TRUE.
+extern char *Input_store_block(boolean permanent, char **copy, size_t *copy_size);
 
 // Append to GlobalDynaBuf while characters are legal for keywords.
 // Throws "missing string" error if none. Returns number of characters added.
+// Also puts lower case version and its hash value into Input_keyword.
 extern int Input_append_keyword_to_global_dynabuf(void);
 // Check GotByte.
 // If LOCAL_PREFIX ('.'), store current local scope value and read next byte.
@@ -126,12 +194,66 @@ extern bits Input_get_force_bit(void);
 
 // include path stuff - should be moved to its own file:
 
+// file cache entry
+struct cached_file {
+	const char	*name;		// file name as given
+	const char	*path;		// where the file was actually found
+	char		*body;		// raw file contents
+	size_t		size;		// number of bytes in body
+	char		*converted;	// contents in high-level format (NULL if not possible)
+	size_t		converted_size;	// number of bytes in converted
+	boolean		conversion_tried;	// TRUE if "converted" is valid
+	char		*unpacked;	// contents unpacked for "!binary" (NULL if not packed or corrupt)
+	size_t		unpacked_size;	// number of bytes in unpacked
+	boolean		unpacking_tried;	// TRUE if "unpacked" is valid
+	boolean		used;		// TRUE if looked up by current build (for "--depfile")
+	boolean		in_memory;	// TRUE if not on disk (standard input stream or file added by libacme)
+	struct cached_file	*original;	// first entry for the same file (holds the "!once" state)
+	boolean		has_once;	// TRUE if "!once" has been found in it (only in original)
+	int		sourced_pass;	// number of pass that included it last (only in original, -1 if none in this build)
+};
+
 // add entry
 extern void includepaths_add(const char *path);
-// open file for reading (trying list entries as prefixes)
-// "uses_lib" tells whether to access library or to make use of include paths
+// remove all entries (for "--batch")
+extern void includepaths_clear(void);
+// add file in memory, to be found under the given name before the file
+// system is searched (for libacme). an earlier one with the same name is
+// replaced. name and contents are copied. call filecache_refresh() before
+// the next build, so the cache sees the change.
+extern void filecache_add_memfile(const char *name, const char *body, size_t size);
+// remove all files in memory
+extern void filecache_clear_memfiles(void);
+// get file from cache (searching for it and reading it if not done yet)
+// if "use_include_paths" is TRUE, include path list entries are tried as
+// prefixes.
+// file name is expected in GlobalDynaBuf
+// returns NULL if file could not be opened (failures are cached as well, but
+// no error is thrown - the caller must complain).
+extern struct cached_file *filecache_get(boolean use_include_paths);
+// get contents of file for "!binary": compressed files (see unpack.h) are
+// unpacked on first use. returns FALSE if the file is compressed but corrupt.
+extern boolean filecache_get_binary(struct cached_file *file, const char **body, size_t *size);
+// check all file cache entries against the files on disk (for "--watch"):
+// files that have changed, vanished or appeared are read again and their
+// high-level format copies are dropped. returns number of changed entries.
+extern int filecache_refresh(void);
+// clear "used" flags of all file cache entries (done before each build)
+extern void filecache_forget_uses(void);
+// forget about all nested inputs (after assembly was aborted by an error)
+extern void Input_reset(void);
+// call given function for each file cache entry (including failed lookups,
+// which have a NULL path). the node's id number is nonzero if include paths
+// were used, 0 otherwise.
+struct rwnode;
+extern void filecache_dump(void (*fn)(struct rwnode *, FILE *), FILE *fd);
+// start reading the files the given top level sources will need in the
+// background, if the platform allows this ("--prefetch")
+extern void filecache_prefetch(int count, const char *names[]);
+// get file, using include paths unless library access is wanted
 // file name is expected in GlobalDynaBuf
-extern FILE *includepaths_open_ro(boolean uses_lib);
+// returns NULL on error (error has been reported)
+extern struct cached_file *includepaths_get(boolean uses_lib);
 
 
 #endif
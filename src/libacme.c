@@ -0,0 +1,170 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// libacme: assembling from memory, for programs that embed ACME
+//
+// The library consists of all modules, with "acme.c" compiled without its
+// main() function (ACME_LIBRARY is defined). Each build works like one
+// project of "--batch": the keyword trees and the file cache are kept, but
+// the cache is refreshed before each build, so changed files (in memory or
+// on disk) are seen. Errors do not end the program, they only end the build
+// (see ACME_exit()). After a successful build, the output buffer, the
+// segment list and the symbol table are copied to the caller's struct.
+#include "libacme.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "acme.h"
+#include "config.h"
+#include "global.h"
+#include "input.h"
+#include "output.h"
+#include "symbol.h"
+
+
+// counters for filling the arrays
+static int	segments_used;
+static int	symbols_used;
+
+
+// count segment
+static void count_segment(intval_t start, intval_t length, void *arg)
+{
+	++segments_used;
+}
+
+// copy segment to result
+static void copy_segment(intval_t start, intval_t length, void *arg)
+{
+	struct libacme_segment	*segment	= ((struct libacme_result *) arg)->segments + segments_used++;
+
+	segment->start = start;
+	segment->length = length;
+}
+
+// count symbol
+static void count_symbol(const char *name, const struct symbol *symbol, void *arg)
+{
+	++symbols_used;
+}
+
+// copy symbol to result (the name is copied as well, because the symbol table
+// is freed when the next build starts). if out of memory, the symbol is not
+// counted.
+static void copy_symbol(const char *name, const struct symbol *symbol, void *arg)
+{
+	struct libacme_symbol	*target	= ((struct libacme_result *) arg)->symbols + symbols_used;
+	const struct number	*number	= &symbol->object.u.number;
+
+	target->name = malloc(strlen(name) + 1);
+	if (target->name == NULL)
+		return;
+
+	strcpy(target->name, name);
+	target->is_float = (number->ntype == NUMTYPE_FLOAT);
+	if (number->ntype == NUMTYPE_INT)
+		target->value = number->val.intval;
+	else if (number->ntype == NUMTYPE_FLOAT)
+		target->value = (long) number->val.fpval;
+	else
+		target->value = 0;
+	target->is_address = (number->ntype != NUMTYPE_UNDEFINED) && (number->addr_refs == 1);
+	++symbols_used;
+}
+
+
+// copy results of successful build to caller's struct. returns FALSE if out
+// of memory.
+static boolean copy_results(struct libacme_result *result)
+{
+	intval_t	start,
+			amount;
+	int		wanted;
+
+	if (output_get_range(&start, &amount)) {
+		result->output = malloc(amount);
+		if (result->output == NULL)
+			return FALSE;
+
+		output_copy((char *) result->output, start, amount);
+		result->output_size = amount;
+		result->output_start = start;
+	}
+	segments_used = 0;
+	output_for_each_segment(count_segment, NULL);
+	if (segments_used) {
+		result->segments = malloc(segments_used * sizeof(*result->segments));
+		if (result->segments == NULL)
+			return FALSE;
+
+		segments_used = 0;
+		output_for_each_segment(copy_segment, result);
+		result->segment_count = segments_used;
+	}
+	symbols_used = 0;
+	symbols_for_each_listed(count_symbol, NULL);
+	if (symbols_used) {
+		result->symbols = malloc(symbols_used * sizeof(*result->symbols));
+		if (result->symbols == NULL)
+			return FALSE;
+
+		wanted = symbols_used;
+		symbols_used = 0;
+		symbols_for_each_listed(copy_symbol, result);
+		result->symbol_count = symbols_used;
+		if (symbols_used != wanted)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+// add file in memory
+void libacme_add_file(const char *name, const void *body, size_t size)
+{
+	filecache_add_memfile(name, body, size);
+}
+
+
+// remove all files in memory
+void libacme_clear_files(void)
+{
+	filecache_clear_memfiles();
+}
+
+
+// assemble project
+int libacme_assemble(int argc, const char *argv[], struct libacme_result *result)
+{
+	memset(result, 0, sizeof(*result));
+	// files in memory may have been added, changed or removed since the
+	// last build
+	filecache_refresh();
+	result->status = ACME_assemble_embedded(argc, argv);
+	if ((result->status == EXIT_SUCCESS) && !copy_results(result)) {
+		fputs("Error: No memory for build results.\n", stderr);
+		libacme_free_result(result);
+		result->status = EXIT_FAILURE;
+	}
+	return result->status;
+}
+
+
+// free memory held by results
+void libacme_free_result(struct libacme_result *result)
+{
+	int	ii;
+
+	free(result->output);
+	free(result->segments);
+	for (ii = 0; ii < result->symbol_count; ++ii)
+		free(result->symbols[ii].name);
+	free(result->symbols);
+	result->output = NULL;
+	result->output_size = 0;
+	result->segments = NULL;
+	result->segment_count = 0;
+	result->symbols = NULL;
+	result->symbol_count = 0;
+}
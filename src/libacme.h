@@ -0,0 +1,65 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// libacme: assembling from memory, for programs that embed ACME
+// (build "libacme.a" using "make libacme.a" and include this file, which
+// does not need any of ACME's other header files)
+#ifndef libacme_H
+#define libacme_H
+
+
+#include <stddef.h>	// for size_t
+
+
+// type definitions
+
+// one segment of output (as seen in the first pass)
+struct libacme_segment {
+	long	start,
+		length;
+};
+// one global symbol (the ones a symbol list would show)
+struct libacme_symbol {
+	char	*name;
+	long	value;	// floats are truncated
+	int	is_float;	// nonzero if value was a float
+	int	is_address;	// nonzero if marked as address (see "-Wtype-mismatch")
+};
+// results of a build
+struct libacme_result {
+	int			status;	// 0 on success, nonzero on errors
+	unsigned char		*output;	// from lowest to highest address written, without file format header (NULL if none)
+	size_t			output_size;
+	long			output_start;	// address of first byte
+	struct libacme_segment	*segments;
+	int			segment_count;
+	struct libacme_symbol	*symbols;
+	int			symbol_count;
+};
+
+
+// prototypes
+
+// add file in memory. "!source", "!binary", "!convtab" and the top level
+// sources look for files in memory first: the name must be the same as the
+// one given in the source code, or that name prefixed with an include path.
+// an earlier file with the same name is replaced. name and contents are
+// copied, so the caller may free them afterwards.
+extern void libacme_add_file(const char *name, const void *body, size_t size);
+// remove all files in memory
+extern void libacme_clear_files(void);
+// assemble project. the arguments are the same as for the "acme" program
+// (argv[0] is the program name, then options and top level sources), but
+// "--batch", "--watch" and "--query" cannot be used. messages go to stderr
+// (or stdout, see "--use-stdout"). files are only written if wanted by the
+// arguments or the source code ("-o", "!to", "-l", ...). the program is never
+// ended, not even by serious errors. all results are stored in the given
+// struct, which must be freed using libacme_free_result() afterwards.
+// returns the status (0 on success).
+extern int libacme_assemble(int argc, const char *argv[], struct libacme_result *result);
+// free memory held by results
+extern void libacme_free_result(struct libacme_result *result);
+
+
+#endif
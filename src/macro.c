@@ -12,7 +12,9 @@
 #include "dynabuf.h"
 #include "global.h"
 #include "input.h"
+#include "profile.h"
 #include "section.h"
+#include "snapshot.h"
 #include "symbol.h"
 #include "tree.h"
 
@@ -25,33 +27,64 @@
 #define REFERENCE_CHAR	'~'	// prefix for call-by-reference
 #define HALF_INITIAL_ARG_TABLE_SIZE	4
 static const char	exception_macro_twice[]	= "Macro already defined.";
+static const char	exception_too_deep[]	= "Too deeply nested. Recursive macro calls?";
+static const char	exception_called_from[]	= "...called from here.";
 
 
+// formal parameter, parsed when macro is defined
+struct macro_param {
+	struct rwname	name;	// (hash is computed once)
+	char		prefix;	// LOCAL_PREFIX, CHEAP_PREFIX or '\0' for global
+};
 // macro struct type definition
+// the tree holds one entry per macro title, its body is the list of macros
+// with that title (one per signature).
 struct macro {
+	struct macro	*next;	// macro with same title but other signature
+	char	*signature;	// one ARGTYPE_* char per parameter, zero-terminated
+	struct macro_param	*params;	// one per signature char
 	int	def_line_number;	// line number of definition	for error msgs
 	char	*def_filename,	// file name of definition	for error msgs
 		*original_name,	// user-supplied name		for error msgs
-		*parameter_list,	// parameters (whole line)
-		*body;	// RAM block containing macro body
+		*body,	// RAM block containing macro body
+		*copy;	// malloc'd copy of body (NULL if body is in file cache)
+	size_t	copy_size;	// allocated size of copy
+	struct parsed_block	parsed;	// statements of body already looked up
 };
 // there's no need to make this a struct and add a type component:
-// when the macro has been found, accessing its parameter_list component
-// gives us the possibility to find out which args are call-by-value and
-// which ones are call-by-reference.
+// when the macro has been found, its signature tells which args are
+// call-by-value and which ones are call-by-reference.
 union macro_arg_t {
 	struct object	result;	// value and flags (call by value)
 	struct symbol	*symbol;	// pointer to symbol struct (call by reference)
 };
+// one active macro call. the body is parsed by the main loop instead of a
+// recursive call (see Parse_enter_block()), so the call's data is kept in a
+// list instead of on the C stack. the structs are re-used via a free list
+// (they cannot be kept in a growing array, because the input and section
+// structs must not move while they are active).
+struct expansion {
+	struct expansion	*outer;	// calling expansion (or next free struct)
+	struct input		input,	// for reading macro body
+				*outer_input;
+	struct section		section,	// for macro's local symbols
+				*outer_section;
+	char			gotbyte;	// CAUTION - ugly kluge
+	int			outer_err_count,	// to decide about call stack output
+				outer_deferred_count;
+};
 
 
 // Variables
 static	STRUCT_DYNABUF_REF(user_macro_name, NAME_INITIALSIZE);	// original macro title
 static	STRUCT_DYNABUF_REF(internal_name, NAME_INITIALSIZE);	// plus param type chars
-static struct rwnode	*macro_forest[256];	// trees (because of 8b hash)
+static	size_t			signature_start;	// index of param type chars in internal_name
 // Dynamic argument table
 static union macro_arg_t	*arg_table	= NULL;
 static int			argtable_size	= HALF_INITIAL_ARG_TABLE_SIZE;
+// active macro calls (innermost first) and pool of unused structs
+static struct expansion		*expansions	= NULL;
+static struct expansion		*free_expansions	= NULL;
 
 
 // Functions
@@ -59,11 +92,34 @@ static int			argtable_size	= HALF_INITIAL_ARG_TABLE_SIZE;
 // Enlarge the argument table
 static void enlarge_arg_table(void)
 {
+	arg_table = safe_realloc(arg_table, arg_table ? argtable_size * sizeof(*arg_table) : 0, 2 * argtable_size * sizeof(*arg_table), MEMUSE_MACROS);
 	argtable_size *= 2;
 	//printf("Doubling arg table size to %d.\n", argtable_size);
-	arg_table = realloc(arg_table, argtable_size * sizeof(*arg_table));
-	if (arg_table == NULL)
-		Throw_serious_error(exception_no_memory_left);
+}
+
+// get struct for new macro call (from pool, if possible) and make it the
+// innermost one
+static struct expansion *push_expansion(void)
+{
+	struct expansion	*expansion	= free_expansions;
+
+	if (expansion)
+		free_expansions = expansion->outer;
+	else
+		expansion = safe_malloc(sizeof(*expansion), MEMUSE_MACROS);
+	expansion->outer = expansions;
+	expansions = expansion;
+	return expansion;
+}
+
+// return innermost macro call's struct to pool
+static void pop_expansion(void)
+{
+	struct expansion	*expansion	= expansions;
+
+	expansions = expansion->outer;
+	expansion->outer = free_expansions;
+	free_expansions = expansion;
 }
 
 // Read macro scope and title. Title is read to GlobalDynaBuf and then copied
@@ -73,8 +129,9 @@ static void enlarge_arg_table(void)
 static scope_t get_scope_and_title(void)
 {
 	scope_t	macro_scope;
+	int	length;
 
-	Input_read_scope_and_keyword(&macro_scope);	// skips spaces before
+	length = Input_read_scope_and_keyword(&macro_scope);	// skips spaces before
 	// now GotByte = illegal character after title
 	// copy macro title to private dynabuf and add separator character
 	DYNABUF_CLEAR(user_macro_name);
@@ -83,10 +140,11 @@ static scope_t get_scope_and_title(void)
 		// TODO - allow "cheap macros"?!
 		DynaBuf_append(user_macro_name, LOCAL_PREFIX);
 	}
-	DynaBuf_add_string(user_macro_name, GLOBALDYNABUF_CURRENT);
-	DynaBuf_add_string(internal_name, GLOBALDYNABUF_CURRENT);
+	DynaBuf_add_span(user_macro_name, GLOBALDYNABUF_CURRENT, length);
+	DynaBuf_add_span(internal_name, GLOBALDYNABUF_CURRENT, length);
 	DynaBuf_append(user_macro_name, '\0');
 	DynaBuf_append(internal_name, ARG_SEPARATOR);
+	signature_start = internal_name->size;
 	SKIPSPACE();	// done here once so it's not necessary at two callers
 	return macro_scope;
 }
@@ -102,40 +160,81 @@ static int pipe_comma(void)
 	return result;
 }
 
-// Return malloc'd copy of string
+// Return arena copy of string
 static char *get_string_copy(const char *original)
 {
-	size_t	size;
-	char	*copy;
-
-	size = strlen(original) + 1;
-	copy = safe_malloc(size);
-	memcpy(copy, original, size);
-	return copy;
+	return arena_copy(&part->arena, original, strlen(original) + 1, MEMUSE_MACROS);
 }
 
 // This function is called from both macro definition and macro call.
-// Terminate macro name and copy from internal_name to GlobalDynaBuf
-// (because that's where Tree_hard_scan() looks for the search string).
-// Then try to find macro and return whether it was created.
-static int search_for_macro(struct rwnode **result, scope_t scope, int create)
+// Find tree entry for macro title in GlobalDynaBuf (create if wanted).
+// Returns NULL if not found.
+static struct rwnode *find_title(scope_t scope, boolean create)
 {
-	DynaBuf_append(internal_name, '\0');	// terminate macro name
-	// now internal_name = macro_title SPC argument_specifiers NUL
-	DYNABUF_CLEAR(GlobalDynaBuf);
-	DynaBuf_add_string(GlobalDynaBuf, internal_name->buffer);
-	DynaBuf_append(GlobalDynaBuf, '\0');
-	return Tree_hard_scan(result, macro_forest, scope, create);
+	struct rwnode	*node;
+
+	if (Tree_hard_scan(&node, part->macros, scope, create))
+		node->body = NULL;	// no macros with this title yet
+	return node;
+}
+
+// Return pointer to link of the macro with the given signature (which is
+// NULL if there is none, then a new macro can be linked there)
+static struct macro **find_signature(struct rwnode *title_node, const char *signature)
+{
+	struct macro	**link	= (struct macro **) &title_node->body;
+
+	while (*link && strcmp((*link)->signature, signature))
+		link = &(*link)->next;
+	return link;
+}
+
+// Parse formal parameter list ("~.a,@b,c" and CHAR_EOS, see definition)
+// into the macro's parameter array
+static void set_params(struct macro *macro, const char *list)
+{
+	struct macro_param	*param;
+	const char		*name;
+	size_t			count	= strlen(macro->signature);
+
+	macro->params = arena_alloc(&part->arena, (count ? count : 1) * sizeof(*param), MEMUSE_MACROS);
+	for (param = macro->params; count--; ++param) {
+		if (*list == REFERENCE_CHAR)
+			++list;
+		param->prefix = '\0';
+		if ((*list == LOCAL_PREFIX) || (*list == CHEAP_PREFIX))
+			param->prefix = *list++;
+		name = list;
+		while ((*list != ',') && (*list != CHAR_EOS))
+			++list;
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		DynaBuf_add_span(GlobalDynaBuf, name, list - name);
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		Tree_make_name(&param->name, arena_copy(&part->arena, GlobalDynaBuf->buffer, GlobalDynaBuf->size, MEMUSE_MACROS), GlobalDynaBuf->size);
+		++list;	// skip ','
+	}
+}
+
+// return whether a local parameter of the same name and scope comes before
+// the given one
+static boolean param_given_before(const struct macro *macro, const struct macro_param *param)
+{
+	const struct macro_param	*other;
+
+	for (other = macro->params; other != param; ++other) {
+		if ((other->prefix == param->prefix)
+		&& (strcmp(other->name.string, param->name.string) == 0))
+			return TRUE;
+	}
+	return FALSE;
 }
 
 // This function is called when an already existing macro is re-defined.
 // It first outputs a warning and then a serious error, stopping assembly.
 // Showing the first message as a warning guarantees that ACME does not reach
 // the maximum error limit inbetween.
-static void report_redefinition(struct rwnode *macro_node)
+static void report_redefinition(struct macro *original_macro)
 {
-	struct macro	*original_macro	= macro_node->body;
-
 	// show warning with location of current definition
 	Throw_warning(exception_macro_twice);
 	// CAUTION, ugly kluge: fiddle with Input_now and section_now
@@ -154,10 +253,15 @@ static void report_redefinition(struct rwnode *macro_node)
 void Macro_parse_definition(void)	// Now GotByte = illegal char after "!macro"
 {
 	char		*formal_parameters;
-	struct rwnode	*macro_node;
-	struct macro	*new_macro;
+	size_t		parameters_size;
+	struct rwnode	*title_node;
+	struct macro	**link,
+			*new_macro;
 	scope_t		macro_scope	= get_scope_and_title();
 
+	// now GlobalDynaBuf = macro title
+	title_node = find_title(macro_scope, TRUE);
+
 	// now GotByte = first non-space after title
 	DYNABUF_CLEAR(GlobalDynaBuf);	// prepare to hold formal parameters
 	// GlobalDynaBuf = "" (will hold formal parameter list)
@@ -198,41 +302,129 @@ void Macro_parse_definition(void)	// Now GotByte = illegal char after "!macro"
 	DynaBuf_append(GlobalDynaBuf, CHAR_EOS);	// terminate param list
 	// now GlobalDynaBuf = comma-separated parameter list without spaces,
 	// but terminated with CHAR_EOS.
-	formal_parameters = DynaBuf_get_copy(GlobalDynaBuf);
+	formal_parameters = arena_copy(&part->arena, GlobalDynaBuf->buffer, GlobalDynaBuf->size, MEMUSE_MACROS);
+	parameters_size = GlobalDynaBuf->size;
 	// now GlobalDynaBuf = unused
+	DynaBuf_append(internal_name, '\0');	// terminate signature
+	// now internal_name = macro_title SPC argument_specifiers NUL
 	// Reading the macro body would change the line number. To have correct
 	// error messages, we're checking for "macro twice" *now*.
-	// Search for macro. Create if not found.
-	// But if found, complain (macro twice).
-	if (search_for_macro(&macro_node, macro_scope, TRUE) == FALSE)
-		report_redefinition(macro_node);	// quits with serious error
+	// Search for macro. If found, complain (macro twice).
+	link = find_signature(title_node, internal_name->buffer + signature_start);
+	if (*link)
+		report_redefinition(*link);	// quits with serious error
+	if (snapshot_recording && (macro_scope != SCOPE_GLOBAL))
+		snapshot_invalidate();	// zone numbers cannot be put in snapshots
 	// Create new macro struct and set it up. Finally we'll read the body.
-	new_macro = safe_malloc(sizeof(*new_macro));
+	new_macro = arena_alloc(&part->arena, sizeof(*new_macro), MEMUSE_MACROS);
+	new_macro->next = NULL;
+	new_macro->signature = get_string_copy(internal_name->buffer + signature_start);
+	set_params(new_macro, formal_parameters);
 	new_macro->def_line_number = Input_now->line_number;
 	new_macro->def_filename = get_string_copy(Input_now->original_filename);
 	new_macro->original_name = get_string_copy(user_macro_name->buffer);
-	new_macro->parameter_list = formal_parameters;
-	new_macro->body = Input_skip_or_store_block(TRUE);	// changes LineNumber
-	macro_node->body = new_macro;	// link macro struct to tree node
+	new_macro->body = Input_store_block(TRUE, &new_macro->copy, &new_macro->copy_size);	// changes LineNumber
+	PARSED_BLOCK_INIT(&new_macro->parsed);
+	*link = new_macro;	// link macro struct to tree node
+	if (snapshot_recording) {
+		// only bodies from converted files can be copied
+		if (new_macro->copy)
+			snapshot_invalidate();
+		else
+			snapshot_note_macro(internal_name->buffer, internal_name->size, new_macro->original_name,
+				formal_parameters, parameters_size, new_macro->body, Input_now->src.ram_ptr - new_macro->body,
+				Input_now->original_filename, new_macro->def_line_number);
+	}
 	// and that about sums it up
 }
 
-// Parse macro call ("+MACROTITLE"). Has to be re-entrant.
+
+// put title part of internal name into GlobalDynaBuf and return signature
+static const char *split_internal_name(const char *name)
+{
+	const char	*separator	= strchr(name, ARG_SEPARATOR);
+
+	if (separator == NULL)
+		Bug_found("NoMacroSignature", 0);
+	DYNABUF_CLEAR(GlobalDynaBuf);
+	DynaBuf_add_span(GlobalDynaBuf, name, separator - name);
+	DynaBuf_append(GlobalDynaBuf, '\0');
+	return separator + 1;
+}
+
+
+// return whether global macro with given internal name exists (the size
+// includes the terminator)
+boolean Macro_exists(const char *name, size_t size)
+{
+	const char	*signature	= split_internal_name(name);
+	struct rwnode	*title_node;
+
+	title_node = find_title(SCOPE_GLOBAL, FALSE);
+	return title_node && *find_signature(title_node, signature);
+}
+
+
+// define global macro from a library snapshot (the sizes include the
+// terminators, the body is copied and gets an end-of-file marker)
+void Macro_define(const char *name, size_t name_size, const char *original_name, const char *parameters, size_t parameters_size, const char *body, size_t body_size, const char *def_filename, int def_line_number)
+{
+	const char	*signature	= split_internal_name(name);
+	struct macro	**link,
+			*new_macro;
+
+	link = find_signature(find_title(SCOPE_GLOBAL, TRUE), signature);
+	if (*link)
+		Bug_found("SnapshotMacroTwice", 0);
+	new_macro = arena_alloc(&part->arena, sizeof(*new_macro), MEMUSE_MACROS);
+	new_macro->next = NULL;
+	new_macro->signature = get_string_copy(signature);
+	set_params(new_macro, parameters);
+	new_macro->def_line_number = def_line_number;
+	new_macro->def_filename = get_string_copy(def_filename);
+	new_macro->original_name = get_string_copy(original_name);
+	new_macro->copy_size = body_size + 2;
+	new_macro->copy = safe_malloc(new_macro->copy_size, MEMUSE_BLOCKS);
+	memcpy(new_macro->copy, body, body_size);
+	new_macro->copy[body_size] = CHAR_EOS;	// add EOF, see Input_store_block()
+	new_macro->copy[body_size + 1] = CHAR_EOF;
+	new_macro->body = new_macro->copy;
+	PARSED_BLOCK_INIT(&new_macro->parsed);
+	*link = new_macro;
+}
+
+// free macro bodies of a title (called via Tree_clear(), the rest is in the
+// part's arena)
+static void free_macros(void *body)
+{
+	struct macro	*macro;
+
+	for (macro = body; macro; macro = macro->next) {
+		safe_free(macro->copy, macro->copy_size, MEMUSE_BLOCKS);
+		Input_free_parsed_block(&macro->parsed);
+	}
+}
+
+// forget all macros (for "--batch")
+void Macro_clear(void)
+{
+	Tree_clear(part->macros, free_macros);
+	// if the previous build was aborted, calls may still be active
+	while (expansions)
+		pop_expansion();
+}
+
+// Parse macro call ("+MACROTITLE") and enter macro body, see header file.
 void Macro_parse_call(void)	// Now GotByte = dot or first char of macro name
 {
-	char		local_gotbyte;
+	struct expansion	*expansion;
 	struct symbol	*symbol;
-	struct section	new_section,
-			*outer_section;
-	struct input	new_input,
-			*outer_input;
 	struct macro	*actual_macro;
-	struct rwnode	*macro_node,
+	struct macro_param	*param;
+	struct rwnode	*title_node,
 			*symbol_node;
-	scope_t		macro_scope,
-			symbol_scope;
+	scope_t		symbol_scope;
 	int		arg_count	= 0;
-	int		outer_err_count;
 
 	// make sure arg_table is ready (if not yet initialised, do it now)
 	if (arg_table == NULL)
@@ -240,9 +432,11 @@ void Macro_parse_call(void)	// Now GotByte = dot or first char of macro name
 
 	// Enter deeper nesting level
 	// Quit program if recursion too deep.
-	if (--macro_recursions_left < 0)
-		Throw_serious_error("Too deeply nested. Recursive macro calls?");
-	macro_scope = get_scope_and_title();
+	if (--part->macro_recursions_left < 0)
+		Throw_serious_error(exception_too_deep);
+	// look up title now, before arguments are evaluated (GlobalDynaBuf
+	// will be re-used)
+	title_node = find_title(get_scope_and_title(), FALSE);
 	// now GotByte = first non-space after title
 	// internal_name = MacroTitle ARG_SEPARATOR (grows to signature)
 	// Accept n>=0 comma-separated arguments before CHAR_EOS.
@@ -275,85 +469,108 @@ void Macro_parse_call(void)	// Now GotByte = dot or first char of macro name
 	// now arg_table contains the arguments
 	// now GlobalDynaBuf = unused
 	// check for "unknown macro"
-	// Search for macro. Do not create if not found.
-	search_for_macro(&macro_node, macro_scope, FALSE);
-	if (macro_node == NULL) {
+	DynaBuf_append(internal_name, '\0');	// terminate signature
+	actual_macro = title_node ? *find_signature(title_node, internal_name->buffer + signature_start) : NULL;
+	if (actual_macro == NULL) {
 		Throw_error("Macro not defined (or wrong signature).");
 		Input_skip_remainder();
-	} else {
-		// make macro_node point to the macro struct
-		actual_macro = macro_node->body;
-		local_gotbyte = GotByte;	// CAUTION - ugly kluge
-
-		// set up new input
-		new_input.original_filename = actual_macro->def_filename;
-		new_input.line_number = actual_macro->def_line_number;
-		new_input.source = INPUTSRC_RAM;
-		new_input.state = INPUTSTATE_NORMAL;	// FIXME - fix others!
-		new_input.src.ram_ptr = actual_macro->parameter_list;
-		// remember old input
-		outer_input = Input_now;
-		// activate new input
-		Input_now = &new_input;
-
-		outer_err_count = Throw_get_counter();	// remember error count (for call stack decision)
-
-		// remember old section
-		outer_section = section_now;
-		// start new section (with new scope)
-		// FALSE = title mustn't be freed
-		section_new(&new_section, "Macro", actual_macro->original_name, FALSE);
-		section_new_cheap_scope(&new_section);
-		GetByte();	// fetch first byte of parameter list
-		// assign arguments
-		if (GotByte != CHAR_EOS) {	// any at all?
-			arg_count = 0;
-			do {
-				// Decide whether call-by-reference
-				// or call-by-value
-				// In both cases, GlobalDynaBuf may be used.
-				if (GotByte == REFERENCE_CHAR) {
-					// assign call-by-reference arg
-					GetByte();	// eat '~'
-					Input_read_scope_and_keyword(&symbol_scope);
-					// create new tree node and link existing symbol struct from arg list to it
-					if ((Tree_hard_scan(&symbol_node, symbols_forest, symbol_scope, TRUE) == FALSE)
-					&& (FIRST_PASS))
-						Throw_error("Macro parameter twice.");
-					symbol_node->body = arg_table[arg_count].symbol;	// CAUTION, object type may be NULL
-				} else {
-					// assign call-by-value arg
-					Input_read_scope_and_keyword(&symbol_scope);
-					symbol = symbol_find(symbol_scope);
+		++part->macro_recursions_left;	// leave this nesting level
+		return;
+	}
+
+	expansion = push_expansion();
+	expansion->gotbyte = GotByte;	// CAUTION - ugly kluge
+	// set up new input
+	expansion->input.original_filename = actual_macro->def_filename;
+	expansion->input.line_number = actual_macro->def_line_number;
+	expansion->input.source = INPUTSRC_RAM;
+	expansion->input.state = INPUTSTATE_NORMAL;	// FIXME - fix others!
+	expansion->input.src.ram_ptr = actual_macro->body;
+	expansion->input.parsed = &actual_macro->parsed;
+	// remember old input
+	expansion->outer_input = Input_now;
+	// activate new input
+	Input_now = &expansion->input;
+	++stats.macro_calls;
+
+	expansion->outer_err_count = Throw_get_new_counter();	// remember error count (for call stack decision)
+	expansion->outer_deferred_count = Throw_get_deferred_counter();
+
+	// remember old section
+	expansion->outer_section = section_now;
+	// start new section (with new scope)
+	// FALSE = title mustn't be freed
+	section_new(&expansion->section, "Macro", actual_macro->original_name, FALSE);
+	section_new_cheap_scope(&expansion->section);
+	// assign arguments (the signature matched, so there is one
+	// parameter per argument). local ones go to a frame instead of
+	// the symbol table, see symbol.c
+	symbols_push_frame(arg_count);
+	for (arg_count = 0, param = actual_macro->params; actual_macro->signature[arg_count]; ++arg_count, ++param) {
+		if (param->prefix) {
+			symbol_scope = (param->prefix == LOCAL_PREFIX) ? section_now->local_scope : section_now->cheap_scope;
+			if (actual_macro->signature[arg_count] == ARGTYPE_REF) {
+				if (FIRST_PASS && param_given_before(actual_macro, param))
+					Throw_error("Macro parameter twice.");
+				symbols_add_param(&param->name, symbol_scope, arg_table[arg_count].symbol);	// CAUTION, object type may be NULL
+			} else {
+				symbols_add_param(&param->name, symbol_scope, NULL)->object = arg_table[arg_count].result;
+			}
+			continue;
+		}
+
+		symbol_scope = SCOPE_GLOBAL;
+		++pass.volatile_count;	// global args change value
+		// Decide whether call-by-reference or call-by-value
+		if (actual_macro->signature[arg_count] == ARGTYPE_REF) {
+			// create new tree node and link existing symbol struct from arg list to it
+			if ((Tree_hard_scan_name(&symbol_node, part->symbols, &param->name, symbol_scope, TRUE) == FALSE)
+			&& (FIRST_PASS))
+				Throw_error("Macro parameter twice.");
+			symbol_node->body = arg_table[arg_count].symbol;	// CAUTION, object type may be NULL
+		} else {
+			symbol = symbol_find_name(&param->name, symbol_scope);
 // FIXME - find out if symbol was just created.
 // Then check for the same error message here as above ("Macro parameter twice.").
 // TODO - on the other hand, this would rule out globals as args (stupid anyway, but not illegal yet!)
-					symbol->object = arg_table[arg_count].result;	// FIXME - this assignment redefines globals/whatever without throwing errors!
-				}
-				++arg_count;
-			} while (Input_accept_comma());
+			symbol->object = arg_table[arg_count].result;	// FIXME - this assignment redefines globals/whatever without throwing errors!
 		}
-		// and now, finally, parse the actual macro body
-		Input_now->state = INPUTSTATE_NORMAL;	// FIXME - fix others!
-// maybe call parse_ram_block(actual_macro->def_line_number, actual_macro->body)
-		Input_now->src.ram_ptr = actual_macro->body;
-		Parse_until_eob_or_eof();
-		if (GotByte != CHAR_EOB)
-			Bug_found("IllegalBlockTerminator", GotByte);
-		// end section (free title memory, if needed)
-		section_finalize(&new_section);
-		// restore previous section
-		section_now = outer_section;
-		// restore previous input:
-		Input_now = outer_input;
-		// restore old Gotbyte context
-		GotByte = local_gotbyte;	// CAUTION - ugly kluge
-
-		// if needed, output call stack
-		if (Throw_get_counter() != outer_err_count)
-			Throw_warning("...called from here.");
-
-		Input_ensure_EOS();
 	}
-	++macro_recursions_left;	// leave this nesting level
+	// and now, finally, let the main loop parse the actual macro body
+	if (profile_active)
+		profile_enter_macro(actual_macro->original_name);
+	Parse_enter_block(BLOCKKIND_MACRO);
+}
+
+
+// Leave macro body, see header file.
+void Macro_end_call(void)	// Now GotByte = CHAR_EOB
+{
+	struct expansion	*expansion	= expansions;
+
+	if (expansion == NULL)
+		Bug_found("ExpansionStackEmpty", 0);
+	if (profile_active)
+		profile_leave_macro();
+	if (GotByte != CHAR_EOB)
+		Bug_found("IllegalBlockTerminator", GotByte);
+	symbols_pop_frame();
+	// end section (free title memory, if needed)
+	section_finalize(&expansion->section);
+	// restore previous section
+	section_now = expansion->outer_section;
+	// restore previous input:
+	Input_now = expansion->outer_input;
+	// restore old Gotbyte context
+	GotByte = expansion->gotbyte;	// CAUTION - ugly kluge
+
+	// if needed, output call stack
+	if (Throw_get_new_counter() != expansion->outer_err_count)
+		Throw_warning(exception_called_from);
+	else if (Throw_get_deferred_counter() != expansion->outer_deferred_count)
+		Throw_deferred_warning(exception_called_from);	// only if error is shown
+
+	pop_expansion();
+	Input_ensure_EOS();
+	++part->macro_recursions_left;	// leave this nesting level
 }
@@ -7,6 +7,7 @@
 #define macro_H
 
 
+#include <stdlib.h>	// for size_t
 #include "config.h"
 
 
@@ -14,8 +15,19 @@
 
 // only call once (during first pass)
 extern void Macro_parse_definition(void);
-// Parse macro call ("+MACROTITLE"). Has to be re-entrant.
+// Parse macro call ("+MACROTITLE") and make the macro body the current input,
+// to be parsed by the main loop (see Parse_enter_block()).
 extern void Macro_parse_call(void);
+// called by main loop at end of macro body: go back to calling statement
+extern void Macro_end_call(void);
+// return whether global macro with given internal name exists (the size
+// includes the terminator)
+extern boolean Macro_exists(const char *name, size_t size);
+// define global macro from a library snapshot (the sizes include the
+// terminators, the body is copied and gets an end-of-file marker)
+extern void Macro_define(const char *name, size_t name_size, const char *original_name, const char *parameters, size_t parameters_size, const char *body, size_t body_size, const char *def_filename, int def_line_number);
+// forget all macros (for "--batch")
+extern void Macro_clear(void);
 
 
 #endif
@@ -4,19 +4,21 @@
 //
 // Mnemonics stuff
 #include "mnemo.h"
+#include <string.h>	// for strcmp()
 #include "config.h"
 #include "alu.h"
 #include "cpu.h"
 #include "dynabuf.h"
+#include "fixup.h"
 #include "global.h"
 #include "input.h"
 #include "output.h"
+#include "symbol.h"
 #include "tree.h"
 #include "typesystem.h"
 
 
 // constants
-#define MNEMO_INITIALSIZE	8	// 4 + terminator should suffice
 
 // These values are needed to recognize addressing modes:
 // indexing:
@@ -61,6 +63,12 @@
 #define MAYBE___2__	NUMBER_FORCES_16
 #define MAYBE_____3	NUMBER_FORCES_24
 
+// flags in cycle tables (bits 0..3 hold the base cycle count):
+#define CYCLES_BASE		0x0f
+#define CYCFLAG_PAGE		0x10	// indexed access may cross page boundary
+#define CYCFLAG_BRANCH		0x20	// conditional branch
+#define CYCFLAG_BRANCHALWAYS	0x40	// unconditional branch
+
 // The mnemonics are split up into groups, each group has its own function to be dealt with:
 enum mnemogroup {
 	GROUP_ACCU,		// main accumulator stuff, plus PEI		Byte value = table index
@@ -140,6 +148,101 @@ SCS jump_lind[]  = {      0,      0,  0xdc00,      0,      0,       0,  0xdc00,
 #undef SCS
 #undef SCL
 
+// Cycle tables:
+// Base cycle count of each opcode, combined with flags for the penalties
+// (zero means the cycle count is unknown):
+#define PG	CYCFLAG_PAGE	// +1 if indexing crosses page boundary
+#define BR	CYCFLAG_BRANCH	// +1 if branch is taken, +1 more if target is in other page
+#define BA	CYCFLAG_BRANCHALWAYS	// +1 if target is in other page
+const unsigned char	mnemo_6502_cycles[256]	= {
+//	x0    x1    x2    x3    x4    x5    x6    x7    x8    x9    xa    xb    xc    xd    xe    xf
+	7,    6,    0,    8,    3,    3,    5,    5,    3,    2,    2,    2,    4,    4,    6,    6,	// 0x
+	2|BR, 5|PG, 0,    8,    4,    4,    6,    6,    2,    4|PG, 2,    7,    4|PG, 4|PG, 7,    7,	// 1x
+	6,    6,    0,    8,    3,    3,    5,    5,    4,    2,    2,    2,    4,    4,    6,    6,	// 2x
+	2|BR, 5|PG, 0,    8,    4,    4,    6,    6,    2,    4|PG, 2,    7,    4|PG, 4|PG, 7,    7,	// 3x
+	6,    6,    0,    8,    3,    3,    5,    5,    3,    2,    2,    2,    3,    4,    6,    6,	// 4x
+	2|BR, 5|PG, 0,    8,    4,    4,    6,    6,    2,    4|PG, 2,    7,    4|PG, 4|PG, 7,    7,	// 5x
+	6,    6,    0,    8,    3,    3,    5,    5,    4,    2,    2,    2,    5,    4,    6,    6,	// 6x
+	2|BR, 5|PG, 0,    8,    4,    4,    6,    6,    2,    4|PG, 2,    7,    4|PG, 4|PG, 7,    7,	// 7x
+	2,    6,    2,    6,    3,    3,    3,    3,    2,    2,    2,    2,    4,    4,    4,    4,	// 8x
+	2|BR, 6,    0,    6,    4,    4,    4,    4,    2,    5,    2,    5,    5,    5,    5,    5,	// 9x
+	2,    6,    2,    6,    3,    3,    3,    3,    2,    2,    2,    2,    4,    4,    4,    4,	// ax
+	2|BR, 5|PG, 0,    5|PG, 4,    4,    4,    4,    2,    4|PG, 2,    4|PG, 4|PG, 4|PG, 4|PG, 4|PG,	// bx
+	2,    6,    2,    8,    3,    3,    5,    5,    2,    2,    2,    2,    4,    4,    6,    6,	// cx
+	2|BR, 5|PG, 0,    8,    4,    4,    6,    6,    2,    4|PG, 2,    7,    4|PG, 4|PG, 7,    7,	// dx
+	2,    6,    2,    8,    3,    3,    5,    5,    2,    2,    2,    2,    4,    4,    6,    6,	// ex
+	2|BR, 5|PG, 0,    8,    4,    4,    6,    6,    2,    4|PG, 2,    7,    4|PG, 4|PG, 7,    7	// fx
+};
+const unsigned char	mnemo_65c02_cycles[256]	= {
+//	x0    x1    x2    x3    x4    x5    x6    x7    x8    x9    xa    xb    xc    xd    xe    xf
+	7,    6,    2,    1,    5,    3,    5,    5,    3,    2,    2,    1,    6,    4,    6,    5|BR,	// 0x
+	2|BR, 5|PG, 5,    1,    5,    4,    6,    5,    2,    4|PG, 2,    1,    6,    4|PG, 6|PG, 5|BR,	// 1x
+	6,    6,    2,    1,    3,    3,    5,    5,    4,    2,    2,    1,    4,    4,    6,    5|BR,	// 2x
+	2|BR, 5|PG, 5,    1,    4,    4,    6,    5,    2,    4|PG, 2,    1,    4|PG, 4|PG, 6|PG, 5|BR,	// 3x
+	6,    6,    2,    1,    3,    3,    5,    5,    3,    2,    2,    1,    3,    4,    6,    5|BR,	// 4x
+	2|BR, 5|PG, 5,    1,    4,    4,    6,    5,    2,    4|PG, 3,    1,    8,    4|PG, 6|PG, 5|BR,	// 5x
+	6,    6,    2,    1,    3,    3,    5,    5,    4,    2,    2,    1,    6,    4,    6,    5|BR,	// 6x
+	2|BR, 5|PG, 5,    1,    4,    4,    6,    5,    2,    4|PG, 4,    1,    6,    4|PG, 6|PG, 5|BR,	// 7x
+	3|BA, 6,    2,    1,    3,    3,    3,    5,    2,    2,    2,    1,    4,    4,    4,    5|BR,	// 8x
+	2|BR, 6,    5,    1,    4,    4,    4,    5,    2,    5,    2,    1,    4,    5,    5,    5|BR,	// 9x
+	2,    6,    2,    1,    3,    3,    3,    5,    2,    2,    2,    1,    4,    4,    4,    5|BR,	// ax
+	2|BR, 5|PG, 5,    1,    4,    4,    4,    5,    2,    4|PG, 2,    1,    4|PG, 4|PG, 4|PG, 5|BR,	// bx
+	2,    6,    2,    1,    3,    3,    5,    5,    2,    2,    2,    3,    4,    4,    6,    5|BR,	// cx
+	2|BR, 5|PG, 5,    1,    4,    4,    6,    5,    2,    4|PG, 3,    3,    4,    4|PG, 7,    5|BR,	// dx
+	2,    6,    2,    1,    3,    3,    5,    5,    2,    2,    2,    1,    4,    4,    6,    5|BR,	// ex
+	2|BR, 5|PG, 5,    1,    4,    4,    6,    5,    2,    4|PG, 4,    1,    4,    4|PG, 7,    5|BR	// fx
+};
+#undef PG
+#undef BR
+#undef BA
+
+// Peephole rules:
+// Loading the same immediate value again, setting a flag again or doing the
+// same transfer again has no effect, because the previous instruction has
+// already set all registers and flags accordingly. A call followed by a
+// return can be a jump instead. A jump to the next instruction is not needed.
+#define REPEAT(opcode)	{PEEPHOLE_REPEAT, (opcode), 0, 0}
+#define COMMON_RULES	\
+	REPEAT(0xa9), REPEAT(0xa2), REPEAT(0xa0),	/* lda/ldx/ldy #imm */	\
+	REPEAT(0x18), REPEAT(0x38), REPEAT(0x58), REPEAT(0x78), REPEAT(0xb8), REPEAT(0xd8), REPEAT(0xf8),	/* clc sec cli sei clv cld sed */	\
+	REPEAT(0xaa), REPEAT(0xa8), REPEAT(0x8a), REPEAT(0x98),	/* tax tay txa tya */	\
+	{PEEPHOLE_TAILCALL, 0x60, 0x20, 0x4c},	/* jsr + rts -> jmp */	\
+	{PEEPHOLE_JUMPNEXT, 0x4c, 0, 0}		/* jmp */
+const struct peephole_rule	mnemo_6502_peephole[]	= {
+	COMMON_RULES,
+	{PEEPHOLE_END, 0, 0, 0}
+};
+const struct peephole_rule	mnemo_65816_peephole[]	= {
+	COMMON_RULES,
+	{PEEPHOLE_TAILCALL, 0x6b, 0x22, 0x5c},	// jsl + rtl -> jml
+	{PEEPHOLE_JUMPNEXT, 0x5c, 0, 0},	// jml
+	{PEEPHOLE_END, 0, 0, 0}
+};
+const struct peephole_rule	mnemo_65ce02_peephole[]	= {
+	COMMON_RULES,
+	REPEAT(0xa3),	// ldz #imm
+	REPEAT(0x4b), REPEAT(0x6b),	// taz tza
+	{PEEPHOLE_END, 0, 0, 0}
+};
+#undef COMMON_RULES
+#undef REPEAT
+
+// The tables above are unpacked once, so instructions can be emitted without
+// decoding the packed opcodes each time. The first index is the row (i.e.
+// the addressing mode), the second one is the column (i.e. the table index
+// stored in the mnemonic's tree node).
+struct encoding {
+	bits		sizes;		// possible argument sizes (MAYBE_* values)
+	unsigned char	opcode[3];	// for 8, 16 and 24 bit arguments
+};
+#define COLUMNS(table)	(sizeof(table) / sizeof(table[0]))
+enum {ACCU_ABS, ACCU_XABS, ACCU_YABS, ACCU_SABS8, ACCU_XIND8, ACCU_INDY8, ACCU_IND8, ACCU_SINDY8, ACCU_LIND8, ACCU_LINDY8, ACCU_INDZ8, ACCU_LINDZ8, ACCU_ROWS};
+static struct encoding	accu_encodings[ACCU_ROWS][COLUMNS(accu_abs)];
+enum {MISC_ABS, MISC_XABS, MISC_YABS, MISC_ROWS};
+static struct encoding	misc_encodings[MISC_ROWS][COLUMNS(misc_abs)];
+enum {JUMP_ABS, JUMP_IND, JUMP_XIND, JUMP_LIND, JUMP_ROWS};
+static struct encoding	jump_encodings[JUMP_ROWS][COLUMNS(jump_abs)];
+
 // error message strings
 static const char	exception_illegal_combination[]	= "CPU does not support this addressing mode for this mnemonic.";
 static const char	exception_oversized_addrmode[]	= "Using oversized addressing mode.";
@@ -147,7 +250,37 @@ static const char	exception_oversized_addrmode[]	= "Using oversized addressing m
 
 // Variables
 
-static	STRUCT_DYNABUF_REF(mnemo_dyna_buf, MNEMO_INITIALSIZE);	// for mnemonics
+void	*mnemo_found;	// tree node body of mnemonic found most recently
+struct cycle_count	mnemo_cycles;	// counts for all instructions so far
+static int		cycles_opcode;	// opcode of current instruction (-1 if none)
+static int		branch_crossing;	// 1 if branch target is in other page, 0 if not, -1 if unknown
+struct pagecheck	mnemo_pagecheck	= {FALSE, FALSE, 256};
+static boolean		arg16_given;	// TRUE if current instruction has 16-bit argument...
+static struct number	arg16;		// ...and this is it (for page checks)
+static int		skip_crossing;	// for relaxed branches, see relaxed_branch()
+// for "--relax-branches", each branch executed in a pass gets a flag telling
+// whether an earlier pass has found its target to be out of range (and for
+// "--peephole", each jump gets one telling whether it has been removed):
+static boolean		*relax_flags	= NULL;
+static int		relax_size	= 0;
+static int		relax_next;	// index of next branch in current pass
+// for "--peephole", instructions a rule may refer to are remembered:
+struct peephole_insn {
+	int		opcode;		// -1 if there is none
+	int		arg_size;	// number of argument bytes
+	intval_t	value;		// argument...
+	boolean		value_sure;	// ...and whether it has never been undefined
+	intval_t	opcode_idx;	// output index of opcode...
+	char		xor;		// ...and xor value used for it
+	int		report_line;	// line of opcode in listing (-1 if none)...
+	int		report_offset;	// ...and its position there
+	intval_t	end_pc;		// program counter after instruction
+	intval_t	end_idx;	// output index after instruction
+	int		end_definitions;	// symbol definitions before next instruction
+};
+static struct peephole_insn	peep_prev	= {-1};	// previous instruction
+static struct peephole_insn	peep_now;	// current instruction
+static intval_t			peep_start_idx;	// output index at start of current one
 
 // mnemonic's code, flags and group values are stored together in a single integer.
 // ("code" is either a table index or the opcode itself, depending on group value)
@@ -530,6 +663,58 @@ static struct ronode	mnemo_m65_tree[]	= {
 
 // Functions
 
+// unpack opcodes for 8/16/24 bit arguments (in bits 0..7/8..15/16..23)
+static void unpack_opcodes(struct encoding *encoding, unsigned long opcodes)
+{
+	encoding->sizes = MAYBE______;
+	encoding->opcode[0] = opcodes & 255;
+	encoding->opcode[1] = (opcodes >> 8) & 255;
+	encoding->opcode[2] = (opcodes >> 16) & 255;
+	if (encoding->opcode[0])
+		encoding->sizes |= MAYBE_1____;
+	if (encoding->opcode[1])
+		encoding->sizes |= MAYBE___2__;
+	if (encoding->opcode[2])
+		encoding->sizes |= MAYBE_____3;
+}
+#define UNPACK_ROW(target, table)				\
+do {								\
+	int	ii;						\
+								\
+	for (ii = 0; ii < COLUMNS(table); ++ii)			\
+		unpack_opcodes(&(target)[ii], (table)[ii]);	\
+} while (0)
+
+// unpack code tables (only done once)
+static void unpack_encodings(void)
+{
+	static boolean	done	= FALSE;
+
+	if (done)
+		return;
+
+	UNPACK_ROW(accu_encodings[ACCU_ABS], accu_abs);
+	UNPACK_ROW(accu_encodings[ACCU_XABS], accu_xabs);
+	UNPACK_ROW(accu_encodings[ACCU_YABS], accu_yabs);
+	UNPACK_ROW(accu_encodings[ACCU_SABS8], accu_sabs8);
+	UNPACK_ROW(accu_encodings[ACCU_XIND8], accu_xind8);
+	UNPACK_ROW(accu_encodings[ACCU_INDY8], accu_indy8);
+	UNPACK_ROW(accu_encodings[ACCU_IND8], accu_ind8);
+	UNPACK_ROW(accu_encodings[ACCU_SINDY8], accu_sindy8);
+	UNPACK_ROW(accu_encodings[ACCU_LIND8], accu_lind8);
+	UNPACK_ROW(accu_encodings[ACCU_LINDY8], accu_lindy8);
+	UNPACK_ROW(accu_encodings[ACCU_INDZ8], accu_indz8);
+	UNPACK_ROW(accu_encodings[ACCU_LINDZ8], accu_lindz8);
+	UNPACK_ROW(misc_encodings[MISC_ABS], misc_abs);
+	UNPACK_ROW(misc_encodings[MISC_XABS], misc_xabs);
+	UNPACK_ROW(misc_encodings[MISC_YABS], misc_yabs);
+	UNPACK_ROW(jump_encodings[JUMP_ABS], jump_abs);
+	UNPACK_ROW(jump_encodings[JUMP_IND], jump_ind);
+	UNPACK_ROW(jump_encodings[JUMP_XIND], jump_xind);
+	UNPACK_ROW(jump_encodings[JUMP_LIND], jump_lind);
+	done = TRUE;
+}
+
 // Address mode parsing
 
 // utility function for parsing indices. result must be processed via AMB_PREINDEX() or AMB_INDEX() macro!
@@ -641,13 +826,19 @@ static bits get_addr_mode(struct number *result)
 	return address_mode_bits;
 }
 
+// TRUE if calc_arg_size() chose a bigger size because the value was undefined
+// (then the fixup has to do the check for the "oversized" warning)
+static boolean	size_unsure;
+
 // Helper function for calc_arg_size()
 // Only call with "size_bit = NUMBER_FORCES_16" or "size_bit = NUMBER_FORCES_24"
 static bits check_oversize(bits size_bit, struct number *argument)
 {
 	// only check if value is *defined*
-	if (argument->ntype == NUMTYPE_UNDEFINED)
+	if (argument->ntype == NUMTYPE_UNDEFINED) {
+		size_unsure = TRUE;
 		return size_bit;	// pass on result
+	}
 
 	// value is defined, so check
 	if (size_bit == NUMBER_FORCES_16) {
@@ -673,6 +864,7 @@ static bits check_oversize(bits size_bit, struct number *argument)
 // TODO: add pointer arg for result, use return value to indicate error ONLY!
 static bits calc_arg_size(bits force_bit, struct number *argument, bits addressing_modes)
 {
+	size_unsure = FALSE;
 	// if there are no possible addressing modes, complain
 	if (addressing_modes == MAYBE______) {
 		Throw_error(exception_illegal_combination);
@@ -769,6 +961,233 @@ static bits calc_arg_size(bits force_bit, struct number *argument, bits addressi
 	return 0;
 }
 
+// output opcode byte (and remember it for counting cycles)
+static void output_opcode(int opcode)
+{
+	cycles_opcode = opcode & 0xff;
+	Output_byte(opcode);
+}
+
+// add cycles of instruction to counters and to listing report
+static void count_cycles(void)
+{
+	const unsigned char	*table	= CPU_state.type->cycles;
+	struct report_line	*line;
+	int			entry,
+				min,
+				max,
+				taken;
+
+	if (cycles_opcode < 0)
+		return;	// nothing assembled (because of an error)
+
+	if ((table == NULL) || (table[cycles_opcode] == 0)) {
+		++mnemo_cycles.unknown;
+		min = max = -1;
+	} else {
+		entry = table[cycles_opcode];
+		min = max = entry & CYCLES_BASE;
+		if (entry & CYCFLAG_PAGE)
+			++max;
+		if (entry & (CYCFLAG_BRANCH | CYCFLAG_BRANCHALWAYS)) {
+			if (branch_crossing < 0)
+				++mnemo_cycles.unsure;	// count as crossing, for now
+			if (entry & CYCFLAG_BRANCH)
+				++max;	// taken
+			if (branch_crossing) {
+				++max;
+				if ((entry & CYCFLAG_BRANCHALWAYS) && (branch_crossing > 0))
+					++min;
+			}
+		}
+		// a relaxed branch is an inverted branch skipping a jump:
+		if (skip_crossing >= 0) {
+			taken = 3 + skip_crossing;	// jump is skipped
+			min = (taken < 2 + min) ? taken : 2 + min;
+			max = (taken > 2 + max) ? taken : 2 + max;
+		}
+		mnemo_cycles.min += min;
+		mnemo_cycles.max += max;
+	}
+	// cycles belong to the source line recorded last (like the bytes)
+	if (report->active && report->used) {
+		line = &report->lines[report->used - 1];
+		if (min < 0) {
+			line->cycles_unknown = TRUE;
+		} else {
+			line->cycles_min += min;
+			line->cycles_max += max;
+		}
+	}
+}
+
+// complain about page crossing (for "!pagecheck")
+static void pagecheck_complain(const char *message)
+{
+	if (mnemo_pagecheck.is_error)
+		Throw_error(message);
+	else
+		Throw_warning(message);
+}
+
+// if "!pagecheck" is active, check whether instruction takes an extra cycle
+// because of crossing a page boundary
+static void check_pages(void)
+{
+	const unsigned char	*table	= CPU_state.type->cycles;
+	int			entry;
+
+	if ((!mnemo_pagecheck.active) || (cycles_opcode < 0) || (table == NULL))
+		return;
+
+	entry = table[cycles_opcode];
+	if (entry & (CYCFLAG_BRANCH | CYCFLAG_BRANCHALWAYS)) {
+		if (branch_crossing < 0)
+			fixup_invalidate();	// the check must be done in a real pass
+		else if (branch_crossing)
+			pagecheck_complain("Branch target is in other page.");
+	} else if ((entry & CYCFLAG_PAGE) && arg16_given) {
+		// only absolute indexed addressing gets here, because for
+		// "($ff),y", the pointer is not known at assembly time
+		if (arg16.ntype != NUMTYPE_INT)
+			fixup_invalidate();	// the check must be done in a real pass
+		else if ((arg16.val.intval & 0xff) + mnemo_pagecheck.table_size > 256)
+			pagecheck_complain("Indexed access crosses page boundary.");
+	}
+}
+
+// return flag of next branch for "--relax-branches" (TRUE means long form),
+// or of next jump for "--peephole" (TRUE means removed)
+static boolean *relax_flag(void)
+{
+	int	old_size	= relax_size;
+
+	if (relax_next == relax_size) {
+		relax_size = relax_size ? 2 * relax_size : 256;
+		relax_flags = safe_realloc(relax_flags, old_size * sizeof(*relax_flags), relax_size * sizeof(*relax_flags), MEMUSE_OTHER);
+		memset(relax_flags + old_size, 0, (relax_size - old_size) * sizeof(*relax_flags));
+	}
+	return &relax_flags[relax_next++];
+}
+
+// add note to listing line, if there is one
+static void peephole_note(int line, const char *note)
+{
+	if (report->active && (line >= 0))
+		report->lines[line].peephole = note;
+}
+
+// change previous instruction from call to jump (for PEEPHOLE_TAILCALL)
+static void peephole_tailcall(const struct peephole_rule *rule)
+{
+	const unsigned char	*table	= CPU_state.type->cycles;
+	struct report_line	*line;
+	int			saved	= 0;
+
+	output_change_byte(peep_prev.opcode_idx, peep_prev.xor, rule->jump);
+	if (table && table[rule->call] && table[rule->jump])
+		saved = (table[rule->call] & CYCLES_BASE) - (table[rule->jump] & CYCLES_BASE);
+	mnemo_cycles.min -= saved;
+	mnemo_cycles.max -= saved;
+	if (report->active && (peep_prev.report_line >= 0)) {
+		line = &report->lines[peep_prev.report_line];
+		if (peep_prev.report_offset < REPORT_BINBUFSIZE)
+			line->bin[peep_prev.report_offset] = rule->jump;
+		if (!line->cycles_unknown) {
+			line->cycles_min -= saved;
+			line->cycles_max -= saved;
+		}
+		line->peephole = "peephole: call changed to jump";
+	}
+}
+
+// "--peephole": check the instruction about to be output against the rules
+// of the cpu. returns TRUE if it has been dealt with, then the caller must
+// not output it. "arg" is NULL for implied addressing.
+static boolean peephole(int opcode, const struct number *arg, int arg_size)
+{
+	const struct peephole_rule	*rule	= CPU_state.type->peephole;
+	struct number			pc;
+	boolean				follows,	// TRUE if right after previous instruction
+					*removed;
+
+	// remember instruction (unless there was a prefix)
+	peep_now.opcode = -1;
+	if ((!config.peephole) || (rule == NULL) || (output_get_index() != peep_start_idx))
+		return FALSE;
+
+	vcpu_read_pc(&pc);
+	if (pc.ntype != NUMTYPE_INT)
+		return FALSE;
+
+	peep_now.opcode = opcode;
+	peep_now.arg_size = arg_size;
+	peep_now.value = arg ? arg->val.intval : 0;
+	peep_now.value_sure = (arg == NULL)
+		|| ((arg->ntype == NUMTYPE_INT) && !(arg->flags & NUMBER_EVER_UNDEFINED));
+	peep_now.opcode_idx = output_get_index();
+	peep_now.xor = output_get_xor();
+	peep_now.report_line = -1;
+	if (report->active && report->used) {
+		peep_now.report_line = report->used - 1;
+		peep_now.report_offset = report->lines[report->used - 1].bin_used;
+	}
+	// never merge across labels or across anything else that was output
+	follows = (peep_prev.opcode >= 0)
+		&& (peep_prev.end_pc == pc.val.intval + vcpu_get_statement_size())
+		&& (peep_prev.end_idx == peep_now.opcode_idx)
+		&& (peep_prev.end_definitions == symbol_definitions);
+	for (; rule->action != PEEPHOLE_END; ++rule) {
+		if (rule->opcode != opcode)
+			continue;
+
+		switch (rule->action) {
+		case PEEPHOLE_REPEAT:
+			// values that were undefined in some pass may differ
+			// in the next, so these are never compared
+			if (follows
+			&& (peep_prev.opcode == opcode)
+			&& (peep_prev.arg_size == arg_size)
+			&& peep_prev.value_sure
+			&& peep_now.value_sure
+			&& (peep_prev.value == peep_now.value)) {
+				peephole_note(peep_now.report_line, "peephole: repeated instruction removed");
+				return TRUE;
+			}
+			break;
+		case PEEPHOLE_TAILCALL:
+			if (follows && (peep_prev.opcode == rule->call)) {
+				peephole_tailcall(rule);
+				peephole_note(peep_now.report_line, "peephole: return removed, call before it changed to jump");
+				peep_prev.opcode = -1;	// it is something else now
+				return TRUE;
+			}
+			break;
+		case PEEPHOLE_JUMPNEXT:
+			// forward jumps are only found to go to the next
+			// instruction in a later pass. once removed, the jump
+			// stays removed, so the passes are sure to converge.
+			removed = relax_flag();
+			if (arg->ntype != NUMTYPE_INT) {
+				fixup_invalidate();	// the check must be done in a real pass
+			} else if ((!*removed)
+			&& (arg->val.intval == pc.val.intval + vcpu_get_statement_size() + 1 + arg_size)) {
+				*removed = TRUE;
+				if (arg->flags & NUMBER_EVER_UNDEFINED)
+					++pass.relaxed_count;	// layout changed, so another pass is needed
+			}
+			if (*removed) {
+				peephole_note(peep_now.report_line, "peephole: jump to next instruction removed");
+				return TRUE;
+			}
+			break;
+		default:
+			Bug_found("IllegalPeepholeAction", rule->action);
+		}
+	}
+	return FALSE;
+}
+
 // Mnemonics using only implied addressing.
 static void group_only_implied_addressing(int opcode)
 {
@@ -777,7 +1196,8 @@ static void group_only_implied_addressing(int opcode)
 	// for 65ce02 and 4502, warn about buggy decimal mode
 	if ((opcode == 0xf8) && (CPU_state.type->flags & CPUFLAG_DECIMALSUBTRACTBUGGY))
 		Throw_first_pass_warning("Found SED instruction for CPU with known decimal SBC bug.");
-	Output_byte(opcode);
+	if (!peephole(opcode, NULL, 0))
+		output_opcode(opcode);
 	Input_ensure_EOS();
 }
 
@@ -790,86 +1210,132 @@ static void not_in_bank(intval_t target)
 	Throw_error(buffer);
 }
 
+// helper function to output 8-bit offset from base address to target
+static void near_offset(intval_t target, intval_t base)
+{
+	intval_t	offset	= 0;	// dummy value, to not throw more errors than necessary
+
+	if ((target | 0xffff) != 0xffff) {
+		not_in_bank(target);
+	} else {
+		offset = (target - base) & 0xffff;	// clip to 16 bit offset
+		branch_crossing = ((target ^ base) & 0xff00) != 0;
+		// fix sign
+		if (offset & 0x8000)
+			offset -= 0x10000;
+		// range check
+		if ((offset < -128) || (offset > 127)) {
+			char	buffer[60];	// 640K should be enough for anybody
+
+			sprintf(buffer, "Target out of range (%ld; %ld too far).", (long) offset, (long) (offset < -128 ? -128 - offset : offset - 127));
+			Throw_error(buffer);
+		}
+	}
+	// this fn has its own range check (see above).
+	// No reason to irritate the user with another error message,
+	// so use Output_byte() instead of output_8()
+	//output_8(offset);
+	Output_byte(offset);
+}
+
 // helper function for branches with 8-bit offset (including bbr0..7/bbs0..7)
 static void near_branch(int preoffset)
 {
 	struct number	pc;
 	struct number	target;
-	intval_t	offset	= 0;	// dummy value, to not throw more errors than necessary
 
 	vcpu_read_pc(&pc);
 	get_int_arg(&target, TRUE);
 	typesystem_want_addr(&target);
 	if ((pc.ntype == NUMTYPE_INT) && (target.ntype == NUMTYPE_INT)) {
-		if ((target.val.intval | 0xffff) != 0xffff) {
-			not_in_bank(target.val.intval);
-		} else {
-			offset = (target.val.intval - (pc.val.intval + preoffset)) & 0xffff;	// clip to 16 bit offset
-			// fix sign
-			if (offset & 0x8000)
-				offset -= 0x10000;
-			// range check
-			if ((offset < -128) || (offset > 127)) {
-				char	buffer[60];	// 640K should be enough for anybody
-
-				sprintf(buffer, "Target out of range (%ld; %ld too far).", (long) offset, (long) (offset < -128 ? -128 - offset : offset - 127));
-				Throw_error(buffer);
-			}
-		}
+		near_offset(target.val.intval, pc.val.intval + preoffset);
+	} else {
+		if (pc.ntype == NUMTYPE_INT)
+			fixup_add_relative(near_offset, pc.val.intval + preoffset);
+		Output_byte(0);	// dummy value, to not throw more errors than necessary
 	}
-	// this fn has its own range check (see above).
-	// No reason to irritate the user with another error message,
-	// so use Output_byte() instead of output_8()
-	//output_8(offset);
-	Output_byte(offset);
 	Input_ensure_EOS();
 }
 
+// helper function to output 16-bit offset from base address to target
+static void far_offset(intval_t target, intval_t base)
+{
+	intval_t	offset	= 0;	// dummy value, to not throw more errors than necessary
+
+	if ((target | 0xffff) != 0xffff) {
+		not_in_bank(target);
+	} else {
+		offset = (target - base) & 0xffff;
+		// no further checks necessary, 16-bit branches can access whole bank
+	}
+	output_le16(offset);
+}
+
 // helper function for relative addressing with 16-bit offset
 static void far_branch(int preoffset)
 {
 	struct number	pc;
 	struct number	target;
-	intval_t	offset	= 0;	// dummy value, to not throw more errors than necessary
 
 	vcpu_read_pc(&pc);
 	get_int_arg(&target, TRUE);
 	typesystem_want_addr(&target);
 	if ((pc.ntype == NUMTYPE_INT) && (target.ntype == NUMTYPE_INT)) {
-		if ((target.val.intval | 0xffff) != 0xffff) {
-			not_in_bank(target.val.intval);
-		} else {
-			offset = (target.val.intval - (pc.val.intval + preoffset)) & 0xffff;
-			// no further checks necessary, 16-bit branches can access whole bank
-		}
+		far_offset(target.val.intval, pc.val.intval + preoffset);
+	} else {
+		if (pc.ntype == NUMTYPE_INT)
+			fixup_add_relative(far_offset, pc.val.intval + preoffset);
+		output_le16(0);	// dummy value, to not throw more errors than necessary
 	}
-	output_le16(offset);
 	Input_ensure_EOS();
 }
 
-// set addressing mode bits depending on which opcodes exist, then calculate
-// argument size and output both opcode and argument
-static void make_instruction(bits force_bit, struct number *result, unsigned long opcodes)
+// output functions for fixups of arguments whose size was chosen before their
+// value was known, so the "oversized" check of check_oversize() is done then
+static void output_unsure_le16(intval_t value)
+{
+	if ((value <= 255) && (value >= -128))
+		Throw_warning(exception_oversized_addrmode);
+	output_le16(value);
+}
+static void output_unsure_le24(intval_t value)
 {
-	int	addressing_modes	= MAYBE______;
-
-	if (opcodes & 0x0000ff)
-		addressing_modes |= MAYBE_1____;
-	if (opcodes & 0x00ff00)
-		addressing_modes |= MAYBE___2__;
-	if (opcodes & 0xff0000)
-		addressing_modes |= MAYBE_____3;
-	switch (calc_arg_size(force_bit, result, addressing_modes)) {
+	if ((value <= 65535) && (value >= -32768))
+		Throw_warning(exception_oversized_addrmode);
+	output_le24(value);
+}
+
+// calculate argument size from the sizes the encoding allows, then output
+// both opcode and argument
+static void make_instruction(bits force_bit, struct number *result, const struct encoding *encoding)
+{
+	switch (calc_arg_size(force_bit, result, encoding->sizes)) {
 	case NUMBER_FORCES_8:
-		Output_byte(opcodes & 255);
+		if (peephole(encoding->opcode[0], result, 1))
+			break;
+		output_opcode(encoding->opcode[0]);
+		if (result->ntype == NUMTYPE_UNDEFINED)
+			fixup_add(output_8, FALSE);
 		output_8(result->val.intval);
 		break;
 	case NUMBER_FORCES_16:
-		Output_byte((opcodes >> 8) & 255);
+		if (peephole(encoding->opcode[1], result, 2))
+			break;
+		output_opcode(encoding->opcode[1]);
+		arg16_given = TRUE;
+		arg16 = *result;
+		if (result->addr_refs == 1)
+			output_relocation();
+		if (result->ntype == NUMTYPE_UNDEFINED)
+			fixup_add(size_unsure ? output_unsure_le16 : output_le16, TRUE);
 		output_le16(result->val.intval);
 		break;
 	case NUMBER_FORCES_24:
-		Output_byte((opcodes >> 16) & 255);
+		if (peephole(encoding->opcode[2], result, 3))
+			break;
+		output_opcode(encoding->opcode[2]);
+		if (result->ntype == NUMTYPE_UNDEFINED)
+			fixup_add(size_unsure ? output_unsure_le24 : output_le24, FALSE);
 		output_le24(result->val.intval);
 	}
 }
@@ -911,6 +1377,8 @@ static unsigned int imm_ops(bits *force_bit, unsigned char opcode, bits immediat
 // helper function to warn if zp pointer wraps around
 static void check_zp_wraparound(struct number *result)
 {
+	if (result->ntype == NUMTYPE_UNDEFINED)
+		fixup_invalidate();	// the check must be done in a real pass
 	if ((result->ntype == NUMTYPE_INT)
 	&& (result->val.intval == 0xff)
 	&& (CPU_state.type->flags & CPUFLAG_WARN_ABOUT_FF_PTR))
@@ -921,61 +1389,61 @@ static void check_zp_wraparound(struct number *result)
 // plus PEI.
 static void group_main(int index, bits flags)
 {
-	unsigned long	immediate_opcodes;
+	struct encoding	immediate;
 	struct number	result;
 	bits		force_bit	= Input_get_force_bit();	// skips spaces after
 
 	switch (get_addr_mode(&result)) {
 	case IMMEDIATE_ADDRESSING:	// #$ff or #$ffff (depending on accu length)
-		immediate_opcodes = imm_ops(&force_bit, accu_imm[index], flags & IMMASK);
+		unpack_opcodes(&immediate, imm_ops(&force_bit, accu_imm[index], flags & IMMASK));
 		// CAUTION - do not incorporate the line above into the line
 		// below - "force_bit" might be undefined (depends on compiler).
-		make_instruction(force_bit, &result, immediate_opcodes);
+		make_instruction(force_bit, &result, &immediate);
 		break;
 	case ABSOLUTE_ADDRESSING:	// $ff, $ffff, $ffffff
-		make_instruction(force_bit, &result, accu_abs[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_ABS][index]);
 		break;
 	case X_INDEXED_ADDRESSING:	// $ff,x, $ffff,x, $ffffff,x
-		make_instruction(force_bit, &result, accu_xabs[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_XABS][index]);
 		break;
 	case Y_INDEXED_ADDRESSING:	// $ffff,y (in theory, "$ff,y" as well)
-		make_instruction(force_bit, &result, accu_yabs[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_YABS][index]);
 		break;
 	case STACK_INDEXED_ADDRESSING:	// $ff,s
-		make_instruction(force_bit, &result, accu_sabs8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_SABS8][index]);
 		break;
 	case X_INDEXED_INDIRECT_ADDRESSING:	// ($ff,x)
-		make_instruction(force_bit, &result, accu_xind8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_XIND8][index]);
 		break;
 	case INDIRECT_ADDRESSING:	// ($ff)
-		make_instruction(force_bit, &result, accu_ind8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_IND8][index]);
 		check_zp_wraparound(&result);
 		break;
 	case INDIRECT_Y_INDEXED_ADDRESSING:	// ($ff),y
-		make_instruction(force_bit, &result, accu_indy8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_INDY8][index]);
 		check_zp_wraparound(&result);
 		break;
 	case INDIRECT_Z_INDEXED_ADDRESSING:	// ($ff),z	only for 65ce02/4502/m65
-		make_instruction(force_bit, &result, accu_indz8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_INDZ8][index]);
 		check_zp_wraparound(&result);
 		break;
 	case LONG_INDIRECT_ADDRESSING:	// [$ff]	for 65816 and m65
 		// if in quad mode, m65 encodes this as NOP + ($ff),z
 		if (flags & LI_PREFIX_NOP)
 			Output_byte(0xea);
-		make_instruction(force_bit, &result, accu_lind8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_LIND8][index]);
 		break;
 	case LONG_INDIRECT_Y_INDEXED_ADDRESSING:	// [$ff],y	only for 65816
-		make_instruction(force_bit, &result, accu_lindy8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_LINDY8][index]);
 		break;
 	case STACK_INDEXED_INDIRECT_Y_INDEXED_ADDRESSING:	// ($ff,s),y	only for 65816 and 65ce02/4502/m65
-		make_instruction(force_bit, &result, accu_sindy8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_SINDY8][index]);
 		break;
 	case LONG_INDIRECT_Z_INDEXED_ADDRESSING:	// [$ff],z	only for m65
 		// if not in quad mode, m65 encodes this as NOP + ($ff),z
 		if (flags & LI_PREFIX_NOP)
 			Output_byte(0xea);
-		make_instruction(force_bit, &result, accu_lindz8[index]);
+		make_instruction(force_bit, &result, &accu_encodings[ACCU_LINDZ8][index]);
 		break;
 	default:	// other combinations are illegal
 		Throw_error(exception_illegal_combination);
@@ -986,13 +1454,16 @@ static void group_main(int index, bits flags)
 static void group_misc(int index, bits immediate_mode)
 {
 	unsigned long	immediate_opcodes;
+	struct encoding	immediate;
 	struct number	result;
 	bits		force_bit	= Input_get_force_bit();	// skips spaces after
 
 	switch (get_addr_mode(&result)) {
 	case IMPLIED_ADDRESSING:	// implied addressing
-		if (misc_impl[index])
-			Output_byte(misc_impl[index]);
+		if (misc_impl[index]) {
+			if (!peephole(misc_impl[index], NULL, 0))
+				output_opcode(misc_impl[index]);
+		}
 		else
 			Throw_error(exception_illegal_combination);
 		break;
@@ -1000,9 +1471,13 @@ static void group_misc(int index, bits immediate_mode)
 		immediate_opcodes = imm_ops(&force_bit, misc_imm[index], immediate_mode);
 		// CAUTION - do not incorporate the line above into the line
 		// below - "force_bit" might be undefined (depends on compiler).
-		make_instruction(force_bit, &result, immediate_opcodes);
+		unpack_opcodes(&immediate, immediate_opcodes);
+		make_instruction(force_bit, &result, &immediate);
 		// warn about unstable ANE/LXA (undocumented opcode of NMOS 6502)?
 		if ((CPU_state.type->flags & CPUFLAG_8B_AND_AB_NEED_0_ARG)
+		&& (result.ntype == NUMTYPE_UNDEFINED))
+			fixup_invalidate();	// the check must be done in a real pass
+		if ((CPU_state.type->flags & CPUFLAG_8B_AND_AB_NEED_0_ARG)
 		&& (result.ntype == NUMTYPE_INT)
 		&& (result.val.intval != 0x00)) {
 			if (immediate_opcodes == 0x8b)
@@ -1012,24 +1487,84 @@ static void group_misc(int index, bits immediate_mode)
 		}
 		break;
 	case ABSOLUTE_ADDRESSING:	// $ff or  $ffff
-		make_instruction(force_bit, &result, misc_abs[index]);
+		make_instruction(force_bit, &result, &misc_encodings[MISC_ABS][index]);
 		break;
 	case X_INDEXED_ADDRESSING:	// $ff,x  or  $ffff,x
-		make_instruction(force_bit, &result, misc_xabs[index]);
+		make_instruction(force_bit, &result, &misc_encodings[MISC_XABS][index]);
 		break;
 	case Y_INDEXED_ADDRESSING:	// $ff,y  or  $ffff,y
-		make_instruction(force_bit, &result, misc_yabs[index]);
+		make_instruction(force_bit, &result, &misc_encodings[MISC_YABS][index]);
 		break;
 	default:	// other combinations are illegal
 		Throw_error(exception_illegal_combination);
 	}
 }
 
+// short branch for "--relax-branches": once the target is found to be out of
+// range, this branch uses a longer form in all later passes (so sizes only
+// ever grow and the passes are sure to converge). the long form is a 16-bit
+// branch if the cpu has those, otherwise a jump (preceded by an inverted
+// branch that skips it, unless the branch is unconditional).
+static void relaxed_branch(int opcode)
+{
+	struct number	pc;
+	struct number	target;
+	boolean		*is_long	= relax_flag();
+	boolean		defined;
+	intval_t	offset;
+
+	vcpu_read_pc(&pc);
+	get_int_arg(&target, TRUE);
+	typesystem_want_addr(&target);
+	defined = (pc.ntype == NUMTYPE_INT) && (target.ntype == NUMTYPE_INT);
+	if (!defined)
+		fixup_invalidate();	// the target might be out of range
+	if (defined && !*is_long && ((target.val.intval | 0xffff) == 0xffff)) {
+		offset = (target.val.intval - (pc.val.intval + 2)) & 0xffff;
+		if (offset & 0x8000)
+			offset -= 0x10000;
+		if ((offset < -128) || (offset > 127)) {
+			*is_long = TRUE;
+			++pass.relaxed_count;	// layout changed, so another pass is needed
+		}
+	}
+	if (!*is_long) {
+		output_opcode(opcode);
+		if (defined)
+			near_offset(target.val.intval, pc.val.intval + 2);
+		else
+			Output_byte(0);	// dummy value, to not throw more errors than necessary
+	} else if (CPU_state.type->flags & CPUFLAG_LONGBRANCHES) {
+		output_opcode(opcode | 0x03);	// 65ce02 has long versions of all branches
+		if (defined)
+			far_offset(target.val.intval, pc.val.intval + 2);
+		else
+			output_le16(0);	// dummy value, to not throw more errors than necessary
+	} else {
+		if ((opcode & 0x1f) == 0x10) {
+			// conditional branch, so invert it and let it skip the jump
+			output_opcode(opcode ^ 0x20);
+			Output_byte(3);
+			if (pc.ntype == NUMTYPE_INT)
+				skip_crossing = (((pc.val.intval + 2) ^ (pc.val.intval + 5)) & 0xff00) != 0;
+		}
+		output_opcode(0x4c);	// jmp
+		if (target.addr_refs == 1)
+			output_relocation();
+		output_le16(target.val.intval);
+	}
+	Input_ensure_EOS();
+}
+
 // mnemonics using only 8bit relative addressing (short branch instructions).
 static void group_std_branches(int opcode)
 {
 	//bits	force_bit	= Input_get_force_bit();	// skips spaces after	// TODO - accept postfix and complain about it?
-	Output_byte(opcode);
+	if (config.relax_branches) {
+		relaxed_branch(opcode);
+		return;
+	}
+	output_opcode(opcode);
 	near_branch(2);
 }
 
@@ -1042,7 +1577,7 @@ static void group_bbr_bbs(int opcode)
 	get_int_arg(&zpmem, TRUE);
 	typesystem_want_addr(&zpmem);
 	if (Input_accept_comma()) {
-		Output_byte(opcode);
+		output_opcode(opcode);
 		Output_byte(zpmem.val.intval);
 		near_branch(3);
 	} else {
@@ -1054,7 +1589,7 @@ static void group_bbr_bbs(int opcode)
 static void group_relative16(int opcode, int preoffset)
 {
 	//bits	force_bit	= Input_get_force_bit();	// skips spaces after	// TODO - accept postfix and complain about it?
-	Output_byte(opcode);
+	output_opcode(opcode);
 	far_branch(preoffset);
 }
 
@@ -1090,7 +1625,7 @@ static void group_mvn_mvp(int opcode)
 	get_int_arg(&target, TRUE);
 	typesystem_want_nonaddr(&target);
 	// output
-	Output_byte(opcode);
+	output_opcode(opcode);
 	output_8(target.val.intval);
 	output_8(source.val.intval);
 	// sanity check
@@ -1107,7 +1642,7 @@ static void group_only_zp(int opcode)
 
 	get_int_arg(&target, TRUE);
 	typesystem_want_addr(&target);
-	Output_byte(opcode);
+	output_opcode(opcode);
 	output_8(target.val.intval);
 	Input_ensure_EOS();
 }
@@ -1130,10 +1665,13 @@ static void group_jump(int index)
 
 	switch (get_addr_mode(&result)) {
 	case ABSOLUTE_ADDRESSING:	// absolute16 or absolute24
-		make_instruction(force_bit, &result, jump_abs[index]);
+		make_instruction(force_bit, &result, &jump_encodings[JUMP_ABS][index]);
 		break;
 	case INDIRECT_ADDRESSING:	// ($ffff)
-		make_instruction(force_bit, &result, jump_ind[index]);
+		make_instruction(force_bit, &result, &jump_encodings[JUMP_IND][index]);
+		if ((result.ntype == NUMTYPE_UNDEFINED)
+		&& (CPU_state.type->flags & CPUFLAG_INDIRECTJMPBUGGY))
+			fixup_invalidate();	// the check must be done in a real pass
 		// check whether to warn about 6502's JMP() bug
 		if ((result.ntype == NUMTYPE_INT)
 		&& ((result.val.intval & 0xff) == 0xff)
@@ -1141,33 +1679,35 @@ static void group_jump(int index)
 			Throw_warning("Assembling buggy JMP($xxff) instruction");
 		break;
 	case X_INDEXED_INDIRECT_ADDRESSING:	// ($ffff,x)
-		make_instruction(force_bit, &result, jump_xind[index]);
+		make_instruction(force_bit, &result, &jump_encodings[JUMP_XIND][index]);
 		break;
 	case LONG_INDIRECT_ADDRESSING:	// [$ffff]
-		make_instruction(force_bit, &result, jump_lind[index]);
+		make_instruction(force_bit, &result, &jump_encodings[JUMP_LIND][index]);
 		break;
 	default:	// other combinations are illegal
 		Throw_error(exception_illegal_combination);
 	}
 }
 
-// Work function
-static boolean check_mnemo_tree(struct ronode *tree, struct dynabuf *dyna_buf)
+// assemble mnemonic, given its tree node body
+void mnemo_assemble(void *node_body)
 {
-	void	*node_body;
-	int	code;
-	bits	flags;
-
-	// search for tree item
-	if (!Tree_easy_scan(tree, &node_body, dyna_buf))
-		return FALSE;
+	struct number	pc;
+	int		code;
+	bits		flags;
 
 	code = ((int) node_body) & CODEMASK;	// get opcode or table index
 	flags = ((int) node_body) & FLAGSMASK;	// get immediate mode flags and prefix flags
+	peep_start_idx = output_get_index();
+	peep_now.opcode = -1;
 	if (flags & PREFIX_NEGNEG) {
 		Output_byte(0x42);
 		Output_byte(0x42);
 	}
+	cycles_opcode = -1;
+	branch_crossing = -1;
+	arg16_given = FALSE;
+	skip_crossing = -1;
 	switch (GROUP((long) node_body)) {
 	case GROUP_ACCU:	// main accumulator stuff
 		group_main(code, flags);
@@ -1205,228 +1745,153 @@ static boolean check_mnemo_tree(struct ronode *tree, struct dynabuf *dyna_buf)
 	default:	// others indicate bugs
 		Bug_found("IllegalGroupIndex", code);
 	}
-	return TRUE;
-}
-
-// check whether mnemonic in GlobalDynaBuf is supported by 6502 cpu.
-boolean keyword_is_6502_mnemo(int length)
-{
-	if (length != 3)
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	return check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf);
-}
-
-// check whether mnemonic in GlobalDynaBuf is supported by NMOS 6502 cpu.
-boolean keyword_is_nmos6502_mnemo(int length)
-{
-	if (length != 3)
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check undocumented ("illegal") opcodes...
-	if (check_mnemo_tree(mnemo_6502undoc1_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// then check some more undocumented ("illegal") opcodes...
-	if (check_mnemo_tree(mnemo_6502undoc2_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes
-	return check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf);
-}
-
-// check whether mnemonic in GlobalDynaBuf is supported by C64DTV2 cpu.
-boolean keyword_is_c64dtv2_mnemo(int length)
-{
-	if (length != 3)
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check C64DTV2 extensions...
-	if (check_mnemo_tree(mnemo_c64dtv2_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check a few undocumented ("illegal") opcodes...
-	if (check_mnemo_tree(mnemo_6502undoc1_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes
-	return check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf);
-}
-
-// check whether mnemonic in GlobalDynaBuf is supported by 65c02 cpu.
-boolean keyword_is_65c02_mnemo(int length)
-{
-	if (length != 3)
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check extensions because some mnemonics gained new addressing modes...
-	if (check_mnemo_tree(mnemo_65c02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes
-	return check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf);
+	count_cycles();
+	check_pages();
+	// unless the peephole optimizer has removed it, remember instruction
+	if (config.peephole
+	&& ((peep_now.opcode < 0) || (output_get_index() != peep_start_idx))) {
+		peep_prev = peep_now;
+		vcpu_read_pc(&pc);
+		peep_prev.end_pc = pc.val.intval + vcpu_get_statement_size();
+		peep_prev.end_idx = output_get_index();
+		peep_prev.end_definitions = symbol_definitions;
+	}
 }
 
-// check whether mnemonic in GlobalDynaBuf is supported by Rockwell 65c02 cpu.
-boolean keyword_is_r65c02_mnemo(int length)
+// set up for new pass
+void mnemo_passinit(void)
 {
-	if ((length != 3) && (length != 4))
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check 65c02 extensions because some mnemonics gained new addressing modes...
-	if (check_mnemo_tree(mnemo_65c02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes...
-	if (check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check Rockwell extensions (rmb, smb, bbr, bbs)
-	return check_mnemo_tree(mnemo_bitmanips_tree, mnemo_dyna_buf);
+	// branches only grow (and jumps are only removed) during a build, so
+	// start afresh in first pass
+	if (FIRST_PASS && relax_size)
+		memset(relax_flags, 0, relax_size * sizeof(*relax_flags));
+	relax_next = 0;
+	peep_prev.opcode = -1;
 }
 
-// check whether mnemonic in GlobalDynaBuf is supported by WDC w65c02 cpu.
-boolean keyword_is_w65c02_mnemo(int length)
+// merge given NULL-terminated list of mnemonic tables into a single one (if a
+// mnemonic is in more than one table, the first one wins, because some
+// mnemonics gained new addressing modes in later cpus)
+struct ronode *mnemo_merge_tables(struct ronode *const *tables)
 {
-	if ((length != 3) && (length != 4))
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check 65c02 extensions because some mnemonics gained new addressing modes...
-	if (check_mnemo_tree(mnemo_65c02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes...
-	if (check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check Rockwell extensions (rmb, smb, bbr, bbs)...
-	if (check_mnemo_tree(mnemo_bitmanips_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check WDC extensions "stp" and "wai"
-	return check_mnemo_tree(mnemo_stp_wai_tree, mnemo_dyna_buf);
-}
-
-// check whether mnemonic in GlobalDynaBuf is supported by CSG 65CE02 cpu.
-boolean keyword_is_65ce02_mnemo(int length)
-{
-	if ((length != 3) && (length != 4))
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check 65ce02 extensions because some mnemonics gained new addressing modes...
-	if (check_mnemo_tree(mnemo_65ce02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check 65c02 extensions because of the same reason...
-	if (check_mnemo_tree(mnemo_65c02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes...
-	if (check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check Rockwell extensions (rmb, smb, bbr, bbs)...
-	if (check_mnemo_tree(mnemo_bitmanips_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check "aug"
-	return check_mnemo_tree(mnemo_aug_tree, mnemo_dyna_buf);
+	struct ronode	*const *table,
+			*read,
+			*merged;
+	int		count	= 0,
+			ii;
+
+	for (table = tables; *table; ++table) {
+		read = *table + 1;	// real data starts at next list item
+		do
+			++count;
+		while ((read++)->hash_value);
+	}
+	unpack_encodings();	// code tables are needed as soon as there is a cpu
+	merged = safe_malloc((count + 1) * sizeof(*merged), MEMUSE_TREES);
+	merged[0] = (*tables)[0];	// list head
+	merged[0].body = NULL;	// will hold lookup table once it has been built
+	count = 0;
+	for (table = tables; *table; ++table) {
+		read = *table + 1;	// real data starts at next list item
+		for (;;) {
+			// this is only done once per cpu type, so no need to be clever
+			for (ii = 1; ii <= count; ++ii) {
+				if (strcmp(merged[ii].id_string, read->id_string) == 0)
+					break;
+			}
+			if (ii > count) {
+				merged[++count] = *read;
+				merged[count].hash_value = 1;	// list goes on
+			}
+			if (read->hash_value == 0)
+				break;	// that was the last item
+			++read;
+		}
+	}
+	merged[count].hash_value = 0;	// mark last item
+	return merged;
 }
 
-// check whether mnemonic in GlobalDynaBuf is supported by CSG 4502 cpu.
-boolean keyword_is_4502_mnemo(int length)
+// check whether mnemonic in GlobalDynaBuf is supported by current cpu. if it
+// is, assemble it and return TRUE.
+// (uses lower case version of keyword made by input module)
+boolean keyword_is_mnemonic(void)
 {
-	if ((length != 3) && (length != 4))
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check 65ce02 extensions because some mnemonics gained new addressing modes...
-	if (check_mnemo_tree(mnemo_65ce02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check 65c02 extensions because of the same reason...
-	if (check_mnemo_tree(mnemo_65c02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes...
-	if (check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check Rockwell extensions (rmb, smb, bbr, bbs)...
-	if (check_mnemo_tree(mnemo_bitmanips_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check "map" and "eom"
-	return check_mnemo_tree(mnemo_map_eom_tree, mnemo_dyna_buf);
-}
+	void	*node_body;
 
-// check whether mnemonic in GlobalDynaBuf is supported by MEGA65 cpu.
-boolean keyword_is_m65_mnemo(int length)
-{
-	if ((length != 3) && (length != 4))
+	// search for tree item
+	if (!Tree_easy_scan_hashed(CPU_state.type->mnemonics, &node_body, Input_keyword.lower->buffer, Input_keyword.hash))
 		return FALSE;
 
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check m65 extensions because some mnemonics gained new addressing modes...
-	if (check_mnemo_tree(mnemo_m65_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check 65ce02 extensions because of the same reason...
-	if (check_mnemo_tree(mnemo_65ce02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check 65c02 extensions because of the same reason...
-	if (check_mnemo_tree(mnemo_65c02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes...
-	if (check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check Rockwell extensions (rmb, smb, bbr, bbs)...
-	if (check_mnemo_tree(mnemo_bitmanips_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check "map" and "eom"
-	return check_mnemo_tree(mnemo_map_eom_tree, mnemo_dyna_buf);
+	mnemo_found = node_body;
+	mnemo_assemble(node_body);
+	return TRUE;
 }
 
-// check whether mnemonic in GlobalDynaBuf is supported by 65816 cpu.
-boolean keyword_is_65816_mnemo(int length)
-{
-	if (length != 3)
-		return FALSE;
-
-	// make lower case version of mnemonic in local dynamic buffer
-	DynaBuf_to_lower(mnemo_dyna_buf, GlobalDynaBuf);
-	// first check 65816 extensions because some mnemonics gained new addressing modes...
-	if (check_mnemo_tree(mnemo_65816_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check 65c02 extensions because of the same reason...
-	if (check_mnemo_tree(mnemo_65c02_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check original opcodes...
-	if (check_mnemo_tree(mnemo_6502_tree, mnemo_dyna_buf))
-		return TRUE;
-
-	// ...then check WDC extensions "stp" and "wai"
-	return check_mnemo_tree(mnemo_stp_wai_tree, mnemo_dyna_buf);
-}
+// mnemonic tables for each cpu type
+struct ronode *const mnemo_6502_tables[]	= {
+	mnemo_6502_tree,
+	NULL
+};
+struct ronode *const mnemo_nmos6502_tables[]	= {
+	mnemo_6502undoc1_tree,	// undocumented ("illegal") opcodes
+	mnemo_6502undoc2_tree,	// some more undocumented ("illegal") opcodes
+	mnemo_6502_tree,	// original opcodes
+	NULL
+};
+struct ronode *const mnemo_c64dtv2_tables[]	= {
+	mnemo_c64dtv2_tree,	// C64DTV2 extensions
+	mnemo_6502undoc1_tree,	// a few undocumented ("illegal") opcodes
+	mnemo_6502_tree,	// original opcodes
+	NULL
+};
+struct ronode *const mnemo_65c02_tables[]	= {
+	mnemo_65c02_tree,	// extensions (some mnemonics gained new addressing modes)
+	mnemo_6502_tree,	// original opcodes
+	NULL
+};
+struct ronode *const mnemo_r65c02_tables[]	= {
+	mnemo_65c02_tree,	// 65c02 extensions
+	mnemo_6502_tree,	// original opcodes
+	mnemo_bitmanips_tree,	// Rockwell extensions (rmb, smb, bbr, bbs)
+	NULL
+};
+struct ronode *const mnemo_w65c02_tables[]	= {
+	mnemo_65c02_tree,	// 65c02 extensions
+	mnemo_6502_tree,	// original opcodes
+	mnemo_bitmanips_tree,	// Rockwell extensions (rmb, smb, bbr, bbs)
+	mnemo_stp_wai_tree,	// WDC extensions "stp" and "wai"
+	NULL
+};
+struct ronode *const mnemo_65ce02_tables[]	= {
+	mnemo_65ce02_tree,	// 65ce02 extensions
+	mnemo_65c02_tree,	// 65c02 extensions
+	mnemo_6502_tree,	// original opcodes
+	mnemo_bitmanips_tree,	// Rockwell extensions (rmb, smb, bbr, bbs)
+	mnemo_aug_tree,		// "aug"
+	NULL
+};
+struct ronode *const mnemo_4502_tables[]	= {
+	mnemo_65ce02_tree,	// 65ce02 extensions
+	mnemo_65c02_tree,	// 65c02 extensions
+	mnemo_6502_tree,	// original opcodes
+	mnemo_bitmanips_tree,	// Rockwell extensions (rmb, smb, bbr, bbs)
+	mnemo_map_eom_tree,	// "map" and "eom"
+	NULL
+};
+struct ronode *const mnemo_m65_tables[]	= {
+	mnemo_m65_tree,		// m65 extensions
+	mnemo_65ce02_tree,	// 65ce02 extensions
+	mnemo_65c02_tree,	// 65c02 extensions
+	mnemo_6502_tree,	// original opcodes
+	mnemo_bitmanips_tree,	// Rockwell extensions (rmb, smb, bbr, bbs)
+	mnemo_map_eom_tree,	// "map" and "eom"
+	NULL
+};
+struct ronode *const mnemo_65816_tables[]	= {
+	mnemo_65816_tree,	// 65816 extensions
+	mnemo_65c02_tree,	// 65c02 extensions
+	mnemo_6502_tree,	// original opcodes
+	mnemo_stp_wai_tree,	// WDC extensions "stp" and "wai"
+	NULL
+};
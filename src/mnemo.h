@@ -10,26 +10,75 @@
 #include "config.h"
 
 
-// check whether mnemonic in GlobalDynaBuf is supported by standard 6502 cpu.
-extern boolean keyword_is_6502_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by NMOS 6502 cpu (includes undocumented opcodes).
-extern boolean keyword_is_nmos6502_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by C64DTV2 cpu.
-extern boolean keyword_is_c64dtv2_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by 65C02 cpu.
-extern boolean keyword_is_65c02_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by Rockwell 65C02 cpu.
-extern boolean keyword_is_r65c02_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by WDC 65C02 cpu.
-extern boolean keyword_is_w65c02_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by 65816 cpu.
-extern boolean keyword_is_65816_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by CSG 65CE02 cpu.
-extern boolean keyword_is_65ce02_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by CSG 4502 cpu.
-extern boolean keyword_is_4502_mnemo(int length);
-// check whether mnemonic in GlobalDynaBuf is supported by MEGA65 cpu.
-extern boolean keyword_is_m65_mnemo(int length);
+// tree node body of mnemonic found most recently (so callers can remember it
+// and later use mnemo_assemble() without looking it up again)
+extern void	*mnemo_found;
+
+// cycles needed by the instructions assembled so far (for "!cycles", the
+// difference between two snapshots of this is used)
+struct cycle_count {
+	unsigned long	min,	// if no branch is taken and no page is crossed
+			max;	// if all branches are taken and all pages are crossed
+	unsigned long	unknown;	// instructions without cycle count
+	unsigned long	unsure;	// branches with undefined target
+};
+extern struct cycle_count	mnemo_cycles;
+
+// page crossing checks (set by "!pagecheck")
+struct pagecheck {
+	boolean		active;
+	boolean		is_error;	// TRUE => throw errors instead of warnings
+	intval_t	table_size;	// number of bytes reached by indexed accesses
+};
+extern struct pagecheck	mnemo_pagecheck;
+
+// peephole rules for "--peephole" (each cpu type has a table of these,
+// terminated by a PEEPHOLE_END entry)
+enum peephole_action {
+	PEEPHOLE_END,		// end of table
+	PEEPHOLE_REPEAT,	// drop instruction if it repeats the previous one
+	PEEPHOLE_TAILCALL,	// return after call: drop it, and turn call into jump
+	PEEPHOLE_JUMPNEXT	// drop jump to the next instruction
+};
+struct peephole_rule {
+	enum peephole_action	action;
+	unsigned char		opcode;		// instruction the rule is about
+	unsigned char		call;		// for PEEPHOLE_TAILCALL: call before it...
+	unsigned char		jump;		// ...and jump to use instead
+};
+
+
+// set up for new pass
+extern void mnemo_passinit(void);
+// assemble mnemonic, given its tree node body
+extern void mnemo_assemble(void *node_body);
+
+// merge given NULL-terminated list of mnemonic tables into a single one (if a
+// mnemonic is in more than one table, the first one wins)
+struct ronode;
+extern struct ronode *mnemo_merge_tables(struct ronode *const *tables);
+// check whether mnemonic in GlobalDynaBuf is supported by current cpu. if it
+// is, assemble it and return TRUE.
+extern boolean keyword_is_mnemonic(void);
+
+// mnemonic tables for each cpu type (for mnemo_merge_tables())
+extern struct ronode *const mnemo_6502_tables[];
+extern struct ronode *const mnemo_nmos6502_tables[];	// includes undocumented opcodes
+extern struct ronode *const mnemo_c64dtv2_tables[];
+extern struct ronode *const mnemo_65c02_tables[];
+extern struct ronode *const mnemo_r65c02_tables[];	// Rockwell 65C02
+extern struct ronode *const mnemo_w65c02_tables[];	// WDC 65C02
+extern struct ronode *const mnemo_65816_tables[];
+extern struct ronode *const mnemo_65ce02_tables[];	// CSG 65CE02
+extern struct ronode *const mnemo_4502_tables[];	// CSG 4502
+extern struct ronode *const mnemo_m65_tables[];		// MEGA65
+// cycle counts for each opcode (not known for all cpu types)
+extern const unsigned char	mnemo_6502_cycles[256];	// NMOS 6502, including undocumented opcodes
+extern const unsigned char	mnemo_65c02_cycles[256];
+// peephole rules for each cpu type (see above)
+extern const struct peephole_rule	mnemo_6502_peephole[];	// also for 65c02
+extern const struct peephole_rule	mnemo_65816_peephole[];
+extern const struct peephole_rule	mnemo_65ce02_peephole[];	// also for 4502 and m65
 
 
 #endif
@@ -9,37 +9,53 @@
 // 19 Nov 2014	Merged Johann Klasek's report listing generator patch
 // 22 Sep 2015	Added big-endian output functions
 // 20 Apr 2019	Prepared for "make segment overlap warnings into errors" later on
+// 14 Oct 2026	Added "o65" output format
+// 14 Oct 2026	Output buffer is now allocated in pages on first write
 #include "output.h"
 #include <stdlib.h>
-#include <string.h>	// for memset()
+#include <string.h>	// for memset() and memcpy()
 #include "acme.h"
 #include "alu.h"
 #include "config.h"
 #include "cpu.h"
 #include "dynabuf.h"
+#include "fixup.h"
 #include "global.h"
 #include "input.h"
 #include "platform.h"
+#include "snapshot.h"
+#include "symbol.h"
 #include "tree.h"
 
 
 // constants
 #define NO_SEGMENT_START	(-1)	// invalid value to signal "not in a segment"
-
-
-// structure for linked list of segment data
+// the output buffer is split into pages, which are only allocated when
+// something gets written to them. until then, they hold the fill value.
+#define PAGE_SHIFT		12	// 4 KiB pages
+#define PAGE_SIZE		(1 << PAGE_SHIFT)
+#define PAGE_MASK		(PAGE_SIZE - 1)
+// o65 file format
+#define O65_MODE		0x1000	// object file, 6502, 16-bit, byte-wise relocation
+#define O65_RELOC_WORD		0x80	// relocation type for 16-bit addresses
+#define O65_SEGMENT_TEXT	2	// (segment number 1 is "absolute")
+
+
+// structure for segment data. segments are kept in an array sorted by start
+// (and length), so they can be found using binary search.
 struct segment {
-	struct segment	*next,
-			*prev;
 	intval_t	start,
-			length;
+			length,
+			reach;	// highest end of this and all earlier segments
 };
 
 // structure for all output stuff:
 struct output {
 	// output buffer stuff
 	intval_t	bufsize;	// either 64 KiB or 16 MiB
-	char		*buffer;	// holds assembled code
+	char		**pages;	// holds assembled code (NULL for unused pages)
+	int		pages_used;	// number of pages allocated
+	char		fill_value;	// contents of unused pages
 	intval_t	write_idx;	// index of next write
 	intval_t	lowest_written;		// smallest address used
 	intval_t	highest_written;	// largest address used
@@ -48,13 +64,27 @@ struct output {
 		intval_t	start;	// start of current segment (or NO_SEGMENT_START)
 		intval_t	max;	// highest address segment may use
 		bits		flags;	// segment flags ("overlay" and "invisible", see header file)
-		struct segment	list_head;	// head element of doubly-linked ring list
+		struct segment	*list;	// segments of first pass, sorted
+		int		used,	// number of array entries in use
+				size;	// number of array entries allocated
 	} segment;
 	char		xor;		// output modifier
+	// buffer indices of 16-bit addresses (relocation entries for "o65")
+	intval_t	*relocs;
+	int		relocs_used,
+			relocs_size;
 };
 
 // for offset assembly:
 static struct pseudopc	*pseudopc_current_context;	// current struct (NULL when not in pseudopc block)
+// what output_begin_patch() has to restore
+static struct {
+	intval_t	write_idx,
+			segment_max;
+	char		xor;
+	struct vcpu	cpu;
+	void		(*output_byte)(intval_t);
+} patch_outer;
 
 
 // variables
@@ -69,16 +99,17 @@ enum output_format {
 	OUTPUT_FORMAT_UNSPECIFIED,	// default (uses "plain" actually)
 	OUTPUT_FORMAT_APPLE,		// load address, length, code
 	OUTPUT_FORMAT_CBM,		// load address, code (default for "!to" pseudo opcode)
+	OUTPUT_FORMAT_O65,		// header, code, relocation table, exported symbols
 	OUTPUT_FORMAT_PLAIN		// code only
 };
 // predefined stuff
 // tree to hold output formats (FIXME - a tree for three items, really?)
 static struct ronode	file_format_tree[]	= {
 	PREDEF_START,
-#define KNOWN_FORMATS	"'plain', 'cbm', 'apple'"	// shown in CLI error message for unknown formats
+#define KNOWN_FORMATS	"'plain', 'cbm', 'apple', 'o65'"	// shown in CLI error message for unknown formats
 	PREDEFNODE("apple",	OUTPUT_FORMAT_APPLE),
 	PREDEFNODE("cbm",	OUTPUT_FORMAT_CBM),
-//	PREDEFNODE("o65",	OUTPUT_FORMAT_O65),
+	PREDEFNODE("o65",	OUTPUT_FORMAT_O65),
 	PREDEF_END("plain",	OUTPUT_FORMAT_PLAIN),
 	//    ^^^^ this marks the last element
 };
@@ -87,13 +118,39 @@ static enum output_format	output_format	= OUTPUT_FORMAT_UNSPECIFIED;
 const char			outputfile_formats[]	= KNOWN_FORMATS;	// string to show if outputfile_set_format() returns nonzero
 
 
-// report binary output
+// report binary output (the bytes belong to the source line recorded last)
 static void report_binary(char value)
 {
-	if (report->bin_used == 0)
-		report->bin_address = out->write_idx;	// remember address at start of line
-	if (report->bin_used < REPORT_BINBUFSIZE)
-		report->bin_buf[report->bin_used++] = value;
+	struct report_line	*line;
+
+	if (report->used == 0)
+		return;	// no source line yet
+
+	line = &report->lines[report->used - 1];
+	if (line->bin_used == 0)
+		line->bin_address = out->write_idx;	// remember address at start of line
+	if (line->bin_used < REPORT_BINBUFSIZE)
+		line->bin[line->bin_used] = value;
+	++line->bin_used;
+}
+
+
+// return number of segments starting at or before the given address (so the
+// result is the index of the first segment starting after it)
+static int count_segments_up_to(intval_t address)
+{
+	int	low	= 0,
+		high	= out->segment.used,
+		middle;
+
+	while (low < high) {
+		middle = (low + high) / 2;
+		if (out->segment.list[middle].start <= address)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return low;
 }
 
 
@@ -101,19 +158,12 @@ static void report_binary(char value)
 // just find the next segment start and subtract 1.
 static void find_segment_max(intval_t new_pc)
 {
-	struct segment	*test_segment	= out->segment.list_head.next;
+	int	next	= count_segments_up_to(new_pc);
 
-	// search for smallest segment start address that
-	// is larger than given address
-	// use list head as sentinel
-// FIXME - if +1 overflows intval_t, we have an infinite loop!
-	out->segment.list_head.start = new_pc + 1;
-	while (test_segment->start <= new_pc)
-		test_segment = test_segment->next;
-	if (test_segment == &out->segment.list_head)
+	if (next == out->segment.used)
 		out->segment.max = out->bufsize - 1;
 	else
-		out->segment.max = test_segment->start - 1;	// last free address available
+		out->segment.max = out->segment.list[next].start - 1;	// last free address available
 }
 
 
@@ -138,9 +188,100 @@ static void border_crossed(int current_offset)
 void (*Output_byte)(intval_t byte);
 
 
+// allocate page of output buffer on first write
+static char *new_page(intval_t page_idx)
+{
+	char	*page;
+
+	page = safe_malloc(PAGE_SIZE, MEMUSE_OUTPUT);
+	memset(page, out->fill_value, PAGE_SIZE);
+	out->pages[page_idx] = page;
+	++out->pages_used;
+	return page;
+}
+
+
+// write bytes to output buffer, applying given xor value
+static void write_to_buffer(intval_t idx, const char *src, intval_t size, char xor)
+{
+	char		*page;
+	intval_t	offset,
+			chunk,
+			ii;
+
+	while (size) {
+		page = out->pages[idx >> PAGE_SHIFT];
+		if (page == NULL)
+			page = new_page(idx >> PAGE_SHIFT);
+		offset = idx & PAGE_MASK;
+		chunk = PAGE_SIZE - offset;
+		if (chunk > size)
+			chunk = size;
+		if (xor) {
+			for (ii = 0; ii < chunk; ++ii)
+				page[offset + ii] = src[ii] ^ xor;
+		} else {
+			memcpy(page + offset, src, chunk);
+		}
+		idx += chunk;
+		src += chunk;
+		size -= chunk;
+	}
+}
+
+
+// fill part of output buffer with given byte value (xor is applied)
+static void fill_buffer(intval_t idx, char value, intval_t size)
+{
+	char		*page;
+	intval_t	offset,
+			chunk;
+
+	value ^= out->xor;
+	while (size) {
+		page = out->pages[idx >> PAGE_SHIFT];
+		if (page == NULL)
+			page = new_page(idx >> PAGE_SHIFT);
+		offset = idx & PAGE_MASK;
+		chunk = PAGE_SIZE - offset;
+		if (chunk > size)
+			chunk = size;
+		memset(page + offset, value, chunk);
+		idx += chunk;
+		size -= chunk;
+	}
+}
+
+
+// read bytes from output buffer (without allocating unused pages)
+static void read_from_buffer(char *dest, intval_t idx, intval_t size)
+{
+	const char	*page;
+	intval_t	offset,
+			chunk;
+
+	while (size) {
+		page = out->pages[idx >> PAGE_SHIFT];
+		offset = idx & PAGE_MASK;
+		chunk = PAGE_SIZE - offset;
+		if (chunk > size)
+			chunk = size;
+		if (page)
+			memcpy(dest, page + offset, chunk);
+		else
+			memset(dest, out->fill_value, chunk);
+		idx += chunk;
+		dest += chunk;
+		size -= chunk;
+	}
+}
+
+
 // send low byte to output buffer, automatically increasing program counter
 static void real_output(intval_t byte)
 {
+	char	*page;
+
 	// CAUTION - there are two copies of these checks!
 	// TODO - add additional check for current segment's "limit" value
 	// did we reach next segment?
@@ -153,9 +294,12 @@ static void real_output(intval_t byte)
 	if (out->write_idx > out->highest_written)
 		out->highest_written = out->write_idx;
 	// write byte and advance ptrs
-	if (report->fd)
+	if (report->active)
 		report_binary(byte & 0xff);	// file for reporting, taking also CPU_2add
-	out->buffer[out->write_idx++] = (byte & 0xff) ^ out->xor;
+	page = out->pages[out->write_idx >> PAGE_SHIFT];
+	if (page == NULL)
+		page = new_page(out->write_idx >> PAGE_SHIFT);
+	page[out->write_idx++ & PAGE_MASK] = (byte & 0xff) ^ out->xor;
 	++CPU_state.add_to_pc;
 }
 
@@ -170,6 +314,43 @@ static void no_output(intval_t byte)
 }
 
 
+// do the checks for writing the given number of bytes (more than zero) in one
+// go and advance pointers. returns index where the bytes must be written.
+static intval_t reserve_bytes(intval_t size)
+{
+	intval_t	last,
+			crossed,
+			start;
+
+	if (size > out->bufsize)
+		border_crossed(out->bufsize);	// throws serious error
+	// CAUTION - there are two copies of these checks!
+	// TODO - add additional check for current segment's "limit" value
+	// did we reach next segment? (maybe more than one, so do what
+	// real_output() would do for each byte that crosses a border)
+	last = out->write_idx + size - 1;
+	crossed = out->write_idx;
+	while (last > out->segment.max) {
+		if (crossed <= out->segment.max)
+			crossed = out->segment.max + 1;
+		border_crossed(crossed);
+		if (!FIRST_PASS)
+			break;	// limit is only adjusted in first pass
+	}
+	// new minimum address?
+	if (out->write_idx < out->lowest_written)
+		out->lowest_written = out->write_idx;
+	// new maximum address?
+	if (last > out->highest_written)
+		out->highest_written = last;
+	// advance ptrs
+	start = out->write_idx;
+	out->write_idx += size;
+	CPU_state.add_to_pc += size;
+	return start;
+}
+
+
 // skip over some bytes in output buffer without starting a new segment
 // (used by "!skip", and also called by "!binary" if really calling
 // Output_byte would be a waste of time)
@@ -186,27 +367,47 @@ void output_skip(int size)
 		Output_byte(0);	// trigger error with a dummy byte
 		--size;	// fix amount to cater for dummy byte
 	}
-	// CAUTION - there are two copies of these checks!
-	// TODO - add additional check for current segment's "limit" value
-	// did we reach next segment?
-	if (out->write_idx + size - 1 > out->segment.max)
-		border_crossed(out->write_idx + size - 1);
-	// new minimum address?
-	if (out->write_idx < out->lowest_written)
-		out->lowest_written = out->write_idx;
-	// new maximum address?
-	if (out->write_idx + size - 1 > out->highest_written)
-		out->highest_written = out->write_idx + size - 1;
-	// advance ptrs
-	out->write_idx += size;
-	CPU_state.add_to_pc += size;
+	if (size)
+		reserve_bytes(size);
+	++pass.volatile_count;	// skipped bytes must not be replayed
+}
+
+
+// send block of bytes to output buffer, automatically increasing program
+// counter. this does the same as calling Output_byte() for each byte, but
+// the checks are only done once for the whole block.
+void output_block(const char *src, size_t size)
+{
+	if (size == 0)
+		return;
+
+	// the report generator wants to see each byte, and if pc is undefined,
+	// the first byte triggers the error message
+	if (report->active || (Output_byte == no_output)) {
+		do
+			Output_byte((unsigned char) *src++);
+		while (--size);
+		return;
+	}
+	write_to_buffer(reserve_bytes(size), src, size, out->xor);
 }
 
 
-// fill output buffer with given byte value
-static void fill_completely(char value)
+// send given number of copies of a byte value to output buffer, automatically
+// increasing program counter (used by "!fill"). like output_block(), the
+// checks are only done once.
+void output_fill(intval_t size, char value)
 {
-	memset(out->buffer, value, out->bufsize);
+	if (size < 1)
+		return;
+
+	if (report->active || (Output_byte == no_output)) {
+		do
+			Output_byte((unsigned char) value);
+		while (--size);
+		return;
+	}
+	fill_buffer(reserve_bytes(size), value, size);
 }
 
 
@@ -214,6 +415,8 @@ static void fill_completely(char value)
 // returns zero if ok, nonzero if already set
 int output_initmem(char content)
 {
+	intval_t	ii;
+
 	// if MemInit flag is already set, complain
 	if (out->initvalue_set) {
 		Throw_warning("Memory already initialised.");
@@ -221,16 +424,19 @@ int output_initmem(char content)
 	}
 	// set MemInit flag
 	out->initvalue_set = TRUE;
-	// init memory
-	fill_completely(content);
-	// enforce another pass
-	if (pass.undefined_count == 0)
-		pass.undefined_count = 1;
-	//if (pass.needvalue_count == 0)	FIXME - use? instead or additionally?
-	//	pass.needvalue_count = 1;
-// FIXME - enforcing another pass is not needed if there hasn't been any
-// output yet. But that's tricky to detect without too much overhead.
-// The old solution was to add &&(out->lowest_written < out->highest_written+1) to "if" above
+	out->fill_value = content;
+	// if nothing has been written yet, that's all.
+	if (out->pages_used == 0)
+		return 0;	// ok
+
+	// otherwise init memory and enforce another pass to write it again
+	for (ii = 0; ii < (out->bufsize >> PAGE_SHIFT); ++ii) {
+		if (out->pages[ii])
+			memset(out->pages[ii], content, PAGE_SIZE);
+	}
+	if (pass.needvalue_count == 0)
+		pass.needvalue_count = 1;
+	fixup_invalidate();	// patching the values would not be enough
 	return 0;	// ok
 }
 
@@ -264,33 +470,166 @@ int outputfile_prefer_cbm_format(void)
 int outputfile_set_filename(void)
 {
 	// if output file already chosen, complain and exit
-	if (output_filename) {
+	if (part->output_filename) {
 		Throw_warning("Output file already chosen.");
 		return 1;	// failed
 	}
 
 	// get malloc'd copy of filename
-	output_filename = DynaBuf_get_copy(GlobalDynaBuf);
+	part->output_filename = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
 	return 0;	// ok
 }
 
 
+// forget output format (for "--batch")
+void outputfile_clear_format(void)
+{
+	output_format = OUTPUT_FORMAT_UNSPECIFIED;
+}
+
+
 // init output struct (done later)
 void Output_init(signed long fill_value, boolean use_large_buf)
 {
+	intval_t	ii;
+
+	// in batch mode, release data of previous project
+	if (out->pages) {
+		for (ii = 0; ii < (out->bufsize >> PAGE_SHIFT); ++ii)
+			safe_free(out->pages[ii], PAGE_SIZE, MEMUSE_OUTPUT);
+		safe_free(out->pages, (out->bufsize >> PAGE_SHIFT) * sizeof(*out->pages), MEMUSE_OUTPUT);
+	}
 	out->bufsize = use_large_buf ? 0x1000000 : 0x10000;
-	out->buffer = safe_malloc(out->bufsize);
+	out->pages = safe_malloc((out->bufsize >> PAGE_SHIFT) * sizeof(*out->pages), MEMUSE_OUTPUT);
+	for (ii = 0; ii < (out->bufsize >> PAGE_SHIFT); ++ii)
+		out->pages[ii] = NULL;
+	out->pages_used = 0;
 	if (fill_value == MEMINIT_USE_DEFAULT) {
 		fill_value = FILLVALUE_INITIAL;
 		out->initvalue_set = FALSE;
 	} else {
 		out->initvalue_set = TRUE;
 	}
-	// init output buffer (fill memory with initial value)
-	fill_completely(fill_value & 0xff);
-	// init ring list of segments
-	out->segment.list_head.next = &out->segment.list_head;
-	out->segment.list_head.prev = &out->segment.list_head;
+	// pages get filled with initial value when allocated
+	out->fill_value = fill_value & 0xff;
+	// clear segment list (array is kept in batch mode)
+	out->segment.used = 0;
+}
+
+
+// o65 stuff:
+
+// write 16-bit value in little-endian byte order
+static void put_le16(FILE *fd, intval_t value)
+{
+	putc(value & 255, fd);
+	putc((value >> 8) & 255, fd);
+}
+
+// write o65 header (everything goes into the text segment)
+static void write_o65_header(FILE *fd, intval_t start, intval_t amount)
+{
+	static const char	marker[]	= {1, 0, 'o', '6', '5', 0};	// incl. version
+
+	fwrite(marker, sizeof(marker), 1, fd);
+	put_le16(fd, O65_MODE);
+	put_le16(fd, start);	// text segment
+	put_le16(fd, amount);
+	put_le16(fd, 0);	// data segment
+	put_le16(fd, 0);
+	put_le16(fd, 0);	// bss segment
+	put_le16(fd, 0);
+	put_le16(fd, 0);	// zero page segment
+	put_le16(fd, 0);
+	put_le16(fd, 0);	// stack size
+	putc(0, fd);	// no header options
+}
+
+// compare function for qsort()
+static int compare_relocs(const void *a, const void *b)
+{
+	intval_t	aa	= *(const intval_t *) a,
+			bb	= *(const intval_t *) b;
+
+	return (aa > bb) - (aa < bb);
+}
+
+// write what follows the code in an o65 file
+static void write_o65_tables(FILE *fd, intval_t start, intval_t amount)
+{
+	intval_t	last	= start - 1,	// relocation offsets start here
+			diff;
+	int		ii;
+
+	put_le16(fd, 0);	// no undefined references
+	// relocation table for text segment
+	qsort(out->relocs, out->relocs_used, sizeof(*out->relocs), compare_relocs);
+	for (ii = 0; ii < out->relocs_used; ++ii) {
+		// skip duplicates and addresses not completely inside file
+		if ((out->relocs[ii] <= last)
+		|| (out->relocs[ii] + 1 >= start + amount))
+			continue;
+
+		for (diff = out->relocs[ii] - last; diff > 254; diff -= 254)
+			putc(255, fd);
+		putc(diff, fd);
+		putc(O65_RELOC_WORD | O65_SEGMENT_TEXT, fd);
+		last = out->relocs[ii];
+	}
+	putc(0, fd);	// end of text relocation table
+	putc(0, fd);	// data relocation table (empty)
+	symbols_o65_exports(fd, start, start + amount);
+}
+
+
+// make sure relocation table has room for given number of additional entries
+static void enlarge_relocs(int count)
+{
+	int	old_size	= out->relocs_size;
+
+	while (out->relocs_used + count > out->relocs_size)
+		out->relocs_size = out->relocs_size ? 2 * out->relocs_size : 64;
+	out->relocs = safe_realloc(out->relocs, old_size * sizeof(*out->relocs), out->relocs_size * sizeof(*out->relocs), MEMUSE_OUTPUT);
+}
+
+
+// remember that the next two bytes hold an address that must be adjusted if
+// the code is moved (mnemo.c and "!16" call this only for address values)
+void output_relocation(void)
+{
+	if (out->relocs_used == out->relocs_size)
+		enlarge_relocs(1);
+	out->relocs[out->relocs_used++] = out->write_idx;
+}
+
+
+// write part of output buffer to file (unused pages are not allocated, they
+// are written from a page holding nothing but the fill value)
+static void save_buffer(FILE *fd, intval_t idx, intval_t size)
+{
+	const char	*page;
+	char		*fill_page	= NULL;
+	intval_t	offset,
+			chunk;
+
+	while (size) {
+		page = out->pages[idx >> PAGE_SHIFT];
+		offset = idx & PAGE_MASK;
+		chunk = PAGE_SIZE - offset;
+		if (chunk > size)
+			chunk = size;
+		if (page == NULL) {
+			if (fill_page == NULL) {
+				fill_page = safe_malloc(PAGE_SIZE, MEMUSE_OUTPUT);
+				memset(fill_page, out->fill_value, PAGE_SIZE);
+			}
+			page = fill_page;
+		}
+		fwrite(page + offset, chunk, 1, fd);
+		idx += chunk;
+		size -= chunk;
+	}
+	safe_free(fill_page, PAGE_SIZE, MEMUSE_OUTPUT);
 }
 
 
@@ -314,7 +653,7 @@ void Output_save_file(FILE *fd)
 	// output file header according to file format
 	switch (output_format) {
 	case OUTPUT_FORMAT_APPLE:
-		PLATFORM_SETFILETYPE_APPLE(output_filename);
+		PLATFORM_SETFILETYPE_APPLE(part->output_filename);
 		// output 16-bit load address in little-endian byte order
 		putc(start & 255, fd);
 		putc(start >> 8, fd);
@@ -322,43 +661,131 @@ void Output_save_file(FILE *fd)
 		putc(amount & 255, fd);
 		putc(amount >> 8, fd);
 		break;
+	case OUTPUT_FORMAT_O65:
+		PLATFORM_SETFILETYPE_PLAIN(part->output_filename);
+		write_o65_header(fd, start, amount);
+		break;
 	case OUTPUT_FORMAT_UNSPECIFIED:
 	case OUTPUT_FORMAT_PLAIN:
-		PLATFORM_SETFILETYPE_PLAIN(output_filename);
+		PLATFORM_SETFILETYPE_PLAIN(part->output_filename);
 		break;
 	case OUTPUT_FORMAT_CBM:
-		PLATFORM_SETFILETYPE_CBM(output_filename);
+		PLATFORM_SETFILETYPE_CBM(part->output_filename);
 		// output 16-bit load address in little-endian byte order
 		putc(start & 255, fd);
 		putc(start >> 8, fd);
 	}
 	// dump output buffer to file
-	fwrite(out->buffer + start, amount, 1, fd);
+	save_buffer(fd, start, amount);
+	if (output_format == OUTPUT_FORMAT_O65)
+		write_o65_tables(fd, start, amount);
+}
+
+
+// get start address and size of the smallest part of the output buffer that
+// holds all output (for libacme). returns FALSE if nothing was written.
+boolean output_get_range(intval_t *start, intval_t *amount)
+{
+	if (out->highest_written < out->lowest_written)
+		return FALSE;	// nothing written
+
+	*start = out->lowest_written;
+	*amount = out->highest_written - *start + 1;
+	return TRUE;
+}
+
+
+// copy part of output buffer to memory (unused pages hold the fill value)
+void output_copy(char *target, intval_t idx, intval_t size)
+{
+	read_from_buffer(target, idx, size);
+}
+
+
+// call given function for each segment of the first pass, in ascending order
+void output_for_each_segment(void (*fn)(intval_t start, intval_t length, void *arg), void *arg)
+{
+	int	ii;
+
+	for (ii = 0; ii < out->segment.used; ++ii)
+		fn(out->segment.list[ii].start, out->segment.list[ii].length, arg);
+}
+
+
+// get numbers of first and last bank of given size that hold output (for
+// "--split-output"). returns FALSE if nothing was written.
+boolean Output_get_banks(intval_t size, intval_t *first, intval_t *last)
+{
+	if (out->highest_written < out->lowest_written)
+		return FALSE;	// nothing written
+
+	*first = out->lowest_written / size;
+	*last = out->highest_written / size;
+	return TRUE;
+}
+
+
+// write part of output that is in given bank (without file format header)
+void Output_save_bank(FILE *fd, intval_t size, intval_t bank)
+{
+	intval_t	start	= bank * size,
+			end	= start + size;
+
+	if (start < out->lowest_written)
+		start = out->lowest_written;
+	if (end > out->highest_written + 1)
+		end = out->highest_written + 1;
+	if (config.process_verbosity)
+		printf("Saving %ld (0x%lx) bytes of bank %ld (0x%lx - 0x%lx exclusive).\n",
+			end - start, end - start, bank, start, end);
+	PLATFORM_SETFILETYPE_PLAIN(part->output_filename);
+	save_buffer(fd, start, end - start);
 }
 
 
-// link segment data into segment ring
+// add segment data to segment list
 static void link_segment(intval_t start, intval_t length)
 {
-	struct segment	*new_segment,
-			*test_segment	= out->segment.list_head.next;
+	struct segment	*list;
+	intval_t	reach;
+	int		ii;
+
+	if (out->segment.used == out->segment.size) {
+		out->segment.list = safe_realloc(out->segment.list, out->segment.size * sizeof(*(out->segment.list)), (out->segment.size ? (out->segment.size * 2) : 16) * sizeof(*(out->segment.list)), MEMUSE_OUTPUT);
+		out->segment.size = out->segment.size ? (out->segment.size * 2) : 16;
+	}
+	list = out->segment.list;
+	// find correct spot (after segments with smaller start, or same start
+	// and smaller length)
+	ii = count_segments_up_to(start - 1);
+	while ((ii < out->segment.used) && (list[ii].start == start) && (list[ii].length < length))
+		++ii;
+	memmove(list + ii + 1, list + ii, (out->segment.used - ii) * sizeof(*list));
+	++out->segment.used;
+	list[ii].start = start;
+	list[ii].length = length;
+	// fix reach values from here on (nothing to do for the usual case of
+	// segments being added in ascending order)
+	reach = ii ? list[ii - 1].reach : 0;
+	for (; ii < out->segment.used; ++ii) {
+		if (list[ii].start + list[ii].length > reach)
+			reach = list[ii].start + list[ii].length;
+		list[ii].reach = reach;
+	}
+}
+
+
+// return whether given range overlaps any segment in list
+static boolean segment_overlaps(intval_t start, intval_t length)
+{
+	int	before	= count_segments_up_to(start - 1);
+
+	// the segment reaching farthest of those starting before the range...
+	if (before && (out->segment.list[before - 1].reach > start))
+		return TRUE;
 
-	// init new segment
-	new_segment = safe_malloc(sizeof(*new_segment));
-	new_segment->start = start;
-	new_segment->length = length;
-	// use ring head as sentinel
-	out->segment.list_head.start = start;
-	out->segment.list_head.length = length + 1;	// +1 to make sure sentinel exits loop
-	// walk ring to find correct spot
-	while ((test_segment->start < new_segment->start)
-	|| ((test_segment->start == new_segment->start) && (test_segment->length < new_segment->length)))
-		test_segment = test_segment->next;
-	// link into ring
-	new_segment->next = test_segment;
-	new_segment->prev = test_segment->prev;
-	new_segment->next->prev = new_segment;
-	new_segment->prev->next = new_segment;
+	// ...or any segment starting inside the range
+	return count_segments_up_to(start + length - 1) > before;
 }
 
 
@@ -366,24 +793,24 @@ static void link_segment(intval_t start, intval_t length)
 // only call in first pass, otherwise too many warnings might be thrown	(TODO - still?)
 static void check_segment(intval_t new_pc)
 {
-	struct segment	*test_segment	= out->segment.list_head.next;
-
-	// use list head as sentinel
-	out->segment.list_head.start = new_pc + 1;	// +1 to make sure sentinel exits loop
-	out->segment.list_head.length = 1;
-	// search ring for matching entry
-	while (test_segment->start <= new_pc) {
-		if ((test_segment->start + test_segment->length) > new_pc) {
-			// TODO - include overlap size in error message!
-			if (config.segment_warning_is_error)
-				Throw_error("Segment starts inside another one, overwriting it.");
-			else
-				Throw_warning("Segment starts inside another one, overwriting it.");
-			return;
-		}
+	char		buffer[100];
+	int		count	= count_segments_up_to(new_pc);
+	intval_t	overlap;
 
-		test_segment = test_segment->next;
-	}
+	// segments starting after the pc do not matter, and of the others,
+	// the one reaching farthest decides
+	if (count == 0)
+		return;
+
+	overlap = out->segment.list[count - 1].reach - new_pc;
+	if (overlap <= 0)
+		return;
+
+	sprintf(buffer, "Segment starts %ld byte%s before end of another one, overwriting it.", (long) overlap, (overlap == 1) ? "" : "s");
+	if (config.segment_warning_is_error)
+		Throw_error(buffer);
+	else
+		Throw_warning(buffer);
 }
 
 
@@ -411,6 +838,7 @@ void Output_passinit(void)
 	out->segment.max = out->bufsize - 1;	// TODO - use end of bank?
 	out->segment.flags = 0;
 	out->xor = 0;
+	out->relocs_used = 0;
 
 	//vcpu stuff:
 	CPU_state.pc.ntype = NUMTYPE_UNDEFINED;	// not defined yet
@@ -425,6 +853,23 @@ void Output_passinit(void)
 }
 
 
+// end current segment, disable output and make program counter undefined,
+// so the next source file has to set it anew (for "--modules")
+void output_new_module(void)
+{
+	Output_end_segment();
+	Output_byte = no_output;
+	out->segment.start = NO_SEGMENT_START;
+	out->segment.flags = 0;
+	out->xor = 0;
+	// pc value is kept so the next "*=" can calculate the offset:
+	CPU_state.pc.ntype = NUMTYPE_UNDEFINED;
+	CPU_state.pc.flags = 0;
+	CPU_state.add_to_pc = 0;
+	pseudopc_current_context = NULL;
+}
+
+
 // show start and end of current segment
 // called whenever a new segment begins, and at end of pass.
 void Output_end_segment(void)
@@ -439,15 +884,21 @@ void Output_end_segment(void)
 	if (out->segment.start == NO_SEGMENT_START)
 		return;
 
-	// ignore "invisible" segments
-	if (out->segment.flags & SEGMENT_FLAG_INVISIBLE)
-		return;
-
 	// ignore empty segments
 	amount = out->write_idx - out->segment.start;
 	if (amount == 0)
 		return;
 
+	// if segments overwrite each other, bytes that fixups would patch may
+	// have been replaced already. invisible segments are not in the list, so
+	// they cannot be checked.
+	if (fixup_recording
+	&& ((out->segment.flags & SEGMENT_FLAG_INVISIBLE) || segment_overlaps(out->segment.start, amount)))
+		fixup_invalidate();
+	// ignore "invisible" segments
+	if (out->segment.flags & SEGMENT_FLAG_INVISIBLE)
+		return;
+
 	// link to segment list
 	link_segment(out->segment.start, amount);
 	// announce
@@ -492,6 +943,122 @@ void output_set_xor(char xor)
 }
 
 
+// return buffer index of next write (for fixups)
+intval_t output_get_index(void)
+{
+	return out->write_idx;
+}
+// make the following output overwrite the buffer at the given index instead,
+// without segment checks (for fixups). afterwards, call output_end_patch().
+void output_begin_patch(intval_t idx, char xor)
+{
+	patch_outer.write_idx = out->write_idx;
+	patch_outer.segment_max = out->segment.max;
+	patch_outer.xor = out->xor;
+	patch_outer.cpu = CPU_state;
+	patch_outer.output_byte = Output_byte;
+	out->write_idx = idx;
+	out->segment.max = out->bufsize - 1;
+	out->xor = xor;
+	Output_byte = real_output;
+}
+// go back to normal output after output_begin_patch()
+void output_end_patch(void)
+{
+	out->write_idx = patch_outer.write_idx;
+	out->segment.max = patch_outer.segment_max;
+	out->xor = patch_outer.xor;
+	CPU_state = patch_outer.cpu;
+	Output_byte = patch_outer.output_byte;
+}
+// change byte that has already been written (for "--peephole")
+void output_change_byte(intval_t idx, char xor, char byte)
+{
+	write_to_buffer(idx, &byte, 1, xor);
+}
+
+
+// remember current output state
+void output_get_state(struct output_state *state)
+{
+	state->write_idx = out->write_idx;
+	state->segment_start = out->segment.start;
+	state->segment_flags = out->segment.flags;
+	state->xor = out->xor;
+	state->relocs_used = out->relocs_used;
+	state->enabled = (Output_byte != no_output);
+	state->cpu = CPU_state;
+	state->pseudopc = pseudopc_current_context;
+}
+// restore output state remembered by output_get_state()
+void output_set_state(const struct output_state *state)
+{
+	out->write_idx = state->write_idx;
+	out->segment.start = state->segment_start;
+	out->segment.flags = state->segment_flags;
+	out->xor = state->xor;
+	Output_byte = state->enabled ? real_output : no_output;
+	CPU_state = state->cpu;
+	pseudopc_current_context = state->pseudopc;
+}
+// return whether two output states are the same
+boolean output_state_equal(const struct output_state *a, const struct output_state *b)
+{
+	return (a->write_idx == b->write_idx)
+		&& (a->segment_start == b->segment_start)
+		&& (a->segment_flags == b->segment_flags)
+		&& (a->xor == b->xor)
+		&& (a->enabled == b->enabled)
+		&& (a->cpu.type == b->cpu.type)
+		&& (a->cpu.pc.ntype == b->cpu.pc.ntype)
+		&& (a->cpu.pc.flags == b->cpu.pc.flags)
+		&& (a->cpu.pc.val.intval == b->cpu.pc.val.intval)
+		&& (a->cpu.pc.addr_refs == b->cpu.pc.addr_refs)
+		&& (a->cpu.add_to_pc == b->cpu.add_to_pc)
+		&& (a->cpu.a_is_long == b->cpu.a_is_long)
+		&& (a->cpu.xy_are_long == b->cpu.xy_are_long)
+		&& (a->pseudopc == b->pseudopc);
+}
+
+
+// copy bytes (and relocation entries) generated between given states.
+// returns malloc'd block.
+char *output_backup(const struct output_state *entry, const struct output_state *exit, size_t *backup_size)
+{
+	intval_t	size	= exit->write_idx - entry->write_idx;
+	size_t		relocs	= (exit->relocs_used - entry->relocs_used) * sizeof(*out->relocs);
+	char		*backup;
+
+	*backup_size = size + relocs + 1;	// +1 because size may be zero
+	backup = safe_malloc(*backup_size, MEMUSE_BLOCKS);
+	read_from_buffer(backup, entry->write_idx, size);
+	if (relocs)
+		memcpy(backup + size, out->relocs + entry->relocs_used, relocs);
+	return backup;
+}
+// write bytes (and relocation entries) copied by output_backup() back
+void output_restore(const char *backup, const struct output_state *entry, const struct output_state *exit)
+{
+	intval_t	start	= entry->write_idx,
+			size	= exit->write_idx - entry->write_idx;
+	int		count	= exit->relocs_used - entry->relocs_used;
+
+	if (count) {
+		enlarge_relocs(count);
+		memcpy(out->relocs + out->relocs_used, backup + size, count * sizeof(*out->relocs));
+		out->relocs_used += count;
+	}
+	if (size == 0)
+		return;
+
+	write_to_buffer(start, backup, size, 0);	// xor was applied before
+	if (start < out->lowest_written)
+		out->lowest_written = start;
+	if (start + size - 1 > out->highest_written)
+		out->highest_written = start + size - 1;
+}
+
+
 // set program counter to defined value (FIXME - allow for undefined!)
 // if start address was given on command line, main loop will call this before each pass.
 // in addition to that, it will be called on each "*= VALUE".
@@ -513,6 +1080,7 @@ void vcpu_set_pc(intval_t new_pc, bits segment_flags)
 			// stuff happens! i see no reason to try to mimic that.
 		}
 	}
+	++pass.volatile_count;	// new segment, so output cannot be replayed
 	pc_change = new_pc - CPU_state.pc.val.intval;
 	CPU_state.pc.val.intval = new_pc;	// FIXME - oversized values are accepted without error and will be wrapped at end of statement!
 	CPU_state.pc.ntype = NUMTYPE_INT;	// FIXME - remove when allowing undefined!
@@ -553,6 +1121,9 @@ Maybe like this:
 // get program counter
 void vcpu_read_pc(struct number *target)
 {
+	// labels and the like cannot be put in library snapshots
+	if (snapshot_recording)
+		snapshot_invalidate();
 	*target = CPU_state.pc;
 }
 
@@ -578,17 +1149,61 @@ struct pseudopc {
 	intval_t	offset;	// inner minus outer pc
 	enum numtype	ntype;	// type of outer pc (INT/UNDEFINED)
 };
+// contexts only differ by the values above, so each combination is created
+// once and then re-used by all blocks and passes (linear probing, table is
+// doubled when half full). they are never freed, as they get linked to labels!
+#define PSEUDOPC_INITIALSIZE	64
+static struct arena	pseudopc_arena;
+static struct pseudopc	**pseudopc_slots	= NULL;
+static size_t		pseudopc_size		= 0;	// number of slots (a power of two)
+static size_t		pseudopc_used		= 0;
+static struct pseudopc **find_pseudopc_slot(struct pseudopc *outer, intval_t offset, enum numtype ntype)
+{
+	size_t		hash;
+	struct pseudopc	**slot;
+
+	hash = (((size_t) outer) ^ ((size_t) offset << 4) ^ (size_t) ntype) * 2654435761u;
+	hash ^= hash >> 15;
+	for (;;) {
+		slot = pseudopc_slots + (hash & (pseudopc_size - 1));
+		if ((*slot == NULL)
+		|| (((*slot)->outer == outer) && ((*slot)->offset == offset) && ((*slot)->ntype == ntype)))
+			return slot;
+		++hash;
+	}
+}
+static struct pseudopc *get_pseudopc(struct pseudopc *outer, intval_t offset, enum numtype ntype)
+{
+	struct pseudopc	**old_slots	= pseudopc_slots,
+			**slot;
+	size_t		old_size	= pseudopc_size,
+			ii;
+
+	if (2 * (pseudopc_used + 1) > pseudopc_size) {
+		pseudopc_size = pseudopc_size ? 2 * pseudopc_size : PSEUDOPC_INITIALSIZE;
+		pseudopc_slots = safe_malloc(pseudopc_size * sizeof(*pseudopc_slots), MEMUSE_OUTPUT);
+		memset(pseudopc_slots, 0, pseudopc_size * sizeof(*pseudopc_slots));
+		for (ii = 0; ii < old_size; ++ii) {
+			if (old_slots[ii])
+				*find_pseudopc_slot(old_slots[ii]->outer, old_slots[ii]->offset, old_slots[ii]->ntype) = old_slots[ii];
+		}
+		safe_free(old_slots, old_size * sizeof(*old_slots), MEMUSE_OUTPUT);
+	}
+	slot = find_pseudopc_slot(outer, offset, ntype);
+	if (*slot == NULL) {
+		*slot = arena_alloc(&pseudopc_arena, sizeof(**slot), MEMUSE_OUTPUT);
+		(*slot)->outer = outer;
+		(*slot)->offset = offset;
+		(*slot)->ntype = ntype;
+		++pseudopc_used;
+	}
+	return *slot;
+}
 // start offset assembly
 void pseudopc_start(struct number *new_pc)
 {
-	struct pseudopc	*new_context;
-
-	new_context = safe_malloc(sizeof(*new_context));	// create new struct (this must never be freed, as it gets linked to labels!)
-	new_context->outer = pseudopc_current_context;	// let it point to previous one
-	pseudopc_current_context = new_context;	// make it the current one
-
-	new_context->ntype = CPU_state.pc.ntype;
-	new_context->offset = new_pc->val.intval - CPU_state.pc.val.intval;
+	// let new context point to previous one and make it the current one
+	pseudopc_current_context = get_pseudopc(pseudopc_current_context, new_pc->val.intval - CPU_state.pc.val.intval, CPU_state.pc.ntype);
 	CPU_state.pc.val.intval = new_pc->val.intval;
 	CPU_state.pc.ntype = NUMTYPE_INT;	// FIXME - remove when allowing undefined!
 	//new: CPU_state.pc.flags = new_pc->flags & (NUMBER_IS_DEFINED | NUMBER_EVER_UNDEFINED);
@@ -32,6 +32,18 @@ struct vcpu {
 // variables
 extern struct vcpu	CPU_state;	// current CPU state	FIXME - restrict visibility to .c file
 
+// output and program counter state, so files can be replayed (see flow.c)
+struct output_state {
+	intval_t	write_idx;
+	intval_t	segment_start;
+	bits		segment_flags;
+	char		xor;
+	int		relocs_used;	// number of relocation entries (not compared)
+	boolean		enabled;	// FALSE if pc is still undefined
+	struct vcpu	cpu;
+	struct pseudopc	*pseudopc;
+};
+
 
 // Prototypes
 
@@ -41,12 +53,19 @@ extern void Output_passinit(void);
 
 // outbuf stuff:
 
+// forget output format (for "--batch")
+extern void outputfile_clear_format(void);
 // alloc and init mem buffer (done later)
 extern void Output_init(signed long fill_value, boolean use_large_buf);
 // skip over some bytes in output buffer without starting a new segment
 // (used by "!skip", and also called by "!binary" if really calling
 // Output_byte would be a waste of time)
 extern void output_skip(int size);
+// send block of bytes to output buffer (used by "!binary" and for values
+// of more than one byte)
+extern void output_block(const char *src, size_t size);
+// send given number of copies of a byte value to output buffer (used by "!fill")
+extern void output_fill(intval_t size, char value);
 // Send low byte of arg to output buffer and advance pointer
 // FIXME - replace by output_sequence(char *src, size_t size)
 extern void (*Output_byte)(intval_t);
@@ -66,12 +85,50 @@ extern int outputfile_prefer_cbm_format(void);
 extern int outputfile_set_filename(void);
 // write smallest-possible part of memory buffer to file
 extern void Output_save_file(FILE *fd);
+// get numbers of first and last bank of given size that hold output (for
+// "--split-output"). returns FALSE if nothing was written.
+extern boolean Output_get_banks(intval_t size, intval_t *first, intval_t *last);
+// write part of output that is in given bank (without file format header)
+extern void Output_save_bank(FILE *fd, intval_t size, intval_t bank);
+// get start address and size of the smallest part of the output buffer that
+// holds all output (for libacme). returns FALSE if nothing was written.
+extern boolean output_get_range(intval_t *start, intval_t *amount);
+// copy part of output buffer to memory (unused pages hold the fill value)
+extern void output_copy(char *target, intval_t idx, intval_t size);
+// call given function for each segment of the first pass, in ascending order
+extern void output_for_each_segment(void (*fn)(intval_t start, intval_t length, void *arg), void *arg);
 // change output pointer and enable output
 extern void Output_start_segment(intval_t address_change, bits segment_flags);
 // Show start and end of current segment
 extern void Output_end_segment(void);
+// end current segment, disable output and make program counter undefined,
+// so the next source file has to set it anew (for "--modules")
+extern void output_new_module(void);
 extern char output_get_xor(void);
 extern void output_set_xor(char xor);
+// return buffer index of next write (for fixups)
+extern intval_t output_get_index(void);
+// make the following output overwrite the buffer at the given index instead,
+// without segment checks (for fixups). afterwards, call output_end_patch().
+extern void output_begin_patch(intval_t idx, char xor);
+// go back to normal output after output_begin_patch()
+extern void output_end_patch(void);
+// change byte that has already been written (for "--peephole")
+extern void output_change_byte(intval_t idx, char xor, char byte);
+// remember current output state
+extern void output_get_state(struct output_state *state);
+// restore output state remembered by output_get_state()
+extern void output_set_state(const struct output_state *state);
+// return whether two output states are the same
+extern boolean output_state_equal(const struct output_state *a, const struct output_state *b);
+// copy bytes (and relocation entries) generated between given states.
+// returns malloc'd block and stores its size.
+extern char *output_backup(const struct output_state *entry, const struct output_state *exit, size_t *backup_size);
+// write bytes (and relocation entries) copied by output_backup() back
+extern void output_restore(const char *backup, const struct output_state *entry, const struct output_state *exit);
+// remember that the next two bytes hold an address that must be adjusted if
+// the code is moved (for "o65" output format)
+extern void output_relocation(void);
 
 // set program counter to defined value (TODO - allow undefined!)
 extern void vcpu_set_pc(intval_t new_pc, bits flags);
@@ -0,0 +1,205 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// pass tracing ("--trace-passes")
+//
+// After each pass, the value of each symbol is compared to its value after
+// the previous pass, and the size of each statement is compared to the size of
+// the statement at the same position in the previous pass. Everything that has
+// changed is shown, because those are the reasons for the next pass.
+// Symbols are not looked up by name: tree nodes are only ever appended to the
+// symbol tables (and anonymous labels to their list), so the n-th node is
+// always the same symbol.
+#include "passtrace.h"
+#include <stdio.h>
+#include <string.h>
+#include "alu.h"
+#include "dynabuf.h"
+#include "global.h"
+#include "input.h"
+#include "symbol.h"
+#include "tree.h"
+
+
+// types
+struct value_list {
+	struct number	*values;	// symbol values after previous pass
+	size_t		used;
+	size_t		size;
+	size_t		index;		// position during check
+};
+struct statement_size {
+	const char	*filename;
+	int		line_number;
+	intval_t	bytes;
+};
+
+
+// variables
+static struct value_list	symbol_values	= {NULL, 0, 0, 0};	// global symbol table entries
+static struct value_list	local_values	= {NULL, 0, 0, 0};	// local symbol table entries
+static struct value_list	anon_values	= {NULL, 0, 0, 0};	// anonymous labels
+static struct statement_size	*sizes[2]	= {NULL, NULL};	// previous and current pass
+static size_t			sizes_used[2]	= {0, 0};
+static size_t			sizes_size[2]	= {0, 0};
+static int			current		= 0;	// index of current pass in arrays above
+
+
+// the current statement has ended, having emitted the given number of bytes
+void passtrace_statement(intval_t bytes)
+{
+	struct statement_size	*size;
+
+	if (sizes_used[current] == sizes_size[current]) {
+		sizes[current] = safe_realloc(sizes[current], sizes_size[current] * sizeof(*sizes[current]),
+			(sizes_size[current] ? 2 * sizes_size[current] : 1024) * sizeof(*sizes[current]), MEMUSE_OTHER);
+		sizes_size[current] = sizes_size[current] ? 2 * sizes_size[current] : 1024;
+	}
+	size = &sizes[current][sizes_used[current]++];
+	size->filename = Input_now->original_filename;
+	size->line_number = Input_now->line_number;
+	size->bytes = bytes;
+}
+
+
+// get value of symbol as a number (anything else counts as undefined)
+static void get_number(struct number *number, const struct symbol *symbol)
+{
+	if (symbol->object.type == &type_number) {
+		*number = symbol->object.u.number;
+	} else {
+		number->ntype = NUMTYPE_UNDEFINED;
+		number->val.intval = 0;
+	}
+}
+
+
+// write number, or "undefined"
+static void print_number(const struct number *number)
+{
+	if (number->ntype == NUMTYPE_INT)
+		printf("$%lx", (unsigned long) number->val.intval);
+	else if (number->ntype == NUMTYPE_FLOAT)
+		printf("%g", number->val.fpval);
+	else
+		printf("undefined");
+}
+
+
+// compare numbers (types and values)
+static boolean numbers_differ(const struct number *a, const struct number *b)
+{
+	if (a->ntype != b->ntype)
+		return TRUE;
+
+	if (a->ntype == NUMTYPE_INT)
+		return a->val.intval != b->val.intval;
+
+	if (a->ntype == NUMTYPE_FLOAT)
+		return a->val.fpval != b->val.fpval;
+
+	return FALSE;
+}
+
+
+// show symbol if it has changed, and remember its current value
+static void check_symbol(struct value_list *list, struct symbol *symbol, const char *name)
+{
+	struct number	now;
+	size_t		ii	= list->index++;
+
+	get_number(&now, symbol);
+	if (ii == list->size) {
+		list->values = safe_realloc(list->values, list->size * sizeof(*list->values),
+			(list->size ? 2 * list->size : 256) * sizeof(*list->values), MEMUSE_OTHER);
+		list->size = list->size ? 2 * list->size : 256;
+	}
+	if ((ii < list->used)
+	&& numbers_differ(&list->values[ii], &now)) {
+		printf("  Symbol \"%s\"", name);
+		if (symbol->def_filename)
+			printf(" (file %s, line %d)", symbol->def_filename, symbol->def_line_number);
+		printf(": ");
+		print_number(&list->values[ii]);
+		printf(" -> ");
+		print_number(&now);
+		printf("\n");
+	} else if ((ii >= list->used)
+	&& (pass.number > 0)) {
+		printf("  Symbol \"%s\" is new", name);
+		if (symbol->def_filename)
+			printf(" (file %s, line %d)", symbol->def_filename, symbol->def_line_number);
+		printf(".\n");
+	}
+	list->values[ii] = now;
+}
+static void check_anon(struct symbol *symbol)
+{
+	check_symbol(&anon_values, symbol, GLOBALDYNABUF_CURRENT);
+}
+
+
+// show symbols that have changed, and remember their current values.
+// anonymous labels are not in the symbol table, they have a list of their own.
+static void check_symbols(void)
+{
+	struct rwnode	*node;
+
+	symbol_values.index = 0;
+	for (node = part->symbols->first; node; node = node->next)
+		check_symbol(&symbol_values, node->body, node->id_string);
+	symbol_values.used = symbol_values.index;
+	local_values.index = 0;
+	for (node = part->locals->first; node; node = node->next)
+		check_symbol(&local_values, node->body, node->id_string);
+	local_values.used = local_values.index;
+	anon_values.index = 0;
+	symbols_for_each_anon(check_anon);
+	anon_values.used = anon_values.index;
+}
+
+
+// show statements whose size has changed
+static void check_sizes(void)
+{
+	const struct statement_size	*old	= sizes[!current],
+					*now	= sizes[current];
+	size_t				ii,
+					count	= sizes_used[current];
+
+	if (count > sizes_used[!current])
+		count = sizes_used[!current];
+	for (ii = 0; ii < count; ++ii, ++old, ++now) {
+		// only compare if this is still the same statement
+		if ((old->bytes != now->bytes)
+		&& (old->line_number == now->line_number)
+		&& (old->filename == now->filename))
+			printf("  Statement (file %s, line %d): %ld -> %ld bytes\n",
+				now->filename, now->line_number, (long) old->bytes, (long) now->bytes);
+	}
+}
+
+
+// show what has changed since the previous pass
+void passtrace_end_pass(void)
+{
+	printf("Pass %d: %d undefined results (%d needed).\n", pass.number + 1, pass.undefined_count, pass.needvalue_count);
+	check_symbols();
+	if (pass.number > 0)
+		check_sizes();
+	// arrays change roles for next pass
+	current = !current;
+	sizes_used[current] = 0;
+}
+
+
+// forget everything (for "--batch")
+void passtrace_clear(void)
+{
+	symbol_values.used = 0;
+	local_values.used = 0;
+	anon_values.used = 0;
+	sizes_used[0] = 0;
+	sizes_used[1] = 0;
+}
@@ -0,0 +1,23 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// pass tracing ("--trace-passes")
+#ifndef passtrace_H
+#define passtrace_H
+
+
+#include "config.h"
+
+
+// prototypes
+
+// the current statement has ended, having emitted the given number of bytes
+extern void passtrace_statement(intval_t bytes);
+// show what has changed since the previous pass
+extern void passtrace_end_pass(void);
+// forget everything (for "--batch")
+extern void passtrace_clear(void);
+
+
+#endif
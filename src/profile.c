@@ -0,0 +1,327 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// profiler ("--profile" and "--profile-stacks")
+//
+// Every statement is counted at its "site", which is the macro call stack
+// plus file name and line number (so each macro line is one site per call
+// path). Processor time is measured at the start and end of each statement
+// and charged to the innermost statement running, so each site gets its own
+// time, not that of the statements it contains. Bytes are charged the same
+// way. All counts are kept across passes. At the end, sites are summed up per
+// line and per macro for the report, or written as collapsed stacks (one line
+// per site, weighted by statement count) for flame graph tools.
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dynabuf.h"
+#include "global.h"
+#include "input.h"
+#include "platform.h"
+#include "tree.h"
+
+
+// types
+struct profile_count {
+	unsigned long	statements;
+	unsigned long	bytes;
+	clock_t		time;
+};
+struct profile_site {
+	struct profile_count	count;
+	struct profile_site	*line;	// site of same line without call stack
+};
+struct profile_macro {
+	struct profile_count	count;	// including everything called from macro
+	unsigned long		calls;
+	int			active;	// number of running calls (for recursion)
+};
+struct macro_call {
+	struct profile_macro	*macro;
+	struct profile_count	start;	// totals when call started
+	size_t			stack_size;	// size of stack_buf before call
+};
+
+
+// variables
+const char			*profile_filename	= NULL;
+const char			*profile_stacks_filename	= NULL;
+boolean				profile_active	= FALSE;
+static struct arena		profile_arena;
+static STRUCT_RWTABLE_REF(site_table, &profile_arena);
+static STRUCT_RWTABLE_REF(macro_table, &profile_arena);
+static STRUCT_DYNABUF_REF(stack_buf, 256);	// "macro;macro;" of current calls
+static STRUCT_DYNABUF_REF(key_buf, 256);
+static struct profile_site	**site_stack	= NULL;	// running statements
+static int			site_sp		= 0;
+static int			site_stack_size	= 0;
+static struct macro_call	*call_stack	= NULL;	// running macro calls
+static int			call_sp		= 0;
+static int			call_stack_size	= 0;
+static struct profile_count	total;
+static clock_t			last_clock;
+
+
+// charge time since last call to innermost statement
+static void charge_time(void)
+{
+	clock_t	now	= clock();
+
+	if (site_sp)
+		site_stack[site_sp - 1]->count.time += now - last_clock;
+	total.time += now - last_clock;
+	last_clock = now;
+}
+
+
+// find or create site for the given call stack (a prefix of stack_buf)
+static struct profile_site *get_site(size_t stack_size)
+{
+	struct rwname		name;
+	struct rwnode		*node;
+	struct profile_site	*site;
+	char			number[24];
+
+	DYNABUF_CLEAR(key_buf);
+	if (stack_size)
+		DynaBuf_add_span(key_buf, stack_buf->buffer, stack_size);
+	DynaBuf_add_string(key_buf, Input_now->original_filename);
+	sprintf(number, ":%d", Input_now->line_number);
+	DynaBuf_add_string(key_buf, number);
+	DynaBuf_append(key_buf, '\0');
+	Tree_make_name(&name, key_buf->buffer, key_buf->size);
+	if (Tree_hard_scan_name(&node, site_table, &name, 0, TRUE)) {
+		site = arena_alloc(&profile_arena, sizeof(*site), MEMUSE_OTHER);
+		memset(site, 0, sizeof(*site));
+		node->body = site;
+		// key_buf is not needed anymore, so it may be re-used:
+		site->line = stack_size ? get_site(0) : site;
+	}
+	return node->body;
+}
+
+
+// a statement starts at the current input position
+void profile_begin_statement(void)
+{
+	struct profile_site	*site;
+
+	if (site_sp == 0)
+		last_clock = clock();	// do not charge time between passes
+	charge_time();
+	site = get_site(stack_buf->size);
+	++site->count.statements;
+	++total.statements;
+	if (site_sp >= site_stack_size) {
+		site_stack = safe_realloc(site_stack, site_stack_size * sizeof(*site_stack), (site_stack_size ? 2 * site_stack_size : 64) * sizeof(*site_stack), MEMUSE_OTHER);
+		site_stack_size = site_stack_size ? 2 * site_stack_size : 64;
+	}
+	site_stack[site_sp++] = site;
+}
+
+
+// the innermost statement has ended, having emitted the given number of bytes
+void profile_end_statement(intval_t bytes)
+{
+	if (site_sp == 0)
+		Bug_found("ProfileStackEmpty", 0);
+	charge_time();
+	if (bytes > 0) {
+		site_stack[site_sp - 1]->count.bytes += bytes;
+		total.bytes += bytes;
+	}
+	--site_sp;
+}
+
+
+// the body of the given macro is about to be parsed
+void profile_enter_macro(const char *name)
+{
+	struct rwname		rwname;
+	struct rwnode		*node;
+	struct profile_macro	*macro;
+	struct macro_call	*call;
+
+	charge_time();
+	Tree_make_name(&rwname, name, strlen(name) + 1);
+	if (Tree_hard_scan_name(&node, macro_table, &rwname, 0, TRUE)) {
+		macro = arena_alloc(&profile_arena, sizeof(*macro), MEMUSE_OTHER);
+		memset(macro, 0, sizeof(*macro));
+		node->body = macro;
+	}
+	macro = node->body;
+	++macro->calls;
+	++macro->active;
+	if (call_sp >= call_stack_size) {
+		call_stack = safe_realloc(call_stack, call_stack_size * sizeof(*call_stack), (call_stack_size ? 2 * call_stack_size : 16) * sizeof(*call_stack), MEMUSE_OTHER);
+		call_stack_size = call_stack_size ? 2 * call_stack_size : 16;
+	}
+	if (call_sp == 0)
+		DYNABUF_CLEAR(stack_buf);	// (also allocates buffer on first call)
+	call = &call_stack[call_sp++];
+	call->macro = macro;
+	call->start = total;
+	call->stack_size = stack_buf->size;
+	DynaBuf_add_string(stack_buf, name);
+	DynaBuf_append(stack_buf, ';');
+}
+
+
+// the body of the innermost macro has been parsed
+void profile_leave_macro(void)
+{
+	struct macro_call	*call;
+
+	if (call_sp == 0)
+		Bug_found("ProfileCallStackEmpty", 0);
+	charge_time();
+	call = &call_stack[--call_sp];
+	// with recursion, only count outermost call
+	if (--call->macro->active == 0) {
+		call->macro->count.statements += total.statements - call->start.statements;
+		call->macro->count.bytes += total.bytes - call->start.bytes;
+		call->macro->count.time += total.time - call->start.time;
+	}
+	stack_buf->size = call->stack_size;
+}
+
+
+// sort by time, then by statements, then by bytes (largest first)
+static int compare_counts(const struct profile_count *a, const struct profile_count *b)
+{
+	if (a->time != b->time)
+		return a->time < b->time ? 1 : -1;
+	if (a->statements != b->statements)
+		return a->statements < b->statements ? 1 : -1;
+	if (a->bytes != b->bytes)
+		return a->bytes < b->bytes ? 1 : -1;
+	return 0;
+}
+static int compare_lines(const void *a, const void *b)
+{
+	const struct rwnode	*node_a	= *(const struct rwnode *const *) a,
+				*node_b	= *(const struct rwnode *const *) b;
+
+	return compare_counts(&((struct profile_site *) node_a->body)->count, &((struct profile_site *) node_b->body)->count);
+}
+static int compare_macros(const void *a, const void *b)
+{
+	const struct rwnode	*node_a	= *(const struct rwnode *const *) a,
+				*node_b	= *(const struct rwnode *const *) b;
+
+	return compare_counts(&((struct profile_macro *) node_a->body)->count, &((struct profile_macro *) node_b->body)->count);
+}
+
+
+// put nodes of table into array and sort them.
+// if "lines_only" is TRUE, only sites without call stack are used.
+static struct rwnode **sorted_nodes(struct rwtable *table, boolean lines_only, int (*compare)(const void *, const void *), size_t *count)
+{
+	struct rwnode	*node,
+			**array;
+	size_t		used	= 0;
+
+	array = safe_malloc((table->used + 1) * sizeof(*array), MEMUSE_OTHER);
+	for (node = table->first; node; node = node->next) {
+		if (lines_only
+		&& (((struct profile_site *) node->body)->line != node->body))
+			continue;
+		array[used++] = node;
+	}
+	qsort(array, used, sizeof(*array), compare);
+	*count = used;
+	return array;
+}
+
+
+// write report, sorted by cost
+static void write_report(FILE *fd)
+{
+	struct rwnode		*node,
+				**array;
+	struct profile_site	*site;
+	struct profile_macro	*macro;
+	size_t			count,
+				ii;
+
+	// add counts of sites with call stack to their lines
+	for (node = site_table->first; node; node = node->next) {
+		site = node->body;
+		if (site->line != site) {
+			site->line->count.statements += site->count.statements;
+			site->line->count.bytes += site->count.bytes;
+			site->line->count.time += site->count.time;
+		}
+	}
+	fprintf(fd, "; ACME profile, %lu statements, %lu bytes, %.3f seconds (all passes)\n",
+		total.statements, total.bytes, (double) total.time / CLOCKS_PER_SEC);
+	fprintf(fd, "\n; lines (without the statements they contain)\n;  seconds  statements       bytes  line\n");
+	array = sorted_nodes(site_table, TRUE, compare_lines, &count);
+	for (ii = 0; ii < count; ++ii) {
+		site = array[ii]->body;
+		fprintf(fd, "%10.3f %11lu %11lu  %s\n", (double) site->count.time / CLOCKS_PER_SEC,
+			site->count.statements, site->count.bytes, array[ii]->id_string);
+	}
+	safe_free(array, (site_table->used + 1) * sizeof(*array), MEMUSE_OTHER);
+	fprintf(fd, "\n; macros (including everything they call)\n;  seconds  statements       bytes       calls  macro\n");
+	array = sorted_nodes(macro_table, FALSE, compare_macros, &count);
+	for (ii = 0; ii < count; ++ii) {
+		macro = array[ii]->body;
+		fprintf(fd, "%10.3f %11lu %11lu %11lu  %s\n", (double) macro->count.time / CLOCKS_PER_SEC,
+			macro->count.statements, macro->count.bytes, macro->calls, array[ii]->id_string);
+	}
+	safe_free(array, (macro_table->used + 1) * sizeof(*array), MEMUSE_OTHER);
+}
+
+
+// write collapsed stacks (format used by flame graph tools)
+static void write_stacks(FILE *fd)
+{
+	struct rwnode		*node;
+	struct profile_site	*site;
+
+	for (node = site_table->first; node; node = node->next) {
+		site = node->body;
+		if (site->count.statements)	// lines only reached via macros have none
+			fprintf(fd, "%s %lu\n", node->id_string, site->count.statements);
+	}
+}
+
+
+// open file, call function to write it, close file
+static void write_file(const char *filename, void (*fn)(FILE *))
+{
+	FILE	*fd;
+
+	fd = fopen(filename, "w");
+	if (fd == NULL) {
+		fprintf(stderr, "Error: Cannot open profile file \"%s\".\n", filename);
+		return;
+	}
+	fn(fd);
+	fclose(fd);
+	PLATFORM_SETFILETYPE_TEXT(filename);
+}
+
+
+// write wanted files and forget all data collected so far
+void profile_write(void)
+{
+	if (!profile_active)
+		return;
+
+	// write stacks first, because report changes counts
+	if (profile_stacks_filename)
+		write_file(profile_stacks_filename, write_stacks);
+	if (profile_filename)
+		write_file(profile_filename, write_report);
+	Tree_clear(site_table, NULL);
+	Tree_clear(macro_table, NULL);
+	arena_free(&profile_arena);
+	site_sp = 0;
+	call_sp = 0;
+	memset(&total, 0, sizeof(total));
+}
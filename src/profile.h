@@ -0,0 +1,33 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// profiler ("--profile" and "--profile-stacks")
+#ifndef profile_H
+#define profile_H
+
+
+#include "config.h"
+
+
+// variables
+extern const char	*profile_filename;	// NULL means "no report"
+extern const char	*profile_stacks_filename;	// NULL means "no collapsed stacks"
+extern boolean		profile_active;	// TRUE if one of the above was given
+
+
+// prototypes
+
+// a statement starts at the current input position
+extern void profile_begin_statement(void);
+// the innermost statement has ended, having emitted the given number of bytes
+extern void profile_end_statement(intval_t bytes);
+// the body of the given macro is about to be parsed
+extern void profile_enter_macro(const char *name);
+// the body of the innermost macro has been parsed
+extern void profile_leave_macro(void);
+// write wanted files and forget all data collected so far
+extern void profile_write(void);
+
+
+#endif
@@ -12,12 +12,16 @@
 #include "alu.h"
 #include "dynabuf.h"
 #include "encoding.h"
+#include "fixup.h"
 #include "flow.h"
 #include "input.h"
 #include "macro.h"
+#include "mnemo.h"
 #include "global.h"
 #include "output.h"
 #include "section.h"
+#include "snapshot.h"
+#include "strip.h"
 #include "symbol.h"
 #include "tree.h"
 #include "typesystem.h"
@@ -28,11 +32,13 @@ enum eos {
 	SKIP_REMAINDER,		// skip remainder of line - (after errors)
 	ENSURE_EOS,		// make sure there's nothing left in statement
 	PARSE_REMAINDER,	// parse what's left
-	AT_EOS_ANYWAY		// actually, same as PARSE_REMAINDER
+	AT_EOS_ANYWAY,		// actually, same as PARSE_REMAINDER
+	ENTERED_BLOCK		// block is parsed by main loop, see Parse_enter_block()
 };
 
 // constants
 static const char	exception_unknown_pseudo_opcode[]	= "Unknown pseudo opcode.";
+static const char	exception_no_cycles[]	= "Cycle counts are not known for this CPU.";
 
 
 // this is not really a pseudo opcode, but similar enough to be put here:
@@ -181,8 +187,14 @@ static enum eos iterate(void (*fn)(intval_t))
 	iter.stringxor = 0;
 	do {
 		ALU_any_result(&object);
+		if (flow_trace)
+			flow_trace_item(fn, ALU_last_compiled());
+		if ((object.type == &type_number) && (object.u.number.ntype == NUMTYPE_UNDEFINED))
+			fixup_add(fn, fn == output_le16);
 		output_object(&object, &iter);
 	} while (Input_accept_comma());
+	if (flow_trace)
+		flow_trace_end_statement();
 	return ENSURE_EOS;
 }
 
@@ -248,29 +260,50 @@ static enum eos po_le32(void)
 // Insert bytes given as pairs of hex digits (helper for source code generators)
 static enum eos po_hex(void)	// now GotByte = illegal char
 {
-	int		digits	= 0;
-	unsigned char	byte	= 0;
-
+	char	buf[256];
+	size_t	used;
+	char	*read;
+	int	high,
+		low,
+		digits	= 0;
+	int	byte	= 0;
+
+	// when reading from RAM, runs of digit pairs are decoded directly from
+	// the input buffer and sent to output as blocks. anything unusual is
+	// left to the byte-by-byte loop below.
+	if (Input_now->source != INPUTSRC_FILE) {
+		read = Input_now->src.ram_ptr - 1;	// points to GotByte
+		used = 0;
+		for (;;) {
+			if ((*read == ' ') || (*read == '\t')) {
+				++read;
+				continue;
+			}
+			high = DIGIT_VALUE(read[0]);
+			if (high == DIGIT_NONE)
+				break;
+			low = DIGIT_VALUE(read[1]);	// ok, because read[0] was not CHAR_EOS
+			if (low == DIGIT_NONE)
+				break;
+			buf[used++] = (high << 4) | low;
+			read += 2;
+			if (used == sizeof(buf)) {
+				output_block(buf, used);
+				used = 0;
+			}
+		}
+		output_block(buf, used);
+		Input_now->src.ram_ptr = read + 1;
+		GotByte = *read;
+	}
 	for (;;) {
 		if (digits == 2) {
 			Output_byte(byte);
 			digits = 0;
 			byte = 0;
 		}
-		if (GotByte >= '0' && GotByte <= '9') {
-			byte = (byte << 4) | (GotByte - '0');
-			++digits;
-			GetByte();
-			continue;
-		}
-		if (GotByte >= 'a' && GotByte <= 'f') {
-			byte = (byte << 4) | (GotByte - 'a' + 10);
-			++digits;
-			GetByte();
-			continue;
-		}
-		if (GotByte >= 'A' && GotByte <= 'F') {
-			byte = (byte << 4) | (GotByte - 'A' + 10);
+		if (DIGIT_VALUE(GotByte) != DIGIT_NONE) {
+			byte = (byte << 4) | DIGIT_VALUE(GotByte);
 			++digits;
 			GetByte();
 			continue;
@@ -308,69 +341,37 @@ static enum eos po_cbm(void)
 	return ENSURE_EOS;
 }
 
-// read encoding table from file
-static enum eos user_defined_encoding(FILE *stream)
-{
-	unsigned char		local_table[256],
-				*buffered_table		= encoding_loaded_table;
-	const struct encoder	*buffered_encoder	= encoder_current;
-
-	if (stream) {
-		encoding_load_from_file(local_table, stream);
-		fclose(stream);
-	}
-	encoder_current = &encoder_file;	// activate new encoding
-	encoding_loaded_table = local_table;		// activate local table
-	// if there's a block, parse that and then restore old values
-	if (Parse_optional_block()) {
-		encoder_current = buffered_encoder;
-	} else {
-		// if there's *no* block, the table must be used from now on.
-		// copy the local table to the "outer" table
-		memcpy(buffered_table, local_table, 256);
-	}
-	// re-activate "outer" table (it might have been changed by memcpy())
-	encoding_loaded_table = buffered_table;
-	return ENSURE_EOS;
-}
-
-// use one of the pre-defined encodings (raw, pet, scr)
-static enum eos predefined_encoding(void)
+// switch to given encoder (if not NULL) for the optional block or for the
+// rest of the current one
+static enum eos switch_encoding(const struct encoder *new_encoder)
 {
-	unsigned char		local_table[256],
-				*buffered_table		= encoding_loaded_table;
 	const struct encoder	*buffered_encoder	= encoder_current;
 
-	if (Input_read_and_lower_keyword()) {
-		const struct encoder	*new_encoder	= encoding_find();
-
-		if (new_encoder)
-			encoder_current = new_encoder;	// activate new encoder
-	}
-	encoding_loaded_table = local_table;	// activate local table
-	// if there's a block, parse that and then restore old values
+	if (new_encoder)
+		encoder_current = new_encoder;	// activate new encoder
+	// if there's a block, parse that and then restore old value
 	if (Parse_optional_block())
 		encoder_current = buffered_encoder;
-	// re-activate "outer" table
-	encoding_loaded_table = buffered_table;
 	return ENSURE_EOS;
 }
 // set current encoding ("!convtab" pseudo opcode)
 static enum eos po_convtab(void)
 {
-	boolean	uses_lib;
-	FILE	*stream;
+	boolean			uses_lib;
+	struct cached_file	*file;
 
 	if ((GotByte == '<') || (GotByte == '"')) {
 		// encoding table from file
 		if (Input_read_filename(TRUE, &uses_lib))
 			return SKIP_REMAINDER;	// missing or unterminated file name
 
-		stream = includepaths_open_ro(uses_lib);
-		return user_defined_encoding(stream);
+		file = includepaths_get(uses_lib);
+		return switch_encoding(file ? encoding_from_file(file) : NULL);
 	} else {
 		// one of the pre-defined encodings
-		return predefined_encoding();
+		if (Input_read_and_lower_keyword())
+			return switch_encoding(encoding_find());
+		return switch_encoding(NULL);
 	}
 }
 // insert string(s)
@@ -390,21 +391,14 @@ static enum eos encode_string(const struct encoder *inner_encoder, unsigned char
 		// older dialect, the new code will complain about string lengths > 1!
 		if ((GotByte == '"') && (config.wanted_version < VER_BACKSLASHESCAPING)) {
 			// the old way of handling string literals:
-			int	offset;
-
 			DYNABUF_CLEAR(GlobalDynaBuf);
-			if (Input_quoted_to_dynabuf('"'))
+			if (Input_unescaped_to_dynabuf('"'))
 				return SKIP_REMAINDER;	// unterminated or escaping error
 
 			// eat closing quote
 			GetByte();
-			// now convert to unescaped version
-			if (Input_unescape_dynabuf(0))
-				return SKIP_REMAINDER;	// escaping error
-
 			// send characters
-			for (offset = 0; offset < GlobalDynaBuf->size; ++offset)
-				output_8(xor ^ encoding_encode_char(GLOBALDYNABUF_CURRENT[offset]));
+			output_encoded_string(GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size, xor);
 		} else {
 			// handle everything else (also strings in newer dialects):
 			// parse value. no problems with single characters because the
@@ -453,11 +447,14 @@ static enum eos po_scrxor(void)
 // FIXME - split this into "parser" and "worker" fn and move worker fn somewhere else.
 static enum eos po_binary(void)
 {
-	boolean		uses_lib;
-	FILE		*stream;
-	int		byte;
-	struct number	size,
-			skip;
+	boolean			uses_lib;
+	struct cached_file	*file;
+	const char		*body;
+	size_t			body_size;
+	intval_t		offset,
+				available;
+	struct number		size,
+				skip;
 
 	size.val.intval = -1;	// means "not given" => "until EOF"
 	skip.val.intval	= 0;
@@ -466,11 +463,16 @@ static enum eos po_binary(void)
 	if (Input_read_filename(TRUE, &uses_lib))
 		return SKIP_REMAINDER;
 
-	// try to open file
-	stream = includepaths_open_ro(uses_lib);
-	if (stream == NULL)
+	// try to open file (or rather, get it from cache)
+	file = includepaths_get(uses_lib);
+	if (file == NULL)
 		return SKIP_REMAINDER;
 
+	// compressed files are unpacked, "size" and "skip" refer to the result
+	if (!filecache_get_binary(file, &body, &body_size)) {
+		Throw_error("Compressed file is corrupt.");
+		return SKIP_REMAINDER;
+	}
 	// read optional arguments
 	if (Input_accept_comma()) {
 		// any size given?
@@ -492,21 +494,21 @@ static enum eos po_binary(void)
 	// check whether including is a waste of time
 	// FIXME - future changes ("several-projects-at-once")
 	// may be incompatible with this!
-	if ((size.val.intval >= 0) && (pass.undefined_count || pass.error_count)) {
-	//if ((size.val.intval >= 0) && (pass.needvalue_count || pass.error_count)) {	FIXME - use!
+	// (not when using fixups, because then there will be no further pass)
+	if ((size.val.intval >= 0) && (pass.needvalue_count || pass.error_count) && !fixup_recording) {
 		output_skip(size.val.intval);	// really including is useless anyway
 	} else {
 		// really insert file
-		fseek(stream, skip.val.intval, SEEK_SET);	// set read pointer
+		// (negative skip values are ignored, just as fseek() used to do)
+		offset = (skip.val.intval < 0) ? 0 : skip.val.intval;
+		available = (offset < body_size) ? body_size - offset : 0;
 		// if "size" non-negative, read "size" bytes.
 		// otherwise, read until EOF.
-		while (size.val.intval != 0) {
-			byte = getc(stream);
-			if (byte == EOF)
-				break;
-			Output_byte(byte);
-			--size.val.intval;
-		}
+		if ((size.val.intval >= 0) && (size.val.intval < available))
+			available = size.val.intval;
+		output_block(body + offset, available);
+		if (size.val.intval > 0)
+			size.val.intval -= available;
 		// if more should have been read, warn and add padding
 		if (size.val.intval > 0) {
 			Throw_warning("Padding with zeroes.");
@@ -515,7 +517,6 @@ static enum eos po_binary(void)
 			while (--size.val.intval);
 		}
 	}
-	fclose(stream);
 	// if verbose, produce some output
 	if (FIRST_PASS && (config.process_verbosity > 1)) {
 		int	amount	= vcpu_get_statement_size();
@@ -536,8 +537,11 @@ static enum eos po_fill(void)
 	ALU_defined_int(&sizeresult);	// FIXME - forbid addresses!
 	if (Input_accept_comma())
 		ALU_any_int(&fill);	// FIXME - forbid addresses!
-	while (sizeresult.val.intval--)
-		output_8(fill);
+	if ((sizeresult.val.intval > 0) && (fill >= -0x80) && (fill <= 0xff))
+		output_fill(sizeresult.val.intval, fill);
+	else
+		while (sizeresult.val.intval--)
+			output_8(fill);	// complains about range for each byte
 	return ENSURE_EOS;
 }
 
@@ -710,6 +714,106 @@ static enum eos po_rs(void)
 }
 
 
+// complain about page crossings in block ("!pagecheck" pseudo opcode)
+static enum eos po_pagecheck(void)
+{
+	struct pagecheck	old	= mnemo_pagecheck;
+	struct number		size;
+
+	// get mode (in case of errors, go on so the block is still parsed)
+	mnemo_pagecheck.is_error = FALSE;
+	if (Input_read_and_lower_keyword()) {
+		if (strcmp(GlobalDynaBuf->buffer, "error") == 0)
+			mnemo_pagecheck.is_error = TRUE;
+		else if (strcmp(GlobalDynaBuf->buffer, "warn"))
+			Throw_error("Unknown page check mode.");
+	}
+	// get size of tables accessed via indexing
+	mnemo_pagecheck.table_size = 256;
+	if (Input_accept_comma()) {
+		ALU_defined_int(&size);
+		if ((size.val.intval < 1) || (size.val.intval > 256))
+			Throw_error(exception_number_out_of_range);
+		else
+			mnemo_pagecheck.table_size = size.val.intval;
+	}
+	if (CPU_state.type->cycles == NULL)
+		Throw_error(exception_no_cycles);	// block is parsed, but not checked
+	mnemo_pagecheck.active = TRUE;
+	if (!Parse_optional_block()) {
+		mnemo_pagecheck = old;
+		Throw_error(exception_no_left_brace);
+		return SKIP_REMAINDER;
+	}
+	mnemo_pagecheck = old;	// restore outer state
+	return ENSURE_EOS;
+}
+
+
+// check number of cycles needed by block ("!cycles" pseudo opcode)
+static enum eos po_cycles(void)
+{
+	struct number		budget;
+	struct cycle_count	before	= mnemo_cycles;
+	unsigned long		min,
+				max;
+	char			buffer[100];	// 640K should be enough for anybody
+
+	ALU_defined_int(&budget);
+	if (CPU_state.type->cycles == NULL)
+		Throw_error(exception_no_cycles);
+	if (!Parse_optional_block()) {
+		Throw_error(exception_no_left_brace);
+		return SKIP_REMAINDER;
+	}
+	if (CPU_state.type->cycles == NULL)
+		return ENSURE_EOS;	// error has been reported
+
+	min = mnemo_cycles.min - before.min;
+	max = mnemo_cycles.max - before.max;
+	if (mnemo_cycles.unknown != before.unknown)
+		Throw_first_pass_warning("Cycle count of block is incomplete.");
+	// if a branch target is still undefined, the check is left to a later pass
+	if (mnemo_cycles.unsure != before.unsure) {
+		fixup_invalidate();	// there must be a later pass
+		return ENSURE_EOS;
+	}
+	if ((budget.val.intval < 0) || (max > (unsigned long) budget.val.intval)) {
+		sprintf(buffer, "Cycle budget exceeded (%lu to %lu cycles, budget is %ld).", min, max, (long) budget.val.intval);
+		Throw_warning(buffer);
+	}
+	return ENSURE_EOS;
+}
+
+
+// block that is left out if nothing outside of it uses its symbols
+// ("!strippable" pseudo opcode, only with "--dead-strip"). has to be re-entrant.
+static enum eos po_strippable(void)
+{
+	SKIPSPACE();
+	if (GotByte != CHAR_SOB) {
+		Throw_error(exception_no_left_brace);
+		return SKIP_REMAINDER;
+	}
+	if (!config.dead_strip) {
+		Parse_optional_block();
+		return ENSURE_EOS;
+	}
+
+	// which blocks are used is only known at the end of a pass
+	if (snapshot_recording)
+		snapshot_invalidate();
+	if (strip_begin()) {
+		Parse_optional_block();
+		strip_end();
+	} else {
+		Input_skip_block();
+		GetByte();	// eat '}'
+	}
+	return ENSURE_EOS;
+}
+
+
 // force explicit label definitions to set "address" flag ("!addr"). Has to be re-entrant.
 static enum eos po_address(void)	// now GotByte = illegal char
 {
@@ -781,13 +885,13 @@ static enum eos po_symbollist(void)
 		return SKIP_REMAINDER;
 
 	// if symbol list file name already set, complain and exit
-	if (symbollist_filename) {
+	if (part->symbollist_filename) {
 		Throw_warning("Symbol list file name already chosen.");
 		return SKIP_REMAINDER;
 	}
 
 	// get malloc'd copy of filename
-	symbollist_filename = DynaBuf_get_copy(GlobalDynaBuf);
+	part->symbollist_filename = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
 	// ensure there's no garbage at end of line
 	return ENSURE_EOS;
 }
@@ -811,7 +915,7 @@ static enum eos po_zone(void)
 		// because we know of one character for sure,
 		// there's no need to check the return value.
 		Input_read_keyword();
-		new_title = DynaBuf_get_copy(GlobalDynaBuf);
+		new_title = DynaBuf_get_copy(GlobalDynaBuf, MEMUSE_OTHER);
 		allocated = TRUE;
 	}
 	// setup new section
@@ -843,43 +947,44 @@ static enum eos po_subzone(void)
 // include source file ("!source" or "!src"). has to be re-entrant.
 static enum eos po_source(void)	// now GotByte = illegal char
 {
-	boolean		uses_lib;
-	FILE		*stream;
-	char		local_gotbyte;
-	struct input	new_input,
-			*outer_input;
+	boolean			uses_lib,
+				recorded;
+	struct cached_file	*file;
+	char			local_gotbyte;
+	struct input		new_input,
+				*outer_input;
 
 	// enter new nesting level
 	// quit program if recursion too deep
-	if (--source_recursions_left < 0)
+	if (--part->source_recursions_left < 0)
 		Throw_serious_error("Too deeply nested. Recursive \"!source\"?");
 	// read file name. quit function on error
 	if (Input_read_filename(TRUE, &uses_lib))
 		return SKIP_REMAINDER;
 
 	// if file could be opened, parse it. otherwise, complain
-	stream = includepaths_open_ro(uses_lib);
-	if (stream) {
-// FIXME - just use safe_malloc and never free! this also saves us making a copy if defining macros down the road...
-#ifdef __GNUC__
-		char	filename[GlobalDynaBuf->size];	// GCC can do this
-#else
-		char	*filename	= safe_malloc(GlobalDynaBuf->size);	// VS can not
-#endif
-
-		strcpy(filename, GLOBALDYNABUF_CURRENT);
+	// (the cache entry holds a permanent copy of the file name, so no
+	// need to make one here)
+	// library files may be taken from a snapshot instead
+	file = includepaths_get(uses_lib);
+	if (file && file->original->has_once && (file->original->sourced_pass == pass.number)) {
+		// "!once" file has already been included in this pass (maybe under
+		// another name), so skip it
+		++stats.skipped_once;
+	} else if (file && !(uses_lib && snapshot_apply(file))) {
 		outer_input = Input_now;	// remember old input
 		local_gotbyte = GotByte;	// CAUTION - ugly kluge
 		Input_now = &new_input;	// activate new input
-		flow_parse_and_close_file(stream, filename);
+		recorded = uses_lib && snapshot_begin(file);
+		file->original->sourced_pass = pass.number;
+		flow_parse_file(file);
+		if (recorded)
+			snapshot_end();
 		Input_now = outer_input;	// restore previous input
 		GotByte = local_gotbyte;	// CAUTION - ugly kluge
-#ifndef __GNUC__
-		free(filename);	// GCC auto-frees
-#endif
 	}
 	// leave nesting level
-	++source_recursions_left;
+	++part->source_recursions_left;
 	return ENSURE_EOS;
 }
 
@@ -890,12 +995,70 @@ enum ifmode {
 	IFMODE_IFNDEF,	// check symbol, then parse block or line
 	IFMODE_ELSE	// unconditional last block
 };
+// after block of if/ifdef/ifndef/else (now GotByte = '}'): check for "else".
+// returns TRUE if there is another block, then mode is set accordingly.
+// otherwise FALSE is returned and "then" is set.
+static boolean read_else(enum ifmode *mode, enum eos *then)
+{
+	NEXTANDSKIPSPACE();
+	// after ELSE {} it's all over. it must be.
+	if (*mode == IFMODE_ELSE) {
+		// we could just return ENSURE_EOS, but checking here allows for better error message
+		if (GotByte != CHAR_EOS)
+			Throw_error("Expected end-of-statement after ELSE block.");
+		*then = SKIP_REMAINDER;	// normal exit after ELSE {...}
+		return FALSE;
+	}
+
+	// anything more?
+	if (GotByte == CHAR_EOS) {
+		*then = AT_EOS_ANYWAY;	// normal exit if there is no ELSE {...} block
+		return FALSE;
+	}
+
+	*then = SKIP_REMAINDER;	// for errors
+	// read keyword (expected to be "else")
+	if (Input_read_and_lower_keyword() == 0)
+		return FALSE;	// "missing string error" -> ignore rest of line
+
+	// make sure it's "else"
+	if (strcmp(GlobalDynaBuf->buffer, "else")) {
+		Throw_error("Expected ELSE or end-of-statement.");
+		return FALSE;	// an error has been reported, so ignore rest of line
+	}
+	// anything more?
+	SKIPSPACE();
+	if (GotByte == CHAR_SOB) {
+		// ELSE {...} -> one last round
+		*mode = IFMODE_ELSE;
+		return TRUE;
+	}
+
+	// read keyword (expected to be if/ifdef/ifndef)
+	if (Input_read_and_lower_keyword() == 0)
+		return FALSE;	// "missing string error" -> ignore rest of line
+
+	// which one is it?
+	if (strcmp(GlobalDynaBuf->buffer, "if") == 0) {
+		*mode = IFMODE_IF;
+	} else if (strcmp(GlobalDynaBuf->buffer, "ifdef") == 0) {
+		*mode = IFMODE_IFDEF;
+	} else if (strcmp(GlobalDynaBuf->buffer, "ifndef") == 0) {
+		*mode = IFMODE_IFNDEF;
+	} else {
+		Throw_error("After ELSE, expected block or IF/IFDEF/IFNDEF.");
+		return FALSE;	// an error has been reported, so ignore rest of line
+	}
+	return TRUE;
+}
 // has to be re-entrant
-static enum eos ifelse(enum ifmode mode)
+// once a block gets executed, the main loop parses it and then calls
+// pseudoopcode_end_block(), which skips all others (nothing_done is FALSE then)
+static enum eos ifelse(enum ifmode mode, boolean nothing_done)
 {
-	boolean		nothing_done	= TRUE;	// once a block gets executed, this becomes FALSE, so all others will be skipped even if condition met
 	boolean		condition_met;	// condition result for next block
 	struct number	ifresult;
+	enum eos	then;
 
 	for (;;) {
 		// check condition according to mode
@@ -922,89 +1085,42 @@ static enum eos ifelse(enum ifmode mode)
 		SKIPSPACE();
 		// execute this block?
 		if (condition_met && nothing_done) {
-			nothing_done = FALSE;	// all further ones will be skipped, even if conditions meet
-			if (GotByte == CHAR_SOB) {
-		                Parse_until_eob_or_eof();	// parse block
-        		        // if block isn't correctly terminated, complain and exit
-                		if (GotByte != CHAR_EOB)
-                		        Throw_serious_error(exception_no_right_brace);
-			} else {
-				return PARSE_REMAINDER;	// parse line (only for ifdef/ifndef)
-			}
-		} else {
 			if (GotByte == CHAR_SOB) {
-				Input_skip_or_store_block(FALSE);	// skip block
-			} else {
-				return SKIP_REMAINDER;	// skip line (only for ifdef/ifndef)
+				// parse block in main loop
+				Parse_enter_block((mode == IFMODE_ELSE) ? BLOCKKIND_ELSE : BLOCKKIND_IF);
+				return ENTERED_BLOCK;
 			}
+			return PARSE_REMAINDER;	// parse line (only for ifdef/ifndef)
 		}
-		// now GotByte = '}'
-		NEXTANDSKIPSPACE();
-		// after ELSE {} it's all over. it must be.
-		if (mode == IFMODE_ELSE) {
-			// we could just return ENSURE_EOS, but checking here allows for better error message
-			if (GotByte != CHAR_EOS)
-				Throw_error("Expected end-of-statement after ELSE block.");
-			return SKIP_REMAINDER;	// normal exit after ELSE {...}
-		}
-
-		// anything more?
-		if (GotByte == CHAR_EOS)
-			return AT_EOS_ANYWAY;	// normal exit if there is no ELSE {...} block
-
-		// read keyword (expected to be "else")
-		if (Input_read_and_lower_keyword() == 0)
-			return SKIP_REMAINDER;	// "missing string error" -> ignore rest of line
-
-		// make sure it's "else"
-		if (strcmp(GlobalDynaBuf->buffer, "else")) {
-			Throw_error("Expected ELSE or end-of-statement.");
-			return SKIP_REMAINDER;	// an error has been reported, so ignore rest of line
-		}
-		// anything more?
-		SKIPSPACE();
 		if (GotByte == CHAR_SOB) {
-			// ELSE {...} -> one last round
-			mode = IFMODE_ELSE;
-			continue;
-		}
-
-		// read keyword (expected to be if/ifdef/ifndef)
-		if (Input_read_and_lower_keyword() == 0)
-			return SKIP_REMAINDER;	// "missing string error" -> ignore rest of line
-
-		// which one is it?
-		if (strcmp(GlobalDynaBuf->buffer, "if") == 0) {
-			mode = IFMODE_IF;
-		} else if (strcmp(GlobalDynaBuf->buffer, "ifdef") == 0) {
-			mode = IFMODE_IFDEF;
-		} else if (strcmp(GlobalDynaBuf->buffer, "ifndef") == 0) {
-			mode = IFMODE_IFNDEF;
+			Input_skip_block();
 		} else {
-			Throw_error("After ELSE, expected block or IF/IFDEF/IFNDEF.");
-			return SKIP_REMAINDER;	// an error has been reported, so ignore rest of line
+			return SKIP_REMAINDER;	// skip line (only for ifdef/ifndef)
 		}
+		// now GotByte = '}'
+		if (!read_else(&mode, &then))
+			return then;
 	}
 }
 
 // conditional assembly ("!if"). has to be re-entrant.
 static enum eos po_if(void)	// now GotByte = illegal char
 {
-	return ifelse(IFMODE_IF);
+	return ifelse(IFMODE_IF, TRUE);
 }
 
 
 // conditional assembly ("!ifdef"). has to be re-entrant.
 static enum eos po_ifdef(void)	// now GotByte = illegal char
 {
-	return ifelse(IFMODE_IFDEF);
+	return ifelse(IFMODE_IFDEF, TRUE);
 }
 
 
 // conditional assembly ("!ifndef"). has to be re-entrant.
 static enum eos po_ifndef(void)	// now GotByte = illegal char
 {
-	return ifelse(IFMODE_IFNDEF);
+	return ifelse(IFMODE_IFNDEF, TRUE);
 }
 
 
@@ -1102,12 +1218,12 @@ does not fail. */
 
 	// remember line number of loop pseudo opcode
 	loop.block.start = Input_now->line_number;
-	// read loop body into DynaBuf and get copy
-	loop.block.body = Input_skip_or_store_block(TRUE);	// changes line number!
+	// remember loop body (or get copy)
+	loop.block.body = Input_store_block(FALSE, &loop.block.copy, &loop.block.copy_size);	// changes line number!
 
 	flow_forloop(&loop);
 	// free memory
-	free(loop.block.body);
+	safe_free(loop.block.copy, loop.block.copy_size, MEMUSE_BLOCKS);
 
 	// GotByte of OuterInput would be '}' (if it would still exist)
 	GetByte();	// fetch next byte
@@ -1126,10 +1242,10 @@ static enum eos po_do(void)	// now GotByte = illegal char
 	if (GotByte != CHAR_SOB)
 		Throw_serious_error(exception_no_left_brace);
 	// remember line number of loop body,
-	// then read block and get copy
+	// then remember block (or get copy)
 	loop.block.start = Input_now->line_number;
 	// reading block changes line number!
-	loop.block.body = Input_skip_or_store_block(TRUE);	// must be freed!
+	loop.block.body = Input_store_block(FALSE, &loop.block.copy, &loop.block.copy_size);	// copy must be freed!
 	// now GotByte = '}'
 	NEXTANDSKIPSPACE();	// now GotByte = first non-blank char after block
 	// read tail condition to buffer
@@ -1137,9 +1253,9 @@ static enum eos po_do(void)	// now GotByte = illegal char
 	// now GotByte = CHAR_EOS
 	flow_do_while(&loop);
 	// free memory
-	free(loop.head_cond.body);
-	free(loop.block.body);
-	free(loop.tail_cond.body);
+	safe_free(loop.head_cond.body, loop.head_cond.size, MEMUSE_BLOCKS);
+	safe_free(loop.block.copy, loop.block.copy_size, MEMUSE_BLOCKS);
+	safe_free(loop.tail_cond.body, loop.tail_cond.size, MEMUSE_BLOCKS);
 	return AT_EOS_ANYWAY;
 }
 
@@ -1155,16 +1271,17 @@ static enum eos po_while(void)	// now GotByte = illegal char
 	if (GotByte != CHAR_SOB)
 		Throw_serious_error(exception_no_left_brace);
 	// remember line number of loop body,
-	// then read block and get copy
+	// then remember block (or get copy)
 	loop.block.start = Input_now->line_number;
 	// reading block changes line number!
-	loop.block.body = Input_skip_or_store_block(TRUE);	// must be freed!
+	loop.block.body = Input_store_block(FALSE, &loop.block.copy, &loop.block.copy_size);	// copy must be freed!
 	// clear tail condition
 	loop.tail_cond.body = NULL;
+	loop.tail_cond.size = 0;
 	flow_do_while(&loop);
 	// free memory
-	free(loop.head_cond.body);
-	free(loop.block.body);
+	safe_free(loop.head_cond.body, loop.head_cond.size, MEMUSE_BLOCKS);
+	safe_free(loop.block.copy, loop.block.copy_size, MEMUSE_BLOCKS);
 	// GotByte of OuterInput would be '}' (if it would still exist)
 	GetByte();	// fetch next byte
 	return ENSURE_EOS;
@@ -1184,7 +1301,7 @@ static enum eos po_macro(void)	// now GotByte = illegal char
 		// for the same reason, there is no need to check for quotes.
 		while (GotByte != CHAR_SOB)
 			GetByte();
-		Input_skip_or_store_block(FALSE);	// now GotByte = '}'
+		Input_skip_block();	// now GotByte = '}'
 	}
 	GetByte();	// Proceed with next character
 	return ENSURE_EOS;
@@ -1263,15 +1380,11 @@ static enum eos throw_string(const char prefix[], void (*fn)(const char *))
 	do {
 		if ((GotByte == '"') && (config.wanted_version < VER_BACKSLASHESCAPING)) {
 			DYNABUF_CLEAR(GlobalDynaBuf);
-			if (Input_quoted_to_dynabuf('"'))
+			if (Input_unescaped_to_dynabuf('"'))
 				return SKIP_REMAINDER;	// unterminated or escaping error
 
 			// eat closing quote
 			GetByte();
-			// now convert to unescaped version
-			if (Input_unescape_dynabuf(0))
-				return SKIP_REMAINDER;	// escaping error
-
 			DynaBuf_append(GlobalDynaBuf, '\0');	// terminate string
 			DynaBuf_add_string(user_message, GLOBALDYNABUF_CURRENT);	// add to message
 		} else {
@@ -1323,12 +1436,25 @@ static enum eos po_serious(void)
 }
 
 
+// include current file only once per pass ("!once")
+static enum eos po_once(void)
+{
+	if (!Input_mark_once())
+		Throw_error("\"!once\" must not be used in loops or macros.");
+	// a snapshot would skip the file without marking it as included, so
+	// files using "!once" are always parsed
+	if (snapshot_recording)
+		snapshot_invalidate();
+	return ENSURE_EOS;
+}
+
+
 // end of source file ("!endoffile" or "!eof")
 static enum eos po_endoffile(void)
 {
 	// well, it doesn't end right here and now, but at end-of-line! :-)
 	Input_ensure_EOS();
-	Input_now->state = INPUTSTATE_EOF;
+	Input_end_file();
 	return AT_EOS_ANYWAY;
 }
 
@@ -1377,6 +1503,9 @@ static struct ronode	pseudo_opcode_tree[]	= {
 	PREDEFNODE("as",		po_as),
 	PREDEFNODE("rl",		po_rl),
 	PREDEFNODE("rs",		po_rs),
+	PREDEFNODE("cycles",		po_cycles),
+	PREDEFNODE("pagecheck",		po_pagecheck),
+	PREDEFNODE("strippable",	po_strippable),
 	PREDEFNODE("addr",		po_address),
 	PREDEFNODE("address",		po_address),
 //	PREDEFNODE("enum",		po_enum),
@@ -1403,37 +1532,77 @@ static struct ronode	pseudo_opcode_tree[]	= {
 	PREDEFNODE("warn",		po_warn),
 	PREDEFNODE("error",		po_error),
 	PREDEFNODE("serious",		po_serious),
+	PREDEFNODE("once",		po_once),
 	PREDEFNODE("eof",		po_endoffile),
 	PREDEF_END("endoffile",		po_endoffile),
 	//    ^^^^ this marks the last element
 };
 
 
-// parse a pseudo opcode. has to be re-entrant.
-void pseudoopcode_parse(void)	// now GotByte = "!"
+// act on what pseudo opcode function returned
+static void end_pseudo_opcode(enum eos then)
 {
-	void		*node_body;
-	enum eos	(*fn)(void),
-			then	= SKIP_REMAINDER;	// prepare for errors
-
-	GetByte();	// read next byte
-	// on missing keyword, return (complaining will have been done)
-	if (Input_read_and_lower_keyword()) {
-		// search for tree item
-		if ((Tree_easy_scan(pseudo_opcode_tree, &node_body, GlobalDynaBuf))
-		&& node_body) {
-			fn = (enum eos (*)(void)) node_body;
-			SKIPSPACE();
-			// call function
-			then = fn();
-		} else {
-			Throw_error(exception_unknown_pseudo_opcode);
-		}
-	}
 	if (then == SKIP_REMAINDER)
 		Input_skip_remainder();
 	else if (then == ENSURE_EOS)
 		Input_ensure_EOS();
-	// the other two possibilities (PARSE_REMAINDER and AT_EOS_ANYWAY)
-	// will lead to the remainder of the line being parsed by the mainloop.
+	// the other possibilities (PARSE_REMAINDER and AT_EOS_ANYWAY)
+	// will lead to the remainder of the line being parsed by the mainloop,
+	// and ENTERED_BLOCK to the block being parsed.
+}
+
+
+// parse a pseudo opcode. has to be re-entrant.
+void pseudoopcode_parse(void)	// now GotByte = "!"
+{
+	void			*node_body;
+	struct parsed_stmt	stmt,
+				*known;
+	enum eos		(*fn)(void),
+				then	= SKIP_REMAINDER;	// prepare for errors
+
+	// if pseudo opcode has been found here before, skip reading and looking up
+	known = Input_find_stmt(&stmt);
+	if (known && (known->kind == STMT_PSEUDOOPCODE)) {
+		Input_resume_stmt(known);
+		fn = (enum eos (*)(void)) known->action;
+		then = fn();
+	} else {
+		GetByte();	// read next byte
+		// on missing keyword, return (complaining will have been done)
+		if (Input_read_and_lower_keyword()) {
+			// search for tree item
+			if ((Tree_easy_scan_hashed(pseudo_opcode_tree, &node_body, GLOBALDYNABUF_CURRENT, Input_keyword.hash))
+			&& node_body) {
+				fn = (enum eos (*)(void)) node_body;
+				SKIPSPACE();
+				Input_set_resume(&stmt);
+				stmt.kind = STMT_PSEUDOOPCODE;
+				stmt.cpu = NULL;
+				stmt.action = node_body;
+				Input_remember_stmt(&stmt);
+				// call function
+				then = fn();
+			} else {
+				Throw_error(exception_unknown_pseudo_opcode);
+			}
+		}
+	}
+	end_pseudo_opcode(then);
+}
+
+
+// finish "!if"/"!ifdef"/"!ifndef" statement after the main loop has parsed a
+// block (now GotByte = '}', or CHAR_EOF if block is not terminated)
+void pseudoopcode_end_block(enum block_kind kind)
+{
+	enum ifmode	mode	= (kind == BLOCKKIND_ELSE) ? IFMODE_ELSE : IFMODE_IF;
+	enum eos	then;
+
+	// if block isn't correctly terminated, complain and exit
+	if (GotByte != CHAR_EOB)
+		Throw_serious_error(exception_no_right_brace);
+	if (read_else(&mode, &then))
+		then = ifelse(mode, FALSE);	// skip all remaining blocks
+	end_pseudo_opcode(then);
 }
@@ -7,10 +7,16 @@
 #define pseudoopcodes_H
 
 
+#include "global.h"
+
+
 // call when "*= EXPRESSION" is parsed
 extern void notreallypo_setpc(void);
 // parse pseudo opcode. has to be re-entrant.
 extern void pseudoopcode_parse(void);
+// called by main loop at end of a block entered by "!if"/"!ifdef"/"!ifndef"
+// (see Parse_enter_block())
+extern void pseudoopcode_end_block(enum block_kind kind);
 
 
 #endif
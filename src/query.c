@@ -0,0 +1,266 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// query interface ("--query")
+//
+// After a build, queries are read line by line and answered from what the
+// build left in memory: the symbol table (all scopes, not just the globals
+// the symbol list contains) and the lines recorded for the listing report,
+// which hold the output bytes and zone of each source line. Fields are
+// separated by tabs, numbers are decimal. Each answer consists of any number
+// of result lines, followed by either "ok" or "error" and a message.
+#include "query.h"
+#include <stdlib.h>
+#include <string.h>
+#include "alu.h"
+#include "dynabuf.h"
+#include "global.h"
+#include "input.h"
+#include "symbol.h"
+#include "tree.h"
+
+
+// variables
+static	STRUCT_DYNABUF_REF(query_buf, 256);	// current query line
+static	STRUCT_DYNABUF_REF(value_buf, 64);	// to print symbol values
+
+
+// read line into query_buf (zero-terminated, without line break).
+// returns FALSE at end of input.
+static boolean read_query(FILE *in)
+{
+	int	byte;
+
+	DYNABUF_CLEAR(query_buf);
+	for (;;) {
+		byte = getc(in);
+		if ((byte == EOF) || (byte == '\n'))
+			break;
+		if (byte != '\r')
+			DynaBuf_append(query_buf, (char) byte);
+	}
+	DynaBuf_append(query_buf, '\0');
+	return (byte != EOF) || (query_buf->size > 1);
+}
+
+
+// split off next word (changes the line). returns NULL if there is none.
+static char *next_word(char **read)
+{
+	char	*word;
+
+	while ((**read == ' ') || (**read == '\t'))
+		++*read;
+	if (**read == '\0')
+		return NULL;
+
+	word = *read;
+	while (**read && (**read != ' ') && (**read != '\t'))
+		++*read;
+	if (**read)
+		*(*read)++ = '\0';
+	return word;
+}
+
+
+// parse number ("$hex", "0xhex" or decimal). returns FALSE on error.
+static boolean parse_number(const char *string, long *result)
+{
+	char	*end;
+
+	if (*string == '$')
+		*result = strtol(string + 1, &end, 16);
+	else
+		*result = strtol(string, &end, 0);
+	return (*string != '\0') && (*end == '\0');
+}
+
+
+// return first recorded line matching "FILE:LINE" (name as given in the
+// source or path where file was found), or NULL if there is none.
+static const struct report_line *find_line(const char *location, const struct report_line *start)
+{
+	const struct report_line	*line,
+					*end	= report->lines + report->used;
+	const char			*colon;
+	size_t				length;
+	long				number;
+
+	colon = strrchr(location, ':');
+	if ((colon == NULL) || !parse_number(colon + 1, &number))
+		return NULL;
+
+	length = colon - location;
+	for (line = start ? start : report->lines; line != end; ++line) {
+		if ((line->line_number == number)
+		&& (((strncmp(line->file->name, location, length) == 0) && (line->file->name[length] == '\0'))
+		|| (line->file->path && (strncmp(line->file->path, location, length) == 0) && (line->file->path[length] == '\0'))))
+			return line;
+	}
+	return NULL;
+}
+
+
+// write error answer
+static void answer_error(FILE *out, const char *message)
+{
+	fprintf(out, "error\t%s\n", message);
+}
+
+
+// write symbol result line
+static void print_symbol(FILE *out, char prefix, const struct rwnode *node)
+{
+	const struct symbol	*symbol	= node->body;
+	char			buffer[64];
+
+	DYNABUF_CLEAR(value_buf);
+	if (symbol->object.type == &type_number) {
+		if (symbol->object.u.number.ntype == NUMTYPE_INT) {
+			sprintf(buffer, "%ld", (long) symbol->object.u.number.val.intval);
+			DynaBuf_add_string(value_buf, buffer);
+		} else if (symbol->object.u.number.ntype == NUMTYPE_FLOAT) {
+			sprintf(buffer, "%.30g", symbol->object.u.number.val.fpval);
+			DynaBuf_add_string(value_buf, buffer);
+		} else {
+			DynaBuf_append(value_buf, '?');
+		}
+	} else if (symbol->object.type) {
+		symbol->object.type->print(&symbol->object, value_buf);
+	} else {
+		DynaBuf_append(value_buf, '?');
+	}
+	DynaBuf_append(value_buf, '\0');
+	fputs("symbol\t", out);
+	if (prefix)
+		putc(prefix, out);
+	fprintf(out, "%s\t%u\t%s\t%s:%d\n", node->id_string, (unsigned) node->id_number, value_buf->buffer,
+		symbol->def_filename ? symbol->def_filename : "", symbol->def_line_number);
+}
+
+
+// "symbol NAME [SCOPE | FILE:LINE]": show value of symbol. without a scope,
+// local symbols (".NAME") and cheap locals ("@NAME") of all zones are shown.
+static void answer_symbol(FILE *out, char *name, const char *where)
+{
+	const struct report_line	*line;
+	const struct rwnode		*node;
+	char				prefix	= '\0';
+	boolean				any_scope	= FALSE;
+	long				scope	= SCOPE_GLOBAL;
+
+	if (name == NULL) {
+		answer_error(out, "No symbol name given.");
+		return;
+	}
+	if ((*name == LOCAL_PREFIX) || (*name == CHEAP_PREFIX))
+		prefix = *name++;
+	if (prefix && where) {
+		if (!parse_number(where, &scope)) {
+			line = find_line(where, NULL);
+			if (line == NULL) {
+				answer_error(out, "Line not found.");
+				return;
+			}
+			scope = (prefix == LOCAL_PREFIX) ? line->local_scope : line->cheap_scope;
+		}
+	} else if (prefix) {
+		any_scope = TRUE;
+	}
+	for (node = (prefix ? part->locals : part->symbols)->first; node; node = node->next) {
+		if (strcmp(node->id_string, name))
+			continue;
+
+		// locals have even scope numbers, cheap locals have odd ones
+		if (any_scope
+		? ((node->id_number != SCOPE_GLOBAL) && ((node->id_number & 1) == (prefix == CHEAP_PREFIX)))
+		: (node->id_number == (scope_t) scope))
+			print_symbol(out, prefix, node);
+	}
+	fputs("ok\n", out);
+}
+
+
+// "address ADDRESS": show source lines that generated byte at given address
+static void answer_address(FILE *out, const char *argument)
+{
+	const struct report_line	*line,
+					*end	= report->lines + report->used;
+	long				address;
+
+	if ((argument == NULL) || !parse_number(argument, &address)) {
+		answer_error(out, "No address given.");
+		return;
+	}
+	for (line = report->lines; line != end; ++line) {
+		if (line->bin_used
+		&& (address >= line->bin_address)
+		&& (address < line->bin_address + line->bin_used))
+			fprintf(out, "line\t%s\t%d\t%d\t%d\n", line->file->name, line->line_number,
+				line->bin_address, line->bin_address + line->bin_used);
+	}
+	fputs("ok\n", out);
+}
+
+
+// "line FILE:LINE": show zone and address ranges generated by source line
+static void answer_line(FILE *out, const char *location)
+{
+	const struct report_line	*line;
+
+	if ((location == NULL) || ((line = find_line(location, NULL)) == NULL)) {
+		answer_error(out, "Line not found.");
+		return;
+	}
+	fprintf(out, "scope\t%u\t%u\n", (unsigned) line->local_scope, (unsigned) line->cheap_scope);
+	// a line may have been reached several times (loops, repeated "!source")
+	for (; line; line = find_line(location, line + 1)) {
+		if (line->bin_used)
+			fprintf(out, "range\t%d\t%d\n", line->bin_address, line->bin_address + line->bin_used);
+	}
+	fputs("ok\n", out);
+}
+
+
+// read one query line from "in" and write answer to "out"
+enum query_result query_handle(FILE *in, FILE *out)
+{
+	char	*read,
+		*command,
+		*first,
+		*second;
+
+	if (!read_query(in))
+		return QUERY_QUIT;
+
+	read = query_buf->buffer;
+	command = next_word(&read);
+	first = next_word(&read);
+	second = next_word(&read);
+	if (command == NULL) {
+		return QUERY_DONE;	// ignore empty lines
+	} else if (strcmp(command, "symbol") == 0) {
+		answer_symbol(out, first, second);
+	} else if (strcmp(command, "address") == 0) {
+		answer_address(out, first);
+	} else if (strcmp(command, "line") == 0) {
+		answer_line(out, first);
+	} else if (strcmp(command, "update") == 0) {
+		return QUERY_UPDATE;
+	} else if (strcmp(command, "quit") == 0) {
+		return QUERY_QUIT;
+	} else {
+		answer_error(out, "Unknown query.");
+	}
+	fflush(out);
+	return QUERY_DONE;
+}
+
+
+// answer "update" query, after given number of files had changed
+void query_updated(FILE *out, int changed)
+{
+	fprintf(out, "update\t%d\nok\n", changed);
+	fflush(out);
+}
@@ -0,0 +1,30 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// query interface ("--query")
+#ifndef query_H
+#define query_H
+
+
+#include <stdio.h>
+#include "config.h"
+
+
+// what the caller has to do after a query line has been handled
+enum query_result {
+	QUERY_DONE,	// query has been answered, read next one
+	QUERY_UPDATE,	// check files and assemble again, then call query_updated()
+	QUERY_QUIT	// "quit" or end of input
+};
+
+
+// prototypes
+
+// read one query line from "in" and write answer to "out"
+extern enum query_result query_handle(FILE *in, FILE *out);
+// answer "update" query, after given number of files had changed
+extern void query_updated(FILE *out, int changed);
+
+
+#endif
@@ -58,13 +58,31 @@ void section_new_cheap_scope(struct section *section)
 }
 
 
+// remember current section state
+void section_get_state(struct section_state *state)
+{
+	state->section = *section_now;
+	state->local_scope_max = local_scope_max;
+	state->cheap_scope_max = cheap_scope_max;
+}
+// restore scope values remembered by section_get_state()
+// (type and title are left alone, caller must make sure they did not change)
+void section_set_state(const struct section_state *state)
+{
+	section_now->local_scope = state->section.local_scope;
+	section_now->cheap_scope = state->section.cheap_scope;
+	local_scope_max = state->local_scope_max;
+	cheap_scope_max = state->cheap_scope_max;
+}
+
+
 // Tidy up: If necessary, release section title.
 // Warning - the state of the component "Allocd" may have
 // changed in the meantime, so don't rely on a local variable.
 void section_finalize(struct section *section)
 {
 	if (section->allocated)
-		free(section->title);
+		safe_free_string(section->title, MEMUSE_OTHER);
 }
 
 
@@ -77,3 +95,12 @@ void section_passinit(void)
 	cheap_scope_max = -1;	// will be incremented by 2 by next line
 	section_new_cheap_scope(&outer_section);
 }
+
+
+// replace outermost section with a new untitled one (for "--modules")
+void section_new_module(void)
+{
+	section_finalize(&outer_section);	// "!zone" may have set a title
+	section_new(&outer_section, "Zone", s_untitled, FALSE);
+	section_new_cheap_scope(&outer_section);
+}
@@ -23,6 +23,13 @@ struct section {
 // current section structure
 extern struct section	*section_now;
 
+// section state, so files can be replayed (see flow.c)
+struct section_state {
+	struct section	section;	// copy of current section
+	scope_t		local_scope_max,
+			cheap_scope_max;
+};
+
 
 // write given info into given structure and activate it
 extern void section_new(struct section *section, const char *type, char *title, boolean allocated);
@@ -30,6 +37,12 @@ extern void section_new(struct section *section, const char *type, char *title,
 extern void section_new_cheap_scope(struct section *section);
 // setup outermost section
 extern void section_passinit(void);
+// replace outermost section with a new untitled one (for "--modules")
+extern void section_new_module(void);
+// remember current section state
+extern void section_get_state(struct section_state *state);
+// restore scope values remembered by section_get_state()
+extern void section_set_state(const struct section_state *state);
 // tidy up: if necessary, release section title.
 extern void section_finalize(struct section *section);
 
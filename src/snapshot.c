@@ -0,0 +1,909 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// library snapshots ("--snapshot-dir")
+//
+// Library files mostly define constants and macros. When such a file is
+// parsed in the first pass, everything it does is recorded: the state of each
+// symbol it uses before and after parsing it, the macros it defines and the
+// files it reads. If it did nothing else (no output, no program counter, no
+// change of cpu, encoding or zone, no messages and no undefined results), the
+// recording is written to the snapshot directory. Whenever the file is
+// included again, the snapshot is used instead of parsing the file, as long
+// as the files still have the same contents, the same options are in effect
+// and all symbols are in the state they were in before parsing. Later passes
+// parse library files as usual (the "!ifdef" guards make that cheap).
+// Recordings can be nested, so snapshots of files that include other files
+// contain the other files' effects as well.
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alu.h"
+#include "buildcache.h"
+#include "dynabuf.h"
+#include "encoding.h"
+#include "flow.h"
+#include "global.h"
+#include "input.h"
+#include "macro.h"
+#include "output.h"
+#include "platform.h"
+#include "section.h"
+#include "symbol.h"
+#include "tree.h"
+#include "version.h"
+
+
+// constants
+static const char	snapshot_magic[]	= "ACME library snapshot, release " RELEASE "\n";
+static const char	snapshot_suffix[]	= ".acmesnap";
+static const char	temp_suffix[]	= ".tmp";
+enum snapstate {
+	SNAPSTATE_NONE,		// symbol does not exist (or has no type yet)
+	SNAPSTATE_UNDEFINED,	// number with undefined value
+	SNAPSTATE_INT		// integer
+};
+
+
+// types
+struct snapvalue {
+	enum snapstate	state;
+	bits		flags;
+	intval_t	intval;
+	int		addr_refs;
+};
+struct snapfile {
+	const char		*name;	// (in recording: file cache's copy)
+	const char		*path;	// NULL if not found
+	unsigned long		size;
+	struct checksum		sum;
+	int			index;	// for writing definition locations
+	struct cached_file	*current;	// set when checked
+};
+struct snapsymbol {
+	const struct symbol	*symbol;	// (only while recording)
+	struct snapvalue	before,
+				after;
+	boolean			read;	// has been read after parsing
+	const char		*def_filename;	// (only while recording)
+	struct snapfile		*def_file;	// NULL if not defined by file
+	int			def_line_number;
+};
+struct snapmacro {
+	const char	*original_name;
+	const char	*parameters;
+	size_t		parameters_size;
+	const char	*body;
+	size_t		body_size;
+	const char	*def_filename;	// (only while recording)
+	struct snapfile	*def_file;
+	int		def_line_number;
+};
+struct snapshot {
+	struct arena	arena;	// everything below is allocated here
+	struct rwtable	files[1];	// id number: 1 if include paths were used
+	struct rwtable	symbols[1];	// global names
+	struct rwtable	macros[1];	// internal names
+	int		volatile_delta;	// change of pass.volatile_count
+	int		file_count;	// number of files parsed
+	boolean		undefined_ifdef;	// "!ifdef" found undefined symbol
+};
+struct recording {
+	struct recording	*outer;
+	struct snapshot		*snapshot;
+	struct cached_file	*file;
+	boolean			valid;
+	struct output_state	out_entry;
+	struct section_state	section_entry;
+	const struct encoder	*encoder;
+	int			throws,
+				undefined_count,
+				needvalue_count,
+				volatile_count,
+				file_count;
+	const char		*output_filename,
+				*symbollist_filename,
+				*vicelabels_filename;
+};
+
+
+// variables
+const char		*snapshot_dir	= NULL;
+boolean			snapshot_recording	= FALSE;
+static struct recording	*recording	= NULL;	// innermost
+static struct arena	known_arena;
+static STRUCT_RWTABLE_REF(known_table, &known_arena);	// library path -> snapshot (NULL if none)
+static struct arena	used_arena;
+static STRUCT_RWTABLE_REF(used_table, &used_arena);	// library paths recorded or applied in this build
+static STRUCT_DYNABUF_REF(name_buf, 256);	// name of snapshot file
+static STRUCT_DYNABUF_REF(key_buf, 64);	// options that change how files are parsed
+static STRUCT_DYNABUF_REF(data_buf, 256);	// strings read from snapshot file
+
+
+// create empty snapshot
+static struct snapshot *new_snapshot(void)
+{
+	struct snapshot	*snapshot;
+
+	snapshot = safe_malloc(sizeof(*snapshot), MEMUSE_OTHER);
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->files->arena = &snapshot->arena;
+	snapshot->symbols->arena = &snapshot->arena;
+	snapshot->macros->arena = &snapshot->arena;
+	return snapshot;
+}
+
+
+// free snapshot
+static void free_snapshot(struct snapshot *snapshot)
+{
+	if (snapshot == NULL)
+		return;
+
+	Tree_clear(snapshot->files, NULL);
+	Tree_clear(snapshot->symbols, NULL);
+	Tree_clear(snapshot->macros, NULL);
+	arena_free(&snapshot->arena);
+	safe_free(snapshot, sizeof(*snapshot), MEMUSE_OTHER);
+}
+
+
+// put current options into key_buf
+static void make_key(void)
+{
+	char	key[64];
+
+	sprintf(key, "%c %d %d %d %d %d %d", config.pseudoop_prefix, config.warn_on_indented_labels,
+		config.warn_on_type_mismatch, config.warn_bin_mask, config.honor_leading_zeroes,
+		config.test_new_features, (int) config.wanted_version);
+	DYNABUF_CLEAR(key_buf);
+	DynaBuf_add_string(key_buf, key);
+	DynaBuf_append(key_buf, '\0');
+}
+
+
+// put name of snapshot file for given library path (plus given suffix) into
+// name_buf
+static void make_snapshot_name(const char *path, const char *suffix)
+{
+	struct checksum	sum;
+	char		hex[20];
+
+	buildcache_checksum(&sum, path, strlen(path));
+	sprintf(hex, "%08lx%08lx", sum.a, sum.b);
+	DYNABUF_CLEAR(name_buf);
+	DynaBuf_add_string(name_buf, snapshot_dir);
+	// if wanted and possible, ensure last char is directory separator
+	if (DIRECTORY_SEPARATOR
+	&& name_buf->size
+	&& (name_buf->buffer[name_buf->size - 1] != DIRECTORY_SEPARATOR))
+		DynaBuf_append(name_buf, DIRECTORY_SEPARATOR);
+	DynaBuf_add_string(name_buf, hex);
+	DynaBuf_add_string(name_buf, snapshot_suffix);
+	DynaBuf_add_string(name_buf, suffix);
+	DynaBuf_append(name_buf, '\0');
+}
+
+
+// get state of symbol. returns FALSE if it cannot be put in a snapshot.
+static boolean get_value(struct snapvalue *value, const struct symbol *symbol)
+{
+	memset(value, 0, sizeof(*value));
+	value->state = SNAPSTATE_NONE;
+	if ((symbol == NULL) || (symbol->object.type == NULL))
+		return TRUE;
+
+	if (symbol->object.type != &type_number)
+		return FALSE;	// strings and lists are not supported
+
+	value->flags = symbol->object.u.number.flags;
+	value->addr_refs = symbol->object.u.number.addr_refs;
+	if (symbol->object.u.number.ntype == NUMTYPE_UNDEFINED) {
+		value->state = SNAPSTATE_UNDEFINED;
+		return TRUE;
+	}
+	if (symbol->object.u.number.ntype != NUMTYPE_INT)
+		return FALSE;	// floats are not supported
+
+	value->state = SNAPSTATE_INT;
+	value->intval = symbol->object.u.number.val.intval;
+	return TRUE;
+}
+
+
+// compare states
+static boolean values_equal(const struct snapvalue *a, const struct snapvalue *b)
+{
+	if (a->state != b->state)
+		return FALSE;
+
+	if (a->state == SNAPSTATE_NONE)
+		return TRUE;
+
+	return (a->flags == b->flags)
+		&& (a->addr_refs == b->addr_refs)
+		&& (a->intval == b->intval);
+}
+
+
+// find or create entry of table (name must be zero-terminated, size includes
+// terminator). returns TRUE if created.
+static boolean get_entry(struct rwnode **node, struct rwtable *table, const char *name, size_t size, int id_number)
+{
+	struct rwname	rwname;
+
+	Tree_make_name(&rwname, name, size);
+	return Tree_hard_scan_name(node, table, &rwname, id_number, TRUE);
+}
+
+
+// recording:
+
+// symbol is about to be used or defined ("symbol" is NULL if not found).
+// the name must be zero-terminated, the size includes the terminator.
+void snapshot_note_symbol(const char *name, size_t size, scope_t scope, const struct symbol *symbol)
+{
+	struct recording	*rec;
+	struct rwnode		*node;
+	struct snapsymbol	*entry;
+
+	for (rec = recording; rec; rec = rec->outer) {
+		// local symbols depend on zone numbers, so they are not supported
+		if (scope != SCOPE_GLOBAL) {
+			rec->valid = FALSE;
+			continue;
+		}
+		if (get_entry(&node, rec->snapshot->symbols, name, size, 0)) {
+			entry = arena_alloc(&rec->snapshot->arena, sizeof(*entry), MEMUSE_OTHER);
+			memset(entry, 0, sizeof(*entry));
+			if (!get_value(&entry->before, symbol))
+				rec->valid = FALSE;
+			if (symbol) {
+				entry->def_filename = symbol->def_filename;
+				entry->def_line_number = symbol->def_line_number;
+			}
+			node->body = entry;
+		}
+		entry = node->body;
+		if (symbol)
+			entry->symbol = symbol;
+	}
+}
+
+
+// file cache entry was looked up ("file" is NULL if not found)
+void snapshot_note_file(const char *name, boolean use_include_paths, const struct cached_file *file)
+{
+	struct recording	*rec;
+	struct rwnode		*node;
+	struct snapfile		*entry;
+
+	for (rec = recording; rec; rec = rec->outer) {
+		if (!get_entry(&node, rec->snapshot->files, name, strlen(name) + 1, use_include_paths))
+			continue;
+
+		entry = arena_alloc(&rec->snapshot->arena, sizeof(*entry), MEMUSE_OTHER);
+		memset(entry, 0, sizeof(*entry));
+		entry->name = name;
+		if (file) {
+			entry->path = arena_copy(&rec->snapshot->arena, file->path, strlen(file->path) + 1, MEMUSE_OTHER);
+			entry->size = file->size;
+			buildcache_checksum(&entry->sum, file->body, file->size);
+		}
+		node->body = entry;
+	}
+}
+
+
+// macro has been defined (name is internal name, see macro.c)
+void snapshot_note_macro(const char *name, size_t name_size, const char *original_name, const char *parameters, size_t parameters_size, const char *body, size_t body_size, const char *def_filename, int def_line_number)
+{
+	struct recording	*rec;
+	struct rwnode		*node;
+	struct snapmacro	*entry;
+	struct arena		*arena;
+
+	for (rec = recording; rec; rec = rec->outer) {
+		arena = &rec->snapshot->arena;
+		if (!get_entry(&node, rec->snapshot->macros, name, name_size, 0)) {
+			rec->valid = FALSE;	// defined twice
+			continue;
+		}
+		entry = arena_alloc(arena, sizeof(*entry), MEMUSE_OTHER);
+		entry->original_name = arena_copy(arena, original_name, strlen(original_name) + 1, MEMUSE_OTHER);
+		entry->parameters = arena_copy(arena, parameters, parameters_size, MEMUSE_OTHER);
+		entry->parameters_size = parameters_size;
+		entry->body = arena_copy(arena, body, body_size, MEMUSE_OTHER);
+		entry->body_size = body_size;
+		entry->def_filename = def_filename;
+		entry->def_file = NULL;
+		entry->def_line_number = def_line_number;
+		node->body = entry;
+	}
+}
+
+
+// "!ifdef" has found an undefined symbol
+void snapshot_note_undefined_ifdef(void)
+{
+	struct recording	*rec;
+
+	for (rec = recording; rec; rec = rec->outer)
+		rec->snapshot->undefined_ifdef = TRUE;
+}
+
+
+// something happened that cannot be put in a snapshot
+void snapshot_invalidate(void)
+{
+	struct recording	*rec;
+
+	for (rec = recording; rec; rec = rec->outer)
+		rec->valid = FALSE;
+}
+
+
+// remember that library file has been handled in this build. returns FALSE
+// if it already was.
+static boolean mark_used(const char *path)
+{
+	struct rwnode	*node;
+
+	return get_entry(&node, used_table, path, strlen(path) + 1, 0);
+}
+
+
+// start recording what parsing the given library file does. returns FALSE
+// if snapshots are not wanted now (then snapshot_end() must not be called).
+boolean snapshot_begin(struct cached_file *file)
+{
+	struct recording	*rec;
+
+	if ((snapshot_dir == NULL) || !FIRST_PASS)
+		return FALSE;
+
+	// later inclusions usually just hit the "!ifdef" guard, so only the
+	// first one is worth keeping
+	if (!mark_used(file->path))
+		return FALSE;
+
+	rec = safe_malloc(sizeof(*rec), MEMUSE_OTHER);
+	rec->outer = recording;
+	rec->snapshot = new_snapshot();
+	rec->file = file;
+	rec->valid = TRUE;
+	output_get_state(&rec->out_entry);
+	section_get_state(&rec->section_entry);
+	rec->encoder = encoder_current;
+	rec->throws = Throw_get_counter();
+	rec->undefined_count = pass.undefined_count;
+	rec->needvalue_count = pass.needvalue_count;
+	rec->volatile_count = pass.volatile_count;
+	rec->file_count = flow_file_count();
+	rec->output_filename = part->output_filename;
+	rec->symbollist_filename = part->symbollist_filename;
+	rec->vicelabels_filename = part->vicelabels_filename;
+	recording = rec;
+	snapshot_recording = TRUE;
+	// the file itself is the first one the snapshot depends on
+	snapshot_note_file(file->name, FALSE, file);
+	return TRUE;
+}
+
+
+// check that nothing has changed but symbols and macros
+static boolean check_recording(struct recording *rec)
+{
+	struct output_state	out_exit;
+	struct section_state	section_exit;
+
+	if (!rec->valid)
+		return FALSE;
+
+	output_get_state(&out_exit);
+	section_get_state(&section_exit);
+	return output_state_equal(&rec->out_entry, &out_exit)
+		&& (out_exit.relocs_used == rec->out_entry.relocs_used)
+		&& (section_exit.section.local_scope == rec->section_entry.section.local_scope)
+		&& (section_exit.section.cheap_scope == rec->section_entry.section.cheap_scope)
+		&& (section_exit.section.type == rec->section_entry.section.type)
+		&& (section_exit.section.title == rec->section_entry.section.title)
+		&& (section_exit.local_scope_max == rec->section_entry.local_scope_max)
+		&& (section_exit.cheap_scope_max == rec->section_entry.cheap_scope_max)
+		&& (encoder_current == rec->encoder)
+		&& (Throw_get_counter() == rec->throws)
+		&& (pass.undefined_count == rec->undefined_count)
+		&& (pass.needvalue_count == rec->needvalue_count)
+		&& (part->output_filename == rec->output_filename)
+		&& (part->symbollist_filename == rec->symbollist_filename)
+		&& (part->vicelabels_filename == rec->vicelabels_filename);
+}
+
+
+// return entry of file with given name (the file cache's copy), or NULL if
+// the file was not read while recording
+static struct snapfile *find_file(struct snapshot *snapshot, const char *name)
+{
+	struct rwnode	*node;
+
+	for (node = snapshot->files->first; node; node = node->next) {
+		if (((struct snapfile *) node->body)->name == name)
+			return node->body;
+	}
+	return NULL;
+}
+
+
+// fill in the "after" parts of all symbol entries and find the files where
+// things were defined. returns FALSE if not possible.
+static boolean finish_snapshot(struct snapshot *snapshot)
+{
+	struct rwnode		*node;
+	struct snapsymbol	*entry;
+	struct snapmacro	*macro;
+	int			index	= 0;
+
+	for (node = snapshot->files->first; node; node = node->next)
+		((struct snapfile *) node->body)->index = index++;
+	for (node = snapshot->macros->first; node; node = node->next) {
+		macro = node->body;
+		macro->def_file = find_file(snapshot, macro->def_filename);
+		if (macro->def_file == NULL)
+			return FALSE;
+	}
+	for (node = snapshot->symbols->first; node; node = node->next) {
+		entry = node->body;
+		if (!get_value(&entry->after, entry->symbol))
+			return FALSE;
+
+		if (entry->symbol == NULL)
+			continue;
+
+		entry->read = entry->symbol->has_been_read;
+		if ((entry->symbol->def_filename == entry->def_filename)
+		&& (entry->symbol->def_line_number == entry->def_line_number))
+			continue;	// not defined by file
+
+		// definitions can only come from files that were parsed
+		entry->def_line_number = entry->symbol->def_line_number;
+		entry->def_file = find_file(snapshot, entry->symbol->def_filename);
+		if (entry->def_file == NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+// return entry for given library path in table of known snapshots
+static struct rwnode *known_entry(const char *path)
+{
+	struct rwnode	*node;
+
+	if (get_entry(&node, known_table, path, strlen(path) + 1, 0))
+		node->body = NULL;
+	return node;
+}
+
+
+// write value
+static void write_value(const struct snapvalue *value, FILE *fd)
+{
+	fprintf(fd, " %d %lx %ld %d", (int) value->state, (unsigned long) value->flags, (long) value->intval, value->addr_refs);
+}
+
+
+// write snapshot to disk
+static void write_snapshot(const struct snapshot *snapshot, const char *path)
+{
+	const struct rwnode	*node;
+	const struct snapfile	*file;
+	const struct snapsymbol	*symbol;
+	const struct snapmacro	*macro;
+	char			*temp_name;
+	FILE			*fd;
+	int			failed	= 0;
+
+	// write to temporary file first, so other builds never see half a snapshot
+	make_snapshot_name(path, temp_suffix);
+	temp_name = DynaBuf_get_copy(name_buf, MEMUSE_OTHER);
+	fd = fopen(temp_name, "wb");
+	if (fd == NULL) {
+		fprintf(stderr, "Warning: Cannot write library snapshot \"%s\".\n", temp_name);
+		safe_free_string(temp_name, MEMUSE_OTHER);
+		return;
+	}
+	fputs(snapshot_magic, fd);
+	fwrite(key_buf->buffer, 1, key_buf->size, fd);
+	fprintf(fd, "V%d %d %d\n", snapshot->volatile_delta, snapshot->file_count, snapshot->undefined_ifdef);
+	for (node = snapshot->files->first; node; node = node->next) {
+		file = node->body;
+		fprintf(fd, "F%d %d %lu %08lx %08lx\n", node->id_number, file->path != NULL, file->size, file->sum.a, file->sum.b);
+		fwrite(file->name, 1, strlen(file->name) + 1, fd);
+		if (file->path)
+			fwrite(file->path, 1, strlen(file->path), fd);
+		putc('\0', fd);
+	}
+	for (node = snapshot->symbols->first; node; node = node->next) {
+		symbol = node->body;
+		putc('S', fd);
+		write_value(&symbol->before, fd);
+		write_value(&symbol->after, fd);
+		fprintf(fd, " %d %d %d\n", symbol->read, symbol->def_file ? symbol->def_file->index : -1, symbol->def_line_number);
+		fwrite(node->id_string, 1, strlen(node->id_string) + 1, fd);
+	}
+	for (node = snapshot->macros->first; node; node = node->next) {
+		macro = node->body;
+		fprintf(fd, "M%d %d %lu %lu %lu\n", macro->def_file->index, macro->def_line_number, (unsigned long) strlen(node->id_string) + 1,
+			(unsigned long) macro->parameters_size, (unsigned long) macro->body_size);
+		fwrite(node->id_string, 1, strlen(node->id_string) + 1, fd);
+		fwrite(macro->original_name, 1, strlen(macro->original_name) + 1, fd);
+		fwrite(macro->parameters, 1, macro->parameters_size, fd);
+		fwrite(macro->body, 1, macro->body_size, fd);
+	}
+	putc('E', fd);
+	failed |= ferror(fd);
+	failed |= fclose(fd);
+	make_snapshot_name(path, "");
+	remove(name_buf->buffer);	// rename() may fail if target exists
+	if (failed || rename(temp_name, name_buf->buffer))
+		remove(temp_name);
+	safe_free_string(temp_name, MEMUSE_OTHER);
+}
+
+
+// stop recording and, if the file can be snapshotted, store the snapshot
+void snapshot_end(void)
+{
+	struct recording	*rec	= recording;
+	struct rwnode		*node;
+
+	if (rec == NULL)
+		Bug_found("SnapshotNotRecording", 0);
+	recording = rec->outer;
+	snapshot_recording = (recording != NULL);
+	rec->snapshot->volatile_delta = pass.volatile_count - rec->volatile_count;
+	rec->snapshot->file_count = flow_file_count() - rec->file_count;
+	if (check_recording(rec) && finish_snapshot(rec->snapshot)) {
+		if (config.process_verbosity > 2)
+			printf("Writing snapshot of library file '%s'\n", rec->file->name);
+		make_key();
+		write_snapshot(rec->snapshot, rec->file->path);
+		node = known_entry(rec->file->path);
+		free_snapshot(node->body);
+		node->body = rec->snapshot;
+	} else {
+		free_snapshot(rec->snapshot);
+	}
+	safe_free(rec, sizeof(*rec), MEMUSE_OTHER);
+}
+
+
+// stop all recordings and forget which files have been handled (for
+// "--batch", or after an aborted build)
+void snapshot_clear(void)
+{
+	struct recording	*rec;
+
+	while ((rec = recording)) {
+		recording = rec->outer;
+		free_snapshot(rec->snapshot);
+		safe_free(rec, sizeof(*rec), MEMUSE_OTHER);
+	}
+	snapshot_recording = FALSE;
+	Tree_clear(used_table, NULL);
+	arena_free(&used_arena);
+}
+
+
+// reading:
+
+// read zero-terminated string from snapshot file into data_buf.
+// returns nonzero on error.
+static int read_string(FILE *fd)
+{
+	int	byte;
+
+	DYNABUF_CLEAR(data_buf);
+	for (;;) {
+		byte = getc(fd);
+		if (byte == EOF)
+			return 1;	// error
+
+		DYNABUF_APPEND(data_buf, (char) byte);
+		if (byte == '\0')
+			return 0;	// ok
+	}
+}
+
+
+// read given number of bytes into data_buf. returns nonzero on error.
+static int read_block(size_t size, FILE *fd)
+{
+	DYNABUF_CLEAR(data_buf);
+	if (fread(DynaBuf_reserve(data_buf, size), 1, size, fd) != size)
+		return 1;
+
+	data_buf->size = size;
+	return 0;
+}
+
+
+// read given number of bytes into arena copy. returns NULL on error.
+static char *read_copy(struct snapshot *snapshot, size_t size, FILE *fd)
+{
+	if (read_block(size, fd))
+		return NULL;
+
+	return arena_copy(&snapshot->arena, data_buf->buffer, size, MEMUSE_OTHER);
+}
+
+
+// read value. returns nonzero on error.
+static int read_value(struct snapvalue *value, FILE *fd)
+{
+	int		state;
+	unsigned long	flags;
+	long		intval;
+
+	if (fscanf(fd, " %d %lx %ld %d", &state, &flags, &intval, &value->addr_refs) != 4)
+		return 1;
+
+	value->state = (enum snapstate) state;
+	value->flags = flags;
+	value->intval = intval;
+	return 0;
+}
+
+
+// read snapshot file. returns NULL if there is none (or it is broken or
+// was made with different options).
+static struct snapshot *read_snapshot(const char *path)
+{
+	struct snapshot		*snapshot;
+	struct snapfile		**files	= NULL;
+	struct snapfile		*file;
+	struct snapsymbol	*symbol;
+	struct snapmacro	*macro;
+	struct rwnode		*node;
+	char			*name;
+	int			files_used	= 0,
+				type,
+				use_include_paths,
+				found,
+				number,
+				index;
+	unsigned long		name_size,
+				parameters_size,
+				body_size;
+	FILE			*fd;
+	boolean			done	= FALSE;
+
+	make_snapshot_name(path, "");
+	fd = fopen(name_buf->buffer, "rb");
+	if (fd == NULL)
+		return NULL;
+
+	snapshot = new_snapshot();
+	make_key();
+	// check header and options
+	if (read_block(strlen(snapshot_magic), fd)
+	|| memcmp(data_buf->buffer, snapshot_magic, data_buf->size)
+	|| read_block(key_buf->size, fd)
+	|| memcmp(data_buf->buffer, key_buf->buffer, data_buf->size)
+	|| (fscanf(fd, "V%d %d %d\n", &snapshot->volatile_delta, &snapshot->file_count, &number) != 3))
+		goto out;
+
+	snapshot->undefined_ifdef = number;
+	for (;;) {
+		type = getc(fd);
+		if (type == 'F') {
+			file = arena_alloc(&snapshot->arena, sizeof(*file), MEMUSE_OTHER);
+			memset(file, 0, sizeof(*file));
+			if ((fscanf(fd, "%d %d %lu %lx %lx", &use_include_paths, &found, &file->size, &file->sum.a, &file->sum.b) != 5)
+			|| (getc(fd) != '\n')
+			|| read_string(fd))
+				goto out;
+
+			get_entry(&node, snapshot->files, data_buf->buffer, data_buf->size, use_include_paths);
+			file->name = node->id_string;
+			if (read_string(fd))
+				goto out;
+
+			if (found)
+				file->path = arena_copy(&snapshot->arena, data_buf->buffer, data_buf->size, MEMUSE_OTHER);
+			node->body = file;
+			files = safe_realloc(files, files_used * sizeof(*files), (files_used + 1) * sizeof(*files), MEMUSE_OTHER);
+			files[files_used++] = file;
+		} else if (type == 'S') {
+			symbol = arena_alloc(&snapshot->arena, sizeof(*symbol), MEMUSE_OTHER);
+			memset(symbol, 0, sizeof(*symbol));
+			if (read_value(&symbol->before, fd)
+			|| read_value(&symbol->after, fd)
+			|| (fscanf(fd, " %d %d %d", &number, &index, &symbol->def_line_number) != 3)
+			|| (getc(fd) != '\n')
+			|| (index >= files_used)
+			|| read_string(fd))
+				goto out;
+
+			symbol->read = number;
+			if (index >= 0)
+				symbol->def_file = files[index];
+			get_entry(&node, snapshot->symbols, data_buf->buffer, data_buf->size, 0);
+			node->body = symbol;
+		} else if (type == 'M') {
+			macro = arena_alloc(&snapshot->arena, sizeof(*macro), MEMUSE_OTHER);
+			if ((fscanf(fd, "%d %d %lu %lu %lu", &index, &macro->def_line_number, &name_size, &parameters_size, &body_size) != 5)
+			|| (getc(fd) != '\n')
+			|| (index < 0)
+			|| (index >= files_used)
+			|| ((name = read_copy(snapshot, name_size, fd)) == NULL)
+			|| read_string(fd))
+				goto out;
+
+			macro->def_file = files[index];
+			macro->original_name = arena_copy(&snapshot->arena, data_buf->buffer, data_buf->size, MEMUSE_OTHER);
+			macro->parameters_size = parameters_size;
+			macro->body_size = body_size;
+			if (((macro->parameters = read_copy(snapshot, parameters_size, fd)) == NULL)
+			|| ((macro->body = read_copy(snapshot, body_size, fd)) == NULL))
+				goto out;
+
+			get_entry(&node, snapshot->macros, name, name_size, 0);
+			node->body = macro;
+		} else {
+			done = (type == 'E') && files_used;
+			goto out;
+		}
+	}
+out:
+	fclose(fd);
+	safe_free(files, files_used * sizeof(*files), MEMUSE_OTHER);
+	if (done)
+		return snapshot;
+
+	free_snapshot(snapshot);
+	return NULL;
+}
+
+
+// applying:
+
+// check that all files a snapshot depends on still have the same contents
+static boolean check_files(struct snapshot *snapshot)
+{
+	struct rwnode		*node;
+	struct snapfile		*entry;
+	struct checksum		sum;
+
+	for (node = snapshot->files->first; node; node = node->next) {
+		entry = node->body;
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		DynaBuf_add_string(GlobalDynaBuf, entry->name);
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		entry->current = filecache_get(node->id_number != 0);
+		if (entry->path == NULL) {
+			if (entry->current)
+				return FALSE;	// file must still be missing
+
+			continue;
+		}
+		if ((entry->current == NULL)
+		|| strcmp(entry->current->path, entry->path)
+		|| (entry->current->size != entry->size))
+			return FALSE;
+
+		buildcache_checksum(&sum, entry->current->body, entry->current->size);
+		if ((sum.a != entry->sum.a) || (sum.b != entry->sum.b))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+// look up global symbol with name of given entry. returns NULL if it does not
+// exist and "create" is FALSE.
+static struct symbol *find_symbol(const struct rwnode *entry_node, boolean create)
+{
+	struct rwname	name;
+	struct rwnode	*node;
+
+	Tree_make_name(&name, entry_node->id_string, strlen(entry_node->id_string) + 1);
+	if (create)
+		return symbol_find_name(&name, SCOPE_GLOBAL);	// (notes symbol if recording)
+
+	Tree_hard_scan_name(&node, part->symbols, &name, SCOPE_GLOBAL, FALSE);
+	return node ? node->body : NULL;
+}
+
+
+// check that symbols are in the state they were in when the snapshot was
+// recorded, and that none of the macros exist yet
+static boolean check_state(struct snapshot *snapshot)
+{
+	struct rwnode		*node;
+	struct snapvalue	value;
+
+	for (node = snapshot->symbols->first; node; node = node->next) {
+		if ((!get_value(&value, find_symbol(node, FALSE)))
+		|| (!values_equal(&value, &((struct snapsymbol *) node->body)->before)))
+			return FALSE;
+	}
+	for (node = snapshot->macros->first; node; node = node->next) {
+		if (Macro_exists(node->id_string, strlen(node->id_string) + 1))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+// if there is an up-to-date snapshot of the given library file, apply it
+// instead of parsing the file and return TRUE.
+boolean snapshot_apply(struct cached_file *file)
+{
+	struct rwnode		*known,
+				*node;
+	struct snapshot		*snapshot;
+	struct snapsymbol	*entry;
+	struct snapmacro	*macro;
+	struct symbol		*symbol;
+
+	// listings need the real thing
+	if ((snapshot_dir == NULL) || !FIRST_PASS || report->active)
+		return FALSE;
+
+	// load from disk if not done yet
+	known = known_entry(file->path);
+	if (known->body == NULL)
+		known->body = read_snapshot(file->path);
+	snapshot = known->body;
+	if ((snapshot == NULL)
+	|| !check_files(snapshot)
+	|| !check_state(snapshot))
+		return FALSE;
+
+	mark_used(file->path);
+	// be verbose
+	if (config.process_verbosity > 2)
+		printf("Using snapshot of library file '%s'\n", file->name);
+	for (node = snapshot->symbols->first; node; node = node->next) {
+		entry = node->body;
+		if (entry->after.state == SNAPSTATE_NONE) {
+			if (snapshot_recording)
+				snapshot_note_symbol(node->id_string, strlen(node->id_string) + 1, SCOPE_GLOBAL, find_symbol(node, FALSE));
+			continue;
+		}
+		symbol = find_symbol(node, TRUE);
+		symbol->object.type = &type_number;
+		symbol->object.u.number.ntype = (entry->after.state == SNAPSTATE_INT) ? NUMTYPE_INT : NUMTYPE_UNDEFINED;
+		symbol->object.u.number.flags = entry->after.flags;
+		symbol->object.u.number.val.intval = entry->after.intval;
+		symbol->object.u.number.addr_refs = entry->after.addr_refs;
+		if (entry->read)
+			symbol->has_been_read = TRUE;
+		if (entry->def_file) {
+			symbol->def_filename = entry->def_file->current->name;
+			symbol->def_line_number = entry->def_line_number;
+		}
+	}
+	for (node = snapshot->macros->first; node; node = node->next) {
+		macro = node->body;
+		Macro_define(node->id_string, strlen(node->id_string) + 1, macro->original_name,
+			macro->parameters, macro->parameters_size, macro->body, macro->body_size,
+			macro->def_file->current->name, macro->def_line_number);
+		if (snapshot_recording)
+			snapshot_note_macro(node->id_string, strlen(node->id_string) + 1, macro->original_name,
+				macro->parameters, macro->parameters_size, macro->body, macro->body_size,
+				macro->def_file->current->name, macro->def_line_number);
+	}
+	pass.volatile_count += snapshot->volatile_delta;
+	// keep replay table in step with the files the snapshot stands for
+	flow_skip_files(snapshot->file_count);
+	if (snapshot->undefined_ifdef) {
+		flow_undefined_ifdef();
+		if (snapshot_recording)
+			snapshot_note_undefined_ifdef();
+	}
+	return TRUE;
+}
@@ -0,0 +1,48 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// library snapshots ("--snapshot-dir")
+#ifndef snapshot_H
+#define snapshot_H
+
+
+#include <stdlib.h>	// for size_t
+#include "config.h"
+
+
+// variables
+extern const char	*snapshot_dir;	// NULL means "do not use snapshots"
+extern boolean		snapshot_recording;	// TRUE while a library file is parsed for a snapshot
+
+
+// prototypes
+
+// if there is an up-to-date snapshot of the given library file, apply it
+// instead of parsing the file and return TRUE.
+struct cached_file;
+extern boolean snapshot_apply(struct cached_file *file);
+// start recording what parsing the given library file does. returns FALSE
+// if snapshots are not wanted now (then snapshot_end() must not be called).
+extern boolean snapshot_begin(struct cached_file *file);
+// stop recording and, if the file can be snapshotted, store the snapshot
+extern void snapshot_end(void);
+// these are called while recording (check snapshot_recording first):
+// symbol is about to be used or defined ("symbol" is NULL if not found).
+// the name must be zero-terminated, the size includes the terminator.
+struct symbol;
+extern void snapshot_note_symbol(const char *name, size_t size, scope_t scope, const struct symbol *symbol);
+// file cache entry was looked up ("file" is NULL if not found)
+extern void snapshot_note_file(const char *name, boolean use_include_paths, const struct cached_file *file);
+// macro has been defined (name is internal name, see macro.c)
+extern void snapshot_note_macro(const char *name, size_t name_size, const char *original_name, const char *parameters, size_t parameters_size, const char *body, size_t body_size, const char *def_filename, int def_line_number);
+// "!ifdef" has found an undefined symbol
+extern void snapshot_note_undefined_ifdef(void);
+// something happened that cannot be put in a snapshot
+extern void snapshot_invalidate(void);
+// stop all recordings and forget which files have been handled (for
+// "--batch", or after an aborted build)
+extern void snapshot_clear(void);
+
+
+#endif
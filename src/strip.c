@@ -0,0 +1,146 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// dead-stripping ("--dead-strip" and "!strippable")
+//
+// Each "!strippable" block assembled in a pass gets a record, in the order
+// the blocks are reached. Symbols remember the block they were defined in,
+// and reading such a symbol from outside of its block marks the block as
+// used. Once the passes have converged, unused blocks are removed and more
+// passes are done, because the following code moves and other blocks may
+// have been used only by the removed ones. If a later pass still reads a
+// symbol of a removed block (for example, because of "!ifdef"), the block
+// is put back and is never removed again, so the passes are sure to end.
+#include "strip.h"
+#include <stdio.h>
+#include "global.h"
+
+
+// block states
+enum strip_state {
+	STRIP_ASSEMBLED,	// assembled (may be removed later)
+	STRIP_REMOVED,		// removed because nothing used it
+	STRIP_KEPT		// assembled for good (had to be put back)
+};
+struct strip_block {
+	enum strip_state	state;
+	int			parent;	// number of outer block (0 if none)
+	int			nested;	// number of blocks inside (so they can be skipped, too)
+	boolean			active;	// TRUE while being assembled
+	boolean			used;	// TRUE if a symbol was read from outside in this pass
+};
+
+
+// variables
+int				strip_block_now	= 0;
+static struct strip_block	*blocks		= NULL;	// index is number - 1
+static int			blocks_used	= 0;
+static int			blocks_size	= 0;
+static int			next_block;	// index of next block in current pass
+
+
+// set up for new pass
+void strip_passinit(void)
+{
+	int	ii;
+
+	// the records of the previous build must not be used
+	if (FIRST_PASS)
+		blocks_used = 0;
+	for (ii = 0; ii < blocks_used; ++ii) {
+		blocks[ii].active = FALSE;
+		blocks[ii].used = FALSE;
+	}
+	next_block = 0;
+	strip_block_now = 0;
+}
+
+
+// "!strippable" block starts. returns FALSE if it has been removed, then the
+// caller must skip it (and not call strip_end()).
+boolean strip_begin(void)
+{
+	struct strip_block	*block;
+
+	if (next_block == blocks_used) {
+		if (blocks_used == blocks_size) {
+			blocks = safe_realloc(blocks, blocks_size * sizeof(*blocks), (blocks_size ? 2 * blocks_size : 64) * sizeof(*blocks), MEMUSE_OTHER);
+			blocks_size = blocks_size ? 2 * blocks_size : 64;
+		}
+		block = &blocks[blocks_used++];
+		block->state = STRIP_ASSEMBLED;
+		block->nested = 0;
+		block->used = FALSE;
+	}
+	block = &blocks[next_block++];
+	if (block->state == STRIP_REMOVED) {
+		next_block += block->nested;	// those are not reached now
+		return FALSE;
+	}
+
+	block->parent = strip_block_now;
+	block->active = TRUE;
+	strip_block_now = next_block;	// this is the number of the block
+	return TRUE;
+}
+
+
+// "!strippable" block has ended
+void strip_end(void)
+{
+	struct strip_block	*block	= &blocks[strip_block_now - 1];
+
+	block->nested = next_block - strip_block_now;
+	block->active = FALSE;
+	strip_block_now = block->parent;
+}
+
+
+// symbol defined in given "!strippable" block has been read
+void strip_note_read(int number)
+{
+	struct strip_block	*block;
+
+	// reading from inside the block does not count, and if the block is
+	// nested in others, the ones around it are used as well.
+	for (; number && (number <= blocks_used); number = block->parent) {
+		block = &blocks[number - 1];
+		if (block->active)
+			break;
+
+		block->used = TRUE;
+		if (block->state == STRIP_REMOVED) {
+			block->state = STRIP_KEPT;
+			++pass.relaxed_count;	// the layout changes, so another pass is needed
+		}
+	}
+}
+
+
+// return whether given block has been removed (number 0 means "no block")
+boolean strip_is_removed(int number)
+{
+	return number && (number <= blocks_used) && (blocks[number - 1].state == STRIP_REMOVED);
+}
+
+
+// call when the passes have converged: remove all blocks whose symbols were
+// not used from outside, and return whether there were any (then another
+// pass is needed).
+boolean strip_unused(void)
+{
+	int	ii,
+		removed	= 0;
+
+	for (ii = 0; ii < blocks_used; ++ii) {
+		if ((blocks[ii].state == STRIP_ASSEMBLED) && !blocks[ii].used) {
+			blocks[ii].state = STRIP_REMOVED;
+			++removed;
+		}
+	}
+	if (removed && config.show_stats)
+		printf("Dead-stripping: %d blocks removed.\n", removed);
+	return removed != 0;
+}
+
@@ -0,0 +1,36 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// dead-stripping ("--dead-strip" and "!strippable")
+#ifndef strip_H
+#define strip_H
+
+
+#include "config.h"
+
+
+// variables
+extern int	strip_block_now;	// number of innermost "!strippable" block being assembled (0 if none)
+
+
+// prototypes
+
+// set up for new pass
+extern void strip_passinit(void);
+// "!strippable" block starts. returns FALSE if it has been removed, then the
+// caller must skip it (and not call strip_end()).
+extern boolean strip_begin(void);
+// "!strippable" block has ended
+extern void strip_end(void);
+// symbol defined in given "!strippable" block has been read
+extern void strip_note_read(int number);
+// return whether given block has been removed (number 0 means "no block")
+extern boolean strip_is_removed(int number);
+// call when the passes have converged: remove all blocks whose symbols were
+// not used from outside, and return whether there were any (then another
+// pass is needed).
+extern boolean strip_unused(void);
+
+
+#endif
@@ -9,6 +9,8 @@
 // 23 Nov 2014	Added label output in VICE format
 #include "symbol.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "acme.h"
 #include "alu.h"
 #include "dynabuf.h"
@@ -17,121 +19,530 @@
 #include "output.h"
 #include "platform.h"
 #include "section.h"
+#include "snapshot.h"
+#include "strip.h"
 #include "tree.h"
 #include "typesystem.h"
 
 
-// variables
-struct rwnode	*symbols_forest[256]	= { NULL };	// because of 8-bit hash - must be (at least partially) pre-defined so array will be zeroed!
+// symbol export: global numbers are collected into an array (sorted if
+// wanted), then the output is built in a buffer that is written in large
+// chunks, instead of calling fprintf() several times for each symbol.
+#define DUMP_FLUSH_SIZE	65536	// write buffer when it gets this large
+static	STRUCT_DYNABUF_REF(dump_buf, DUMP_FLUSH_SIZE + 1024);
+static FILE		*dump_fd;
+static const char	hexdigits[]	= "0123456789abcdef";
+int			symbol_definitions	= 0;	// counts calls of symbol_set_object()
+
+// anonymous labels are not put in the symbol table, because that would mean
+// building a unique name for each forward label. instead, each local scope has
+// an array indexed by the number of '+' or '-' characters, and forward labels
+// are indexed by the number of definitions before them in the current pass.
+struct anon_depth {
+	struct symbol	*backward;	// "-", "--", ...
+	struct symbol	**forward;	// "+", "++", ... in order of definition
+	int		forward_size;	// number of entries allocated
+	int		next_forward;	// index of next definition...
+	int		pass;		// ...in this pass
+};
+struct anon_scope {
+	struct anon_depth	*depths;	// index is number of characters - 1
+	int			size;
+};
+struct anon_label {
+	struct symbol	*symbol;
+	int		depth;
+	boolean		forward;
+};
+static struct anon_scope	*anon_scopes		= NULL;	// index is local scope
+static scope_t			anon_scopes_size	= 0;
+static struct anon_label	*anon_list		= NULL;	// all anons in order of creation
+static size_t			anon_list_used		= 0;
+static size_t			anon_list_size		= 0;
+
+// local parameters of macro calls are not put in the symbol table, because
+// each call has new scopes, so the table would fill up with dead entries.
+// instead, each call depth has a frame of slots, which is re-used by the next
+// call at that depth. only the innermost frame has to be searched, because
+// the scopes of outer calls cannot be reached from inside a macro body.
+struct param_slot {
+	const struct rwname	*name;	// (belongs to macro definition)
+	scope_t			scope;
+	struct symbol		*reference;	// caller's symbol, NULL for call by value
+	struct symbol		own;	// value (call by value)
+};
+struct param_frame {
+	struct param_slot	*slots;
+	int			used,
+				size;
+	scope_t			local_scope,
+				cheap_scope;
+};
+static struct param_frame	*frames		= NULL;	// index is call depth
+static int			frames_used	= 0;
+static int			frames_size	= 0;
+
+
+// write buffer contents to file
+static void dump_flush(void)
+{
+	fwrite(dump_buf->buffer, 1, dump_buf->size, dump_fd);
+	dump_buf->size = 0;
+}
 
 
-// Dump symbol value and flags to dump file
-static void dump_one_symbol(struct rwnode *node, FILE *fd)
+// start writing to given file
+static void dump_begin(FILE *fd)
 {
-	struct symbol	*symbol	= node->body;
+	dump_fd = fd;
+	DYNABUF_CLEAR(dump_buf);
+}
 
-	// if symbol is neither int nor float, skip
-	if (symbol->object.type != &type_number)
-		return;
 
-	// CAUTION: if more types are added, check for NULL before using type pointer!
+// write buffer if it is large enough (call after each symbol)
+static void dump_check(void)
+{
+	if (dump_buf->size >= DUMP_FLUSH_SIZE)
+		dump_flush();
+}
+
+
+// add hex number with at least the given number of digits (without "$")
+static void dump_hex(unsigned long value, int min_digits)
+{
+	char	digits[2 * sizeof(value)];
+	int	used	= 0;
+
+	do {
+		digits[used++] = hexdigits[value & 15];
+		value >>= 4;
+	} while (value || (used < min_digits));
+	while (used)
+		DYNABUF_APPEND(dump_buf, digits[--used]);
+}
+
+
+// add decimal number
+static void dump_decimal(intval_t value)
+{
+	char		digits[3 * sizeof(value) + 1];
+	int		used	= 0;
+	uintval_t	magnitude	= value;
+
+	if (value < 0) {
+		DYNABUF_APPEND(dump_buf, '-');
+		magnitude = -magnitude;
+	}
+	do {
+		digits[used++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude);
+	while (used)
+		DYNABUF_APPEND(dump_buf, digits[--used]);
+}
+
+
+// add little-endian value with given number of bytes
+static void dump_le(uintval_t value, int bytes)
+{
+	while (bytes--) {
+		DYNABUF_APPEND(dump_buf, value & 255);
+		value >>= 8;
+	}
+}
+
+
+// add string in double quotes, escaped for JSON
+static void dump_json_string(const char *string)
+{
+	unsigned char	byte;
+
+	DYNABUF_APPEND(dump_buf, '"');
+	while ((byte = *string++)) {
+		if ((byte == '"') || (byte == '\\')) {
+			DYNABUF_APPEND(dump_buf, '\\');
+			DYNABUF_APPEND(dump_buf, byte);
+		} else if (byte < 32) {
+			DynaBuf_add_string(dump_buf, "\\u");
+			dump_hex(byte, 4);
+		} else {
+			DYNABUF_APPEND(dump_buf, byte);
+		}
+	}
+	DYNABUF_APPEND(dump_buf, '"');
+}
+
+
+// sort by name
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp((*(const struct rwnode *const *) a)->id_string, (*(const struct rwnode *const *) b)->id_string);
+}
+
+
+// sort by value (undefined ones last), then by name
+static int compare_values(const void *a, const void *b)
+{
+	const struct rwnode	*node_a	= *(const struct rwnode *const *) a,
+				*node_b	= *(const struct rwnode *const *) b;
+	const struct number	*num_a	= &((struct symbol *) node_a->body)->object.u.number,
+				*num_b	= &((struct symbol *) node_b->body)->object.u.number;
+	double			value_a,
+				value_b;
+
+	if ((num_a->ntype == NUMTYPE_UNDEFINED) != (num_b->ntype == NUMTYPE_UNDEFINED))
+		return (num_a->ntype == NUMTYPE_UNDEFINED) ? 1 : -1;
+
+	if (num_a->ntype != NUMTYPE_UNDEFINED) {
+		if ((num_a->ntype == NUMTYPE_INT) && (num_b->ntype == NUMTYPE_INT)) {
+			if (num_a->val.intval != num_b->val.intval)
+				return (num_a->val.intval < num_b->val.intval) ? -1 : 1;
+		} else {
+			value_a = (num_a->ntype == NUMTYPE_INT) ? num_a->val.intval : num_a->val.fpval;
+			value_b = (num_b->ntype == NUMTYPE_INT) ? num_b->val.intval : num_b->val.fpval;
+			if (value_a != value_b)
+				return (value_a < value_b) ? -1 : 1;
+		}
+	}
+	return strcmp(node_a->id_string, node_b->id_string);
+}
+
+
+// collect global number symbols into array (sorted as wanted). caller must
+// free the array.
+static struct rwnode **collect_symbols(size_t *count)
+{
+	struct rwnode	*node,
+			**array;
+	size_t		used	= 0;
+
+	array = safe_malloc((part->symbols->used + 1) * sizeof(*array), MEMUSE_OTHER);
+	for (node = part->symbols->first; node; node = node->next) {
+		// CAUTION: if more types are added, check for NULL before using type pointer!
+		// (symbols of blocks removed by "--dead-strip" are left out)
+		if ((((struct symbol *) node->body)->object.type == &type_number)
+		&& !strip_is_removed(((struct symbol *) node->body)->strip_block))
+			array[used++] = node;
+	}
+	if (config.symbol_order == SYMBOLORDER_NAME)
+		qsort(array, used, sizeof(*array), compare_names);
+	else if (config.symbol_order == SYMBOLORDER_ADDRESS)
+		qsort(array, used, sizeof(*array), compare_values);
+	*count = used;
+	return array;
+}
+
+// free array returned by collect_symbols()
+static void forget_collected(struct rwnode **array)
+{
+	safe_free(array, (part->symbols->used + 1) * sizeof(*array), MEMUSE_OTHER);
+}
+
+
+// add symbol value and flags in ACME format
+static void dump_one_symbol(const struct rwnode *node)
+{
+	const struct symbol	*symbol	= node->body;
+	char			fpbuf[64];
 
 	// output name
 	if (config.warn_on_type_mismatch
 	&& symbol->object.u.number.addr_refs == 1)
-		fprintf(fd, "!addr");
-	fprintf(fd, "\t%s", node->id_string);
+		DynaBuf_add_string(dump_buf, "!addr");
+	DYNABUF_APPEND(dump_buf, '\t');
+	DynaBuf_add_string(dump_buf, node->id_string);
 	switch (symbol->object.u.number.flags & NUMBER_FORCEBITS) {
 	case NUMBER_FORCES_16:
-		fprintf(fd, "+2\t= ");
+		DynaBuf_add_string(dump_buf, "+2\t= ");
 		break;
 	case NUMBER_FORCES_16 | NUMBER_FORCES_24:
 		/*FALLTHROUGH*/
 	case NUMBER_FORCES_24:
-		fprintf(fd, "+3\t= ");
+		DynaBuf_add_string(dump_buf, "+3\t= ");
 		break;
 	default:
-		fprintf(fd, "\t= ");
+		DynaBuf_add_string(dump_buf, "\t= ");
 	}
-	if (symbol->object.u.number.ntype == NUMTYPE_UNDEFINED)
-		fprintf(fd, " ?");	// TODO - maybe write "UNDEFINED" instead? then the file could at least be parsed without errors
-	else if (symbol->object.u.number.ntype == NUMTYPE_INT)
-		fprintf(fd, "$%x", (unsigned) symbol->object.u.number.val.intval);
-	else if (symbol->object.u.number.ntype == NUMTYPE_FLOAT)
-		fprintf(fd, "%.30f", symbol->object.u.number.val.fpval);	//FIXME %g
-	else
+	if (symbol->object.u.number.ntype == NUMTYPE_UNDEFINED) {
+		DynaBuf_add_string(dump_buf, " ?");	// TODO - maybe write "UNDEFINED" instead? then the file could at least be parsed without errors
+	} else if (symbol->object.u.number.ntype == NUMTYPE_INT) {
+		DYNABUF_APPEND(dump_buf, '$');
+		dump_hex((unsigned) symbol->object.u.number.val.intval, 1);
+	} else if (symbol->object.u.number.ntype == NUMTYPE_FLOAT) {
+		sprintf(fpbuf, "%.30f", symbol->object.u.number.val.fpval);	//FIXME %g
+		DynaBuf_add_string(dump_buf, fpbuf);
+	} else {
 		Bug_found("IllegalNumberType4", symbol->object.u.number.ntype);
+	}
 	if (symbol->object.u.number.flags & NUMBER_EVER_UNDEFINED)
-		fprintf(fd, "\t; ?");	// TODO - write "forward" instead?
+		DynaBuf_add_string(dump_buf, "\t; ?");	// TODO - write "forward" instead?
 	if (!symbol->has_been_read)
-		fprintf(fd, "\t; unused");
-	fprintf(fd, "\n");
+		DynaBuf_add_string(dump_buf, "\t; unused");
+	DYNABUF_APPEND(dump_buf, '\n');
 }
 
 
-// output symbols in VICE format (example: "al C:09ae .nmi1")
-static void dump_vice_address(struct rwnode *node, FILE *fd)
+// add symbol as JSON object
+static void dump_json_symbol(const struct rwnode *node, boolean last)
 {
-	struct symbol	*symbol	= node->body;
+	const struct symbol	*symbol	= node->body;
+	char			fpbuf[64];
+
+	DynaBuf_add_string(dump_buf, "{\"name\": ");
+	dump_json_string(node->id_string);
+	if (symbol->object.u.number.ntype == NUMTYPE_INT) {
+		DynaBuf_add_string(dump_buf, ", \"type\": \"int\", \"value\": ");
+		dump_decimal(symbol->object.u.number.val.intval);
+	} else if (symbol->object.u.number.ntype == NUMTYPE_FLOAT) {
+		sprintf(fpbuf, "%.17g", symbol->object.u.number.val.fpval);
+		DynaBuf_add_string(dump_buf, ", \"type\": \"float\", \"value\": ");
+		DynaBuf_add_string(dump_buf, fpbuf);
+	} else {
+		DynaBuf_add_string(dump_buf, ", \"type\": \"undefined\", \"value\": null");
+	}
+	DynaBuf_add_string(dump_buf, (symbol->object.u.number.addr_refs == 1) ? ", \"address\": true" : ", \"address\": false");
+	switch (symbol->object.u.number.flags & NUMBER_FORCEBITS) {
+	case NUMBER_FORCES_8:
+		DynaBuf_add_string(dump_buf, ", \"force\": 1");
+		break;
+	case NUMBER_FORCES_16:
+		DynaBuf_add_string(dump_buf, ", \"force\": 2");
+		break;
+	case 0:
+		DynaBuf_add_string(dump_buf, ", \"force\": 0");
+		break;
+	default:
+		DynaBuf_add_string(dump_buf, ", \"force\": 3");
+	}
+	DynaBuf_add_string(dump_buf, symbol->has_been_read ? ", \"used\": true" : ", \"used\": false");
+	DynaBuf_add_string(dump_buf, (symbol->object.u.number.flags & NUMBER_EVER_UNDEFINED) ? ", \"unsure\": true" : ", \"unsure\": false");
+	if (symbol->def_filename) {
+		DynaBuf_add_string(dump_buf, ", \"file\": ");
+		dump_json_string(symbol->def_filename);
+		DynaBuf_add_string(dump_buf, ", \"line\": ");
+		dump_decimal(symbol->def_line_number);
+	}
+	DynaBuf_add_string(dump_buf, last ? "}\n" : "},\n");
+}
 
-	// dump address symbols even if they are not used
-	if ((symbol->object.type == &type_number)
-	&& (symbol->object.u.number.ntype == NUMTYPE_INT)
-	&& (symbol->object.u.number.addr_refs == 1))
-		fprintf(fd, "al C:%04x .%s\n", (unsigned) symbol->object.u.number.val.intval, node->id_string);
+
+// binary format: flag bits
+#define SYMBIN_ADDRESS	(1u << 0)
+#define SYMBIN_USED	(1u << 1)
+#define SYMBIN_UNSURE	(1u << 2)
+#define SYMBIN_FORCE16	(1u << 3)
+#define SYMBIN_FORCE24	(1u << 4)
+// add symbol in binary format (only for defined integers)
+static void dump_binary_symbol(const struct rwnode *node)
+{
+	const struct symbol	*symbol	= node->body;
+	size_t			length	= strlen(node->id_string);
+	bits			flags	= 0;
+
+	if (symbol->object.u.number.addr_refs == 1)
+		flags |= SYMBIN_ADDRESS;
+	if (symbol->has_been_read)
+		flags |= SYMBIN_USED;
+	if (symbol->object.u.number.flags & NUMBER_EVER_UNDEFINED)
+		flags |= SYMBIN_UNSURE;
+	if (symbol->object.u.number.flags & NUMBER_FORCES_24)
+		flags |= SYMBIN_FORCE24;
+	else if (symbol->object.u.number.flags & NUMBER_FORCES_16)
+		flags |= SYMBIN_FORCE16;
+	dump_le(symbol->object.u.number.val.intval, 4);
+	dump_le(flags, 1);
+	dump_le(length, 2);
+	DynaBuf_add_span(dump_buf, node->id_string, length);
 }
-static void dump_vice_usednonaddress(struct rwnode *node, FILE *fd)
+
+
+// output address symbols as exported globals of o65 file
+static int		o65_count;	// number of exports
+static intval_t		o65_start,	// text segment
+			o65_end;
+static boolean is_o65_export(struct rwnode *node)
 {
 	struct symbol	*symbol	= node->body;
 
-	// dump non-addresses that are used
-	if (symbol->has_been_read
-	&& (symbol->object.type == &type_number)
-	&& (symbol->object.u.number.ntype == NUMTYPE_INT)
-	&& (symbol->object.u.number.addr_refs != 1))
-		fprintf(fd, "al C:%04x .%s\n", (unsigned) symbol->object.u.number.val.intval, node->id_string);
+	return (symbol->object.type == &type_number)
+		&& (symbol->object.u.number.ntype == NUMTYPE_INT)
+		&& (symbol->object.u.number.addr_refs == 1);
+}
+static void count_o65_export(struct rwnode *node, FILE *fd)
+{
+	if (is_o65_export(node))
+		++o65_count;
 }
-static void dump_vice_unusednonaddress(struct rwnode *node, FILE *fd)
+static void dump_o65_export(struct rwnode *node, FILE *fd)
 {
 	struct symbol	*symbol	= node->body;
+	intval_t	value;
 
-	// dump non-addresses that are unused
-	if (!symbol->has_been_read
-	&& (symbol->object.type == &type_number)
-	&& (symbol->object.u.number.ntype == NUMTYPE_INT)
-	&& (symbol->object.u.number.addr_refs != 1))
-		fprintf(fd, "al C:%04x .%s\n", (unsigned) symbol->object.u.number.val.intval, node->id_string);
+	if (!is_o65_export(node))
+		return;
+
+	value = symbol->object.u.number.val.intval;
+	fwrite(node->id_string, 1, strlen(node->id_string) + 1, fd);
+	// addresses outside of code are not relocated
+	putc(((value >= o65_start) && (value < o65_end)) ? 2 : 1, fd);	// segment
+	putc(value & 255, fd);
+	putc((value >> 8) & 255, fd);
+}
+
+
+// set up symbol structure with NULL object (CAUTION!)
+static struct symbol *init_symbol(struct symbol *symbol)
+{
+	symbol->object.type = NULL;	// no object yet (CAUTION!)
+	symbol->pass = pass.number;
+	symbol->def_pass = -1;
+	symbol->strip_block = 0;
+	symbol->has_been_read = FALSE;
+	symbol->reported_pass = -2;	// (pass numbers start at -1)
+	symbol->pseudopc = NULL;
+	symbol->def_filename = NULL;
+	symbol->def_line_number = 0;
+	return symbol;
+}
+
+
+// return table holding symbols of given scope. locals have a table of their
+// own, so there can be lots of zones without globals getting slower to find
+// (and dumping globals does not have to skip all those locals).
+#define SYMBOL_TABLE(scope)	(((scope) == SCOPE_GLOBAL) ? part->symbols : part->locals)
+
+
+// create new symbol structure with NULL object (CAUTION!)
+static struct symbol *new_symbol(void)
+{
+	++stats.symbols_created;
+	return init_symbol(arena_alloc(&part->arena, sizeof(struct symbol), MEMUSE_SYMBOLS));
+}
+
+
+// return parameter symbol of innermost macro call, or NULL if there is none
+static struct symbol *find_param(const struct rwname *name, scope_t scope)
+{
+	struct param_frame	*frame;
+	struct param_slot	*slot;
+
+	if (frames_used == 0)
+		return NULL;
+
+	frame = &frames[frames_used - 1];
+	if ((scope != frame->local_scope) && (scope != frame->cheap_scope))
+		return NULL;
+
+	// search backward, so if a name is given twice, the last one is used
+	for (slot = frame->slots + frame->used; slot-- != frame->slots; ) {
+		if ((slot->scope == scope)
+		&& (slot->name->hash == name->hash)
+		&& (strcmp(slot->name->string, name->string) == 0))
+			return slot->reference ? slot->reference : &slot->own;
+	}
+	return NULL;
 }
 
 
 // search for symbol. if it does not exist, create with NULL object (CAUTION!).
 // the symbol name must be held in GlobalDynaBuf.
 struct symbol *symbol_find(scope_t scope)
+{
+	struct rwname	name;
+
+	Tree_make_name(&name, GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size);
+	return symbol_find_name(&name, scope);
+}
+// same, but with name given explicitly
+struct symbol *symbol_find_name(const struct rwname *name, scope_t scope)
 {
 	struct rwnode	*node;
 	struct symbol	*symbol;
-	boolean		node_created;
-
-	node_created = Tree_hard_scan(&node, symbols_forest, scope, TRUE);
-	// if node has just been created, create symbol as well
-	if (node_created) {
-		// create new symbol structure
-		symbol = safe_malloc(sizeof(*symbol));
-		node->body = symbol;
-		// finish empty symbol item
-		symbol->object.type = NULL;	// no object yet (CAUTION!)
-		symbol->pass = pass.number;
-		symbol->has_been_read = FALSE;
-		symbol->has_been_reported = FALSE;
-		symbol->pseudopc = NULL;
-	} else {
+
+	symbol = find_param(name, scope);
+	if (symbol == NULL) {
+		// if node has just been created, create symbol as well
+		if (Tree_hard_scan_name(&node, SYMBOL_TABLE(scope), name, scope, TRUE))
+			node->body = new_symbol();
 		symbol = node->body;
 	}
+	if (snapshot_recording)
+		snapshot_note_symbol(name->string, name->size, scope, symbol);
 	return symbol;	// now symbol->object.type can be tested to see if this was freshly created.
 	// CAUTION: this only works if caller always sets a type pointer after checking! if NULL is kept, the struct still looks new later on...
 }
 
 
+// search for symbol, but do not create it (returns NULL if not found).
+// the symbol name must be held in GlobalDynaBuf.
+struct symbol *symbol_lookup(scope_t scope)
+{
+	struct rwname	name;
+	struct rwnode	*node;
+	struct symbol	*symbol;
+
+	Tree_make_name(&name, GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size);
+	symbol = find_param(&name, scope);
+	if (symbol == NULL) {
+		Tree_hard_scan_name(&node, SYMBOL_TABLE(scope), &name, scope, FALSE);
+		symbol = node ? node->body : NULL;
+	}
+	return symbol;
+}
+
+
+// start frame for the local parameters of a macro call, with room for the
+// given number of them. the scopes of the current section are used.
+void symbols_push_frame(int count)
+{
+	struct param_frame	*frame;
+
+	if (frames_used == frames_size) {
+		frames = safe_realloc(frames, frames_size * sizeof(*frames), (frames_size + 16) * sizeof(*frames), MEMUSE_SYMBOLS);
+		for (; frames_size < frames_used + 16; ++frames_size) {
+			frames[frames_size].slots = NULL;
+			frames[frames_size].size = 0;
+		}
+	}
+	frame = &frames[frames_used++];
+	if (frame->size < count) {
+		frame->slots = safe_realloc(frame->slots, frame->size * sizeof(*(frame->slots)), count * sizeof(*(frame->slots)), MEMUSE_SYMBOLS);
+		frame->size = count;
+	}
+	frame->used = 0;
+	frame->local_scope = section_now->local_scope;
+	frame->cheap_scope = section_now->cheap_scope;
+}
+
+
+// add local parameter to innermost frame and return its symbol. for call by
+// reference, this is the given symbol. for call by value, "reference" must be
+// NULL, then a new symbol with NULL object (CAUTION!) is returned.
+// the name struct must stay valid until the frame is ended.
+struct symbol *symbols_add_param(const struct rwname *name, scope_t scope, struct symbol *reference)
+{
+	struct param_frame	*frame	= &frames[frames_used - 1];
+	struct param_slot	*slot;
+
+	if (frame->used == frame->size)
+		Bug_found("ParamFrameFull", frame->size);
+	slot = &frame->slots[frame->used++];
+	slot->name = name;
+	slot->scope = scope;
+	slot->reference = reference;
+	return reference ? reference : init_symbol(&slot->own);
+}
+
+
+// end innermost frame
+void symbols_pop_frame(void)
+{
+	if (frames_used == 0)
+		Bug_found("ParamFrameStackEmpty", 0);
+	--frames_used;
+}
+
+
 // assign object to symbol. the function acts upon the symbol's flag bits and
 // produces an error if needed.
 // using "power" bits, caller can state which changes are ok.
@@ -143,6 +554,29 @@ struct symbol *symbol_find(scope_t scope)
 //	CAUTION: actual incrementing of counter is then done directly without calls here!
 void symbol_set_object(struct symbol *symbol, struct object *new_value, bits powers)
 {
+	// the peephole optimizer must not merge instructions across this
+	++symbol_definitions;
+	// when branches get longer (or instructions are removed), the labels
+	// after them move, so their values may change from one pass to the
+	// next. references that have used the old value are fixed by doing
+	// another pass.
+	if (LAYOUT_MAY_CHANGE
+	&& (symbol->def_pass != pass.number)
+	&& !(powers & POWER_CHANGE_VALUE)) {
+		if (symbol->object.type
+		&& (symbol->object.type == new_value->type)
+		&& symbol->object.type->differs(&symbol->object, new_value)) {
+			powers |= POWER_CHANGE_VALUE;
+			++pass.relaxed_count;
+		}
+	}
+	symbol->def_pass = pass.number;
+	symbol->strip_block = strip_block_now;
+	// values that may change during a pass keep files from being replayed
+	if (powers & POWER_CHANGE_VALUE)
+		++pass.volatile_count;
+	symbol->def_filename = Input_now->original_filename;
+	symbol->def_line_number = Input_now->line_number;
 	// if symbol has no object assigned to it yet, fine:
 	if (symbol->object.type == NULL) {
 		symbol->object = *new_value;	// copy whole struct including type
@@ -171,6 +605,38 @@ void symbol_set_object(struct symbol *symbol, struct object *new_value, bits pow
 }
 
 
+// forget all symbols (for "--batch").
+// symbol structs are in the part's arena, so there is nothing to free here
+// (call-by-reference macro arguments make several nodes point to the same one
+// anyway).
+void symbols_clear(void)
+{
+	scope_t	scope;
+	int	ii;
+
+	Tree_clear(part->symbols, NULL);
+	Tree_clear(part->locals, NULL);
+	for (ii = 0; ii < frames_size; ++ii)
+		safe_free(frames[ii].slots, frames[ii].size * sizeof(*(frames[ii].slots)), MEMUSE_SYMBOLS);
+	safe_free(frames, frames_size * sizeof(*frames), MEMUSE_SYMBOLS);
+	frames = NULL;
+	frames_used = 0;
+	frames_size = 0;
+	for (scope = 0; scope < anon_scopes_size; ++scope) {
+		for (ii = 0; ii < anon_scopes[scope].size; ++ii)
+			safe_free(anon_scopes[scope].depths[ii].forward, anon_scopes[scope].depths[ii].forward_size * sizeof(*(anon_scopes[scope].depths[ii].forward)), MEMUSE_SYMBOLS);
+		safe_free(anon_scopes[scope].depths, anon_scopes[scope].size * sizeof(*(anon_scopes[scope].depths)), MEMUSE_SYMBOLS);
+	}
+	safe_free(anon_scopes, anon_scopes_size * sizeof(*anon_scopes), MEMUSE_SYMBOLS);
+	anon_scopes = NULL;
+	anon_scopes_size = 0;
+	safe_free(anon_list, anon_list_size * sizeof(*anon_list), MEMUSE_SYMBOLS);
+	anon_list = NULL;
+	anon_list_used = 0;
+	anon_list_size = 0;
+}
+
+
 // set force bit of symbol. trying to change to a different one will raise error.
 void symbol_set_force_bit(struct symbol *symbol, bits force_bit)
 {
@@ -216,68 +682,198 @@ void symbol_define(intval_t value)
 // dump global symbols to file
 void symbols_list(FILE *fd)
 {
-	Tree_dump_forest(symbols_forest, SCOPE_GLOBAL, dump_one_symbol, fd);
+	struct rwnode	**array;
+	size_t		count,
+			ii,
+			defined	= 0;
+
+	array = collect_symbols(&count);
+	dump_begin(fd);
+	switch (config.symbol_format) {
+	case SYMBOLFORMAT_ACME:
+		for (ii = 0; ii < count; ++ii) {
+			dump_one_symbol(array[ii]);
+			dump_check();
+		}
+		break;
+	case SYMBOLFORMAT_JSON:
+		DynaBuf_add_string(dump_buf, "{\"symbols\": [\n");
+		for (ii = 0; ii < count; ++ii) {
+			dump_json_symbol(array[ii], ii == count - 1);
+			dump_check();
+		}
+		DynaBuf_add_string(dump_buf, "]}\n");
+		break;
+	case SYMBOLFORMAT_BINARY:
+		for (ii = 0; ii < count; ++ii) {
+			if (((struct symbol *) array[ii]->body)->object.u.number.ntype == NUMTYPE_INT)
+				++defined;
+		}
+		DynaBuf_add_string(dump_buf, "ACMESYM");
+		dump_le(1, 1);	// format version
+		dump_le(defined, 4);
+		for (ii = 0; ii < count; ++ii) {
+			if (((struct symbol *) array[ii]->body)->object.u.number.ntype == NUMTYPE_INT) {
+				dump_binary_symbol(array[ii]);
+				dump_check();
+			}
+		}
+		break;
+	}
+	dump_flush();
+	forget_collected(array);
 }
 
 
+// dump global labels to file in VICE format (example: "al C:09ae .nmi1")
 void symbols_vicelabels(FILE *fd)
 {
+	struct rwnode	**array;
+	struct symbol	*symbol;
+	size_t		count,
+			ii;
+	int		group;
+
 	// FIXME - if type checking is enabled, maybe only output addresses?
-	// the order of dumped labels is important because VICE will prefer later defined labels
-	// dump unused labels
-	Tree_dump_forest(symbols_forest, SCOPE_GLOBAL, dump_vice_unusednonaddress, fd);
-	fputc('\n', fd);
-	// dump other used labels
-	Tree_dump_forest(symbols_forest, SCOPE_GLOBAL, dump_vice_usednonaddress, fd);
-	fputc('\n', fd);
-	// dump address symbols
-	Tree_dump_forest(symbols_forest, SCOPE_GLOBAL, dump_vice_address, fd);
+	// the order of dumped labels is important because VICE will prefer later defined labels:
+	// group 0 is unused non-addresses, group 1 used non-addresses, group 2 addresses
+	// (address symbols are dumped even if they are not used)
+	array = collect_symbols(&count);
+	dump_begin(fd);
+	for (group = 0; group < 3; ++group) {
+		if (group)
+			DYNABUF_APPEND(dump_buf, '\n');
+		for (ii = 0; ii < count; ++ii) {
+			symbol = array[ii]->body;
+			if (symbol->object.u.number.ntype != NUMTYPE_INT)
+				continue;
+			if (symbol->object.u.number.addr_refs == 1) {
+				if (group != 2)
+					continue;
+			} else if (group != (symbol->has_been_read ? 1 : 0)) {
+				continue;
+			}
+			DynaBuf_add_string(dump_buf, "al C:");
+			dump_hex((unsigned) symbol->object.u.number.val.intval, 4);
+			DynaBuf_add_string(dump_buf, " .");
+			DynaBuf_add_string(dump_buf, array[ii]->id_string);
+			DYNABUF_APPEND(dump_buf, '\n');
+			dump_check();
+		}
+	}
 	// TODO - add trace points and watch points with load/store/exec args!
+	dump_flush();
+	forget_collected(array);
 }
 
 
-// fix name of anonymous forward label (held in DynaBuf, NOT TERMINATED!) so it
-// references the *next* anonymous forward label definition. The tricky bit is,
-// each name length would need its own counter. But hey, ACME's real quick in
-// finding symbols, so I'll just abuse the symbol system to store those counters.
-// example:
-//	forward anon name is "+++"
-//	we look up that symbol's value in the current local scope -> $12
-//	we attach hex digits to name -> "+++21"
-//	that's the name of the symbol that _actually_ contains the address
-// caller sets "increment" to TRUE for writing, FALSE for reading
-void symbol_fix_forward_anon_name(boolean increment)
-{
-	struct symbol	*counter_symbol;
-	unsigned long	number;
-
-	// terminate name, find "counter" symbol and read value
-	DynaBuf_append(GlobalDynaBuf, '\0');
-	counter_symbol = symbol_find(section_now->local_scope);
-	if (counter_symbol->object.type == NULL) {
-		// finish freshly created symbol item
-		counter_symbol->object.type = &type_number;
-		counter_symbol->object.u.number.ntype = NUMTYPE_INT;
-		counter_symbol->object.u.number.flags = 0;
-		counter_symbol->object.u.number.addr_refs = 0;
-		counter_symbol->object.u.number.val.intval = 0;
-	} else if (counter_symbol->object.type != &type_number) {
-		// sanity check: it must be a number!
-		Bug_found("ForwardAnonCounterNotInt", 0);
+// call given function for each global symbol the symbol list would show, in
+// the order chosen by "--symbolorder" (for libacme)
+void symbols_for_each_listed(void (*fn)(const char *name, const struct symbol *symbol, void *arg), void *arg)
+{
+	struct rwnode	**array;
+	size_t		count,
+			ii;
+
+	array = collect_symbols(&count);
+	for (ii = 0; ii < count; ++ii)
+		fn(array[ii]->id_string, array[ii]->body, arg);
+	forget_collected(array);
+}
+
+
+// write list of exported globals for o65 file (code is in [start, end[)
+void symbols_o65_exports(FILE *fd, intval_t start, intval_t end)
+{
+	o65_count = 0;
+	o65_start = start;
+	o65_end = end;
+	Tree_dump_forest(part->symbols, SCOPE_GLOBAL, count_o65_export, fd);
+	putc(o65_count & 255, fd);
+	putc((o65_count >> 8) & 255, fd);
+	Tree_dump_forest(part->symbols, SCOPE_GLOBAL, dump_o65_export, fd);
+}
+
+
+// grow array of "count" entries of the given size to at least "wanted"
+// entries, clearing the new ones
+static void *grow_zeroed(void *array, int *count, int wanted, size_t size)
+{
+	int	new_count	= *count ? *count : 8;
+
+	while (new_count < wanted)
+		new_count *= 2;
+	array = safe_realloc(array, *count * size, new_count * size, MEMUSE_SYMBOLS);
+	memset((char *) array + *count * size, 0, (new_count - *count) * size);
+	*count = new_count;
+	return array;
+}
+
+
+// find anonymous label in current local scope, "depth" is the number of '+'
+// or '-' characters. forward labels are looked up as the next one to be
+// defined; if "define" is TRUE, the one after that will be found next time.
+// if it does not exist, it is created with NULL object (CAUTION!).
+struct symbol *symbol_find_anon(boolean forward, int depth, boolean define)
+{
+	scope_t			scope	= section_now->local_scope;
+	struct anon_scope	*anon;
+	struct anon_depth	*entry;
+	struct symbol		**slot;
+	int			size;
+
+	if (scope >= anon_scopes_size) {
+		size = anon_scopes_size;
+		anon_scopes = grow_zeroed(anon_scopes, &size, scope + 1, sizeof(*anon_scopes));
+		anon_scopes_size = size;
 	}
-	// make sure it gets reset to zero in each new pass
-	if (counter_symbol->pass != pass.number) {
-		counter_symbol->pass = pass.number;
-		counter_symbol->object.u.number.val.intval = 0;
+	anon = &anon_scopes[scope];
+	if (depth > anon->size)
+		anon->depths = grow_zeroed(anon->depths, &anon->size, depth, sizeof(*anon->depths));
+	entry = &anon->depths[depth - 1];
+	if (forward) {
+		// make sure counter gets reset to zero in each new pass
+		if (entry->pass != pass.number) {
+			entry->pass = pass.number;
+			entry->next_forward = 0;
+		}
+		if (entry->next_forward >= entry->forward_size)
+			entry->forward = grow_zeroed(entry->forward, &entry->forward_size, entry->next_forward + 1, sizeof(*entry->forward));
+		slot = &entry->forward[entry->next_forward];
+		if (define) {
+			++entry->next_forward;
+			++pass.volatile_count;	// counter is reset in each pass
+		}
+	} else {
+		slot = &entry->backward;
+	}
+	if (*slot == NULL) {
+		*slot = new_symbol();
+		if (anon_list_used == anon_list_size) {
+			anon_list = safe_realloc(anon_list, anon_list_size * sizeof(*anon_list), (anon_list_size ? 2 * anon_list_size : 64) * sizeof(*anon_list), MEMUSE_SYMBOLS);
+			anon_list_size = anon_list_size ? 2 * anon_list_size : 64;
+		}
+		anon_list[anon_list_used].symbol = *slot;
+		anon_list[anon_list_used].depth = depth;
+		anon_list[anon_list_used].forward = forward;
+		++anon_list_used;
+	}
+	return *slot;
+}
+
+
+// call given function for each anonymous label in order of creation, with its
+// displayed name ("+", "--", ...) in GlobalDynaBuf
+void symbols_for_each_anon(void (*fn)(struct symbol *))
+{
+	size_t	ii;
+	int	jj;
+
+	for (ii = 0; ii < anon_list_used; ++ii) {
+		DYNABUF_CLEAR(GlobalDynaBuf);
+		for (jj = 0; jj < anon_list[ii].depth; ++jj)
+			DYNABUF_APPEND(GlobalDynaBuf, anon_list[ii].forward ? '+' : '-');
+		DynaBuf_append(GlobalDynaBuf, '\0');
+		fn(anon_list[ii].symbol);
 	}
-	number = (unsigned long) counter_symbol->object.u.number.val.intval;
-	// now append to the name to make it unique
-	GlobalDynaBuf->size--;	// forget terminator, we want to append
-	do {
-		DYNABUF_APPEND(GlobalDynaBuf, 'a' + (number & 15));
-		number >>= 4;
-	} while (number);
-	DynaBuf_append(GlobalDynaBuf, '\0');
-	if (increment)
-		counter_symbol->object.u.number.val.intval++;
 }
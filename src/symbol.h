@@ -9,15 +9,19 @@
 
 #include <stdio.h>
 #include "config.h"
+#include "tree.h"	// for struct rwtable
 
 
 struct symbol {
 	struct object	object;	// number/list/string
-	int		pass;	// pass of creation (for anon counters)
+	int		pass;	// pass of creation
+	int		def_pass;	// pass of last definition (for "--relax-branches")
+	int		strip_block;	// "!strippable" block of definition (0 if none)
 	boolean		has_been_read;	// to find out if actually used
-	boolean		has_been_reported;	// indicates "has been reported as undefined"
+	int		reported_pass;	// pass in which it was reported as undefined
 	struct pseudopc	*pseudopc;	// NULL when defined outside of !pseudopc block
-	// add file ref + line num of last definition
+	const char	*def_filename;	// file and line of last definition
+	int		def_line_number;	// (NULL and 0 if never defined)
 };
 
 
@@ -25,13 +29,28 @@ struct symbol {
 #define SCOPE_GLOBAL	0	// number of "global zone"
 
 
-// variables
-extern struct rwnode	*symbols_forest[];	// trees (because of 8-bit hash)
+// Variables
+extern int	symbol_definitions;	// counts calls of symbol_set_object() (for "--peephole")
 
 
 // search for symbol. if it does not exist, create with NULL type object (CAUTION!).
 // the symbol name must be held in GlobalDynaBuf.
 extern struct symbol *symbol_find(scope_t scope);
+// same, but with name given explicitly (see tree.h)
+extern struct symbol *symbol_find_name(const struct rwname *name, scope_t scope);
+// search for symbol, but do not create it (returns NULL if not found).
+// the symbol name must be held in GlobalDynaBuf.
+extern struct symbol *symbol_lookup(scope_t scope);
+// start frame for the local parameters of a macro call, with room for the
+// given number of them. the scopes of the current section are used.
+extern void symbols_push_frame(int count);
+// add local parameter to innermost frame and return its symbol. for call by
+// reference, this is the given symbol. for call by value, "reference" must be
+// NULL, then a new symbol with NULL object (CAUTION!) is returned.
+// the name struct must stay valid until the frame is ended.
+extern struct symbol *symbols_add_param(const struct rwname *name, scope_t scope, struct symbol *reference);
+// end innermost frame
+extern void symbols_pop_frame(void);
 // assign object to symbol. function acts upon the symbol's flag bits and
 // produces an error if needed.
 // using "power" bits, caller can state which changes are ok.
@@ -48,9 +67,21 @@ extern void symbol_define(intval_t value);
 extern void symbols_list(FILE *fd);
 // dump global labels to file in VICE format
 extern void symbols_vicelabels(FILE *fd);
-// fix name of anonymous forward label (held in GlobalDynaBuf, NOT TERMINATED!)
-// so it references the *next* anonymous forward label definition.
-extern void symbol_fix_forward_anon_name(boolean increment);
+// call given function for each global symbol the symbol list would show, in
+// the order chosen by "--symbolorder" (for libacme)
+extern void symbols_for_each_listed(void (*fn)(const char *name, const struct symbol *symbol, void *arg), void *arg);
+// write list of exported globals for o65 file (code is in [start, end[)
+extern void symbols_o65_exports(FILE *fd, intval_t start, intval_t end);
+// find anonymous label in current local scope, "depth" is the number of '+'
+// or '-' characters. forward labels are looked up as the next one to be
+// defined; if "define" is TRUE, the one after that will be found next time.
+// if it does not exist, it is created with NULL object (CAUTION!).
+extern struct symbol *symbol_find_anon(boolean forward, int depth, boolean define);
+// call given function for each anonymous label in order of creation, with its
+// displayed name ("+", "--", ...) in GlobalDynaBuf
+extern void symbols_for_each_anon(void (*fn)(struct symbol *));
+// forget all symbols (for "--batch")
+extern void symbols_clear(void);
 
 
 #endif
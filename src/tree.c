@@ -4,6 +4,7 @@
 //
 // tree stuff
 #include "tree.h"
+#include <string.h>	// for strcmp()
 #include "config.h"
 #include "dynabuf.h"
 #include "global.h"
@@ -12,202 +13,318 @@
 
 // Functions
 
-// Compute hash value by exclusive ORing the node's ID string and write
-// output to struct.
-// This function is not allowed to change GlobalDynaBuf!
-static hash_t make_hash(struct ronode *node) {
-	register char		byte;
-	register const char	*read;
-	register hash_t		tmp	= 0;
-
-	read = node->id_string;
-	while ((byte = *read++))
-		tmp = ((tmp << 7) | (tmp >> (8 * sizeof(hash_t) - 7))) ^ byte;
-	node->hash_value = tmp;
+// "read-only" items (keywords) are held in perfect hash tables, built from
+// the predefined lists on first use: keys are distributed to buckets, and
+// each bucket gets its own seed for the second hash, chosen so that no two
+// keys end up in the same slot. So a lookup is one hash computation over the
+// string, some integer operations and a single string comparison.
+
+// perfect hash table for "read-only" items
+struct rotable {
+	hash_t		bucket_mask;	// number of buckets - 1
+	hash_t		slot_mask;	// number of slots - 1
+	hash_t		*seeds;		// seed for each bucket
+	struct ronode	**slots;	// each slot holds at most one node
+};
+// how many seeds to try per bucket before using a larger table
+#define ROTABLE_MAXSEEDS	1000
+
+// compute hash value of string (FNV-1a).
+// this function is not allowed to change GlobalDynaBuf!
+static hash_t make_hash(const char *read)
+{
+	hash_t	tmp	= TREE_HASH_START;
+
+	while (*read)
+		TREE_HASH_ADD(tmp, *read++);
 	return tmp;
 }
 
-// Link a predefined data set to a tree
-static void add_node_to_tree(struct ronode **tree, struct ronode *node_to_add)
+// mix hash value with seed, so all bits of result are usable
+static hash_t mix_hash(hash_t hash, hash_t seed)
+{
+	hash ^= seed * 2654435769u;
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3bu;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+// which bucket does hash belong to?
+#define ROTABLE_BUCKET(table, hash)	(mix_hash((hash), 0) & (table)->bucket_mask)
+// which slot does hash belong to?
+#define ROTABLE_SLOT(table, hash, bucket)	(mix_hash((hash), (table)->seeds[bucket] + 1) & (table)->slot_mask)
+
+// try to put all nodes of given bucket into free slots, using given seed.
+// returns nonzero on failure (then, no slots have been changed).
+static int place_bucket(struct rotable *table, struct ronode *list, hash_t *hashes, int count, hash_t bucket, hash_t seed)
+{
+	int	ii,
+		jj;
+	hash_t	slot;
+
+	table->seeds[bucket] = seed;
+	for (ii = 0; ii < count; ++ii) {
+		if (ROTABLE_BUCKET(table, hashes[ii]) != bucket)
+			continue;
+		slot = ROTABLE_SLOT(table, hashes[ii], bucket);
+		if (table->slots[slot]) {
+			// collision, so undo changes
+			for (jj = 0; jj < ii; ++jj) {
+				if (ROTABLE_BUCKET(table, hashes[jj]) == bucket)
+					table->slots[ROTABLE_SLOT(table, hashes[jj], bucket)] = NULL;
+			}
+			return 1;	// failed
+		}
+		table->slots[slot] = list + ii;
+	}
+	return 0;	// ok
+}
+
+// try to build perfect hash table of given size.
+// returns nonzero on failure.
+static int try_table(struct rotable *table, struct ronode *list, hash_t *hashes, int count, hash_t slots)
 {
-	hash_t	hash;
-
-	// compute hash value
-	hash = make_hash(node_to_add);
-	// search for NULL pointer to replace
-	while (*tree) {
-		// decide which way to go
-		if (hash > (*tree)->hash_value)
-			tree = &((*tree)->greater_than);
-		else
-			tree = &((*tree)->less_than_or_equal);
+	int	*bucket_sizes;
+	hash_t	buckets,
+		ii,
+		seed;
+	int	size;
+
+	buckets = slots / 4;
+	if (buckets == 0)
+		buckets = 1;
+	table->bucket_mask = buckets - 1;
+	table->slot_mask = slots - 1;
+	table->seeds = safe_malloc(buckets * sizeof(*(table->seeds)), MEMUSE_TREES);
+	table->slots = safe_malloc(slots * sizeof(*(table->slots)), MEMUSE_TREES);
+	for (ii = 0; ii < slots; ++ii)
+		table->slots[ii] = NULL;
+	bucket_sizes = safe_malloc(buckets * sizeof(*bucket_sizes), MEMUSE_TREES);
+	for (ii = 0; ii < buckets; ++ii)
+		bucket_sizes[ii] = 0;
+	for (size = 0; size < count; ++size)
+		++bucket_sizes[ROTABLE_BUCKET(table, hashes[size])];
+	// place large buckets first, because then there is still more room
+	for (size = count; size > 0; --size) {
+		for (ii = 0; ii < buckets; ++ii) {
+			if (bucket_sizes[ii] != size)
+				continue;
+			seed = 0;
+			while (place_bucket(table, list, hashes, count, ii, seed)) {
+				if (++seed == ROTABLE_MAXSEEDS) {
+					safe_free(bucket_sizes, buckets * sizeof(*bucket_sizes), MEMUSE_TREES);
+					safe_free(table->seeds, buckets * sizeof(*(table->seeds)), MEMUSE_TREES);
+					safe_free(table->slots, slots * sizeof(*(table->slots)), MEMUSE_TREES);
+					return 1;	// failed
+				}
+			}
+		}
 	}
-	*tree = node_to_add;	// add new leaf to tree
-// New nodes are always added as leaves, so there's no need to copy a second
-// pointer. And because the PREDEF* macros contain NULL as init values, it is
-// not necessary to clear the new node's greater_than and less_than_or_equal
-// fields.
+	safe_free(bucket_sizes, buckets * sizeof(*bucket_sizes), MEMUSE_TREES);
+	return 0;	// ok
 }
 
-// Add predefined tree items to given tree. The PREDEF* macros set the hash
-// to 1 in all entries but the last, and to 0 in the last entry.
-static void tree_from_list(struct ronode **tree, struct ronode *table_to_add)
+// build perfect hash table from predefined list. The PREDEF* macros set
+// "hash_value" to 1 in all entries but the last, and to 0 in the last entry.
+static struct rotable *table_from_list(struct ronode *list)
 {
-	//printf("Building tree from list.\n");
-	// Caution when trying to optimise this. :)
-	while (table_to_add->hash_value)
-		add_node_to_tree(tree, table_to_add++);
-	add_node_to_tree(tree, table_to_add);
+	struct rotable	*table;
+	hash_t		*hashes;
+	hash_t		slots;
+	int		count,
+			ii;
+
+	//printf("Building table from list.\n");
+	count = 1;
+	while (list[count - 1].hash_value)
+		++count;
+	hashes = safe_malloc(count * sizeof(*hashes), MEMUSE_TREES);
+	for (ii = 0; ii < count; ++ii)
+		hashes[ii] = make_hash(list[ii].id_string);
+	table = safe_malloc(sizeof(*table), MEMUSE_TREES);
+	slots = 4;
+	while (slots < 2 * count)
+		slots *= 2;
+	while (try_table(table, list, hashes, count, slots)) {
+		slots *= 2;
+		// this will only happen if list contains the same keyword twice:
+		if (slots > 64 * count)
+			Bug_found("KeywordTableFailed", count);
+	}
+	safe_free(hashes, count * sizeof(*hashes), MEMUSE_TREES);
+	return table;
 }
 
-// Search for a given ID string in a given tree.
-// Compute the hash of the given string and then use that to try to find a
-// tree item that matches the given data (HashValue and DynaBuf-String).
+// Search for a given ID string in a given keyword table.
+// Use the hash of the given string to find the only table slot where it could
+// be.
 // Store "body" component in node_body and return TRUE.
 // Return FALSE if no matching item found.
-int Tree_easy_scan(struct ronode *tree, void **node_body, struct dynabuf *dyna_buf)
+int Tree_easy_scan_hashed(struct ronode *tree, void **node_body, const char *string, hash_t hash)
 {
-	struct ronode	wanted;	// temporary storage
-	const char	*p1,
-			*p2;
-	char		b1,
-			b2;
-	hash_t		hash;
-
-	// check if tree is actually ready to use. if not, build it from list.
-	// (list's first item does not contain real data, so "greater_than" is
-	// used to hold pointer to tree root)
-	if (tree->greater_than == NULL)
-		tree_from_list(&tree->greater_than, tree + 1);	// real data starts at next list item
-	tree = tree->greater_than;	// go from list head to tree root
-	// ok, we're done with this setup stuff.
-	// from now on, "greater_than" really means "greater_than"!
-
-	wanted.id_string = dyna_buf->buffer;
-	hash = make_hash(&wanted);
-	while (tree) {
-		// compare HashValue
-		if (hash > tree->hash_value) {
-			// wanted hash is bigger than current, so go
-			// to tree branch with bigger hashes
-			tree = tree->greater_than;
-			continue;
-		}
-		if (hash == tree->hash_value) {
-			p1 = wanted.id_string;
-			p2 = tree->id_string;
-			do {
-				b1 = *p1++;
-				b2 = *p2++;
-			} while ((b1 == b2) && b1);
-			if (b1 == b2) {
-				// store body data
-				*node_body = tree->body;
-				return TRUE;
-			}
-		}
-		// either the wanted hash is smaller or
-		// it was exact but didn't match
-		tree = tree->less_than_or_equal;
+	struct rotable	*table;
+	struct ronode	*node;
+	hash_t		bucket;
+
+	// check if table is actually ready to use. if not, build it from list.
+	// (list's first item does not contain real data, so "body" is used to
+	// hold pointer to table)
+	if (tree->body == NULL)
+		tree->body = table_from_list(tree + 1);	// real data starts at next list item
+	table = tree->body;
+	bucket = ROTABLE_BUCKET(table, hash);
+	node = table->slots[ROTABLE_SLOT(table, hash, bucket)];
+	if (node && (strcmp(node->id_string, string) == 0)) {
+		// store body data
+		*node_body = node->body;
+		return TRUE;
 	}
-	return FALSE ;	// indicate failure
+	return FALSE;	// indicate failure
 }
 
-// Search for a "RAM tree" item. Compute the hash of string in GlobalDynaBuf
-// and then use that to try to find a tree item that matches the given data
-// (HashValue, ID_Number, GlobalDynaBuf-String). Save pointer to found tree
-// item in given location.
+// Search for a given ID string in a given keyword table. Store "body"
+// component in node_body and return TRUE. Return FALSE if no matching item
+// found.
+int Tree_easy_scan(struct ronode *tree, void **node_body, struct dynabuf *dyna_buf)
+{
+	return Tree_easy_scan_hashed(tree, node_body, dyna_buf->buffer, make_hash(dyna_buf->buffer));
+}
+
+// "read/write" items are held in open-addressing hash tables:
+
+// initial number of slots (must be a power of two)
+#define RWTABLE_INITIALSIZE	256
+
+// set up name struct for given zero-terminated string (size includes terminator)
+void Tree_make_name(struct rwname *name, const char *string, size_t size)
+{
+	name->string = string;
+	name->size = size;
+	name->hash = make_hash(string);
+}
+
+// put node into first free slot
+static void put_into_slot(struct rwtable *table, struct rwnode *node)
+{
+	hash_t	mask	= table->size - 1;
+	hash_t	index	= node->hash_value & mask;
+
+	while (table->slots[index])
+		index = (index + 1) & mask;
+	table->slots[index] = node;
+}
+
+// allocate (larger) slot array and re-insert all nodes
+static void grow_table(struct rwtable *table)
+{
+	struct rwnode	*node;
+	hash_t		ii;
+
+	safe_free(table->slots, table->size * sizeof(*(table->slots)), MEMUSE_TREES);
+	table->size = table->size ? 2 * table->size : RWTABLE_INITIALSIZE;
+	table->slots = safe_malloc(table->size * sizeof(*(table->slots)), MEMUSE_TREES);
+	for (ii = 0; ii < table->size; ++ii)
+		table->slots[ii] = NULL;
+	for (node = table->first; node; node = node->next)
+		put_into_slot(table, node);
+}
+
+// Search for a "RAM table" item. Use the name's hash value to try to find an
+// item that matches the given data (HashValue, ID_Number, name). Save pointer
+// to found item in given location.
 // If no matching item is found, check the "create" flag. If it is set, create
-// a new tree item, link to tree, fill with data and store its pointer. If the
+// a new item, add to table, fill with data and store its pointer. If the
 // "create" flag is zero, store NULL as result.
 // Returns whether item was created.
-int Tree_hard_scan(struct rwnode **result, struct rwnode **forest, int id_number, boolean create)
+int Tree_hard_scan_name(struct rwnode **result, struct rwtable *table, const struct rwname *name, int id_number, boolean create)
 {
-	struct ronode	wanted;	// temporary storage
-	struct rwnode	**current_node;
-	struct rwnode	*new_leaf_node;
-	const char	*p1,
-			*p2;
-	char		b1,
-			b2;
-	hash_t		byte_hash;
-
-	wanted.id_string = GLOBALDYNABUF_CURRENT;
-	// incorporate ID number into hash value
-	byte_hash = make_hash(&wanted) ^ id_number;
-	wanted.hash_value = byte_hash;	// correct struct's hash
-	PLATFORM_UINT2CHAR(byte_hash);	// transform into byte
-
-	current_node = &(forest[byte_hash]);	// point into table
-	while (*current_node) {
-		// compare HashValue
-		if (wanted.hash_value > (*current_node)->hash_value) {
-			// wanted hash is bigger than current, so go
-			// to tree branch with bigger hashes
-			current_node = &((*current_node)->greater_than);
-			continue;
-		}
-		if (wanted.hash_value == (*current_node)->hash_value) {
-			if (id_number == (*current_node)->id_number) {
-				p1 = wanted.id_string;
-				p2 = (*current_node)->id_string;
-				do {
-					b1 = *p1++;
-					b2 = *p2++;
-				} while ((b1 == b2) && b1);
-				if (b1 == b2) {
-					// store node pointer
-					*result = *current_node;
-					// return FALSE because node
-					// was not created
-					return FALSE;
-				}
-			}
+	struct rwnode	*node;
+	hash_t		hash,
+			mask,
+			index;
+
+	if (table->slots == NULL)
+		grow_table(table);
+	hash = mix_hash(name->hash, (hash_t) id_number);
+	mask = table->size - 1;
+	index = hash & mask;
+	++stats.table_lookups;
+	while ((node = table->slots[index])) {
+		++stats.table_probes;
+		if ((node->hash_value == hash)
+		&& (node->id_number == id_number)
+		&& (strcmp(node->id_string, name->string) == 0)) {
+			*result = node;
+			return FALSE;	// return FALSE because node was not created
 		}
-		// either the wanted hash is smaller or
-		// it was exact but didn't match
-		current_node = &((*current_node)->less_than_or_equal);
+		index = (index + 1) & mask;
 	}
 	// node wasn't found. Check whether to create it
 	if (!create) {
 		*result = NULL;	// indicate failure
 		return FALSE;	// return FALSE because node was not created
 	}
-	// create new node
-	new_leaf_node = safe_malloc(sizeof(*new_leaf_node));
-	new_leaf_node->greater_than = NULL;
-	new_leaf_node->less_than_or_equal = NULL;
-	new_leaf_node->hash_value = wanted.hash_value;
-	new_leaf_node->id_number = id_number;
-	new_leaf_node->id_string = DynaBuf_get_copy(GlobalDynaBuf);	// make permanent copy
-	// add new leaf to tree
-	*current_node = new_leaf_node;
+	// create new node, with its name right behind it
+	node = arena_alloc(table->arena, sizeof(*node) + name->size, MEMUSE_TREES);
+	node->next = NULL;
+	node->hash_value = hash;
+	node->id_number = id_number;
+	node->id_string = (char *) (node + 1);
+	memcpy(node->id_string, name->string, name->size);	// make permanent copy
+	node->body = NULL;
+	// add to table (index still points to free slot)
+	table->slots[index] = node;
+	if (table->last)
+		table->last->next = node;
+	else
+		table->first = node;
+	table->last = node;
+	// keep table at most half full, so searches stay short
+	if (++table->used > table->size / 2)
+		grow_table(table);
 	// store pointer to new node in result location
-	*result = new_leaf_node;
+	*result = node;
 	return TRUE;	// return TRUE because node was created
 }
 
-// Call given function for each object of matching type in the given tree.
-// Calls itself recursively.
-static void dump_tree(struct rwnode *node, int id_number, void (*fn)(struct rwnode *, FILE *), FILE *env)
+// Search for a "RAM table" item, name is in GlobalDynaBuf (see above)
+int Tree_hard_scan(struct rwnode **result, struct rwtable *table, int id_number, boolean create)
 {
+	struct rwname	name;
+
+	Tree_make_name(&name, GLOBALDYNABUF_CURRENT, GlobalDynaBuf->size);
+	return Tree_hard_scan_name(result, table, &name, id_number, create);
+}
 
-	if (node->id_number == id_number)
-		fn(node, env);
-	if (node->greater_than)
-		dump_tree(node->greater_than, id_number, fn, env);
-	if (node->less_than_or_equal)
-		dump_tree(node->less_than_or_equal, id_number, fn, env);
+// Remove all nodes from given table. If not NULL, the given function is called
+// for each node body first. The nodes themselves are left in the table's arena.
+void Tree_clear(struct rwtable *table, void (*free_body)(void *))
+{
+	struct rwnode	*node;
+
+	if (free_body) {
+		for (node = table->first; node; node = node->next) {
+			if (node->body)
+				free_body(node->body);
+		}
+	}
+	safe_free(table->slots, table->size * sizeof(*(table->slots)), MEMUSE_TREES);
+	table->slots = NULL;
+	table->size = 0;
+	table->used = 0;
+	table->first = NULL;
+	table->last = NULL;
 }
 
-// Call Tree_dump_tree for each non-zero entry of the given tree table.
-void Tree_dump_forest(struct rwnode **forest, int id_number, void (*fn)(struct rwnode *, FILE *), FILE *env)
+// Call given function for each node of given table (in order of creation)
+// that has the given id number.
+void Tree_dump_forest(struct rwtable *table, int id_number, void (*fn)(struct rwnode *, FILE *), FILE *env)
 {
-	int	ii;
+	struct rwnode	*node;
 
-	for (ii = 255; ii >= 0; --ii) {
-		if (*forest)
-			dump_tree(*forest, id_number, fn, env);
-		++forest;
+	for (node = table->first; node; node = node->next) {
+		if (node->id_number == id_number)
+			fn(node, env);
 	}
 }
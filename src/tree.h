@@ -11,48 +11,80 @@
 #include "config.h"
 
 
-// macros for pre-defining tree node tables
-#define PREDEF_START		{NULL, NULL, 0, NULL, NULL}	// this is used to determine if list has been made into tree yet
-#define PREDEFNODE(s, v)	{NULL, NULL, 1, s, (void *) (v)}
-#define PREDEF_END(s, v)	{NULL, NULL, 0, s, (void *) (v)}
+// macros for pre-defining keyword tables
+#define PREDEF_START		{0, NULL, NULL}	// list head, its "body" is used to hold the lookup table once it has been built
+#define PREDEFNODE(s, v)	{1, s, (void *) (v)}
+#define PREDEF_END(s, v)	{0, s, (void *) (v)}
 
 // type definitions
 
 typedef unsigned int	hash_t;	// must be unsigned, otherwise the hash algorithm won't be very useful!
 
-// tree node structure type definition for lookups in "read-only" (i.e. keyword) trees
+// node structure type definition for lookups in "read-only" (i.e. keyword) tables
 struct ronode {
-	struct ronode	*greater_than;	// pointer to sub-tree
-	struct ronode	*less_than_or_equal;	// pointer to sub-tree
-	hash_t		hash_value;
+	hash_t		hash_value;	// 1 means "list goes on", 0 means "last entry"
 	const char	*id_string;	// name, zero-terminated
 	void		*body;		// bytes, handles or handler function
 };
 
-// tree node structure type definition for "read/write" items, i.e. macros/symbols
+// node structure type definition for "read/write" items, i.e. macros/symbols
 struct rwnode {
-	struct rwnode	*greater_than;	// pointer to sub-tree
-	struct rwnode	*less_than_or_equal;	// pointer to sub-tree
+	struct rwnode	*next;		// next node of table, in order of creation
 	hash_t		hash_value;
 	char		*id_string;	// name, zero-terminated
 	void		*body;		// macro/symbol body
 	int		id_number;	// scope number
 };
+struct arena;
+// hash table for "read/write" items (open addressing, grows automatically)
+struct rwtable {
+	struct rwnode	**slots;	// NULL until first use
+	hash_t		size;		// number of slots (power of two)
+	hash_t		used;		// number of slots in use
+	struct rwnode	*first;		// list of all nodes, in order of creation
+	struct rwnode	*last;
+	struct arena	*arena;		// nodes (and their names) are allocated here
+};
+// the "[1]" makes sure the name refers to the address and not the struct
+// itself (see STRUCT_DYNABUF_REF)
+// name of "read/write" item, with hash value computed in advance (so names
+// that are looked up again and again only need to be hashed once)
+struct rwname {
+	const char	*string;	// zero-terminated
+	size_t		size;		// including terminator
+	hash_t		hash;		// set by Tree_make_name()
+};
+#define STRUCT_RWTABLE_REF(name, arena)	struct rwtable name[1]	= {{NULL, 0, 0, NULL, NULL, arena}}
+
+
+// keyword hash (FNV-1a), exported so it can be computed while reading keywords
+#define TREE_HASH_START			2166136261u
+#define TREE_HASH_ADD(hash, byte)	((hash) = ((hash) ^ (unsigned char) (byte)) * 16777619u)
 
 
 // prototypes
 
-// Search for a given ID string in a given tree. Store "body" component in
-// node_body and return TRUE. Return FALSE if no matching item found.
+// Search for a given ID string in a given keyword table. Store "body"
+// component in node_body and return TRUE. Return FALSE if no matching item
+// found.
 struct dynabuf;
 extern int Tree_easy_scan(struct ronode *tree, void **node_body, struct dynabuf *dyna_buf);
-// Search for a "RAM tree" item. Save pointer to found tree item in given
+// same, but with zero-terminated string and its hash value given explicitly
+extern int Tree_easy_scan_hashed(struct ronode *tree, void **node_body, const char *string, hash_t hash);
+// Search for a "RAM table" item. Save pointer to found item in given
 // location. If no matching item is found, check the "create" flag: If set,
-// create new tree item, link to tree, fill with data and store its pointer.
+// create new item, add to table, fill with data and store its pointer.
 // If "create" is FALSE, store NULL. Returns whether item was created.
-extern int Tree_hard_scan(struct rwnode **result, struct rwnode **forest, int id_number, boolean create);
-// Call given function for each node of each tree of given forest.
-extern void Tree_dump_forest(struct rwnode **, int id_number, void (*)(struct rwnode *, FILE *), FILE *);
+extern int Tree_hard_scan(struct rwnode **result, struct rwtable *table, int id_number, boolean create);
+// same, but with name given explicitly instead of in GlobalDynaBuf
+extern int Tree_hard_scan_name(struct rwnode **result, struct rwtable *table, const struct rwname *name, int id_number, boolean create);
+// set up name struct for given zero-terminated string (size includes terminator)
+extern void Tree_make_name(struct rwname *name, const char *string, size_t size);
+// Remove all nodes from given table. If not NULL, the given function is called
+// for each node body first. The nodes themselves are left in the table's arena.
+extern void Tree_clear(struct rwtable *table, void (*free_body)(void *));
+// Call given function for each node of given table (in order of creation).
+extern void Tree_dump_forest(struct rwtable *table, int id_number, void (*)(struct rwnode *, FILE *), FILE *);
 
 
 #endif
@@ -0,0 +1,461 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// unpacking compressed binary files ("!binary")
+//
+// Files with a name ending in ".gz" and starting with a gzip header are
+// unpacked before being included. This is a plain "inflate" decoder (see
+// RFC 1950-1952), so no external library is needed. The whole output is kept
+// in a dynabuf, so back references can simply be copied from there instead
+// of using a separate window. Speed does not matter much, because the file
+// cache keeps the unpacked data, so each file is only unpacked once.
+#include "unpack.h"
+#include <ctype.h>
+#include <string.h>
+#include "dynabuf.h"
+
+
+// constants
+#define GZIP_ID1	0x1f
+#define GZIP_ID2	0x8b
+#define GZIP_DEFLATE	8	// compression method
+#define GZIP_FHCRC	0x02	// header flags
+#define GZIP_FEXTRA	0x04
+#define GZIP_FNAME	0x08
+#define GZIP_FCOMMENT	0x10
+#define GZIP_RESERVED	0xe0
+#define GZIP_MINSIZE	18	// header and trailer, without any data
+#define MAXBITS		15	// longest code
+#define MAXLCODES	286	// literal/length codes
+#define MAXDCODES	30	// distance codes
+#define MAXCODES	(MAXLCODES + MAXDCODES)
+#define FIXLCODES	288	// literal/length codes in fixed table
+
+// canonical huffman code, stored as number of codes of each length and the
+// symbols ordered by code
+struct huffman {
+	short	count[MAXBITS + 1];
+	short	symbol[MAXCODES];
+};
+
+// state of decoder
+struct inflate {
+	const unsigned char	*in;
+	size_t			in_size;
+	size_t			in_pos;
+	unsigned long		bitbuf;	// bits not used yet
+	int			bitcnt;
+	boolean			error;	// TRUE when input ran out
+	struct dynabuf		*out;
+	size_t			member_start;	// back references must not go before this
+};
+
+// base values and extra bits for length codes 257..285
+static const short	length_base[29]	= {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const short	length_extra[29]	= {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+// base values and extra bits for distance codes 0..29
+static const short	dist_base[30]	= {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577
+};
+static const short	dist_extra[30]	= {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+// order of code length code lengths in dynamic block header
+static const short	clen_order[19]	= {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+
+// variables
+static struct huffman	fixed_lencode,
+			fixed_distcode;
+static boolean		fixed_done	= FALSE;
+static unsigned long	crc_table[256];
+static boolean		crc_done	= FALSE;
+
+
+// get given number of bits from input (least significant first)
+static int get_bits(struct inflate *s, int need)
+{
+	unsigned long	value;
+
+	while (s->bitcnt < need) {
+		if (s->in_pos == s->in_size) {
+			s->error = TRUE;
+			return 0;
+		}
+		s->bitbuf |= ((unsigned long) s->in[s->in_pos++]) << s->bitcnt;
+		s->bitcnt += 8;
+	}
+	value = s->bitbuf & ((1UL << need) - 1);
+	s->bitbuf >>= need;
+	s->bitcnt -= need;
+	return (int) value;
+}
+
+// set up huffman code from code lengths. returns FALSE if over-subscribed
+// (incomplete codes are accepted, using a missing code is caught later).
+static boolean construct(struct huffman *h, const short *length, int n)
+{
+	short	offs[MAXBITS + 1];
+	int	left,
+		len,
+		symbol;
+
+	for (len = 0; len <= MAXBITS; ++len)
+		h->count[len] = 0;
+	for (symbol = 0; symbol < n; ++symbol)
+		++(h->count[length[symbol]]);
+	left = 1;
+	for (len = 1; len <= MAXBITS; ++len) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return FALSE;
+	}
+	offs[1] = 0;
+	for (len = 1; len < MAXBITS; ++len)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (symbol = 0; symbol < n; ++symbol) {
+		if (length[symbol])
+			h->symbol[offs[length[symbol]]++] = symbol;
+	}
+	return TRUE;
+}
+
+// decode one symbol. returns -1 on error.
+static int decode(struct inflate *s, const struct huffman *h)
+{
+	int	code	= 0,	// bits read so far
+		first	= 0,	// first code of current length
+		index	= 0,	// index of first code of current length in symbol table
+		count,
+		len;
+
+	for (len = 1; len <= MAXBITS; ++len) {
+		code |= get_bits(s, 1);
+		if (s->error)
+			return -1;
+
+		count = h->count[len];
+		if (code - first < count)
+			return h->symbol[index + (code - first)];
+
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;	// ran out of codes
+}
+
+// decode literals and length/distance pairs until end of block
+static boolean codes(struct inflate *s, const struct huffman *lencode, const struct huffman *distcode)
+{
+	struct dynabuf	*out	= s->out;
+	const char	*from;
+	int		symbol,
+			len;
+	size_t		dist;
+
+	for (;;) {
+		symbol = decode(s, lencode);
+		if (symbol < 0)
+			return FALSE;
+
+		if (symbol < 256) {
+			DYNABUF_APPEND(out, (char) symbol);
+			continue;
+		}
+		if (symbol == 256)
+			return TRUE;	// end of block
+
+		// length/distance pair
+		symbol -= 257;
+		if (symbol >= 29)
+			return FALSE;
+
+		len = length_base[symbol] + get_bits(s, length_extra[symbol]);
+		symbol = decode(s, distcode);
+		if ((symbol < 0) || (symbol >= 30))
+			return FALSE;
+
+		dist = dist_base[symbol] + get_bits(s, dist_extra[symbol]);
+		if (s->error || (dist > out->size - s->member_start))
+			return FALSE;
+
+		// copy byte by byte, because source and target may overlap
+		from = DynaBuf_reserve(out, len) - dist;
+		while (len--)
+			DYNABUF_APPEND_RESERVED(out, *(from++));
+	}
+}
+
+// block without compression
+static boolean stored(struct inflate *s)
+{
+	size_t	len;
+
+	// discard bits up to byte boundary
+	s->bitbuf = 0;
+	s->bitcnt = 0;
+	if (s->in_size - s->in_pos < 4)
+		return FALSE;
+
+	len = s->in[s->in_pos] | (s->in[s->in_pos + 1] << 8);
+	if ((s->in[s->in_pos + 2] != (~len & 0xff))
+	|| (s->in[s->in_pos + 3] != ((~len >> 8) & 0xff)))
+		return FALSE;
+
+	s->in_pos += 4;
+	if (s->in_size - s->in_pos < len)
+		return FALSE;
+
+	DynaBuf_add_span(s->out, (const char *) s->in + s->in_pos, len);
+	s->in_pos += len;
+	return TRUE;
+}
+
+// block using fixed codes
+static boolean fixed(struct inflate *s)
+{
+	short	lengths[FIXLCODES];
+	int	symbol;
+
+	// build tables on first use
+	if (!fixed_done) {
+		for (symbol = 0; symbol < 144; ++symbol)
+			lengths[symbol] = 8;
+		for (; symbol < 256; ++symbol)
+			lengths[symbol] = 9;
+		for (; symbol < 280; ++symbol)
+			lengths[symbol] = 7;
+		for (; symbol < FIXLCODES; ++symbol)
+			lengths[symbol] = 8;
+		construct(&fixed_lencode, lengths, FIXLCODES);
+		for (symbol = 0; symbol < MAXDCODES; ++symbol)
+			lengths[symbol] = 5;
+		construct(&fixed_distcode, lengths, MAXDCODES);
+		fixed_done = TRUE;
+	}
+	return codes(s, &fixed_lencode, &fixed_distcode);
+}
+
+// block using codes given in block header
+static boolean dynamic(struct inflate *s)
+{
+	struct huffman	lencode,
+			distcode;
+	short		lengths[MAXCODES];
+	int		nlen,
+			ndist,
+			ncode,
+			index,
+			symbol,
+			len,
+			repeat;
+
+	nlen = get_bits(s, 5) + 257;
+	ndist = get_bits(s, 5) + 1;
+	ncode = get_bits(s, 4) + 4;
+	if (s->error || (nlen > MAXLCODES) || (ndist > MAXDCODES))
+		return FALSE;
+
+	// read code lengths for code length code
+	for (index = 0; index < ncode; ++index)
+		lengths[clen_order[index]] = get_bits(s, 3);
+	for (; index < 19; ++index)
+		lengths[clen_order[index]] = 0;
+	if (s->error || !construct(&lencode, lengths, 19))
+		return FALSE;
+
+	// read code lengths for literal/length and distance codes
+	index = 0;
+	while (index < nlen + ndist) {
+		symbol = decode(s, &lencode);
+		if (symbol < 0)
+			return FALSE;
+
+		if (symbol < 16) {
+			lengths[index++] = symbol;
+			continue;
+		}
+		len = 0;	// value to repeat
+		if (symbol == 16) {
+			if (index == 0)
+				return FALSE;
+
+			len = lengths[index - 1];
+			repeat = 3 + get_bits(s, 2);
+		} else if (symbol == 17) {
+			repeat = 3 + get_bits(s, 3);
+		} else {
+			repeat = 11 + get_bits(s, 7);
+		}
+		if (s->error || (index + repeat > nlen + ndist))
+			return FALSE;
+
+		while (repeat--)
+			lengths[index++] = len;
+	}
+	// end-of-block code is needed
+	if (lengths[256] == 0)
+		return FALSE;
+
+	if (!construct(&lencode, lengths, nlen))
+		return FALSE;
+
+	if (!construct(&distcode, lengths + nlen, ndist))
+		return FALSE;
+
+	return codes(s, &lencode, &distcode);
+}
+
+// compute crc32 of given data (as used in gzip trailer)
+static unsigned long gzip_crc(const char *data, size_t size)
+{
+	unsigned long	crc;
+	int		ii,
+			bit;
+
+	// build table on first use
+	if (!crc_done) {
+		for (ii = 0; ii < 256; ++ii) {
+			crc = ii;
+			for (bit = 0; bit < 8; ++bit)
+				crc = (crc & 1) ? 0xedb88320UL ^ (crc >> 1) : crc >> 1;
+			crc_table[ii] = crc;
+		}
+		crc_done = TRUE;
+	}
+	crc = 0xffffffffUL;
+	while (size--)
+		crc = crc_table[(crc ^ (unsigned char) *(data++)) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffffUL;
+}
+
+// read little-endian 32-bit value
+static unsigned long get_le32(const unsigned char *ptr)
+{
+	return ptr[0] | (ptr[1] << 8) | ((unsigned long) ptr[2] << 16) | ((unsigned long) ptr[3] << 24);
+}
+
+// skip zero-terminated string in gzip header. returns FALSE if unterminated.
+static boolean skip_string(const unsigned char *data, size_t size, size_t *pos)
+{
+	while (*pos < size) {
+		if (data[(*pos)++] == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+// return whether the given file name and contents look like gzip data
+boolean unpack_is_gzip(const char *name, const char *data, size_t size)
+{
+	size_t	len	= strlen(name);
+
+	return (size >= GZIP_MINSIZE)
+		&& (len > 3)
+		&& (name[len - 3] == '.')
+		&& (tolower((unsigned char) name[len - 2]) == 'g')
+		&& (tolower((unsigned char) name[len - 1]) == 'z')
+		&& ((unsigned char) data[0] == GZIP_ID1)
+		&& ((unsigned char) data[1] == GZIP_ID2)
+		&& (data[2] == GZIP_DEFLATE);
+}
+
+// unpack gzip data (one or more members) into given dynabuf
+boolean unpack_gzip(const char *data, size_t size, struct dynabuf *db)
+{
+	const unsigned char	*in	= (const unsigned char *) data;
+	struct inflate		s;
+	size_t			pos	= 0;
+	int			flags,
+				last,
+				type;
+	boolean			ok;
+
+	DYNABUF_CLEAR(db);
+	s.in = in;
+	s.in_size = size;
+	s.out = db;
+	do {
+		// check header
+		if ((size - pos < GZIP_MINSIZE)
+		|| (in[pos] != GZIP_ID1)
+		|| (in[pos + 1] != GZIP_ID2)
+		|| (in[pos + 2] != GZIP_DEFLATE))
+			return FALSE;
+
+		flags = in[pos + 3];
+		if (flags & GZIP_RESERVED)
+			return FALSE;
+
+		pos += 10;	// skip ids, method, flags, time, extra flags, os
+		if (flags & GZIP_FEXTRA) {
+			if (size - pos < 2)
+				return FALSE;
+
+			pos += 2 + (in[pos] | (in[pos + 1] << 8));
+		}
+		if ((flags & GZIP_FNAME) && !skip_string(in, size, &pos))
+			return FALSE;
+
+		if ((flags & GZIP_FCOMMENT) && !skip_string(in, size, &pos))
+			return FALSE;
+
+		if (flags & GZIP_FHCRC)
+			pos += 2;
+		if (pos > size)
+			return FALSE;
+
+		// inflate blocks
+		s.in_pos = pos;
+		s.bitbuf = 0;
+		s.bitcnt = 0;
+		s.error = FALSE;
+		s.member_start = db->size;
+		do {
+			last = get_bits(&s, 1);
+			type = get_bits(&s, 2);
+			if (s.error)
+				return FALSE;
+
+			if (type == 0)
+				ok = stored(&s);
+			else if (type == 1)
+				ok = fixed(&s);
+			else if (type == 2)
+				ok = dynamic(&s);
+			else
+				ok = FALSE;
+			if (!ok)
+				return FALSE;
+		} while (!last);
+		// check trailer (bits left over in last byte are dropped)
+		pos = s.in_pos;
+		if (size - pos < 8)
+			return FALSE;
+
+		if (get_le32(in + pos) != gzip_crc(db->buffer + s.member_start, db->size - s.member_start))
+			return FALSE;
+
+		if (get_le32(in + pos + 4) != ((db->size - s.member_start) & 0xffffffffUL))
+			return FALSE;
+
+		pos += 8;
+	} while (pos < size);
+	return TRUE;
+}
@@ -0,0 +1,24 @@
+// ACME - a crossassembler for producing 6502/65c02/65816/65ce02 code.
+// Copyright (C) 1998-2020 Marco Baye
+// Have a look at "acme.c" for further info
+//
+// unpacking compressed binary files ("!binary")
+#ifndef unpack_H
+#define unpack_H
+
+
+#include "config.h"
+#include <stdlib.h>	// for size_t
+
+
+// prototypes
+
+// return whether the given file name and contents look like gzip data
+extern boolean unpack_is_gzip(const char *name, const char *data, size_t size);
+// unpack gzip data (one or more members) into given dynabuf, which is cleared
+// first. returns FALSE if data is corrupt.
+struct dynabuf;
+extern boolean unpack_gzip(const char *data, size_t size, struct dynabuf *db);
+
+
+#endif
@@ -0,0 +1,101 @@
+#!/bin/bash
+# generate synthetic benchmark sources
+# usage: make-corpora.sh [SCALE [DIR]]
+# SCALE multiplies the size of each corpus (default 1), DIR is where the
+# files are written (default "corpora"). The output only depends on SCALE,
+# so the same corpora can be regenerated on any machine.
+SCALE=${1:-1}
+DIR=${2:-corpora}
+mkdir -p "$DIR" || exit
+
+# each corpus starts a new overlay segment every now and then, so larger
+# scales do not run out of address space.
+
+# many symbols, most of them referenced before they are defined
+SYMBOLS=$((SCALE * 5000))
+{
+	for ((ii = 0; ii < SYMBOLS; ++ii)); do
+		((ii % 5000)) || echo "	* = \$1000, overlay"
+		echo "	lda label$((SYMBOLS - 1 - ii))"
+		echo "	sta data$ii"
+	done
+	for ((ii = 0; ii < SYMBOLS; ++ii)); do
+		((ii % 5000)) || echo "	* = \$1000, overlay"
+		echo "label$ii	!byte $((ii & 255))"
+		echo "data$ii = \$c000 + $((ii & 4095))"
+	done
+} > "$DIR/symbols.a"
+
+# deep macro recursion
+DEPTH=$((SCALE * 200))
+{
+	echo "!macro down .n {"
+	echo "	!if .n {"
+	echo "		lda #<.n"
+	echo "		+down .n - 1"
+	echo "	}"
+	echo "}"
+	for ((ii = 0; ii < 20; ++ii)); do
+		echo "	* = \$1000, overlay"
+		echo "	+down $DEPTH"
+	done
+} > "$DIR/recursion.a"
+
+# large tables generated by nested loops
+ROWS=$((SCALE * 100))
+{
+	echo "	!for row, 0, $ROWS - 1 {"
+	echo "		!if row % 200 = 0 {"
+	echo "			* = \$1000, overlay"
+	echo "		}"
+	echo "		!for col, 0, 255 {"
+	echo "			!byte (row * col + (col >> 1)) & \$ff"
+	echo "		}"
+	echo "		!word row * 40 + \$0400, int(sin(row / 10.0) * 1000) & \$ffff"
+	echo "	}"
+} > "$DIR/tables.a"
+
+# many segments
+SEGMENTS=$((SCALE * 1000))
+{
+	for ((ii = 0; ii < SEGMENTS; ++ii)); do
+		echo "	* = \$$(printf '%04x' $(((ii * 16) & 65535))), overlay"
+		echo "seg$ii	lda #$((ii & 255))"
+		echo "	!pseudopc \$c000 {"
+		echo "		jmp seg$(((ii + 1) % SEGMENTS))"
+		echo "	}"
+	done
+} > "$DIR/segments.a"
+
+# big binary includes (bytes come from a fixed linear congruential generator)
+BINSIZE=$((SCALE * 65536))
+LC_ALL=C awk -v size=$BINSIZE 'BEGIN {
+	x = 1
+	for (ii = 0; ii < size; ++ii) {
+		x = (x * 75 + 74) % 65537
+		printf "%c", x % 256
+	}
+}' > "$DIR/data.bin"
+{
+	for ((ii = 0; ii < SCALE * 16; ++ii)); do
+		echo "	* = \$$(printf '%04x' $(((ii & 15) * 4096))), overlay"
+		echo "	!binary \"data.bin\", \$1000, $ii * \$1000"
+	done
+} > "$DIR/binary.a"
+
+# heavy library use
+CALLS=$((SCALE * 2000))
+{
+	echo "	!src <6502/std.a>"
+	echo "	!src <cbm/c64/vic.a>"
+	echo "	!src <cbm/c64/kernal.a>"
+	for ((ii = 0; ii < CALLS; ++ii)); do
+		((ii % 2000)) || echo "	* = \$0801, overlay"
+		echo "	+inc16 \$fb"
+		echo "	+bne far$ii"
+		echo "	lda #$((ii & 255))"
+		echo "	sta vic_cborder"
+		echo "	jsr k_chrout"
+		echo "far$ii"
+	done
+} > "$DIR/library.a"
@@ -0,0 +1,39 @@
+#!/bin/bash
+# assemble each benchmark corpus several times and record the results
+# usage: run-benchmarks.sh [ACME [RUNS [DIR]]]
+# ACME is the binary to measure (default "acme"), RUNS is the number of runs
+# per corpus (default 5), DIR holds the corpora (default "corpora", see
+# make-corpora.sh). One line of comma-separated values is written per run:
+#	corpus,run,seconds,max_rss_kb,passes
+# max_rss_kb is "NA" if GNU time is not installed as /usr/bin/time.
+ACMEBIN=${1:-acme}
+RUNS=${2:-5}
+DIR=${3:-corpora}
+# relative paths would break after changing to DIR
+case "$ACMEBIN" in
+*/*)	ACMEBIN=$(cd "$(dirname "$ACMEBIN")" && pwd)/$(basename "$ACMEBIN") ;;
+esac
+# library sources are taken from this tree, so all machines use the same
+export ACME=$(cd "$(dirname "$0")/../../ACME_Lib" && pwd)
+# the recursion corpus goes deeper than the default limit
+OPTIONS="-v0 --maxdepth 1000000 --stats"
+
+cd "$DIR" || exit
+echo "corpus,run,seconds,max_rss_kb,passes"
+for SOURCE in *.a; do
+	for ((RUN = 1; RUN <= RUNS; ++RUN)); do
+		START=$(date +%s.%N)
+		if [ -x /usr/bin/time ]; then
+			/usr/bin/time -o rss.tmp -f "%M" "$ACMEBIN" $OPTIONS -o out.tmp "$SOURCE" > stats.tmp || exit
+			RSS=$(tail -n 1 rss.tmp)
+		else
+			"$ACMEBIN" $OPTIONS -o out.tmp "$SOURCE" > stats.tmp || exit
+			RSS=NA
+		fi
+		END=$(date +%s.%N)
+		PASSES=$(grep -c "^Pass " stats.tmp)
+		SECONDS_TAKEN=$(echo "$START $END" | awk '{printf "%.3f", $2 - $1}')
+		echo "${SOURCE%.a},$RUN,$SECONDS_TAKEN,$RSS,$PASSES"
+	done
+done
+rm -f out.tmp stats.tmp rss.tmp
@@ -0,0 +1,14 @@
+#!/bin/bash
+rm -rf cache
+mkdir cache || exit
+acme -v2 --cache-dir cache --depfile out-buildcache.d test-buildcache.a > /dev/null || exit
+cmp out-buildcache.o expected-buildcache.o || exit
+cmp out-buildcache.d expected-buildcache.d || exit
+rm out-buildcache.o out-buildcache.d
+acme -v2 --cache-dir cache --depfile out-buildcache.d test-buildcache.a | grep -q "taken from build cache" || exit
+cmp out-buildcache.o expected-buildcache.o || exit
+cmp out-buildcache.d expected-buildcache.d || exit
+rm -rf cache
+echo
+echo "Build cache test passed successfully."
+echo
@@ -0,0 +1,6 @@
+#!/bin/bash
+acme -v0 --dead-strip test-deadstrip.a || exit
+cmp out-deadstrip.o expected-deadstrip.o || exit
+echo
+echo "Dead strip test passed successfully."
+echo
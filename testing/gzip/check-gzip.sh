@@ -0,0 +1,6 @@
+#!/bin/bash
+acme -v0 test-gzip.a || exit
+cmp out-gzip.o expected-gzip.o || exit
+echo
+echo "Gzip test passed successfully."
+echo
@@ -0,0 +1,6 @@
+#!/bin/bash
+acme -v0 --peephole test-peephole.a || exit
+cmp out-peephole.o expected-peephole.o || exit
+echo
+echo "Peephole test passed successfully."
+echo
@@ -0,0 +1,11 @@
+#!/bin/bash
+rm -rf snapshots
+mkdir snapshots || exit
+ACME=lib acme -v0 --snapshot-dir snapshots test-snapshot.a || exit
+cmp out-snapshot.o expected-snapshot.o || exit
+ACME=lib acme -v0 --snapshot-dir snapshots test-snapshot.a || exit
+cmp out-snapshot.o expected-snapshot.o || exit
+rm -rf snapshots
+echo
+echo "Snapshot test passed successfully."
+echo